@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <sys/socket.h>
+
+// Bytes of log lines held per file before they are written out
+#define ACCESS_LOG_BUFFER (64 * 1024)
+// Seconds a line may wait in the buffer on a quiet server
+#define ACCESS_LOG_FLUSH_INTERVAL 1
+// nginx's "combined" format plus the request time
+#define ACCESS_LOG_DEFAULT_FORMAT "$remote_addr - - [$time_local] \"$request\" $status $bytes_sent " \
+                                  "\"$http_referer\" \"$http_user_agent\" $request_time"
+
+struct AccessLogTarget;
+// An access_log directive as the configuration that declares it holds it;
+// NULL = access_log off
+typedef std::shared_ptr<const AccessLogTarget> AccessLogRef;
+
+// A request from the moment it was complete until its last byte went out:
+// feeds the latency histograms and the access log
+struct RequestRecord {
+  // Phase timestamps from monotonic_micros(), 0 = phase not reached
+  uint64_t accepted = 0;          // Connection accepted
+  uint64_t first_byte = 0;        // First byte of the request read
+  uint64_t headers_done = 0;      // Header block complete
+  uint64_t body_done = 0;         // Body complete; after `received` when streamed to a CGI
+  uint64_t received = 0;          // Handed to routing: the handler starts
+  uint64_t response_start = 0;    // First response byte written
+  std::string location;           // route_config.location, "" if none matched
+  AccessLogRef access_log;        // AccessLog target of the server, NULL = not logged
+  bool traced = false;            // Sampled for the trace_file
+  struct sockaddr_storage peer;   // Client address
+  std::string method;
+  std::string uri;
+  std::string protocol;
+  std::string host;
+  std::vector<std::string> headers; // Values of the $http_* variables the format uses
+  int status = 0;                 // From the status line of the response
+  uint64_t bytes_sent = 0;        // Head and body
+};
+
+// One piece of a compiled format: literal text or a variable
+struct LogSegment {
+  int variable;       // LogVariable, or -1 for literal text
+  std::string text;   // Literal text, or the header name of $http_*
+  size_t header;      // Index into RequestRecord::headers for $http_*
+};
+
+// Open log file and the lines not yet written to it
+struct AccessLogFile {
+  std::string path;
+  int fd;
+  std::string buffer;
+  time_t flushed;
+};
+
+// An access_log directive: which file and what to write there
+struct AccessLogTarget {
+  std::shared_ptr<AccessLogFile> file;
+  std::vector<LogSegment> format;
+  std::vector<std::string> headers;   // Headers to capture, in RequestRecord::headers order
+};
+
+// access_log files, shared by every server that names the same path. Lines
+// are formatted into a per-file buffer and written with one write() when it
+// fills up or once a second from the event loop, instead of a syscall per
+// request. The trace_file is buffered the same way. The configurations that
+// name a file own it: it is flushed and closed once the last of them is gone,
+// e.g. when a reload drops it or fails.
+class AccessLog {
+    private:
+        static std::vector<std::weak_ptr<AccessLogFile> > files;
+
+        static void flushFile(AccessLogFile& file);
+        static void closeFile(AccessLogFile* file);
+
+    public:
+        static std::shared_ptr<AccessLogFile> openFile(const std::string& path, std::string& error);
+        static void append(AccessLogFile& file, const std::string& text);
+        static AccessLogRef open(const std::string& path, const std::string& format, std::string& error);
+        static void write(const AccessLogRef& target, const RequestRecord& record, uint64_t now_us);
+        static void flush(bool force);
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/types.h>
+
+// A started CGI process and the parent's ends of its stdin/stdout pipes
+struct CGIWorker {
+    pid_t pid;
+    int stdin_fd;
+    int stdout_fd;
+};
+
+bool makePipe(int fds[2]);
+pid_t spawnProcess(const std::vector<std::string>& argv, const std::vector<std::string>& env,
+                   int stdin_fd, int stdout_fd);
+bool spawnCGI(const std::vector<std::string>& argv, const std::vector<std::string>& env,
+              CGIWorker& worker);
+
+// Python interpreters started ahead of time (cgi_pool N;). An idle worker
+// has paid its interpreter startup already and waits on stdin for a
+// length-prefixed, NUL-terminated environment block, then runs
+// SCRIPT_FILENAME with the rest of stdin as the request body.
+class CGIWorkerPool {
+    private:
+        static std::map<std::string, std::vector<CGIWorker> > idle;
+        static std::map<std::string, size_t> targets;
+
+    public:
+        static bool supports(const std::string& interpreter);
+        static void configure(const std::string& interpreter, size_t size);
+        static bool take(const std::string& interpreter, CGIWorker& worker);
+        static std::string preamble(const std::vector<std::string>& env);
+        static void replenish();
+        static void shutdown();
+};
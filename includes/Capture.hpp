@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+// Capture file layout (capture_file directive, read by tools/replay):
+//   CAPTURE_MAGIC, then records of
+//   u8 type | u32 connection | u64 microseconds since capture start | u32 length | data
+// with integers little-endian. Connections are numbered in accept order and
+// data records hold the request bytes exactly as recv() returned them.
+#define CAPTURE_MAGIC "WSCAP1\n"
+#define CAPTURE_MAGIC_LEN 7
+#define CAPTURE_RECORD_HEADER 17
+
+enum CaptureRecordType {
+    CaptureOpen = 1,    // Connection accepted
+    CaptureData = 2,    // Bytes read from it
+    CaptureClose = 3    // Connection closed
+};
+
+struct AccessLogFile;
+
+// Records incoming traffic for replay. Written through the access log's
+// buffered files, so capturing costs a memcpy per read between flushes.
+class Capture {
+    private:
+        static std::shared_ptr<AccessLogFile> file; // NULL = off
+        static uint64_t started;
+        static uint32_t next_connection;
+        static std::map<int, uint32_t> connections; // Client fd -> connection number
+
+        static void record(uint8_t type, uint32_t connection, const char* data, size_t len);
+
+    public:
+        static void use(const std::shared_ptr<AccessLogFile>& capture_file);
+        static void opened(int client_fd);
+        static void received(int client_fd, const char* data, size_t len);
+        static void closed(int client_fd);
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+// Incremental decoder for a chunked request body (RFC 7230 4.1). It can be
+// fed the body as it arrives off the socket, in pieces of any size; chunk
+// extensions and trailers are skipped.
+class ChunkedDecoder {
+    private:
+        enum State { Size, Extension, Data, DataEnd, Trailer, Done, Error };
+        State state;
+        size_t remaining;    // Size being parsed, then payload bytes left in the chunk
+        size_t size_digits;
+        size_t line_length;  // Length of the trailer line being skipped
+        size_t decoded;      // Payload bytes produced so far
+
+    public:
+        ChunkedDecoder();
+        size_t feed(const char* data, size_t len, std::string* out);
+        bool done() const { return state == Done; }
+        bool failed() const { return state == Error; }
+        size_t decodedSize() const { return decoded; }
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "../includes/Config_Manager.hpp"
+
+// `webserv --compile file.conf` writes file.conf.cache next to the config
+#define CONFIG_CACHE_SUFFIX ".cache"
+#define CONFIG_CACHE_MAGIC "WSCONF\0\0"
+#define CONFIG_CACHE_MAGIC_LEN 8
+// Bump when the layout or the block structures change
+#define CONFIG_CACHE_VERSION 2
+// Written in host byte order; a cache from another byte order is stale
+#define CONFIG_CACHE_BYTE_ORDER 0x01020304u
+
+// The parsed blocks of a config file in a flat binary form, read straight
+// from an mmap() of the file. A cache is used only when it was made from
+// the same source text (hash and size) by the same layout version.
+// Otherwise the text is parsed and the cache rewritten. It skips lexing
+// and parsing only: directives are still applied as usual, so access_log,
+// include and the like work as they do from the text.
+//
+//   magic | u32 version | u32 byte order | u64 source hash | u64 source size
+//   u32 servers, each: directives | u32 locations, each: string path,
+//   u8 is_regex, directives | types (as directives)
+//   u32 upstreams, each: string name | directives
+//   directives: u32 count, each: string name | u32 argc | strings
+//   string: u32 length | bytes
+class ConfigCache {
+    public:
+        static uint64_t hash(const std::string& text);
+        static bool load(const std::string& path, uint64_t hash, uint64_t size,
+                         std::vector<ServerBlock>& servers, std::vector<UpstreamBlock>& upstreams);
+        static bool store(const std::string& path, uint64_t hash, uint64_t size,
+                          const std::vector<ServerBlock>& servers, const std::vector<UpstreamBlock>& upstreams);
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// readdir() entries consumed per write event while a listing is loading
+#define DIR_LISTING_BATCH 4096
+// Directories with more entries than this are streamed unsorted and not cached
+#define DIR_LISTING_SORT_MAX 500000
+// Entries kept across all cached directories before the least recently used go
+#define DIR_LISTING_CACHE_MAX 1000000
+// Target size of one chunk of HTML sent to the client
+#define DIR_LISTING_CHUNK 65536
+
+#ifdef __APPLE__
+# define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+# define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+struct DirEntry {
+    std::string name;
+    bool is_dir;
+};
+
+// Sorted snapshot of a directory, valid while its inode and mtime are unchanged
+struct DirListing {
+    ino_t inode;
+    time_t mtime;
+    long mtime_nsec;
+    std::vector<DirEntry> entries; // Directories first, then by name
+};
+
+class DirListingCache {
+    private:
+        struct Slot {
+            std::shared_ptr<const DirListing> listing;
+            unsigned long last_used;
+        };
+        static std::map<std::string, Slot> slots;
+        static unsigned long clock;
+        static size_t total_entries;
+
+    public:
+        static std::shared_ptr<const DirListing> lookup(const std::string& path, const struct stat& st);
+        static void store(const std::string& path, const std::shared_ptr<const DirListing>& listing);
+};
+
+// Produces the autoindex page for one request a chunk at a time, so neither
+// the loop nor memory is held hostage by a huge directory.
+class DirListingStream {
+    public:
+        DirListingStream(const std::string& fsPath, const std::string& urlPath,
+                         const struct stat& st, size_t page, size_t page_size, bool chunked);
+        ~DirListingStream();
+
+        bool produceChunk(std::string& out);
+
+    private:
+        enum State { Loading, Unsorted, Sorted, Footer, Done };
+
+        std::string fs_path;
+        std::string url_path;
+        struct stat dir_stat;
+        size_t page;
+        size_t page_size;
+        bool chunked;
+        State state;
+        bool header_sent;
+        DIR* dir;
+        std::vector<DirEntry> loading;
+        std::shared_ptr<const DirListing> listing;
+        size_t index;      // Next entry of the listing (or readdir position) to consider
+        size_t end_index;  // One past the last entry on this page
+        bool has_more;     // Entries exist after this page
+
+        DirListingStream(const DirListingStream&);
+        DirListingStream& operator=(const DirListingStream&);
+
+        bool readBatch(std::vector<DirEntry>& out);
+        void finishLoading();
+        void renderEntry(const DirEntry& entry, std::string& html) const;
+        void renderFooter(std::string& html) const;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <poll.h>
+
+// Submission queue entries of the io_uring backend; a tick that queues
+// more flushes them early
+#define EVENT_RING_ENTRIES 4096
+
+enum EventBackend {
+    EventPoll,      // poll(): the kernel walks every fd on every wait
+    EventEpoll,     // epoll_wait(), plus an epoll_ctl() per interest change
+    EventIoUring    // One io_uring_enter() per tick that submits and waits
+};
+
+// What the backend has been told about one fd number
+struct EventInterest {
+    short events = 0;           // Registered (epoll) or armed (io_uring) mask
+    short ready = 0;            // Reported and not yet handed to Server::poll_fds
+    bool registered = false;
+    bool always_ready = false;  // epoll refused the fd (a regular file): as poll() would say
+    uint32_t generation = 0;    // io_uring: tells completions of an earlier poll or fd apart
+    uint64_t seen = 0;          // Tick it was last in the list
+};
+
+// Waits for the events of Server::poll_fds, which stays the list every
+// handler edits. poll() hands the whole list to the kernel on each wait;
+// epoll and io_uring keep it registered there and are only told what
+// changed since the previous tick, found by comparing the list with what
+// was registered. io_uring arms one-shot polls, so a ready fd is re-armed
+// (and reported again while it stays ready, as with poll()) by the
+// io_uring_enter() that also waits. The backend is chosen at startup with
+// `event_backend`; epoll and io_uring are Linux only, and an io_uring the
+// kernel does not offer falls back to epoll.
+class EventLoop {
+    private:
+        static EventBackend backend;
+        static int fd;              // epoll or io_uring instance
+        static uint64_t tick;
+        static std::vector<EventInterest> interests;  // By fd number
+
+        static EventInterest& interest(int fd);
+        static int pollWait(std::vector<struct pollfd>& fds, int timeout);
+        static int epollWait(std::vector<struct pollfd>& fds, int timeout);
+        static int ringWait(std::vector<struct pollfd>& fds, int timeout);
+        static bool ringSetup();
+        static int collect(std::vector<struct pollfd>& fds);
+
+    public:
+        static EventBackend requested;  // event_backend directive
+
+        static bool parseBackend(const std::string& name, EventBackend& out);
+        static const char* name();
+        static void init();
+        static void added(int fd);
+        static int wait(std::vector<struct pollfd>& fds, int timeout);
+        static void shutdown();
+};
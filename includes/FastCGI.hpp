@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+// FastCGI 1.0 wire format (https://fastcgi-archives.github.io/FastCGI_Specification.html)
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+// Connections carry one request at a time, so the id never changes
+#define FCGI_REQUEST_ID 1
+// Idle connections kept per backend address
+#define FCGI_POOL_MAX_IDLE 32
+// fastcgi_connect_timeout and fastcgi_read_timeout default, in seconds
+#define FASTCGI_DEFAULT_TIMEOUT 60
+
+enum FastCGIRecordType {
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_DATA = 8
+};
+
+// Record encoding/decoding and the per-backend pool of keep-alive connections.
+// Backends are "unix:/path/to.sock" or "host:port".
+class FastCGI {
+    private:
+        static std::map<std::string, std::vector<int> > idle;
+        static void appendRecord(std::string& out, unsigned char type, const char* data, size_t len);
+        static void appendLength(std::string& out, size_t len);
+
+    public:
+        static std::string encodeRequest(const std::vector<std::pair<std::string, std::string> >& params,
+                                         const std::string& body);
+        static bool nextRecord(const std::string& buf, size_t& pos, unsigned char& type,
+                               std::string& content);
+
+        static int connectBackend(const std::string& address, bool& in_progress);
+        static int acquire(const std::string& address, bool& reused, bool& in_progress);
+        static void release(const std::string& address, int fd);
+};
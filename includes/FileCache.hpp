@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <ctime>
+#include <sys/stat.h>
+
+// Seconds a cached stat() result is trusted before the file is looked at again
+#define FILE_CACHE_TTL 1
+// The cache is flushed whole once it holds this many paths
+#define FILE_CACHE_MAX_ENTRIES 4096
+// Content-hash ETags are only computed for files up to this size, as the
+// hash is read in the event loop; larger files keep the inode/size/mtime one
+#define ETAG_HASH_MAX_SIZE (256 * 1024)
+
+struct FileInfo {
+    bool exists;
+    bool is_regular;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    std::string etag;           // Strong validator, quoted
+    std::string last_modified;  // IMF-fixdate of mtime
+    time_t checked;             // When stat() last ran for this entry
+    bool hashed;                // etag is a content hash rather than inode/size/mtime
+    std::string mime_type;      // From the types table by extension, "" if unknown
+    unsigned long mime_generation; // MimeTypes::generation() mime_type was looked up in
+};
+
+// Process-wide cache of stat() results and validators for static files, so
+// conditional requests can be answered without touching the disk.
+class FileCache {
+    private:
+        static std::unordered_map<std::string, FileInfo> entries;
+        static void fill(FileInfo& info, const std::string& path, const struct stat& st);
+        static bool hashContent(const std::string& path, FileInfo& info);
+        static void refreshMimeType(FileInfo& info, const std::string& path);
+
+    public:
+        static const FileInfo& lookup(const std::string& path, bool content_hash = false);
+        static const FileInfo& refresh(const std::string& path, const struct stat& st, bool content_hash = false);
+        static void invalidate(const std::string& path);
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+
+// SETTINGS_HEADER_TABLE_SIZE: the dynamic table each side starts with, and
+// the most our decoder lets the peer's encoder use
+#define HPACK_TABLE_SIZE 4096
+// Decoded size (names, values and 32 bytes per field, as RFC 7541 4.1
+// counts them) a header block may expand to
+#define HPACK_MAX_HEADER_LIST 65536
+// Per-entry overhead of the dynamic table
+#define HPACK_ENTRY_OVERHEAD 32
+
+typedef std::pair<std::string, std::string> HeaderField;
+typedef std::vector<HeaderField> HeaderList;
+
+// The static table (RFC 7541 Appendix A) followed by a dynamic table,
+// newest entry first, indexed together from 1
+class HpackTable {
+    private:
+        std::deque<HeaderField> entries;
+        size_t size;        // Sum of the entry sizes
+        size_t max_size;
+
+        void evict(size_t room);
+
+    public:
+        HpackTable();
+        void add(const std::string& name, const std::string& value);
+        void resize(size_t max);
+        size_t maxSize() const { return max_size; }
+        const HeaderField* get(size_t index) const;
+        size_t find(const std::string& name, const std::string& value, bool& exact) const;
+};
+
+// Header block decoder of one connection. decode() fails on a malformed
+// block and on one past HPACK_MAX_HEADER_LIST; either way the connection
+// has to go, since its table may no longer match the peer's.
+class HpackDecoder {
+    private:
+        HpackTable table;
+
+        bool readString(const uint8_t*& p, const uint8_t* end, std::string& out);
+
+    public:
+        bool decode(const uint8_t* data, size_t len, HeaderList& headers);
+};
+
+// Header block encoder of one connection. Fields that repeat from one
+// response to the next go into the dynamic table; those that change every
+// time (Date, Content-Length, ETag...) are sent as literals that do not
+// evict anything.
+class HpackEncoder {
+    private:
+        HpackTable table;
+        bool size_changed = false;  // Announce the new table size in the next block
+
+        void writeString(std::string& out, const std::string& text);
+
+    public:
+        void setMaxSize(size_t size);
+        void encode(const HeaderList& headers, std::string& out);
+};
+
+// Primitive encodings (RFC 7541 5) and the Huffman code (Appendix B)
+class Hpack {
+    private:
+        static const uint32_t huffman_codes[257];
+        static const uint8_t huffman_lengths[257];
+        static std::vector<int16_t> huffman_tree;   // Decoding trie: pairs of children
+
+        static void buildTree();
+
+    public:
+        static void writeInteger(std::string& out, uint8_t first, int prefix_bits, uint64_t value);
+        static bool readInteger(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value);
+        static size_t huffmanLength(const std::string& text);
+        static void huffmanEncode(std::string& out, const std::string& text);
+        static bool huffmanDecode(const uint8_t* data, size_t len, std::string& out);
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <cstdint>
+#include <cstddef>
+#include "../includes/Hpack.hpp"
+#include "../includes/ChunkedDecoder.hpp"
+
+// Client connection preface (RFC 9113 3.4)
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+// SETTINGS_MAX_FRAME_SIZE we accept (the protocol default)
+#define H2_MAX_FRAME 16384
+// SETTINGS_MAX_CONCURRENT_STREAMS we announce
+#define H2_MAX_STREAMS 128
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+// Receive window of each stream and of the connection, given back with
+// WINDOW_UPDATE once half of it is used
+#define H2_WINDOW (1024 * 1024)
+// Response body a stream holds before its handler is paused, and bytes of
+// frames queued for the socket before every handler is
+#define H2_STREAM_BUFFER (64 * 1024)
+#define H2_OUTPUT_BUFFER (256 * 1024)
+// Client ids of streams start here, above any file descriptor, so the
+// server's per-client maps hold streams the way they hold connections
+#define H2_CLIENT_BASE (1 << 24)
+// HEADERS plus CONTINUATION bytes accepted for one header block
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+// RST_STREAM frames a client may send in a second before GOAWAY(ENHANCE_YOUR_CALM)
+#define H2_MAX_RESETS 100
+
+enum H2FrameType {
+    H2Data = 0,
+    H2Headers = 1,
+    H2Priority = 2,
+    H2RstStream = 3,
+    H2Settings = 4,
+    H2PushPromise = 5,
+    H2Ping = 6,
+    H2Goaway = 7,
+    H2WindowUpdate = 8,
+    H2Continuation = 9
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum H2Setting {
+    H2HeaderTableSize = 1,
+    H2EnablePush = 2,
+    H2MaxConcurrentStreams = 3,
+    H2InitialWindowSize = 4,
+    H2MaxFrameSize = 5,
+    H2MaxHeaderListSize = 6
+};
+
+enum H2Error {
+    H2NoError = 0,
+    H2ProtocolError = 1,
+    H2InternalError = 2,
+    H2FlowControlError = 3,
+    H2StreamClosed = 5,
+    H2FrameSizeError = 6,
+    H2RefusedStream = 7,
+    H2Cancel = 8,
+    H2CompressionError = 9,
+    H2EnhanceYourCalm = 11
+};
+
+// How the end of a response body is found, from its HTTP/1.1 head
+enum H2BodyFraming {
+    H2BodyNone,         // HEAD, 1xx, 204, 304
+    H2BodyLength,       // Content-Length
+    H2BodyChunked,      // Transfer-Encoding: chunked, decoded into DATA
+    H2BodyUntilClose    // Ends when the handler closes the client
+};
+
+struct H2Stream {
+    int client = -1;            // Client id of the request, -1 once its handlers are done
+    std::string method;
+    std::string request;        // HTTP/1.1 head built from HEADERS, until dispatched
+    std::string body;           // Request body received so far, until dispatched; or,
+                                // streamed, what its handler has not read yet
+    size_t body_read = 0;       // Bytes of a streamed body its handler has read
+    bool streaming = false;     // Dispatched with its headers, body read through recvFromClient()
+    bool body_chunked = false;  // ... re-framed as chunked, its length being unknown
+    bool body_end_read = false; // ... up to its end
+    int64_t content_length = -1; // Declared by the client, -1 if it did not
+    uint64_t data_received = 0; // Body bytes of all DATA frames so far
+    uint64_t started = 0;       // monotonic_micros() of the HEADERS
+    bool remote_closed = false; // END_STREAM received
+    bool dispatched = false;
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    size_t recv_unacked = 0;    // DATA bytes not yet given back with WINDOW_UPDATE
+    short events = 0;           // What its handlers wait for; POLLOUT when they have output
+    std::string head;           // HTTP/1.1 response head, until it is complete
+    bool head_done = false;
+    H2BodyFraming framing = H2BodyNone;
+    unsigned long long body_left = 0; // H2BodyLength bytes still to come
+    ChunkedDecoder chunks;
+    std::string output;         // Response body not yet framed
+    bool body_done = false;     // output holds the end of the body
+    bool ended = false;         // END_STREAM sent
+};
+
+struct H2Connection {
+    std::string input;          // Bytes read and not yet parsed
+    std::string output;         // Frames for the socket
+    size_t output_offset = 0;   // Bytes of output already sent
+    bool preface = false;       // Client preface seen
+    bool closing = false;       // GOAWAY received: no new streams
+    bool failed = false;        // GOAWAY sent for an error: close once it is out
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    uint32_t peer_window = H2_DEFAULT_WINDOW;   // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t peer_max_frame = H2_MAX_FRAME;
+    size_t recv_unacked = 0;
+    size_t recv_held = 0;       // Of those, streamed body bytes not read yet: no WINDOW_UPDATE until they are
+    size_t buffered = 0;        // Body bytes of streams not dispatched yet
+    uint64_t reset_period = 0;  // monotonic_micros() the current second of RST_STREAM counting began
+    unsigned resets = 0;        // RST_STREAM frames received in it
+    uint32_t last_stream = 0;   // Highest stream id the client opened
+    uint32_t header_stream = 0; // Stream whose header block is being collected, 0 = none
+    bool header_end_stream = false;
+    std::string header_block;
+    std::map<uint32_t, H2Stream> streams;
+};
+
+// HTTP/2 framing (RFC 9113) and the translation between a stream's
+// messages and the HTTP/1.1 text the request handlers read and write.
+// Connections and streams are driven by the server (Server_Http2.cpp).
+class Http2 {
+    public:
+        static void frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream,
+                          const char* payload, size_t len);
+        static void headers(std::string& out, uint32_t stream, const std::string& block, bool end_stream,
+                            uint32_t max_frame);
+        static void settings(std::string& out);
+        static void windowUpdate(std::string& out, uint32_t stream, uint32_t increment);
+        static void rstStream(std::string& out, uint32_t stream, uint32_t error);
+        static void goaway(std::string& out, uint32_t last_stream, uint32_t error);
+        static uint32_t applySettings(H2Connection& conn, const uint8_t* payload, size_t len);
+        static bool decodeSettingsHeader(const std::string& value, std::string& payload);
+        static bool requestHead(const HeaderList& headers, std::string& head, std::string& method,
+                                int64_t& content_length);
+        static bool responseHeaders(const std::string& head, const std::string& method, HeaderList& headers,
+                                    H2BodyFraming& framing, unsigned long long& length);
+        static uint32_t read32(const uint8_t* p);
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <sstream>
+
+// Severity of a diagnostic line; log_level drops everything below it
+enum LogLevel {
+    LogDebug,
+    LogInfo,
+    LogWarn,
+    LogError
+};
+
+// Diagnostics on stderr, one write() per line. Lines above the level are
+// formatted only when they will be printed, so debug output costs a single
+// comparison in production.
+class Log {
+    public:
+        static LogLevel level;
+
+        static bool enabled(LogLevel lvl) { return lvl >= level; }
+        static bool parseLevel(const std::string& name, LogLevel& lvl);
+        static void write(LogLevel lvl, const std::string& message);
+};
+
+#define LOG(lvl, expr) \
+    do { \
+        if (Log::enabled(lvl)) { \
+            std::ostringstream log_line_; \
+            log_line_ << expr; \
+            Log::write(lvl, log_line_.str()); \
+        } \
+    } while (0)
+#define LOG_DEBUG(expr) LOG(LogDebug, expr)
+#define LOG_INFO(expr) LOG(LogInfo, expr)
+#define LOG_WARN(expr) LOG(LogWarn, expr)
+#define LOG_ERROR(expr) LOG(LogError, expr)
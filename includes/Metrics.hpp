@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <cstdint>
+
+// Latency histogram buckets: exact below 4us, then 4 linear sub-buckets per
+// power of two (HDR-style, ~25% resolution) up to 2^27us (~2 minutes)
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_MAX_EXPONENT 27
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS + (METRICS_MAX_EXPONENT - 1) * METRICS_SUB_BUCKETS)
+
+struct LatencyHistogram {
+    uint64_t counts[METRICS_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+};
+
+// Counters for the stub_status endpoint. The server is one event loop, so
+// this is the only worker: updates are plain increments with no lock or
+// atomic on the request path, and a scrape reads them as they are.
+class Metrics {
+    public:
+        static uint64_t accepted;
+        static uint64_t active;
+        static uint64_t reading;
+        static uint64_t writing;
+        static uint64_t bytes_in;
+        static uint64_t bytes_out;
+        static uint64_t cgi_spawns;
+        static uint64_t cgi_spawn_failures;
+        static uint64_t cgi_timeouts;
+        static uint64_t file_cache_hits;
+        static uint64_t file_cache_misses;
+        static uint64_t listing_cache_hits;
+        static uint64_t listing_cache_misses;
+        static uint64_t response_cache_hits;
+        static uint64_t response_cache_misses;
+        static uint64_t response_cache_waits;    // Collapsed onto a fill in flight
+        static uint64_t response_cache_passes;
+        static uint64_t tls_handshakes;          // Full key exchange
+        static uint64_t tls_resumed;             // From the session cache or a ticket
+        static uint64_t tls_handshake_failures;
+        static uint64_t http2_connections;
+        static uint64_t http2_streams;
+        static uint64_t event_waits;             // Event loop iterations
+        static uint64_t event_syscalls;          // Made by the event backend: waits and interest changes
+        static uint64_t limit_req_passed;
+        static uint64_t limit_req_delayed;
+        static uint64_t limit_req_rejected;
+        static uint64_t limit_conn_rejected;
+        static std::map<int, uint64_t> requests;                  // By status code
+        static std::map<std::string, LatencyHistogram> latency;   // By location
+
+        static int countResponse(const std::string& response);
+        static void observeLatency(const std::string& location, uint64_t micros);
+        static std::string render();
+};
+
+uint64_t monotonic_micros();
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+// Fallback for extensions no types entry covers (default_type overrides it)
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+
+// Extension -> media type, extensions lowercased
+typedef std::unordered_map<std::string, std::string> MimeTable;
+
+// Process-wide media type table. A configuration builds its own from
+// `types { }` blocks and `include mime.types;`, or from the built-in list
+// when it has neither, and replaces this one with it once it is accepted.
+class MimeTypes {
+    private:
+        static MimeTable types;
+        static unsigned long changes;   // Bumped on every change, see generation()
+
+    public:
+        static void add(MimeTable& table, const std::string& extension, const std::string& type);
+        static void loadDefaults(MimeTable& table);
+        static void replace(const MimeTable& table);
+        static const std::string& lookup(const std::string& path);
+        // Changes whenever the table does, so cached lookups know to redo theirs
+        static unsigned long generation() { return changes; }
+};
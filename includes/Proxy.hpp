@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <ctime>
+#include <sys/socket.h>
+#include <memory>
+#include "../includes/Upstream.hpp"
+
+// Idle keep-alive connections kept per upstream address by default (proxy_keepalive)
+#define PROXY_DEFAULT_KEEPALIVE 32
+// Default proxy_connect_timeout, proxy_send_timeout and proxy_read_timeout, in seconds
+#define PROXY_DEFAULT_TIMEOUT 60
+// Response head from the upstream larger than this is answered with 502
+#define PROXY_MAX_HEAD 65536
+
+// How the end of an upstream response body is found
+enum ProxyFraming {
+    ProxyNoBody,        // HEAD, 1xx, 204, 304
+    ProxyLength,        // Content-Length
+    ProxyChunked,       // Transfer-Encoding: chunked, passed through as is
+    ProxyUntilClose     // Neither: the body ends when the upstream closes
+};
+
+// A proxy_pass request as Response hands it to the server loop
+struct ProxyJob {
+    std::string upstream;           // "host:port" to connect to, unless `group` picks it
+    std::shared_ptr<UpstreamGroup> group; // proxy_pass to an upstream block
+    std::string hash_key;           // What a hash-balanced group picks the peer by
+    std::string host;               // Host header for the upstream
+    std::string method;
+    std::string target;             // Request target after the location prefix is replaced
+    std::vector<std::pair<std::string, std::string> > headers;      // From the client
+    std::vector<std::pair<std::string, std::string> > set_headers;  // proxy_set_header
+    std::string body;               // Decoded body so far (all of it unless streamed)
+    bool stream_body;               // The rest of the body follows from the client socket
+    bool chunked;                   // Streamed body without a length: sent on in chunks
+    size_t content_length;          // Length of a streamed body that has one
+    time_t connect_timeout;
+    time_t send_timeout;
+    time_t read_timeout;
+    size_t keepalive;               // proxy_keepalive, 0 = a new connection per request
+    std::string cache_key;          // Response cache key the answer fills, if any
+};
+
+// Status line and headers of an upstream response, rewritten for the client
+struct ProxyResponseHead {
+    int status;
+    std::string head;               // For the client, hop-by-hop headers removed
+    ProxyFraming framing;
+    unsigned long long length;      // Content-Length when framing is ProxyLength
+    bool keep_alive;                // Connection reusable once the body is complete
+};
+
+// proxy_pass helpers: target parsing, header rewriting in both directions,
+// and the per-upstream pool of keep-alive connections
+class Proxy {
+    private:
+        static std::map<std::string, std::vector<int> > idle;
+
+    public:
+        static bool parsePass(const std::string& pass, std::string& upstream, std::string& path);
+        static bool isHopByHop(const std::string& name);
+        static std::string encodeHead(const ProxyJob& job, const struct sockaddr_storage& peer, bool https);
+        static std::string encodeChunk(const std::string& data);
+        static bool parseResponseHead(const std::string& raw, bool head_request, ProxyResponseHead& out);
+
+        static int acquire(const std::string& upstream, bool& reused, bool& in_progress);
+        static void release(const std::string& upstream, int fd, size_t keepalive);
+};
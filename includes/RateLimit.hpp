@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <sys/socket.h>
+
+// limit_req zone size when `zone=name` gives none, in bytes
+#define LIMIT_ZONE_DEFAULT_SIZE (1024 * 1024)
+// Client addresses with open connections that limit_conn can track at once
+#define LIMIT_CONN_ENTRIES 65536
+// Status of a request over its limit_req rate and burst
+#define LIMIT_REQ_STATUS 429
+// Client address as an IPv6 address, then the listening port
+#define ADDRESS_KEY_LEN 18
+
+// `limit_req zone=name[:size] rate=N(r/s|r/m) [burst=N] [nodelay];`
+struct LimitReq {
+    std::string zone;           // "" = no limit
+    uint64_t rate = 0;          // Requests per second, in thousandths
+    uint64_t burst = 0;         // Requests over the rate let through, in thousandths
+    bool nodelay = false;       // Serve the burst at once instead of spacing it at the rate
+};
+
+// State of one client address. Entries are allocated once per table and
+// linked by index: a hash chain and the table's LRU list.
+struct AddressEntry {
+    unsigned char key[ADDRESS_KEY_LEN]; // IPv6 address, or IPv4 as ::ffff:a.b.c.d; port or 0
+    uint64_t last = 0;          // monotonic_micros() the excess was last drained
+    uint64_t excess = 0;        // Requests over the rate not yet drained, in thousandths
+    uint32_t conns = 0;         // Open connections
+    int32_t next = -1;          // Next entry of the hash chain, or of the free list
+    int32_t newer = -1;         // LRU list neighbours
+    int32_t older = -1;
+};
+
+// Fixed-size hash table of client addresses. Nothing is allocated after
+// construction: a new address takes a free entry or, when evicting, the
+// least recently used one, whose client simply starts afresh.
+class AddressTable {
+    private:
+        std::vector<AddressEntry> entries;
+        std::vector<int32_t> buckets;   // Chain heads, -1 = empty
+        int32_t free_entries;           // Unused entries, chained through next
+        int32_t newest;
+        int32_t oldest;
+        bool evict;                     // Reuse the oldest entry when full
+
+        int32_t& bucket(const unsigned char* key);
+        void unlink(int32_t index);
+        void touch(int32_t index);
+
+    public:
+        AddressTable(size_t capacity = 0, bool evict = true);
+        size_t capacity() const { return entries.size(); }
+        AddressEntry* find(const struct sockaddr_storage& peer, int port, bool create);
+        void erase(AddressEntry* entry);
+};
+
+enum LimitResult {
+    LimitPass,      // Serve it now
+    LimitDelay,     // Serve it after the delay given
+    LimitReject     // Over rate and burst: LIMIT_REQ_STATUS
+};
+
+// limit_req and limit_conn, keyed by client address. Zones are kept by
+// name across reloads: one whose size a reload keeps keeps what it knows
+// about its clients, one it no longer declares is dropped. One AddressTable counts every client's
+// open connections for limit_conn, keyed by address and listening port:
+// each port's limit_conn counts only the connections made to it.
+class RateLimit {
+    private:
+        static std::map<std::string, AddressTable> zones;
+        static AddressTable connections;
+
+    public:
+        static void setZones(const std::map<std::string, size_t>& sizes);
+        static bool parseRate(const std::string& value, uint64_t& rate);
+        static LimitResult request(const LimitReq& limit, const struct sockaddr_storage& peer,
+                                   uint64_t now, uint64_t& delay);
+        static bool connect(const struct sockaddr_storage& peer, int port, size_t limit);
+        static void disconnect(const struct sockaddr_storage& peer, int port);
+};
@@ -10,6 +10,7 @@ typedef struct t_request
 {
 	std::string method;
 	std::string url;
+	std::string target;	// url as sent, before urlDecode
 	std::string http_version;
 }		s_request;
 
@@ -32,6 +33,7 @@ class Request
 		void printRequest();
 		std::string urlDecode(const std::string &src);
 		s_request getRequestLine();
+		std::string getHeader(const std::string &name) const;
 
 		
 };
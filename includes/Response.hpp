@@ -6,6 +6,7 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <functional>
 #include <sys/stat.h>
@@ -15,9 +16,28 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <limits>
+#include <utility>
+#include <memory>
 
 #include "../includes/Request.hpp"
 #include "../includes/Config_Manager.hpp"
+#include "../includes/FileCache.hpp"
+#include "../includes/MimeTypes.hpp"
+#include "../includes/Metrics.hpp"
+#include "../includes/Log.hpp"
+#include "../includes/DirListing.hpp"
+#include "../includes/Proxy.hpp"
+#include "../includes/FastCGI.hpp"
+
+// Static files up to this size are read into the response instead of sendfile()
+#define SENDFILE_MIN_SIZE 16384
+// More ranges than this in one request are ignored and the whole file is sent
+#define MAX_BYTE_RANGES 32
+// Rough size of a multipart/byteranges part's boundary and headers
+#define RANGE_PART_OVERHEAD 100
+// buildHeaders() lengths for bodies whose size is not known up front
+#define LENGTH_CHUNKED std::string::npos             // Transfer-Encoding: chunked
+#define LENGTH_UNTIL_CLOSE (std::string::npos - 1)   // Body ends when the connection closes
 
 /*
 HTTP Status Codes
@@ -30,13 +50,20 @@ HTTP Status Codes
 
 enum StatusCode {
     OK = 200,
+    PartialContent = 206,
+    NotModified = 304,
     BadRequest = 400,
     NotFound = 404,
     InternalServerError = 500,
     FileTooLarge = 413,
     Forbidden = 403,
     MethodNotAllowed = 405,
-    UnsupportedMediaType = 415
+    PreconditionFailed = 412,
+    UnsupportedMediaType = 415,
+    RangeNotSatisfiable = 416,
+    BadGateway = 502,
+    ServiceUnavailable = 503,
+    GatewayTimeout = 504
 };
 
 typedef struct RouteConfig {
@@ -46,15 +73,59 @@ typedef struct RouteConfig {
     bool autoindex;
     std::size_t client_max_body_size;
     std::string default_file;
+    bool etag_hash = false;
+    std::size_t autoindex_page_size = 0;
+    std::string fastcgi_pass;
+    std::size_t fastcgi_connect_timeout = FASTCGI_DEFAULT_TIMEOUT;
+    std::size_t fastcgi_read_timeout = FASTCGI_DEFAULT_TIMEOUT;
+    std::map<std::string, std::string> cgi_handlers;
+    std::size_t cgi_pool = 0;
+    std::string cgi_relay = "splice";
+    std::string location;
+    std::size_t cgi_timeout = 60;
+    std::size_t cgi_max_concurrency = 0;
+    std::string default_type = MIME_DEFAULT_TYPE;
+    bool stub_status = false;
+    std::string proxy_pass;
+    std::size_t proxy_connect_timeout = PROXY_DEFAULT_TIMEOUT;
+    std::size_t proxy_send_timeout = PROXY_DEFAULT_TIMEOUT;
+    std::size_t proxy_read_timeout = PROXY_DEFAULT_TIMEOUT;
+    std::vector<std::pair<std::string, std::string> > proxy_set_headers;
+    std::size_t proxy_keepalive = PROXY_DEFAULT_KEEPALIVE;
+    std::shared_ptr<UpstreamGroup> proxy_upstream;
+    std::size_t cache_valid = 0;
+    std::size_t cache_max_size = RESPONSE_CACHE_DEFAULT_SIZE;
+    std::vector<std::string> cache_key_headers;
+    LimitReq limit_req;
 }   t_routeConfig;
 
 using RouteHandler = std::function<t_routeConfig(std::string)>;
 
+// Piece of a file body: `prefix` is sent first, then `length` bytes of the
+// file from `offset` (a multipart/byteranges part and its part headers)
+struct FileSegment {
+    std::string prefix;
+    off_t offset;
+    off_t length;
+};
+
 class Response : public Request
 {
     protected:
         t_routeConfig route_config;
         std::vector<ServerConfig> Rconfig;
+        std::string extra_headers;  // "Name: value\r\n" lines added by buildHeaders
+        int body_fd;                // File sent after the headers with sendfile, -1 if none
+        std::deque<FileSegment> body_segments; // What of it is sent, in order
+        std::shared_ptr<DirListingStream> listing_body; // Chunked autoindex body, if any
+        std::string query_string;
+        bool stream_body = false;   // body holds only what has arrived; the rest is piped to the CGI
+        std::shared_ptr<ProxyJob> proxy_job; // proxy_pass request for the server loop, if any
+        std::string cache_fill;     // Response cache key this request's backend answer fills
+        std::string cache_wait;     // Key whose fill, already under way, answers this request
+        struct sockaddr_storage peer = {};  // Client address, for limit_req
+        bool limit_checked = false; // Already passed limit_req (it was delayed)
+        uint64_t limit_delay = 0;   // Microseconds limit_req holds this request back, 0 = none
 
     public:
         Response(std::vector<ServerConfig> config);
@@ -69,6 +140,11 @@ class Response : public Request
         std::string getHeadResponse(const std::string& requested_path, int statusCode);
 
         std::string buildResponse(const std::string& body, int statusCode, const std::string& contentType);
+        std::string buildHeaders(std::size_t contentLength, int statusCode, const std::string& contentType);
+        void addHeader(const std::string& name, const std::string& value);
+        int releaseFileBody(std::deque<FileSegment>& segments);
+        std::shared_ptr<DirListingStream> releaseListingBody();
+        std::shared_ptr<ProxyJob> releaseProxyJob();
         std::string getStatusLine(int statusCode);
         HttpMethod methodToEnum(std::string method);
         std::string generateDirectoryListing(const std::string& path, const std::string& url);
@@ -79,10 +155,36 @@ class Response : public Request
                                         const std::string& boundary,
                                         std::string& out_filename);
         std::string getMimeType(const std::string& path);
+        const std::string& getMimeType(const FileInfo& info);
         size_t getContentLength(const std::string &headers) const;
         std::string responseApplication(std::string body);
         std::string responseTextPlain(const std::string& body);
 
+        int parseRangeHeader(const std::string& value, off_t size,
+                             std::vector<std::pair<off_t, off_t> >& ranges);
+        std::string getRangeResponse(int fd, const FileInfo& info);
+        void setFileBody(int fd, off_t offset, off_t length);
+        int evaluatePreconditions(const FileInfo& info);
+        void addValidators(const FileInfo& info);
+        bool readFileRange(int fd, off_t offset, off_t length, std::string& out);
+
         bool isCGIRequest(const std::string& url);
+        bool canStreamBody(const std::string& url, bool length_known);
+        const std::string& routeLocation() const { return route_config.location; }
+        void streamBody(const std::string& received);
         std::string executeCGI(const std::string& path, const std::string& query, const std::string& method);
+        std::vector<std::pair<std::string, std::string> > cgiParams(const std::string& scriptName,
+                const std::string& scriptFilename, const std::string& pathInfo,
+                const std::string& query, const std::string& method);
+        bool parseCGIHeaders(const std::string& output, size_t& body_start, int& status,
+                             std::string& contentType, long long& contentLength);
+        std::string executeFastCGI(const std::string& backend, const std::string& scriptPath,
+                                   const std::string& query, const std::string& method);
+        std::string executeProxy(const std::string& method);
+        bool lookupCache(const std::string& method, std::string& response);
+        const std::string& cacheFill() const { return cache_fill; }
+        const std::string& cacheWait() const { return cache_wait; }
+        void setClient(const struct sockaddr_storage& address, bool limited);
+        bool checkLimits();
+        uint64_t limitDelay() const { return limit_delay; }
 };
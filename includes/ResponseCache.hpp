@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <ctime>
+
+// cache_max_size default: bytes of responses kept per caching location
+#define RESPONSE_CACHE_DEFAULT_SIZE (10 * 1024 * 1024)
+// A single response larger than this is passed on but never stored
+#define RESPONSE_CACHE_MAX_ENTRY (1024 * 1024)
+
+enum CacheLookup {
+    CacheHit,       // response holds the stored copy
+    CacheMiss,      // The caller fills the key: complete() or abort() when done
+    CacheWait,      // Another request is filling the key; wait for its answer
+    CachePass       // Known to be uncacheable for now: go to the backend
+};
+
+struct CacheEntry {
+    std::string response;   // Whole HTTP response as the first client got it, "" for a pass
+    time_t stored;
+    time_t expires;
+    std::list<std::string>::iterator lru;
+};
+
+// Entries of one caching location, the unit of cache_max_size
+struct CacheZone {
+    size_t max_size;
+    time_t valid;           // cache_valid: TTL when the response names none
+    size_t size;            // Bytes of keys and responses held
+    std::unordered_map<std::string, CacheEntry> entries;
+    std::list<std::string> lru;     // Most recently used first
+};
+
+// Micro-cache for CGI, FastCGI and proxy_pass responses. A miss makes the
+// request the key's only fill; identical requests arriving meanwhile get
+// CacheWait and are answered from the fill, so a hot key runs the backend
+// once per TTL however many clients ask for it. Responses that must not be
+// shared leave a pass marker instead, and requests go to the backend
+// directly until it expires.
+class ResponseCache {
+    private:
+        static std::map<std::string, CacheZone> zones;           // By location
+        static std::unordered_map<std::string, CacheZone*> filling; // Key -> its zone
+
+        static void insert(CacheZone& zone, const std::string& key, const std::string& response,
+                           time_t now, time_t ttl);
+        static void erase(CacheZone& zone, std::unordered_map<std::string, CacheEntry>::iterator it);
+
+    public:
+        static CacheLookup lookup(const std::string& location, size_t max_size, time_t valid,
+                                  const std::string& key, std::string& response);
+        static bool complete(const std::string& key, const std::string& response);
+        static void abort(const std::string& key, bool pass);
+        static time_t freshness(const std::string& response, time_t valid, time_t now, bool& shared);
+};
@@ -15,18 +15,98 @@
 #include <cstdlib>
 #include <sys/wait.h>
 #include <set>
+#include <deque>
+#include <ctime>
+#include <memory>
+#ifdef __linux__
+# include <sys/sendfile.h>
+#else
+# include <sys/socket.h>
+# include <sys/uio.h>
+#endif
 
 #include "../includes/Request.hpp"
 #include "../includes/Response.hpp"
 #include "../includes/Utils.hpp"
 #include "../includes/Config_Manager.hpp"
+#include "../includes/FastCGI.hpp"
+#include "../includes/CGISpawn.hpp"
+#include "../includes/ChunkedDecoder.hpp"
+#include "../includes/Metrics.hpp"
+#include "../includes/AccessLog.hpp"
+#include "../includes/Log.hpp"
+#include "../includes/Trace.hpp"
+#include "../includes/Capture.hpp"
+#include "../includes/Proxy.hpp"
+#include "../includes/Tls.hpp"
+#include "../includes/Http2.hpp"
+#include "../includes/EventLoop.hpp"
+#include "../includes/RateLimit.hpp"
 
 #define BUF_SIZE 8194
+// Upper bound for one sendfile() call so a big file doesn't starve other clients
+#define SENDFILE_CHUNK (1024 * 1024)
+// Bytes moved per splice() call, and the pipe size requested for relayed CGI output
+#define RELAY_CHUNK (1024 * 1024)
+// CGI output buffered without finding the end of its headers before giving up on relaying
+#define RELAY_MAX_HEADER 65536
+// Seconds between SIGTERM and SIGKILL for a CGI past its cgi_timeout
+#define CGI_KILL_GRACE 2
+// Requests that may wait for a cgi_max_concurrency slot before getting 503
+#define CGI_MAX_QUEUE 64
+// Written to a plain HTTP client over limit_conn before it is closed
+#define LIMIT_CONN_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
 
 struct ClientSession {
 	std::string buffer;
 	bool headers_received = false;
 	int content_length = 0;
+	bool chunked = false;           // Transfer-Encoding: chunked
+	ChunkedDecoder chunked_body;    // Framing seen so far (buffered) or decoder (streamed)
+	size_t scanned = 0;             // Bytes of buffer already fed to chunked_body
+	bool stream_checked = false;    // canStreamBody() has been asked
+	bool streaming = false;         // Body goes straight to a CGI's stdin as it arrives
+	size_t body_left = 0;           // Content-Length bytes still to stream
+	uint64_t first_byte = 0;        // monotonic_micros() of the first byte read
+	uint64_t headers_done = 0;      // ... and of the end of the header block
+	bool limit_checked = false;     // Passed limit_req after a delay: not counted again
+};
+
+// A parsed configuration. SIGHUP makes a new one current; connections
+// accepted before keep theirs alive until they close.
+typedef std::shared_ptr<const std::vector<ServerConfig> > ConfigSnapshot;
+
+// What a request's record starts from on its connection
+struct ClientInfo {
+  struct sockaddr_storage peer;   // Client address
+  uint64_t accepted;              // monotonic_micros() at accept()
+  ConfigSnapshot config;          // Configuration its request is served with
+};
+
+// File body still to be sent with sendfile() once the headers are out
+struct FileTransfer {
+  int fd;                           // Open file being streamed
+  std::deque<FileSegment> segments; // Left to send; the front one's offset is the next byte
+  size_t prefix_sent;               // Bytes of the front segment's prefix already sent
+};
+
+// Autoindex page being generated and sent a chunk at a time
+struct ListingTransfer {
+  std::shared_ptr<DirListingStream> stream;
+  std::string chunk;  // Framed chunk currently being sent
+  size_t offset;      // Bytes of chunk already sent
+  bool last;          // chunk ends the response
+};
+
+// How CGI output reaches the client (cgi_relay directive)
+enum CGIRelayMode {
+  RelayOff,     // Buffer everything, answer with Content-Length at EOF
+  RelayCopy,    // Stream the body through a userspace buffer
+  RelaySplice   // Stream the body pipe-to-socket with splice() (Linux)
 };
 
 // Add this struct to track CGI process state
@@ -35,58 +115,275 @@ struct CGIState {
   int stdin_fd;           // Pipe for writing to CGI stdin
   int stdout_fd;          // Pipe for reading from CGI stdout
   std::string input_buffer; // Request body to send to CGI
+  size_t input_offset;    // Bytes of input_buffer already written
   std::string output_buffer; // Accumulated CGI output
   int client_fd;          // Associated client file descriptor
   bool done;              // Whether CGI has finished
+  CGIRelayMode relay;     // How the body is forwarded once headers are parsed
+  bool relaying;          // Headers sent; body now flows straight to the client
+  bool stdin_streaming;   // More request body still to come from the client
+  std::string cache_key;  // Response cache fill the output completes, if any
+};
+
+// Everything needed to start a CGI run, now or once its location has a free slot
+struct CGIJob {
+  std::vector<std::string> argv;  // Interpreter (if any) and script
+  std::vector<std::string> env;   // CGI meta-variables as NAME=value
+  std::string input;              // Request body for stdin (what has arrived, if streamed)
+  bool stream_body;               // The rest of the body follows from the client socket
+  bool pooled;                    // Run in a warm worker of argv[0] if one is idle
+  int client_fd;                  // Associated client file descriptor
+  CGIRelayMode relay;             // cgi_relay of the location
+  std::string location;           // Key for cgi_max_concurrency
+  size_t max_concurrency;         // 0 = no limit
+  time_t timeout;                 // cgi_timeout in seconds
+  time_t queued_at;               // When it started waiting for a slot
+  std::string cache_key;          // Response cache fill its output completes, if any
+};
+
+// A started CGI process, tracked until the SIGCHLD handler lets us reap it
+struct CGIChild {
+  std::string location;   // Slot to give back when it exits
+  int stdout_fd;          // Key of its CGIState while that exists
+  time_t deadline;        // Next escalation: SIGTERM, then SIGKILL
+  int signals_sent;       // 0 = none, 1 = SIGTERM, 2 = SIGKILL
+};
+
+// Request in flight on a fastcgi_pass backend connection
+struct FastCGIState {
+  std::string backend;      // Pool key, "unix:/path" or "host:port"
+  int client_fd;            // Associated client file descriptor
+  std::string request;      // Encoded records, kept whole for a retry
+  size_t request_offset;    // Bytes of request already written
+  std::string input;        // Unparsed bytes read from the backend
+  std::string stdout_data;  // FCGI_STDOUT content: the answer so far, or once relaying the part not yet sent
+  bool relaying;            // Head delivered; the body goes to the client as it can take it
+  bool complete;            // FCGI_END_REQUEST seen
+  bool connecting;          // Non-blocking connect() still in progress
+  bool reused;              // Came from the pool, may have gone stale
+  std::string cache_key;    // Response cache fill the answer completes, if any
+  time_t deadline;          // When the backend has taken too long, 0 = not waiting on it
+  time_t connect_timeout;
+  time_t read_timeout;
+};
+
+// Request in flight on a proxy_pass upstream connection
+struct ProxyState {
+  std::string upstream;     // Pool key, "host:port"
+  std::shared_ptr<UpstreamGroup> group; // Upstream block the peer came from, if any
+  int peer;                 // Its index in group, -1 without one
+  uint64_t tried;           // Peers of group already tried for this request
+  std::string hash_key;     // For a hash-balanced group
+  bool idempotent;          // Method that may be sent to another peer after a failure
+  int client_fd;            // Associated client file descriptor
+  std::string request;      // Bytes to write upstream: head and body, or the next body piece
+  size_t request_offset;    // Bytes of request already written
+  bool uploading;           // More request body still to come from the client
+  bool chunked_upload;      // ... and it is passed on in chunks
+  bool retryable;           // request holds the whole request, so it can be sent again
+  std::string input;        // Response bytes read before the head was complete
+  bool head_request;        // HEAD: the response has no body whatever it says
+  bool relaying;            // Head delivered; the body goes to the client as it can take it
+  bool complete;            // Whole body read, only the client's copy is left to send
+  ProxyFraming framing;
+  unsigned long long body_left; // ProxyLength bytes still to come
+  ChunkedDecoder chunks;    // ProxyChunked: finds the end of the passed-through body
+  bool keep_alive;          // Upstream connection reusable after this response
+  bool connecting;          // Non-blocking connect() still in progress
+  bool reused;              // Came from the pool, may have gone stale
+  time_t deadline;          // When the upstream has taken too long, 0 = not waiting on it
+  time_t connect_timeout;
+  time_t send_timeout;
+  time_t read_timeout;
+  size_t keepalive;         // proxy_keepalive of the location
+  std::string cache_key;    // Response cache fill the relayed response completes, if any
+  std::string cache_copy;   // The response so far, for that fill
+};
+
+// A request limit_req holds back
+struct DelayedRequest {
+  uint64_t due;             // monotonic_micros() it is routed again
+  ClientSession session;
+};
+
+// A request answered by another one's response cache fill
+struct CacheWaiter {
+  std::string key;
+  ClientSession session;    // The request, to route again if the fill cannot answer it
 };
 
 
 class Server {
 	private:
-		std::vector<ServerConfig> config;
-		std::vector<int> ss_Fds;
+		ConfigSnapshot current_config;
+		std::string config_path;    // Read again on SIGHUP
+		std::map<int, int> listeners; // Port -> listening socket
 		std::map<int, ServerConfig> serverSockets;
 		std::map<int, ServerConfig> clientConfigs;
-		std::vector<int> uniqPorts;
 		std::map<int, ClientSession> client_sessions;
-		std::set<int> seenPorts;
+		std::map<int, FileTransfer> file_transfers;
+		std::map<int, ListingTransfer> listing_transfers;
+		std::map<int, int> cgi_relays; // Client fd -> stdout fd of the CGI it is relaying
+		std::map<int, size_t> response_offsets; // Bytes of responses[fd] already sent
+		std::map<int, RequestRecord> request_records;
+		std::map<int, ClientInfo> client_info;
+		std::map<int, ProxyState> proxy_states; // Keyed by upstream socket
+		std::map<int, int> proxy_clients; // Client fd -> upstream socket serving it
+		std::map<std::string, std::vector<int> > cache_waiters; // Key being filled -> clients waiting on it
+		std::map<int, CacheWaiter> cache_waits; // Client fd -> the fill it waits on
+		std::map<int, DelayedRequest> delayed_requests; // By client fd
+		std::multimap<uint64_t, int> delay_queue; // Due time -> client fd, stale entries skipped
+		time_t shutdown_deadline = 0; // Graceful shutdown under way until then, 0 = not stopping
 
 	public:
 		static std::vector<struct pollfd> poll_fds;
 		static std::map<int, CGIState> cgi_states; // Keyed by stdout_fd
+		static std::map<int, FastCGIState> fcgi_states; // Keyed by backend socket
+		static std::map<int, int> fcgi_clients; // Client fd -> backend socket serving it
 		static int current_client_fd; // Set in main loop before handling request
+		static std::map<pid_t, CGIChild> cgi_children;
+		static std::map<std::string, size_t> cgi_running; // Live scripts per location
+		static std::map<std::string, std::deque<CGIJob> > cgi_queue;
+		static int sigchld_pipe[2]; // Self-pipe: written by the SIGCHLD handler, polled by the loop
+		static std::map<int, int> cgi_uploads; // Client fd -> stdout fd of the CGI taking its body
 		static bool running;
+		static bool reload_pending; // Set by the SIGHUP handler
+		static bool shutdown_pending; // Set by the SIGTERM/SIGQUIT handler
+		static std::map<int, H2Connection> h2_connections; // Keyed by client socket
+		static std::map<int, std::pair<int, uint32_t> > h2_clients; // Stream client id -> socket and stream id
+		static int h2_next_client;
 		std::unordered_map<int, std::string> responses;
 		
-		Server(std::vector<ServerConfig> config);
+		Server(std::vector<ServerConfig> config, const std::string& config_path);
 		~Server();
 
 		//initial step when we go through the results of the parser,
 		//look for the unique ports and create socket for each port we gonna listen on
 		void setupPorts();
+		static bool checkPorts(const std::vector<ServerConfig>& config, std::string& error);
+		static int openListener(int port, std::string& error);
+		bool openListeners(const std::vector<ServerConfig>& config, std::string& error);
+		void closeListeners(const std::vector<ServerConfig>& config);
+		void configureCGIPools();
+		const std::vector<ServerConfig>& configFor(int client_fd) const;
+		void reload();
 		void run();
 		static void signalHandler(int signum);
+		static void sighupHandler(int signum);
+		static void sigchldHandler(int signum);
 		void mainLoop();
+		int waitTimeout() const;
+		void beginShutdown();
+		bool drainConnections();
+		bool clientBusy(int client_fd) const;
+		void releaseDelayedRequests();
 		void handleCGIPipeEvents(size_t i);
+		static std::map<int, CGIState>::iterator findCGIState(int fd);
+		static int submitCGI(const CGIJob& job);
+		static bool launchCGI(const CGIJob& job);
+		void dropCGIState(int stdout_fd);
+		void dropClientCGI(int client_fd);
+		void terminateCGI(pid_t pid);
+		void reapChildren();
+		void startQueuedCGI(const std::string& location);
+		void checkCGITimeouts();
+		static bool startFastCGI(const std::string& backend, const std::string& request, int client_fd,
+								 const std::string& cache_key, time_t connect_timeout, time_t read_timeout);
+		void handleFastCGIEvents(size_t i);
+		bool startFastCGIRelay(FastCGIState& state);
+		bool sendFastCGIBody(int client_fd);
+		void finishFastCGI(int fd, bool completed, int status = 502);
+		void retryFastCGI(int fd);
+		void abortFastCGI(int fd);
+		void checkFastCGITimeouts();
+		bool startProxy(int client_fd, const ProxyJob& job);
+		void handleProxyEvents(size_t i);
+		void readProxyHead(int fd);
+		void failProxy(int fd, int status);
+		int connectProxy(ProxyState& state, bool pick_peer, bool pooled);
+		void retryProxy(int fd, bool next_peer, int status);
+		void finishProxy(int fd, bool reuse);
+		void handleProxyUpload(int client_fd, ClientSession& session);
+		bool sendProxyBody(int client_fd);
+		void checkProxyTimeouts();
+		void copyProxyResponse(ProxyState& state, const char* data, size_t len);
+		void deliverBackendResponse(int client_fd, const std::string& cache_key, const std::string& response);
+		void completeCacheFill(const std::string& key, const std::string& response);
+		void abortCacheFill(const std::string& key, bool pass);
+		void releaseCacheWaiters(const std::string& key, const std::string* response);
+		bool startCGIRelay(std::map<int, CGIState>::iterator cgi_it);
+		bool sendRelayBody(int client_fd);
+		void finishRelay(int client_fd, bool aborted);
+		static void setPollEvents(int fd, short events);
+		static bool writeCGIInput(CGIState& state);
+		bool canStreamBody(int client_fd, const ClientSession& session);
+		void handleCGIUpload(int client_fd, ClientSession& session);
+		void abortCGIUpload(int client_fd, int status);
 		void handleSocketEvents(size_t i);
 		void cleanup();
 
-		void handleNewConnection(int listen_id);
+		bool handleNewConnection(int listen_id);
+		void continueHandshake(int client_fd);
+		H2Connection& startHttp2(int client_fd, const std::string& input);
+		bool detectHttp2(int client_fd, ClientSession& session);
+		bool upgradeHttp2(int client_fd, ClientSession& session);
+		void handleHttp2Events(size_t i);
+		void processHttp2Input(int client_fd);
+		void handleHttp2Frame(int client_fd, H2Connection& conn, uint8_t type, uint8_t flags, uint32_t id,
+							  const uint8_t* payload, size_t len);
+		void readHttp2Data(int client_fd, H2Connection& conn, uint8_t flags, uint32_t id,
+						   const uint8_t* payload, size_t len);
+		void readHttp2WindowUpdate(H2Connection& conn, uint32_t id, const uint8_t* payload, size_t len);
+		void readHttp2HeaderBlock(int client_fd, H2Connection& conn, uint8_t flags, const uint8_t* data, size_t len);
+		void dispatchHttp2Stream(int client_fd, H2Connection& conn, uint32_t id);
+		void streamHttp2Body(int client_fd, H2Connection& conn, uint32_t id);
+		static void creditHttp2(H2Connection& conn, uint32_t id, H2Stream* stream);
+		static void dropHttp2Body(H2Connection& conn, H2Stream& stream);
+		bool streamReadable(const H2Stream& stream) const;
+		void runHttp2Request(int client_fd, H2Connection& conn, uint32_t id, ClientSession& session);
+		void resetHttp2Stream(H2Connection& conn, uint32_t id, uint32_t error);
+		void cancelHttp2Stream(H2Connection& conn, uint32_t id);
+		static void failHttp2(H2Connection& conn, uint32_t error);
+		static ssize_t sendToStream(int client, const char* data, size_t len);
+		static ssize_t recvFromStream(int client, char* buf, size_t len);
+		static void setStreamEvents(int client, short events);
+		static void watchHttp2Output(int client_fd);
+		void endHttp2Stream(int client);
+		void closeHttp2(int client_fd);
+		void writeHttp2(int client_fd);
+		static ssize_t flushHttp2(int client_fd, H2Connection& conn);
+		static void frameHttp2Output(H2Connection& conn);
+		bool http2Writable(const H2Connection& conn) const;
+		static int clientSocket(int client_fd);
+		static bool plainSocket(int client_fd);
+		static ssize_t sendToClient(int client_fd, const void* buf, size_t len, int flags);
+		static ssize_t recvFromClient(int client_fd, char* buf, size_t len);
 		void handleClientData(int client_fd);
 		void handleClientWrite(int client_fd);
 		void closeClient(int client_fd);
+		void queueResponse(int client_fd, const std::string& response, Response& res);
+		void deliverResponse(int client_fd, const std::string& response);
+		void noteResponse(int client_fd, const std::string& response);
+		void countSent(int client_fd, size_t bytes);
+		void finishRequest(int client_fd, bool complete);
+		static void addPollFd(int fd, short events);
+		static void removePollFd(int fd);
+		bool sendFileBody(int client_fd);
+		bool sendListingBody(int client_fd);
+		bool hasPendingBody(int client_fd) const;
 		
 		
 		// Handling client data
-		std::string getHostFromHeaders(const std::string& headers);
-		const ServerConfig* getServerConfigByHost(const std::vector<ServerConfig>& configs,
-													const std::string& host, int port);
+		static std::string getHostFromHeaders(const std::string& headers);
+		static const ServerConfig* getServerConfigByHost(const std::vector<ServerConfig>& configs,
+														const std::string& host, int port);
 		int getListeningPortForClient(int client_fd);
 		bool receiveData(int client_fd);
 		bool processHeaders(ClientSession& session);
-		bool isFullRequestReceived(const ClientSession& session);
+		bool isFullRequestReceived(int client_fd, ClientSession& session);
+		bool isChunkedRequest(const std::string& headers);
 		void processRequest(int client_fd, ClientSession& session);
 		void enableWriteEvents(int client_fd);
-		std::string processCGIOutput(const std::string& output);
+		std::string processCGIOutput(int client_fd, const std::string& output);
 };
 
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <ctime>
+#include <poll.h>
+#include <sys/types.h>
+
+// Plaintext per record while a connection is warming up: with the TLS 1.3
+// record overhead it fits one 1460-byte segment, so the browser can decrypt
+// the first bytes without waiting for the rest of a 16KB record
+#define TLS_RECORD_SMALL 1400
+// The protocol maximum, for bulk transfer once the window has opened
+#define TLS_RECORD_LARGE 16384
+// Bytes sent in small records before switching to large ones: about what
+// slow start lets through in the first three round trips
+#define TLS_RECORD_BOOST_AFTER (128 * 1024)
+// A connection idle this long (microseconds) starts over with small records
+#define TLS_RECORD_IDLE_RESET 1000000
+// ssl_session_cache / ssl_session_timeout defaults
+#define TLS_SESSION_CACHE_DEFAULT 20480
+#define TLS_SESSION_TIMEOUT_DEFAULT 300
+
+struct ssl_st;
+struct ssl_ctx_st;
+
+// The ssl_* directives of a `listen ... ssl` server
+struct TlsSettings {
+    std::string certificate;    // PEM chain, leaf first
+    std::string key;
+    size_t session_cache = TLS_SESSION_CACHE_DEFAULT;   // Sessions kept for resumption, 0 = off
+    bool session_tickets = true;
+    long session_timeout = TLS_SESSION_TIMEOUT_DEFAULT; // Seconds a session may be resumed
+    bool http2 = true;          // Offer h2 in ALPN
+
+    bool operator==(const TlsSettings& other) const {
+        return certificate == other.certificate && key == other.key && session_cache == other.session_cache
+               && session_tickets == other.session_tickets && session_timeout == other.session_timeout
+               && http2 == other.http2;
+    }
+};
+
+// A loaded certificate and its session cache
+struct TlsContext {
+    TlsSettings settings;
+    time_t certificate_time;    // mtimes when loaded: a reload after renewal loads them again
+    time_t key_time;
+    struct ssl_ctx_st* ctx;
+};
+
+struct TlsConnection {
+    struct ssl_st* ssl;
+    bool handshaking;
+    short wait_events;      // What the handshake waits for, POLLIN or POLLOUT
+    size_t retry;           // Length of an SSL_write() that must be repeated, 0 = none
+    uint64_t burst;         // Bytes written since the connection was last idle
+    uint64_t last_write;    // monotonic_micros()
+};
+
+// TLS for `listen ... ssl` servers, with OpenSSL driven by the event loop
+// on non-blocking sockets. Contexts are shared by every server (and every
+// reload) with the same certificate and settings, and so is their session
+// cache; session tickets are sealed with one process-wide key, so either
+// way a returning client resumes without a full key exchange. recv() and
+// send() stand in for the socket calls on client connections and fall
+// through to them for plain TCP. Built with WEBSERV_TLS (make TLS=1).
+class Tls {
+    private:
+        static std::vector<TlsContext> contexts;
+        static std::unordered_map<int, TlsConnection> connections;
+
+        static ssize_t ioResult(TlsConnection& conn, int rc);
+        static bool buffered(int fd);
+
+    public:
+        static int context(const TlsSettings& settings, std::string& error);
+        static bool accept(int fd, int context);
+        static bool active(int fd) { return connections.count(fd) != 0; }
+        static bool handshaking(int fd);
+        static int handshake(int fd);
+        static std::string protocol(int fd);
+        static short waitEvents(int fd);
+        static ssize_t recv(int fd, void* buf, size_t len);
+        static ssize_t send(int fd, const void* buf, size_t len, int flags);
+        static bool anyBuffered(const std::vector<struct pollfd>& fds);
+        static void markBuffered(std::vector<struct pollfd>& fds);
+        static void close(int fd);
+};
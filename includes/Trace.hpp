@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include "../includes/AccessLog.hpp"
+
+// Default for trace_sample: every request
+#define TRACE_DEFAULT_SAMPLE 1
+
+// Request phases as spans in Chrome's trace event format, for
+// chrome://tracing or Perfetto. `trace_file path;` turns it on and
+// `trace_sample N;` keeps one request in N. The JSON array is never closed,
+// which both viewers accept, so the file can grow while the server runs.
+// With no trace_file a request costs one comparison.
+class Trace {
+    private:
+        static std::shared_ptr<AccessLogFile> file; // NULL = off
+        static size_t sample_rate;
+        static size_t counter;
+
+    public:
+        static void use(const std::shared_ptr<AccessLogFile>& trace_file, size_t rate);
+        static bool sample() { return file && counter++ % sample_rate == 0; }
+        static void write(int client_fd, const RequestRecord& record, uint64_t now_us);
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <ctime>
+#include <cstdint>
+
+// Peers per upstream block; a request's tried peers fit in one 64-bit mask
+#define UPSTREAM_MAX_PEERS 64
+// `server` defaults: failures within fail_timeout seconds that mark it down for fail_timeout
+#define UPSTREAM_DEFAULT_MAX_FAILS 1
+#define UPSTREAM_DEFAULT_FAIL_TIMEOUT 10
+// Points on the consistent-hash ring per unit of weight
+#define UPSTREAM_HASH_POINTS 160
+
+enum UpstreamBalance {
+    BalanceRoundRobin,  // Smooth weighted round robin (default)
+    BalanceLeastConn,   // Fewest requests in flight relative to weight
+    BalanceHash         // Consistent hash of the request URI or a header
+};
+
+struct UpstreamPeer {
+    std::string address;    // "host:port", also the connection pool key
+    int weight;
+    int max_fails;          // 0 = never marked down
+    time_t fail_timeout;
+    int current_weight;     // Round robin state
+    int active;             // Requests in flight
+    int fails;              // Failures since failed_at's window began
+    time_t failed_at;       // Last failure
+};
+
+// An `upstream name { server ...; }` block and its balancing state. A
+// configuration snapshot holds its groups, so a reload starts them afresh
+// while requests already under way finish with the old ones.
+class UpstreamGroup {
+    private:
+        std::vector<UpstreamPeer> peers;
+        std::vector<std::pair<uint32_t, uint16_t> > ring; // Sorted hash point -> peer
+        size_t cursor;          // least_conn: where the next tie-break starts
+
+        bool usable(size_t peer, uint64_t tried, time_t now, bool health) const;
+        int roundRobin(uint64_t tried, time_t now, bool health);
+        int leastConn(uint64_t tried, time_t now, bool health);
+        int hashed(const std::string& key, uint64_t tried, time_t now, bool health);
+
+    public:
+        std::string name;
+        UpstreamBalance balance;
+        std::string hash_key;   // BalanceHash: "$request_uri" or "$http_<name>"
+
+        UpstreamGroup(const std::string& name);
+        void addPeer(const std::string& address, int weight, int max_fails, time_t fail_timeout);
+        void buildRing();
+        size_t size() const { return peers.size(); }
+        const std::string& address(int peer) const { return peers[peer].address; }
+
+        int pick(const std::string& key, uint64_t tried, time_t now);
+        void started(int peer) { peers[peer].active++; }
+        void finished(int peer) { peers[peer].active--; }
+        void failed(int peer, time_t now);
+        void succeeded(int peer) { peers[peer].fails = 0; }
+};
@@ -7,6 +7,18 @@
 #include <sstream>
 #include <iostream>
 #include <regex>
+#include <memory>
+#include "../includes/Proxy.hpp"
+#include "../includes/FastCGI.hpp"
+#include "../includes/ResponseCache.hpp"
+#include "../includes/RateLimit.hpp"
+#include "../includes/AccessLog.hpp"
+#include "../includes/MimeTypes.hpp"
+#include "../includes/Log.hpp"
+#include "../includes/EventLoop.hpp"
+
+// shutdown_timeout default: seconds requests under way get to finish after SIGTERM/SIGQUIT
+#define SHUTDOWN_DEFAULT_TIMEOUT 30
 
 // Forward declarations
 class ConfigManager;
@@ -28,6 +40,8 @@ enum class TokenType { Identifier, Symbol, String, Comment, EndOfFile };
 struct Token {
     TokenType type;
     std::string value;
+    int line;       // Where the token starts, for error messages
+    int column;
 };
 
 // AST nodes
@@ -45,6 +59,13 @@ struct LocationBlock {
 struct ServerBlock {
     std::vector<Directive> directives;
     std::vector<LocationBlock> locations;
+    std::vector<Directive> types;  // `types { type ext...; }` entries
+};
+
+// `upstream name { server host:port ...; }`, next to the server blocks
+struct UpstreamBlock {
+    std::string name;
+    std::vector<Directive> directives;
 };
 
 // Runtime configuration structures
@@ -60,6 +81,28 @@ struct RouteConfigFromConfigFile {
     std::string upload_dir;
     std::size_t client_max_body_size = 1024 * 1024; // Default to 1MB
     std::string redirect;
+    bool etag_hash = false;    // Content-hash ETags instead of inode/size/mtime
+    std::size_t autoindex_page_size = 0; // Entries per autoindex page, 0 = all
+    std::string fastcgi_pass;  // FastCGI backend, "unix:/path" or "host:port"
+    std::size_t fastcgi_connect_timeout = FASTCGI_DEFAULT_TIMEOUT; // Seconds to connect
+    std::size_t fastcgi_read_timeout = FASTCGI_DEFAULT_TIMEOUT;    // ... and between reads of the answer
+    std::size_t cgi_pool = 0;  // Warm interpreters kept per python cgi handler
+    std::string cgi_relay = "splice"; // CGI body to client: splice, copy or off (buffered)
+    std::size_t cgi_timeout = 60;          // Seconds a CGI may run before SIGTERM, then SIGKILL
+    std::size_t cgi_max_concurrency = 0;   // Scripts running at once in this location, 0 = no limit
+    std::string default_type;  // Content-Type for unknown extensions, "" = the server's
+    bool stub_status = false;  // Location answers with the server's metrics
+    std::string proxy_pass;    // HTTP upstream, "http://host[:port][/path]"
+    std::size_t proxy_connect_timeout = PROXY_DEFAULT_TIMEOUT; // Seconds, each
+    std::size_t proxy_send_timeout = PROXY_DEFAULT_TIMEOUT;
+    std::size_t proxy_read_timeout = PROXY_DEFAULT_TIMEOUT;
+    std::vector<std::pair<std::string, std::string> > proxy_set_headers; // Name, value ("" = removed)
+    std::size_t proxy_keepalive = PROXY_DEFAULT_KEEPALIVE; // Idle upstream connections kept, 0 = none
+    std::shared_ptr<UpstreamGroup> proxy_upstream; // proxy_pass names an upstream block
+    std::size_t cache_valid = 0;   // Seconds a CGI/FastCGI/proxied response is cached by default, 0 = off
+    std::size_t cache_max_size = RESPONSE_CACHE_DEFAULT_SIZE; // Bytes of responses kept for the location
+    std::vector<std::string> cache_key_headers; // Request headers that tell cached responses apart
+    LimitReq limit_req;        // The server's unless the location has its own
 };
 
 struct ServerConfig {
@@ -68,6 +111,13 @@ struct ServerConfig {
     std::vector<std::string> server_names;
     std::string error_page_404;
     size_t client_max_body_size = 1024 * 1024;
+    std::string default_type = "application/octet-stream";
+    AccessLogRef access_log;   // AccessLog target, NULL = access_log off
+    int tls = -1;              // Tls context of `listen ... ssl`, -1 = plain TCP
+    bool http2 = true;         // HTTP/2 by prior knowledge, h2c upgrade and ALPN
+    LimitReq limit_req;        // Default of its locations
+    size_t limit_conn = 0;     // Open connections per client address, 0 = no limit
+    size_t shutdown_timeout = SHUTDOWN_DEFAULT_TIMEOUT; // Seconds; the longest of all servers applies
     std::vector<RouteConfigFromConfigFile> routes;
 };
 
@@ -79,6 +129,10 @@ public:
     
     // Load and parse configuration
     bool loadFromFile(const std::string& filename);
+    // Parse `filename` and write its binary cache (see ConfigCache.hpp)
+    bool compileCache(const std::string& filename);
+    // Install the process-wide settings of the configuration just loaded
+    void apply();
     bool hasError() const { return m_hasError; }
     const std::string& getErrorMessage() const { return m_errorMessage; }
     
@@ -92,41 +146,71 @@ private:
     bool m_hasError;
     std::string m_errorMessage;
     std::vector<ServerConfig> m_serverConfigs;
+    std::string m_configDir;   // Relative include paths start here
+    bool m_writeCache;         // Store the parse in the cache even if there is none yet
+    std::map<std::string, std::shared_ptr<UpstreamGroup> > m_upstreams; // By name, for proxy_pass
+    // Process-wide settings, held here until apply()
+    MimeTable m_mimeTypes;
+    LogLevel m_logLevel;
+    EventBackend m_eventBackend;
+    std::shared_ptr<AccessLogFile> m_traceFile;
+    size_t m_traceSample;
+    std::shared_ptr<AccessLogFile> m_captureFile;
+    std::map<std::string, size_t> m_zones;  // limit_req zone sizes, by name
     
+    bool readConfigText(const std::string& filename, std::string& content);
+    bool loadTypesFile(const std::string& filename);
     bool validateFilename(const std::string& filename);
-    bool validateContent(const std::vector<std::string>& tokens);
-    std::vector<ServerConfig> buildConfigs(const std::vector<ServerBlock>& blocks);
+    bool validateContent(const std::vector<Token>& tokens);
+    bool parseText(const std::string& content, std::vector<ServerBlock>& servers,
+                   std::vector<UpstreamBlock>& upstreams);
+    std::vector<ServerConfig> buildConfigs(const std::vector<ServerBlock>& blocks,
+                                           const std::vector<UpstreamBlock>& upstreams);
+    void buildUpstream(const UpstreamBlock& block);
+    bool parseCount(const std::string& directive, const std::string& value, long& out);
+    bool parseCount(const Directive& dir, std::size_t& out);
+    bool parseLimitReq(const Directive& dir, LimitReq& limit);
     ServerConfig buildServerConfig(const ServerBlock& block);
 };
 
 // Helper classes
+// Single pass over the text: comments, whitespace and line/column
+// tracking are handled inline, so a config is lexed in linear time
 class ConfigTokenizer {
 public:
     ConfigTokenizer(const std::string& input);
     std::vector<Token> tokenize();
+    bool hasError() const { return !m_error.empty(); }
+    const std::string& getErrorMessage() const { return m_error; }
     
 private:
-    std::string m_input;
+    const std::string& m_input;
     size_t m_pos;
+    std::string m_error;
 };
 
 class ConfigParser {
 public:
-    ConfigParser(const std::vector<std::string>& tokens);
-    std::vector<ServerBlock> parse();
+    ConfigParser(const std::vector<Token>& tokens);
+    std::vector<ServerBlock> parse(std::vector<UpstreamBlock>& upstreams);
+    void parseTypes(std::vector<Directive>& types);
     bool hasError() const { return m_hasError; }
+    const std::string& getErrorMessage() const { return m_error; }
+    bool end() const;
     
 private:
-    const std::vector<std::string>& m_tokens;
+    const std::vector<Token>& m_tokens;
     size_t m_pos;
     bool m_hasError;
+    std::string m_error;    // The first error, with its position
     
-    std::string peek() const;
-    std::string advance();
+    const std::string& peek() const;
+    const std::string& advance();
     bool match(const std::string& expected);
-    bool end() const;
+    void error(const std::string& message);
     
     ServerBlock parseServer();
     LocationBlock parseLocation();
+    UpstreamBlock parseUpstream();
     Directive parseDirective();
 };
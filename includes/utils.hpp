@@ -1,4 +1,8 @@
 #pragma once
 #include <string>
+#include <ctime>
 
 std::string read_file(const std::string& path);
+std::string http_date(time_t t);
+time_t parse_http_date(const std::string& str);
+int connect_nonblocking(const std::string& address, bool& in_progress);
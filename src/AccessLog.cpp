@@ -0,0 +1,244 @@
+#include "../includes/AccessLog.hpp"
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+std::vector<std::weak_ptr<AccessLogFile> > AccessLog::files;
+
+enum LogVariable {
+    VarRemoteAddr,
+    VarTimeLocal,
+    VarTimeIso8601,
+    VarMsec,
+    VarRequest,
+    VarRequestMethod,
+    VarRequestUri,
+    VarServerProtocol,
+    VarStatus,
+    VarBytesSent,
+    VarRequestTime,
+    VarHost,
+    VarLocation,
+    VarIdle,
+    VarReadHeader,
+    VarReadBody,
+    VarHandler,
+    VarSend,
+    VarHeader
+};
+
+static const char* VARIABLE_NAMES[] = {
+    "remote_addr", "time_local", "time_iso8601", "msec", "request", "request_method",
+    "request_uri", "server_protocol", "status", "bytes_sent", "request_time", "host", "location",
+    "idle_us", "read_header_us", "read_body_us", "handler_us", "send_us"
+};
+
+// Splits the format into literals and variables once, at config time
+static bool compileFormat(const std::string& format, AccessLogTarget& target, std::string& error) {
+    size_t pos = 0;
+    while (pos < format.size()) {
+        size_t dollar = format.find('$', pos);
+        if (dollar != pos) {
+            size_t end = dollar == std::string::npos ? format.size() : dollar;
+            target.format.push_back({-1, format.substr(pos, end - pos), 0});
+            pos = end;
+            continue;
+        }
+        size_t end = dollar + 1;
+        while (end < format.size() && (isalnum((unsigned char)format[end]) || format[end] == '_'))
+            end++;
+        std::string name = format.substr(dollar + 1, end - dollar - 1);
+        pos = end;
+        if (name.compare(0, 5, "http_") == 0 && name.size() > 5) {
+            std::string header = name.substr(5);
+            for (char& c : header)
+                c = c == '_' ? '-' : c;
+            target.format.push_back({VarHeader, header, target.headers.size()});
+            target.headers.push_back(header);
+            continue;
+        }
+        size_t i = 0;
+        while (i < VarHeader && name != VARIABLE_NAMES[i])
+            i++;
+        if (i == VarHeader) {
+            error = "Unknown access_log variable: $" + name;
+            return false;
+        }
+        target.format.push_back({(int)i, "", 0});
+    }
+    return true;
+}
+
+// Opens `path` for appending, or finds it already open; NULL with `error` set
+std::shared_ptr<AccessLogFile> AccessLog::openFile(const std::string& path, std::string& error) {
+    for (const std::weak_ptr<AccessLogFile>& file : files) {
+        std::shared_ptr<AccessLogFile> open = file.lock();
+        if (open && open->path == path)
+            return open;
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = "Could not open " + path + ": " + strerror(errno);
+        return std::shared_ptr<AccessLogFile>();
+    }
+    AccessLogFile* opened = new AccessLogFile();
+    opened->path = path;
+    opened->fd = fd;
+    opened->flushed = time(NULL);
+    opened->buffer.reserve(ACCESS_LOG_BUFFER);
+    std::shared_ptr<AccessLogFile> file(opened, closeFile);
+    files.push_back(file);
+    return file;
+}
+
+// The deleter of a file nothing names any more: its last lines go out first
+void AccessLog::closeFile(AccessLogFile* file) {
+    flushFile(*file);
+    close(file->fd);
+    delete file;
+}
+
+void AccessLog::append(AccessLogFile& file, const std::string& text) {
+    if (file.buffer.size() + text.size() > ACCESS_LOG_BUFFER)
+        flushFile(file);
+    file.buffer += text;
+}
+
+// Compiles an access_log directive; NULL with `error` set if it is invalid
+AccessLogRef AccessLog::open(const std::string& path, const std::string& format, std::string& error) {
+    std::shared_ptr<AccessLogTarget> target = std::make_shared<AccessLogTarget>();
+    if (!compileFormat(format, *target, error))
+        return AccessLogRef();
+    target->file = openFile(path, error);
+    if (!target->file)
+        return AccessLogRef();
+    return target;
+}
+
+// The timestamp only changes once a second; format it once per second
+static const std::string& timeLocal(time_t now) {
+    static time_t cached_at = 0;
+    static std::string cached;
+    if (now != cached_at) {
+        char buf[64];
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        cached = buf;
+        cached_at = now;
+    }
+    return cached;
+}
+
+static void appendAddress(std::string& line, const struct sockaddr_storage& peer) {
+    char buf[INET6_ADDRSTRLEN];
+    const char* addr = NULL;
+    if (peer.ss_family == AF_INET)
+        addr = inet_ntop(AF_INET, &((const struct sockaddr_in*)&peer)->sin_addr, buf, sizeof(buf));
+    else if (peer.ss_family == AF_INET6)
+        addr = inet_ntop(AF_INET6, &((const struct sockaddr_in6*)&peer)->sin6_addr, buf, sizeof(buf));
+    line += addr ? addr : "-";
+}
+
+// Empty values print as "-", as in nginx
+static void appendValue(std::string& line, const std::string& value) {
+    line += value.empty() ? "-" : value;
+}
+
+// Microseconds between two phases, "-" if either was not reached
+static void appendPhase(std::string& line, uint64_t from, uint64_t to) {
+    if (from == 0 || to == 0 || to < from)
+        line += "-";
+    else
+        line += std::to_string(to - from);
+}
+
+void AccessLog::write(const AccessLogRef& ref, const RequestRecord& record, uint64_t now_us) {
+    if (!ref)
+        return;
+    const AccessLogTarget& target = *ref;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    char num[64];
+
+    std::string line;
+    for (const LogSegment& segment : target.format) {
+        switch (segment.variable) {
+            case -1: line += segment.text; break;
+            case VarRemoteAddr: appendAddress(line, record.peer); break;
+            case VarTimeLocal: line += timeLocal(tv.tv_sec); break;
+            case VarTimeIso8601: {
+                struct tm tm;
+                localtime_r(&tv.tv_sec, &tm);
+                strftime(num, sizeof(num), "%Y-%m-%dT%H:%M:%S%z", &tm);
+                line += num;
+                break;
+            }
+            case VarMsec:
+                snprintf(num, sizeof(num), "%ld.%03ld", (long)tv.tv_sec, (long)tv.tv_usec / 1000);
+                line += num;
+                break;
+            case VarRequest:
+                line += record.method + " " + record.uri + " " + record.protocol;
+                break;
+            case VarRequestMethod: appendValue(line, record.method); break;
+            case VarRequestUri: appendValue(line, record.uri); break;
+            case VarServerProtocol: appendValue(line, record.protocol); break;
+            case VarStatus: line += std::to_string(record.status); break;
+            case VarBytesSent: line += std::to_string(record.bytes_sent); break;
+            case VarRequestTime: {
+                uint64_t ms = (now_us - record.received) / 1000;
+                snprintf(num, sizeof(num), "%llu.%03llu", (unsigned long long)(ms / 1000),
+                         (unsigned long long)(ms % 1000));
+                line += num;
+                break;
+            }
+            case VarHost: appendValue(line, record.host); break;
+            case VarLocation: appendValue(line, record.location); break;
+            case VarIdle: appendPhase(line, record.accepted, record.first_byte); break;
+            case VarReadHeader: appendPhase(line, record.first_byte, record.headers_done); break;
+            case VarReadBody: appendPhase(line, record.headers_done, record.body_done); break;
+            case VarHandler: appendPhase(line, record.received, record.response_start); break;
+            case VarSend: appendPhase(line, record.response_start, now_us); break;
+            case VarHeader:
+                appendValue(line, segment.header < record.headers.size() ? record.headers[segment.header] : "");
+                break;
+        }
+    }
+    line += '\n';
+    append(*target.file, line);
+}
+
+void AccessLog::flushFile(AccessLogFile& file) {
+    size_t offset = 0;
+    while (offset < file.buffer.size()) {
+        ssize_t n = ::write(file.fd, file.buffer.data() + offset, file.buffer.size() - offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // Disk full or similar: drop the lines rather than stall the loop
+        offset += n;
+    }
+    file.buffer.clear();
+    file.flushed = time(NULL);
+}
+
+// Called once per loop iteration, and with `force` on shutdown
+void AccessLog::flush(bool force) {
+    time_t now = time(NULL);
+    for (size_t i = 0; i < files.size(); ) {
+        std::shared_ptr<AccessLogFile> file = files[i].lock();
+        if (!file) {
+            files[i] = files.back();
+            files.pop_back();
+            continue;
+        }
+        if (!file->buffer.empty() && (force || now - file->flushed >= ACCESS_LOG_FLUSH_INTERVAL))
+            flushFile(*file);
+        i++;
+    }
+}
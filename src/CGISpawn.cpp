@@ -0,0 +1,198 @@
+#include "../includes/CGISpawn.hpp"
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+std::map<std::string, std::vector<CGIWorker> > CGIWorkerPool::idle;
+std::map<std::string, size_t> CGIWorkerPool::targets;
+
+// Runs inside a pooled interpreter: read the environment block, then become the script
+static const char* POOL_BOOTSTRAP =
+    "import os, sys, runpy\n"
+    "def _read(n):\n"
+    "    data = b''\n"
+    "    while len(data) < n:\n"
+    "        part = os.read(0, n - len(data))\n"
+    "        if not part:\n"
+    "            return None\n"
+    "        data += part\n"
+    "    return data\n"
+    "def _serve():\n"
+    "    size = _read(8)\n"
+    "    block = _read(int(size, 16)) if size else None\n"
+    "    if block is None:\n"
+    "        return\n"
+    "    os.environ.clear()\n"
+    "    for item in block.split(b'\\0')[:-1]:\n"
+    "        name, _, value = item.partition(b'=')\n"
+    "        os.environ[name.decode()] = value.decode('latin-1')\n"
+    "    script = os.environ.get('SCRIPT_FILENAME', '')\n"
+    "    sys.argv = [script]\n"
+    "    sys.path[0] = os.path.dirname(os.path.abspath(script))\n"
+    "    runpy.run_path(script, run_name='__main__')\n"
+    "_serve()\n";
+
+// Pipe whose ends are not inherited by anything we spawn later
+bool makePipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (pipe(fds) < 0)
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+// posix_spawn() instead of fork(): no copy of the server's page tables, and
+// since every server fd is close-on-exec the child only gets stdin/stdout/stderr.
+pid_t spawnProcess(const std::vector<std::string>& argv, const std::vector<std::string>& env,
+                   int stdin_fd, int stdout_fd) {
+    std::vector<char*> args;
+    for (const std::string& arg : argv)
+        args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(NULL);
+    std::vector<char*> envp;
+    for (const std::string& var : env)
+        envp.push_back(const_cast<char*>(var.c_str()));
+    envp.push_back(NULL);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+
+    // The server ignores SIGPIPE and may block signals; the script must not inherit that
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults, mask;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, args[0], &actions, &attr, args.data(), envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Starts argv with fresh pipes; the parent's ends are left non-blocking
+bool spawnCGI(const std::vector<std::string>& argv, const std::vector<std::string>& env,
+              CGIWorker& worker) {
+    int pipe_in[2];  // Parent writes to child (CGI input)
+    int pipe_out[2]; // Child writes to parent (CGI output)
+
+    if (!makePipe(pipe_in))
+        return false;
+    if (!makePipe(pipe_out)) {
+        close(pipe_in[0]);
+        close(pipe_in[1]);
+        return false;
+    }
+    pid_t pid = spawnProcess(argv, env, pipe_in[0], pipe_out[1]);
+    close(pipe_in[0]);
+    close(pipe_out[1]);
+    if (pid < 0) {
+        close(pipe_in[1]);
+        close(pipe_out[0]);
+        return false;
+    }
+    fcntl(pipe_in[1], F_SETFL, O_NONBLOCK);
+    fcntl(pipe_out[0], F_SETFL, O_NONBLOCK);
+    worker.pid = pid;
+    worker.stdin_fd = pipe_in[1];
+    worker.stdout_fd = pipe_out[0];
+    return true;
+}
+
+bool CGIWorkerPool::supports(const std::string& interpreter) {
+    size_t slash = interpreter.find_last_of('/');
+    std::string name = slash == std::string::npos ? interpreter : interpreter.substr(slash + 1);
+    return name.compare(0, 6, "python") == 0;
+}
+
+void CGIWorkerPool::configure(const std::string& interpreter, size_t size) {
+    if (!supports(interpreter))
+        return;
+    if (size > targets[interpreter])
+        targets[interpreter] = size;
+}
+
+bool CGIWorkerPool::take(const std::string& interpreter, CGIWorker& worker) {
+    auto it = idle.find(interpreter);
+    if (it == idle.end())
+        return false;
+    while (!it->second.empty()) {
+        worker = it->second.back();
+        it->second.pop_back();
+        if (waitpid(worker.pid, NULL, WNOHANG) == 0)
+            return true;
+        // Died while idle
+        close(worker.stdin_fd);
+        close(worker.stdout_fd);
+    }
+    return false;
+}
+
+// The environment block behind its length in 8 hex digits, so the worker
+// reads exactly that much of stdin with os.read() and leaves the body alone
+std::string CGIWorkerPool::preamble(const std::vector<std::string>& env) {
+    std::string block;
+    for (const std::string& var : env) {
+        block += var;
+        block += '\0';
+    }
+    char size[9];
+    snprintf(size, sizeof(size), "%08zx", block.size());
+    return size + block;
+}
+
+// Tops every pool back up to its size; called once per loop iteration
+void CGIWorkerPool::replenish() {
+    for (const auto& target : targets) {
+        std::vector<CGIWorker>& workers = idle[target.first];
+        while (workers.size() < target.second) {
+            std::vector<std::string> argv;
+            argv.push_back(target.first);
+            argv.push_back("-c");
+            argv.push_back(POOL_BOOTSTRAP);
+            CGIWorker worker;
+            if (!spawnCGI(argv, std::vector<std::string>(), worker)) {
+                perror("spawn CGI pool worker");
+                return;
+            }
+            workers.push_back(worker);
+        }
+    }
+}
+
+// Closing stdin makes an idle worker exit before it ran anything
+void CGIWorkerPool::shutdown() {
+    for (auto& pool : idle) {
+        for (const CGIWorker& worker : pool.second) {
+            close(worker.stdin_fd);
+            close(worker.stdout_fd);
+            waitpid(worker.pid, NULL, 0);
+        }
+        pool.second.clear();
+    }
+    targets.clear();
+}
@@ -0,0 +1,69 @@
+#include "../includes/Capture.hpp"
+#include "../includes/AccessLog.hpp"
+#include "../includes/Metrics.hpp"
+#include "../includes/Log.hpp"
+#include <unistd.h>
+#include <cerrno>
+
+std::shared_ptr<AccessLogFile> Capture::file;
+uint64_t Capture::started = 0;
+uint32_t Capture::next_connection = 0;
+std::map<int, uint32_t> Capture::connections;
+
+static void encodeLE(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out += (char)((value >> (8 * i)) & 0xff);
+}
+
+// A capture starts a new file: its timestamps count from this run's start.
+// A config reload keeps the capture that is running.
+void Capture::use(const std::shared_ptr<AccessLogFile>& capture_file) {
+    if (file || !capture_file)
+        return;
+    if (ftruncate(capture_file->fd, 0) != 0) {
+        LOG_ERROR("Could not truncate capture_file " << capture_file->path);
+        return;
+    }
+    capture_file->buffer.clear();
+    file = capture_file;
+    started = monotonic_micros();
+    AccessLog::append(*file, std::string(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN));
+}
+
+void Capture::record(uint8_t type, uint32_t connection, const char* data, size_t len) {
+    std::string out;
+    out.reserve(CAPTURE_RECORD_HEADER + len);
+    out += (char)type;
+    encodeLE(out, connection, 4);
+    encodeLE(out, monotonic_micros() - started, 8);
+    encodeLE(out, len, 4);
+    if (len > 0)
+        out.append(data, len);
+    AccessLog::append(*file, out);
+}
+
+void Capture::opened(int client_fd) {
+    if (!file)
+        return;
+    uint32_t connection = next_connection++;
+    connections[client_fd] = connection;
+    record(CaptureOpen, connection, NULL, 0);
+}
+
+void Capture::received(int client_fd, const char* data, size_t len) {
+    if (!file)
+        return;
+    auto it = connections.find(client_fd);
+    if (it != connections.end())
+        record(CaptureData, it->second, data, len);
+}
+
+void Capture::closed(int client_fd) {
+    if (!file)
+        return;
+    auto it = connections.find(client_fd);
+    if (it == connections.end())
+        return;
+    record(CaptureClose, it->second, NULL, 0);
+    connections.erase(it);
+}
@@ -0,0 +1,83 @@
+#include "../includes/ChunkedDecoder.hpp"
+#include <cctype>
+
+ChunkedDecoder::ChunkedDecoder()
+    : state(Size), remaining(0), size_digits(0), line_length(0), decoded(0) {}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Consumes up to len bytes and appends the chunk payload among them to out
+// (which may be NULL to only track framing). Returns the bytes consumed;
+// less than len only once the terminating chunk and trailers are complete
+// or the framing turned out to be invalid.
+size_t ChunkedDecoder::feed(const char* data, size_t len, std::string* out) {
+    size_t i = 0;
+    while (i < len && state != Done && state != Error) {
+        char c = data[i];
+        switch (state) {
+        case Size:
+            if (hexValue(c) >= 0) {
+                if (++size_digits > 15) { // Would overflow size_t
+                    state = Error;
+                    break;
+                }
+                remaining = remaining * 16 + hexValue(c);
+            } else if (size_digits == 0) {
+                state = Error;
+            } else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                state = Extension;
+            } else if (c == '\n') {
+                state = remaining ? Data : Trailer;
+            } else {
+                state = Error;
+            }
+            i++;
+            break;
+        case Extension:
+            if (c == '\n')
+                state = remaining ? Data : Trailer;
+            i++;
+            break;
+        case Data: {
+            size_t n = len - i < remaining ? len - i : remaining;
+            if (out)
+                out->append(data + i, n);
+            decoded += n;
+            remaining -= n;
+            i += n;
+            if (remaining == 0)
+                state = DataEnd;
+            break;
+        }
+        case DataEnd:
+            if (c == '\n') {
+                state = Size;
+                size_digits = 0;
+            } else if (c != '\r') {
+                state = Error;
+            }
+            i++;
+            break;
+        case Trailer:
+            if (c == '\n') {
+                if (line_length == 0)
+                    state = Done;
+                line_length = 0;
+            } else if (c != '\r') {
+                line_length++;
+            }
+            i++;
+            break;
+        default:
+            break;
+        }
+    }
+    return i;
+}
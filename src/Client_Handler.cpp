@@ -2,52 +2,102 @@
 
 bool Server::receiveData(int client_fd) {
     char buf[BUF_SIZE];
-    ssize_t nread = recv(client_fd, buf, BUF_SIZE - 1, 0);
+    ssize_t nread = Tls::recv(client_fd, buf, BUF_SIZE - 1);
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true; // Only part of a TLS record so far
     if (nread <= 0)
         return false;
+    Metrics::bytes_in += nread;
+    Capture::received(client_fd, buf, nread);
 
-    client_sessions[client_fd].buffer.append(buf, nread);
+    ClientSession& session = client_sessions[client_fd];
+    if (session.first_byte == 0)
+        session.first_byte = monotonic_micros();
+    session.buffer.append(buf, nread);
     return true;
 }
 
 bool Server::processHeaders(ClientSession& session) {
     size_t header_end = session.buffer.find("\r\n\r\n");
     if (!session.headers_received && header_end != std::string::npos) {
-        Response res(config);
+        Response res(*current_config);
         session.headers_received = true;
+        session.headers_done = monotonic_micros();
         header_end += 4;
         std::string headers = session.buffer.substr(0, header_end);
         session.content_length = res.getContentLength(headers);
+        session.chunked = isChunkedRequest(headers);
     } else if (!session.headers_received) {
         return false; // Headers not fully received yet
     }
     return true;
 }
 
-bool Server::isFullRequestReceived(const ClientSession& session) {
+// Whether the request can be handled: its body is in, or a chunked one has
+// already gone past client_max_body_size (answered with 413)
+bool Server::isFullRequestReceived(int client_fd, ClientSession& session) {
     size_t header_end = session.buffer.find("\r\n\r\n");
     if (header_end == std::string::npos)
         return false;
 
     header_end += 4;
+    if (session.chunked) {
+        // Only the new bytes are scanned; the framing state carries over
+        if (session.scanned < header_end)
+            session.scanned = header_end;
+        session.scanned += session.chunked_body.feed(session.buffer.data() + session.scanned,
+                                                     session.buffer.size() - session.scanned, NULL);
+        return session.chunked_body.done() || session.chunked_body.failed()
+               || session.chunked_body.decodedSize() > configFor(client_fd)[0].client_max_body_size;
+    }
     return session.buffer.size() >= header_end + session.content_length;
 }
 
+// A body bound for a CGI script does not have to be buffered whole first:
+// the script is started as soon as the headers are in
+bool Server::canStreamBody(int client_fd, const ClientSession& session) {
+    if (!session.chunked && session.content_length <= 0)
+        return false;
+    size_t header_end = session.buffer.find("\r\n\r\n") + 4;
+    std::string header_str = session.buffer.substr(0, header_end);
+    const ServerConfig* server_cfg = getServerConfigByHost(configFor(client_fd), getHostFromHeaders(header_str),
+                                                           getListeningPortForClient(client_fd));
+    if (!server_cfg)
+        return false;
+    Response res({*server_cfg});
+    if (res.isMalformedRequest(header_str))
+        return false;
+    res.parseRequest(header_str);
+    return res.canStreamBody(res.getRequestLine().url, !session.chunked);
+}
+
 void Server::processRequest(int client_fd, ClientSession& session) {
-    
+    const std::vector<ServerConfig>& config = configFor(client_fd);
     size_t header_end = session.buffer.find("\r\n\r\n");
     header_end += 4;
     std::string header_str = session.buffer.substr(0, header_end);
-    std::string full_request = session.buffer;
+    std::string full_request = session.streaming ? header_str : session.buffer;
     std::string response;
     Response res(config);
+    RequestRecord& record = request_records[client_fd];
+    record = RequestRecord();
+    record.received = monotonic_micros();
     std::string host = getHostFromHeaders(header_str);
     int port = getListeningPortForClient(client_fd);
     const ServerConfig* server_cfg = getServerConfigByHost(config, host, port);
 
+    const ClientInfo& info = client_info[client_fd];
+    record.peer = info.peer;
+    record.accepted = info.accepted;
+    record.first_byte = session.first_byte;
+    record.headers_done = session.headers_done;
+    if (!session.streaming)
+        record.body_done = record.received;
+    record.traced = Trace::sample();
+    record.host = host;
     if (!server_cfg && host != "localhost") {
         response = res.getErrorResponse(404); // Not Found
-        responses[client_fd] = response;
+        queueResponse(client_fd, response, res);
         client_sessions.erase(client_fd);
         enableWriteEvents(client_fd);
         return;
@@ -55,28 +105,136 @@ void Server::processRequest(int client_fd, ClientSession& session) {
         server_cfg = &config[0];
     }
     Response real_res({*server_cfg});
+    real_res.setClient(info.peer, session.limit_checked);
 
     if (real_res.isMalformedRequest(full_request)) {
         response = real_res.getErrorResponse(400);
     } else {
         real_res.parseRequest(full_request);
-        if (real_res.getContentLength(header_str) > config[0].client_max_body_size)
+        if (session.streaming) {
+            // What came with the headers goes to the script first
+            std::string received = session.buffer.substr(header_end);
+            if (session.chunked) {
+                std::string decoded;
+                session.chunked_body = ChunkedDecoder();
+                session.chunked_body.feed(received.data(), received.size(), &decoded);
+                received.swap(decoded);
+            } else {
+                session.body_left = session.content_length - received.size();
+            }
+            real_res.streamBody(received);
+        }
+        if (real_res.getContentLength(header_str) > config[0].client_max_body_size
+            || (session.chunked && !session.streaming
+                && session.chunked_body.decodedSize() > config[0].client_max_body_size))
             response = real_res.getErrorResponse(413); // Payload Too Large
+        else if (session.chunked && session.chunked_body.failed())
+            response = real_res.getErrorResponse(400);
         else
             response = real_res.routing(real_res.getRequestLine().method, real_res.getRequestLine().url);
     }
 
-    responses[client_fd] = response;
+    record.location = real_res.routeLocation();
+    record.access_log = server_cfg->access_log;
+    if (record.access_log || record.traced) {
+        s_request line = real_res.getRequestLine();
+        record.method = line.method;
+        record.uri = line.url;
+        record.protocol = client_fd >= H2_CLIENT_BASE ? "HTTP/2.0" : line.http_version;
+        if (record.access_log) {
+            for (const std::string& name : record.access_log->headers)
+                record.headers.push_back(real_res.getHeader(name));
+        }
+    }
+
+    if (real_res.limitDelay()) {
+        // Routed again by releaseDelayedRequests() once limit_req lets it through
+        DelayedRequest delayed = {monotonic_micros() + real_res.limitDelay(), session};
+        delayed.session.limit_checked = true;
+        delay_queue.insert(std::make_pair(delayed.due, client_fd));
+        delayed_requests[client_fd] = delayed;
+        client_sessions.erase(client_fd);
+        setPollEvents(client_fd, 0);
+        return;
+    }
+
+    std::shared_ptr<ProxyJob> proxy = real_res.releaseProxyJob();
+    if (proxy) {
+        if (startProxy(client_fd, *proxy)) {
+            // The upstream's answer is relayed once it comes
+            if (session.streaming)
+                session.buffer.clear();
+            else
+                client_sessions.erase(client_fd);
+            setPollEvents(client_fd, 0);
+            return;
+        }
+        response = real_res.getErrorResponse(502);
+    }
+
+    if (!real_res.cacheWait().empty()) {
+        // Answered along with the request already filling the same cache key
+        CacheWaiter waiter = {real_res.cacheWait(), session};
+        cache_waits[client_fd] = waiter;
+        cache_waiters[waiter.key].push_back(client_fd);
+        client_sessions.erase(client_fd);
+        setPollEvents(client_fd, 0);
+        return;
+    }
+    if (!real_res.cacheFill().empty() && !response.empty())
+        abortCacheFill(real_res.cacheFill(), false); // Answered on the spot, not by the backend
+
+    if (session.streaming && response.empty()) {
+        // The script is running (or queued): keep the session to feed it the body
+        session.buffer.clear();
+        if (cgi_uploads.find(client_fd) == cgi_uploads.end())
+            setPollEvents(client_fd, 0); // Queued: the body waits in the socket meanwhile
+        return;
+    }
+
+    queueResponse(client_fd, response, real_res);
     client_sessions.erase(client_fd);
     enableWriteEvents(client_fd);
 }
 
-void Server::enableWriteEvents(int client_fd) {
-    for (auto& pfd : poll_fds) {
-        if (pfd.fd == client_fd) {
-            pfd.events = POLLOUT;
-            pfd.revents = 0;
-            break;
-        }
+// Stores the response text and takes over any file body it still has to stream
+void Server::queueResponse(int client_fd, const std::string& response, Response& res) {
+    noteResponse(client_fd, response);
+    responses[client_fd] = response;
+    response_offsets[client_fd] = 0;
+    std::deque<FileSegment> segments;
+    int fd = res.releaseFileBody(segments);
+    if (fd >= 0) {
+        FileTransfer& transfer = file_transfers[client_fd];
+        transfer.fd = fd;
+        transfer.segments.swap(segments);
+        transfer.prefix_sent = 0;
+    }
+    std::shared_ptr<DirListingStream> listing = res.releaseListingBody();
+    if (listing) {
+        ListingTransfer transfer = {listing, "", 0, false};
+        listing_transfers[client_fd] = transfer;
     }
 }
+
+// Queues a response produced later by a backend, if the client is still there
+void Server::deliverResponse(int client_fd, const std::string& response) {
+    if (clientConfigs.find(client_fd) == clientConfigs.end())
+        return;
+    noteResponse(client_fd, response);
+    responses[client_fd] = response;
+    response_offsets[client_fd] = 0;
+    enableWriteEvents(client_fd);
+}
+
+// Counts the response and remembers its status for the access log
+void Server::noteResponse(int client_fd, const std::string& response) {
+    int status = Metrics::countResponse(response);
+    auto record = request_records.find(client_fd);
+    if (record != request_records.end() && status != 0)
+        record->second.status = status;
+}
+
+void Server::enableWriteEvents(int client_fd) {
+    setPollEvents(client_fd, POLLOUT);
+}
@@ -0,0 +1,176 @@
+#include "../includes/ConfigCache.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdio>
+
+// FNV-1a, as FileCache uses for content ETags
+uint64_t ConfigCache::hash(const std::string& text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Bounds-checked walk over the mapped file; any overrun marks it bad
+struct CacheReader {
+    const char* pos;
+    const char* end;
+    bool bad;
+
+    template <typename T> T number() {
+        T value = 0;
+        if (end - pos < (ptrdiff_t)sizeof(T)) {
+            bad = true;
+            return value;
+        }
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    void string(std::string& out) {
+        uint32_t len = number<uint32_t>();
+        if (bad || (size_t)(end - pos) < len) {
+            bad = true;
+            return;
+        }
+        out.assign(pos, len);
+        pos += len;
+    }
+    void directives(std::vector<Directive>& out) {
+        uint32_t count = number<uint32_t>();
+        if (bad || count > (size_t)(end - pos))
+            return void(bad = true);
+        out.resize(count);
+        for (Directive& dir : out) {
+            string(dir.name);
+            uint32_t argc = number<uint32_t>();
+            if (bad || argc > (size_t)(end - pos))
+                return void(bad = true);
+            dir.args.resize(argc);
+            for (std::string& arg : dir.args)
+                string(arg);
+        }
+    }
+};
+
+template <typename T> static void putNumber(std::string& out, T value) {
+    out.append((const char*)&value, sizeof(T));
+}
+
+static void putString(std::string& out, const std::string& value) {
+    putNumber<uint32_t>(out, value.size());
+    out += value;
+}
+
+static void putDirectives(std::string& out, const std::vector<Directive>& directives) {
+    putNumber<uint32_t>(out, directives.size());
+    for (const Directive& dir : directives) {
+        putString(out, dir.name);
+        putNumber<uint32_t>(out, dir.args.size());
+        for (const std::string& arg : dir.args)
+            putString(out, arg);
+    }
+}
+
+// False if there is no usable cache at `path` for this source
+bool ConfigCache::load(const std::string& path, uint64_t hash, uint64_t size,
+                       std::vector<ServerBlock>& servers, std::vector<UpstreamBlock>& upstreams) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < CONFIG_CACHE_MAGIC_LEN) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    CacheReader in = {(const char*)map, (const char*)map + st.st_size, false};
+    bool valid = memcmp(in.pos, CONFIG_CACHE_MAGIC, CONFIG_CACHE_MAGIC_LEN) == 0;
+    in.pos += CONFIG_CACHE_MAGIC_LEN;
+    valid = valid && in.number<uint32_t>() == CONFIG_CACHE_VERSION
+            && in.number<uint32_t>() == CONFIG_CACHE_BYTE_ORDER
+            && in.number<uint64_t>() == hash && in.number<uint64_t>() == size;
+    if (valid) {
+        uint32_t count = in.number<uint32_t>();
+        std::vector<ServerBlock> blocks(in.bad ? 0 : count);
+        for (size_t i = 0; i < blocks.size() && !in.bad; i++) {
+            ServerBlock& server = blocks[i];
+            in.directives(server.directives);
+            uint32_t locations = in.number<uint32_t>();
+            if (in.bad || locations > (size_t)(in.end - in.pos))
+                break;
+            server.locations.resize(locations);
+            for (LocationBlock& loc : server.locations) {
+                in.string(loc.path);
+                loc.is_regex = in.number<uint8_t>() != 0;
+                in.directives(loc.directives);
+            }
+            in.directives(server.types);
+        }
+        uint32_t groups = in.number<uint32_t>();
+        std::vector<UpstreamBlock> upstream_blocks(in.bad || groups > (size_t)(in.end - in.pos) ? 0 : groups);
+        for (size_t i = 0; i < upstream_blocks.size() && !in.bad; i++) {
+            in.string(upstream_blocks[i].name);
+            in.directives(upstream_blocks[i].directives);
+        }
+        valid = !in.bad && in.pos == in.end;
+        if (valid) {
+            servers.swap(blocks);
+            upstreams.swap(upstream_blocks);
+        }
+    }
+    munmap(map, st.st_size);
+    return valid;
+}
+
+// Written to a temporary name and renamed, so a reader never sees half of it
+bool ConfigCache::store(const std::string& path, uint64_t hash, uint64_t size,
+                        const std::vector<ServerBlock>& servers, const std::vector<UpstreamBlock>& upstreams) {
+    std::string out(CONFIG_CACHE_MAGIC, CONFIG_CACHE_MAGIC_LEN);
+    putNumber<uint32_t>(out, CONFIG_CACHE_VERSION);
+    putNumber<uint32_t>(out, CONFIG_CACHE_BYTE_ORDER);
+    putNumber<uint64_t>(out, hash);
+    putNumber<uint64_t>(out, size);
+    putNumber<uint32_t>(out, servers.size());
+    for (const ServerBlock& server : servers) {
+        putDirectives(out, server.directives);
+        putNumber<uint32_t>(out, server.locations.size());
+        for (const LocationBlock& loc : server.locations) {
+            putString(out, loc.path);
+            putNumber<uint8_t>(out, loc.is_regex);
+            putDirectives(out, loc.directives);
+        }
+        putDirectives(out, server.types);
+    }
+    putNumber<uint32_t>(out, upstreams.size());
+    for (const UpstreamBlock& upstream : upstreams) {
+        putString(out, upstream.name);
+        putDirectives(out, upstream.directives);
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    if (close(fd) < 0 || written < out.size() || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,233 @@
+#include "../includes/DirListing.hpp"
+#include "../includes/Metrics.hpp"
+#include <algorithm>
+#include <sstream>
+#include <fcntl.h>
+
+std::map<std::string, DirListingCache::Slot> DirListingCache::slots;
+unsigned long DirListingCache::clock = 0;
+size_t DirListingCache::total_entries = 0;
+
+std::shared_ptr<const DirListing> DirListingCache::lookup(const std::string& path, const struct stat& st) {
+    auto it = slots.find(path);
+    if (it == slots.end())
+        return std::shared_ptr<const DirListing>();
+    const DirListing& cached = *it->second.listing;
+    if (cached.inode != st.st_ino || cached.mtime != st.st_mtime
+        || cached.mtime_nsec != (long)ST_MTIME_NSEC(st)) {
+        // Directory changed since it was listed
+        total_entries -= cached.entries.size();
+        slots.erase(it);
+        return std::shared_ptr<const DirListing>();
+    }
+    it->second.last_used = ++clock;
+    return it->second.listing;
+}
+
+void DirListingCache::store(const std::string& path, const std::shared_ptr<const DirListing>& listing) {
+    auto old = slots.find(path);
+    if (old != slots.end()) {
+        total_entries -= old->second.listing->entries.size();
+        slots.erase(old);
+    }
+    // Evict least recently used listings until the new one fits
+    while (!slots.empty() && total_entries + listing->entries.size() > DIR_LISTING_CACHE_MAX) {
+        auto lru = slots.begin();
+        for (auto it = slots.begin(); it != slots.end(); ++it) {
+            if (it->second.last_used < lru->second.last_used)
+                lru = it;
+        }
+        total_entries -= lru->second.listing->entries.size();
+        slots.erase(lru);
+    }
+    Slot slot = {listing, ++clock};
+    slots[path] = slot;
+    total_entries += listing->entries.size();
+}
+
+static std::string htmlEscape(const std::string& str) {
+    std::string out;
+    out.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            default: out += c; break;
+        }
+    }
+    return out;
+}
+
+static std::string urlEncode(const std::string& str) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+    return out;
+}
+
+static bool entryLess(const DirEntry& a, const DirEntry& b) {
+    if (a.is_dir != b.is_dir)
+        return a.is_dir;
+    return a.name < b.name;
+}
+
+DirListingStream::DirListingStream(const std::string& fsPath, const std::string& urlPath,
+                                   const struct stat& st, size_t page, size_t page_size, bool chunked)
+    : fs_path(fsPath), url_path(urlPath), dir_stat(st), page(page), page_size(page_size),
+      chunked(chunked), state(Loading), header_sent(false), dir(NULL), index(0), end_index(0),
+      has_more(false) {
+    if (url_path.empty() || url_path.back() != '/')
+        url_path += '/';
+    listing = DirListingCache::lookup(fs_path, dir_stat);
+    if (listing) {
+        Metrics::listing_cache_hits++;
+        finishLoading();
+        return;
+    }
+    Metrics::listing_cache_misses++;
+    dir = opendir(fs_path.c_str());
+    if (dir == NULL)
+        state = Footer;
+}
+
+DirListingStream::~DirListingStream() {
+    if (dir != NULL)
+        closedir(dir);
+}
+
+// Reads up to DIR_LISTING_BATCH visible entries. Returns false once the
+// directory is exhausted, after closing it.
+bool DirListingStream::readBatch(std::vector<DirEntry>& out) {
+    struct dirent* entry;
+    for (size_t n = 0; n < DIR_LISTING_BATCH; n++) {
+        entry = readdir(dir);
+        if (entry == NULL) {
+            closedir(dir);
+            dir = NULL;
+            return false;
+        }
+        if (entry->d_name[0] == '.') // Skip hidden files
+            continue;
+        DirEntry item;
+        item.name = entry->d_name;
+        item.is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            item.is_dir = fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        out.push_back(item);
+    }
+    return true;
+}
+
+// Sorts what was read (unless it came from the cache) and selects the page
+void DirListingStream::finishLoading() {
+    if (!listing) {
+        std::shared_ptr<DirListing> fresh(new DirListing());
+        fresh->inode = dir_stat.st_ino;
+        fresh->mtime = dir_stat.st_mtime;
+        fresh->mtime_nsec = ST_MTIME_NSEC(dir_stat);
+        fresh->entries.swap(loading);
+        std::sort(fresh->entries.begin(), fresh->entries.end(), entryLess);
+        listing = fresh;
+        DirListingCache::store(fs_path, listing);
+    }
+    size_t total = listing->entries.size();
+    index = page_size ? std::min(total, page * page_size) : 0;
+    end_index = page_size ? std::min(total, index + page_size) : total;
+    has_more = end_index < total;
+    state = Sorted;
+}
+
+void DirListingStream::renderEntry(const DirEntry& entry, std::string& html) const {
+    std::string suffix = entry.is_dir ? "/" : "";
+    html += "<li><a href=\"" + htmlEscape(url_path) + urlEncode(entry.name) + suffix + "\">"
+            + htmlEscape(entry.name) + suffix + "</a></li>";
+}
+
+void DirListingStream::renderFooter(std::string& html) const {
+    html += "</ul><hr>";
+    if (page_size && page > 0)
+        html += "<a href=\"?page=" + std::to_string(page - 1) + "\">Previous</a> ";
+    if (page_size && has_more)
+        html += "<a href=\"?page=" + std::to_string(page + 1) + "\">Next</a>";
+    html += "</body></html>";
+}
+
+// Appends the next piece of the page to `out`, framed as an HTTP chunk when
+// chunked. `out` may stay empty while a large directory is still being read.
+// Returns true once the whole page, terminator included, has been produced.
+bool DirListingStream::produceChunk(std::string& out) {
+    std::string html;
+    if (!header_sent) {
+        std::string title = htmlEscape(url_path);
+        html += "<html><head><title>Index of " + title + "</title></head><body>";
+        html += "<h1>Index of " + title + "</h1><hr><ul class=\"file-list\">";
+        header_sent = true;
+    }
+    while (html.size() < DIR_LISTING_CHUNK && state != Done) {
+        if (state == Loading) {
+            bool more = readBatch(loading);
+            if (loading.size() > DIR_LISTING_SORT_MAX)
+                state = Unsorted; // Too big to sort: stream in readdir order
+            else if (!more)
+                finishLoading();
+            else
+                break; // Give other clients a turn between batches
+        } else if (state == Unsorted) {
+            for (size_t i = 0; i < loading.size() && state == Unsorted; i++, index++) {
+                if (page_size && index < page * page_size)
+                    continue;
+                if (page_size && index >= (page + 1) * page_size) {
+                    has_more = true;
+                    state = Footer;
+                    break;
+                }
+                renderEntry(loading[i], html);
+            }
+            loading.clear();
+            if (state != Unsorted)
+                continue;
+            if (dir == NULL)
+                state = Footer;
+            else {
+                readBatch(loading);
+                break;
+            }
+        } else if (state == Sorted) {
+            while (index < end_index && html.size() < DIR_LISTING_CHUNK)
+                renderEntry(listing->entries[index++], html);
+            if (index == end_index)
+                state = Footer;
+        } else if (state == Footer) {
+            if (dir != NULL) {
+                closedir(dir);
+                dir = NULL;
+            }
+            renderFooter(html);
+            state = Done;
+        }
+    }
+    if (!html.empty()) {
+        if (chunked) {
+            std::ostringstream size;
+            size << std::hex << html.size() << "\r\n";
+            out += size.str() + html + "\r\n";
+        } else {
+            out += html;
+        }
+    }
+    if (state == Done && chunked)
+        out += "0\r\n\r\n";
+    return state == Done;
+}
@@ -0,0 +1,398 @@
+#include "../includes/EventLoop.hpp"
+#include "../includes/Metrics.hpp"
+#include "../includes/Log.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+// Waiting with a timeout in io_uring_enter() itself needs 5.11 headers
+# if defined(__NR_io_uring_setup) && defined(IORING_ENTER_EXT_ARG)
+#  define WEBSERV_IO_URING
+# endif
+#endif
+
+EventBackend EventLoop::requested = EventPoll;
+EventBackend EventLoop::backend = EventPoll;
+int EventLoop::fd = -1;
+uint64_t EventLoop::tick = 0;
+std::vector<EventInterest> EventLoop::interests;
+
+static const char* backendName(EventBackend backend) {
+    return backend == EventEpoll ? "epoll" : backend == EventIoUring ? "io_uring" : "poll";
+}
+
+bool EventLoop::parseBackend(const std::string& name, EventBackend& out) {
+    if (name == "poll")
+        out = EventPoll;
+    else if (name == "epoll")
+        out = EventEpoll;
+    else if (name == "io_uring")
+        out = EventIoUring;
+    else
+        return false;
+    return true;
+}
+
+const char* EventLoop::name() {
+    return backendName(backend);
+}
+
+EventInterest& EventLoop::interest(int fd) {
+    if ((size_t)fd >= interests.size())
+        interests.resize(fd + 1);
+    return interests[fd];
+}
+
+// Hands what the kernel reported to the list, the way poll() fills in
+// revents: only the events asked for, plus the ones always reported
+int EventLoop::collect(std::vector<struct pollfd>& fds) {
+    int count = 0;
+    for (struct pollfd& pfd : fds) {
+        pfd.revents = 0;
+        if (pfd.fd < 0 || (size_t)pfd.fd >= interests.size())
+            continue;
+        EventInterest& entry = interests[pfd.fd];
+        if (entry.always_ready)
+            entry.ready = pfd.events;
+        pfd.revents = entry.ready & (pfd.events | POLLERR | POLLHUP | POLLNVAL);
+        entry.ready = 0;
+        if (pfd.revents)
+            count++;
+    }
+    return count;
+}
+
+int EventLoop::pollWait(std::vector<struct pollfd>& fds, int timeout) {
+    Metrics::event_syscalls++;
+    return poll(fds.data(), fds.size(), timeout);
+}
+
+#ifdef __linux__
+static std::vector<struct epoll_event> epoll_events;
+
+int EventLoop::epollWait(std::vector<struct pollfd>& fds, int timeout) {
+    tick++;
+    for (const struct pollfd& pfd : fds) {
+        if (pfd.fd < 0)
+            continue;
+        EventInterest& entry = interest(pfd.fd);
+        entry.seen = tick;
+        if (entry.always_ready || (entry.registered && entry.events == pfd.events))
+            continue;
+        struct epoll_event ev;
+        ev.events = (unsigned short)pfd.events;
+        ev.data.u64 = pfd.fd;
+        Metrics::event_syscalls++;
+        int rc = epoll_ctl(fd, entry.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pfd.fd, &ev);
+        if (rc < 0 && (errno == EEXIST || errno == ENOENT)) {
+            // The number was closed and reused, or is still registered
+            Metrics::event_syscalls++;
+            rc = epoll_ctl(fd, errno == EEXIST ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, pfd.fd, &ev);
+        }
+        if (rc == 0) {
+            entry.registered = true;
+            entry.events = pfd.events;
+        } else if (errno == EPERM) {
+            entry.always_ready = true;  // A regular file, always ready to poll()
+        } else {
+            entry.ready = POLLNVAL;
+        }
+    }
+    // Gone from the list: closed, or paused by a handler
+    for (size_t i = 0; i < interests.size(); i++) {
+        EventInterest& entry = interests[i];
+        if (entry.seen == tick || !(entry.registered || entry.always_ready))
+            continue;
+        if (entry.registered) {
+            Metrics::event_syscalls++;
+            epoll_ctl(fd, EPOLL_CTL_DEL, i, NULL);
+        }
+        entry = EventInterest();
+    }
+
+    if (epoll_events.size() < fds.size() + 1)
+        epoll_events.resize(fds.size() + 1);
+    Metrics::event_syscalls++;
+    int n = epoll_wait(fd, epoll_events.data(), epoll_events.size(), timeout);
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        size_t ready_fd = epoll_events[i].data.u64;
+        if (ready_fd < interests.size())
+            interests[ready_fd].ready |= epoll_events[i].events;
+    }
+    return collect(fds);
+}
+#else
+int EventLoop::epollWait(std::vector<struct pollfd>& fds, int timeout) {
+    return pollWait(fds, timeout);
+}
+#endif
+
+#ifdef WEBSERV_IO_URING
+// user_data of a POLL_REMOVE: its own completion is skipped
+#define RING_REMOVE_TAG UINT64_MAX
+
+// The rings shared with the kernel (one mapping, IORING_FEAT_SINGLE_MMAP)
+struct Ring {
+    void* rings = MAP_FAILED;
+    size_t rings_len = 0;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+    size_t sqes_len = 0;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;              // Ours, published to sq_tail before each enter
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+static Ring ring;
+
+// The fd number and its generation, so a completion is matched with the
+// poll that is armed now and not one cancelled, or one of a closed fd
+static uint64_t pollTag(int fd, uint32_t generation) {
+    return (uint64_t)generation << 32 | (uint32_t)fd;
+}
+
+static int ringEnter(int ring_fd, unsigned submit, unsigned wait, int timeout) {
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    Metrics::event_syscalls++;
+    return syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+                   IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+}
+
+// The next free entry; a full queue is submitted first. NULL if the
+// kernel takes none, in which case the caller tries again next tick.
+static struct io_uring_sqe* ringEntry(int ring_fd) {
+    if (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        ringEnter(ring_fd, ring.sq_entries, 0, 0);
+        if (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring.sqes[ring.tail & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.tail++;
+    return sqe;
+}
+
+static void ringArm(int ring_fd, int fd, EventInterest& entry, short events) {
+    struct io_uring_sqe* sqe = ringEntry(ring_fd);
+    if (!sqe)
+        return;
+    uint32_t mask = (unsigned short)events;
+# if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    mask = mask << 16 | mask >> 16;   // poll32_events is stored halfword-swapped
+# endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = pollTag(fd, entry.generation);
+    entry.registered = true;
+    entry.events = events;
+}
+
+static void ringCancel(int ring_fd, int fd, EventInterest& entry) {
+    struct io_uring_sqe* sqe = ringEntry(ring_fd);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = pollTag(fd, entry.generation);
+    sqe->user_data = RING_REMOVE_TAG;
+    entry.registered = false;
+    entry.generation++;
+}
+
+bool EventLoop::ringSetup() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+# ifdef IORING_SETUP_COOP_TASKRUN
+    // Completions are posted when we enter, not by interrupting the loop
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+# endif
+    int ring_fd = syscall(__NR_io_uring_setup, EVENT_RING_ENTRIES, &params);
+    if (ring_fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params)); // Before 5.19
+        ring_fd = syscall(__NR_io_uring_setup, EVENT_RING_ENTRIES, &params);
+    }
+    if (ring_fd < 0)
+        return false;
+    // A wait with a timeout (5.11) implies the single ring mapping (5.4)
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd);
+        errno = ENOSYS;
+        return false;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.rings_len = sq_len > cq_len ? sq_len : cq_len;
+    ring.rings = mmap(NULL, ring.rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQ_RING);
+    ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe*)mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring.rings == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        int saved = errno;
+        if (ring.rings != MAP_FAILED)
+            munmap(ring.rings, ring.rings_len);
+        if (ring.sqes != MAP_FAILED)
+            munmap(ring.sqes, ring.sqes_len);
+        ring = Ring();
+        close(ring_fd);
+        errno = saved;
+        return false;
+    }
+    char* base = (char*)ring.rings;
+    ring.sq_head = (unsigned*)(base + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.tail = *ring.sq_tail;
+    ring.cq_head = (unsigned*)(base + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+    // Entry i of the queue always names sqes[i]
+    unsigned* array = (unsigned*)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    fd = ring_fd;
+    return true;
+}
+
+int EventLoop::ringWait(std::vector<struct pollfd>& fds, int timeout) {
+    tick++;
+    for (const struct pollfd& pfd : fds) {
+        if (pfd.fd < 0)
+            continue;
+        EventInterest& entry = interest(pfd.fd);
+        entry.seen = tick;
+        if (entry.registered && entry.events != pfd.events)
+            ringCancel(fd, pfd.fd, entry);
+        if (!entry.registered)
+            ringArm(fd, pfd.fd, entry, pfd.events);
+    }
+    // A pending poll holds its file open, so a closed fd's must go too
+    for (size_t i = 0; i < interests.size(); i++) {
+        EventInterest& entry = interests[i];
+        if (entry.seen == tick)
+            continue;
+        if (entry.registered)
+            ringCancel(fd, i, entry);
+        entry.ready = 0;
+    }
+
+    // Submits the tick's changes and waits, in one call; completions
+    // already in the queue make it return at once
+    unsigned queued = ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    // ETIME: nothing came; EBUSY: overflowed completions wait to be reaped first
+    if (ringEnter(fd, queued, timeout > 0 ? 1 : 0, timeout) < 0 && errno != ETIME && errno != EBUSY)
+        return -1;
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+        if (cqe.user_data == RING_REMOVE_TAG)
+            continue;
+        size_t ready_fd = (uint32_t)cqe.user_data;
+        if (ready_fd >= interests.size())
+            continue;
+        EventInterest& entry = interests[ready_fd];
+        if (!entry.registered || entry.generation != (uint32_t)(cqe.user_data >> 32))
+            continue;
+        // One-shot: armed again next tick, so it stays level-triggered
+        entry.registered = false;
+        entry.ready |= cqe.res >= 0 ? cqe.res : cqe.res == -EBADF ? POLLNVAL : POLLERR;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return collect(fds);
+}
+#else
+bool EventLoop::ringSetup() {
+    errno = ENOSYS;
+    return false;
+}
+
+int EventLoop::ringWait(std::vector<struct pollfd>& fds, int timeout) {
+    return pollWait(fds, timeout);
+}
+#endif
+
+void EventLoop::init() {
+    shutdown();
+    backend = EventPoll;
+    if (requested == EventPoll)
+        return;
+#ifdef __linux__
+    if (requested == EventIoUring) {
+        if (ringSetup()) {
+            backend = EventIoUring;
+            LOG_INFO("Event backend: io_uring");
+            return;
+        }
+        LOG_WARN("io_uring is not available (" << strerror(errno) << "), using epoll");
+    }
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd < 0) {
+        LOG_WARN("epoll_create1: " << strerror(errno) << ", using poll");
+        return;
+    }
+    backend = EventEpoll;
+    LOG_INFO("Event backend: epoll");
+#else
+    LOG_WARN("event_backend " << backendName(requested) << " needs Linux, using poll");
+#endif
+}
+
+// `fd` was added to the list. Its number may be that of a descriptor
+// closed since the last wait, whose registration must not pass for this one's.
+void EventLoop::added(int fd) {
+    if (backend == EventPoll || fd < 0)
+        return;
+    EventInterest& entry = interest(fd);
+#ifdef WEBSERV_IO_URING
+    if (backend == EventIoUring && entry.registered)
+        ringCancel(EventLoop::fd, fd, entry);
+#endif
+    uint32_t generation = entry.generation;
+    entry = EventInterest();
+    entry.generation = generation + 1;
+}
+
+int EventLoop::wait(std::vector<struct pollfd>& fds, int timeout) {
+    Metrics::event_waits++;
+    if (backend == EventEpoll)
+        return epollWait(fds, timeout);
+    if (backend == EventIoUring)
+        return ringWait(fds, timeout);
+    return pollWait(fds, timeout);
+}
+
+void EventLoop::shutdown() {
+#ifdef WEBSERV_IO_URING
+    if (backend == EventIoUring) {
+        munmap(ring.rings, ring.rings_len);
+        munmap(ring.sqes, ring.sqes_len);
+        ring = Ring();
+    }
+#endif
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    interests.clear();
+    backend = EventPoll;
+}
@@ -0,0 +1,119 @@
+#include "../includes/FastCGI.hpp"
+#include "../includes/Utils.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/socket.h>
+
+std::map<std::string, std::vector<int> > FastCGI::idle;
+
+void FastCGI::appendRecord(std::string& out, unsigned char type, const char* data, size_t len) {
+    unsigned char padding = (8 - len % 8) % 8;
+    unsigned char header[FCGI_HEADER_LEN] = {
+        FCGI_VERSION_1, type,
+        (unsigned char)(FCGI_REQUEST_ID >> 8), (unsigned char)(FCGI_REQUEST_ID & 0xff),
+        (unsigned char)(len >> 8), (unsigned char)(len & 0xff),
+        padding, 0
+    };
+    out.append((const char*)header, FCGI_HEADER_LEN);
+    out.append(data, len);
+    out.append(padding, '\0');
+}
+
+// Name-value pair lengths: one byte below 128, otherwise four with the top bit set
+void FastCGI::appendLength(std::string& out, size_t len) {
+    if (len < 128) {
+        out += (char)len;
+        return;
+    }
+    out += (char)((len >> 24) | 0x80);
+    out += (char)((len >> 16) & 0xff);
+    out += (char)((len >> 8) & 0xff);
+    out += (char)(len & 0xff);
+}
+
+// BEGIN_REQUEST, the params stream and the stdin stream, each stream closed
+// by an empty record, ready to be written to the backend as they are.
+std::string FastCGI::encodeRequest(const std::vector<std::pair<std::string, std::string> >& params,
+                                   const std::string& body) {
+    std::string out;
+    unsigned char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    appendRecord(out, FCGI_BEGIN_REQUEST, (const char*)begin, sizeof(begin));
+
+    std::string pairs;
+    for (const auto& param : params) {
+        std::string pair;
+        appendLength(pair, param.first.size());
+        appendLength(pair, param.second.size());
+        pair += param.first + param.second;
+        if (pairs.size() + pair.size() > FCGI_MAX_CONTENT) {
+            appendRecord(out, FCGI_PARAMS, pairs.data(), pairs.size());
+            pairs.clear();
+        }
+        pairs += pair;
+    }
+    if (!pairs.empty())
+        appendRecord(out, FCGI_PARAMS, pairs.data(), pairs.size());
+    appendRecord(out, FCGI_PARAMS, "", 0);
+
+    for (size_t pos = 0; pos < body.size(); pos += FCGI_MAX_CONTENT) {
+        size_t len = body.size() - pos < FCGI_MAX_CONTENT ? body.size() - pos : FCGI_MAX_CONTENT;
+        appendRecord(out, FCGI_STDIN, body.data() + pos, len);
+    }
+    appendRecord(out, FCGI_STDIN, "", 0);
+    return out;
+}
+
+// Decodes the record starting at buf[pos]. Returns false if it is not
+// complete yet; otherwise advances pos past the record and its padding.
+bool FastCGI::nextRecord(const std::string& buf, size_t& pos, unsigned char& type,
+                         std::string& content) {
+    if (buf.size() - pos < FCGI_HEADER_LEN)
+        return false;
+    const unsigned char* header = (const unsigned char*)buf.data() + pos;
+    size_t len = (header[4] << 8) | header[5];
+    size_t padding = header[6];
+    if (buf.size() - pos < FCGI_HEADER_LEN + len + padding)
+        return false;
+    type = header[1];
+    content.assign(buf, pos + FCGI_HEADER_LEN, len);
+    pos += FCGI_HEADER_LEN + len + padding;
+    return true;
+}
+
+// Starts a non-blocking connection; in_progress is set while connect() completes
+int FastCGI::connectBackend(const std::string& address, bool& in_progress) {
+    int fd = connect_nonblocking(address, in_progress);
+    if (fd < 0 && errno != 0)
+        perror("connect FastCGI backend");
+    return fd;
+}
+
+// Hands out a pooled connection that is still open, or a new one
+int FastCGI::acquire(const std::string& address, bool& reused, bool& in_progress) {
+    std::vector<int>& pool = idle[address];
+    in_progress = false;
+    while (!pool.empty()) {
+        int fd = pool.back();
+        pool.pop_back();
+        char probe;
+        ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reused = true;
+            return fd;
+        }
+        close(fd); // Closed by the backend (or sent junk) while idle
+    }
+    reused = false;
+    return connectBackend(address, in_progress);
+}
+
+void FastCGI::release(const std::string& address, int fd) {
+    std::vector<int>& pool = idle[address];
+    if (pool.size() >= FCGI_POOL_MAX_IDLE) {
+        close(fd);
+        return;
+    }
+    pool.push_back(fd);
+}
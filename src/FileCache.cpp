@@ -0,0 +1,101 @@
+#include "../includes/FileCache.hpp"
+#include "../includes/Utils.hpp"
+#include "../includes/MimeTypes.hpp"
+#include "../includes/Metrics.hpp"
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+std::unordered_map<std::string, FileInfo> FileCache::entries;
+
+void FileCache::fill(FileInfo& info, const std::string& path, const struct stat& st) {
+    bool unchanged = info.exists && info.inode == st.st_ino
+                     && info.size == st.st_size && info.mtime == st.st_mtime;
+    info.exists = true;
+    info.is_regular = S_ISREG(st.st_mode);
+    refreshMimeType(info, path);
+    if (unchanged)
+        return; // Keep the validators (and a possibly expensive content hash)
+    info.size = st.st_size;
+    info.mtime = st.st_mtime;
+    info.inode = st.st_ino;
+    info.hashed = false;
+    std::ostringstream etag;
+    etag << "\"" << std::hex << st.st_ino << "-" << st.st_size << "-" << st.st_mtime << "\"";
+    info.etag = etag.str();
+    info.last_modified = http_date(st.st_mtime);
+}
+
+// The types table may have changed since the entry was made (a reload)
+void FileCache::refreshMimeType(FileInfo& info, const std::string& path) {
+    if (info.mime_generation == MimeTypes::generation())
+        return;
+    info.mime_type = MimeTypes::lookup(path);
+    info.mime_generation = MimeTypes::generation();
+}
+
+// FNV-1a over the file content; stable across copies and inode changes
+bool FileCache::hashContent(const std::string& path, FileInfo& info) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    unsigned long long hash = 14695981039346656037ULL;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            hash ^= (unsigned char)buf[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    close(fd);
+    if (n < 0)
+        return false;
+    std::ostringstream etag;
+    etag << "\"h" << std::hex << hash << "\"";
+    info.etag = etag.str();
+    info.hashed = true;
+    return true;
+}
+
+const FileInfo& FileCache::lookup(const std::string& path, bool content_hash) {
+    time_t now = time(NULL);
+    auto it = entries.find(path);
+    if (it != entries.end() && now - it->second.checked < FILE_CACHE_TTL) {
+        Metrics::file_cache_hits++;
+        if (it->second.exists)
+            refreshMimeType(it->second, path);
+        if (content_hash && !it->second.hashed && it->second.is_regular
+            && it->second.size <= ETAG_HASH_MAX_SIZE)
+            hashContent(path, it->second);
+        return it->second;
+    }
+    Metrics::file_cache_misses++;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        if (entries.size() >= FILE_CACHE_MAX_ENTRIES)
+            entries.clear();
+        FileInfo& info = entries[path];
+        info = FileInfo();
+        info.exists = false;
+        info.checked = now;
+        return info;
+    }
+    return refresh(path, st, content_hash);
+}
+
+// Records a fresh stat() result, e.g. from fstat() on a file just opened
+const FileInfo& FileCache::refresh(const std::string& path, const struct stat& st, bool content_hash) {
+    if (entries.size() >= FILE_CACHE_MAX_ENTRIES && entries.find(path) == entries.end())
+        entries.clear();
+    FileInfo& info = entries[path];
+    fill(info, path, st);
+    info.checked = time(NULL);
+    if (content_hash && !info.hashed && info.is_regular && info.size <= ETAG_HASH_MAX_SIZE)
+        hashContent(path, info);
+    return info;
+}
+
+void FileCache::invalidate(const std::string& path) {
+    entries.erase(path);
+}
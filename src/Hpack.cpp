@@ -0,0 +1,429 @@
+#include "../includes/Hpack.hpp"
+#include <cstring>
+
+#define HPACK_STATIC_ENTRIES 61
+
+static const HeaderField static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// Fields that change with every response: a table entry for them would
+// only push out the ones worth keeping
+static bool volatileField(const std::string& name) {
+    static const char* const names[] = {"content-length", "date", "etag", "last-modified", "age",
+                                        "content-range", "expires", "location", "set-cookie", NULL};
+    for (size_t i = 0; names[i]; i++) {
+        if (name == names[i])
+            return true;
+    }
+    return false;
+}
+
+HpackTable::HpackTable() : size(0), max_size(HPACK_TABLE_SIZE) {
+}
+
+void HpackTable::evict(size_t room) {
+    while (!entries.empty() && size + room > max_size) {
+        size -= entries.back().first.size() + entries.back().second.size() + HPACK_ENTRY_OVERHEAD;
+        entries.pop_back();
+    }
+}
+
+// An entry larger than the whole table empties it and is not kept (4.4)
+void HpackTable::add(const std::string& name, const std::string& value) {
+    size_t entry = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    evict(entry);
+    if (entry > max_size)
+        return;
+    entries.push_front(HeaderField(name, value));
+    size += entry;
+}
+
+void HpackTable::resize(size_t max) {
+    max_size = max;
+    evict(0);
+}
+
+// NULL for an index past both tables
+const HeaderField* HpackTable::get(size_t index) const {
+    if (index == 0)
+        return NULL;
+    if (index <= HPACK_STATIC_ENTRIES)
+        return &static_table[index - 1];
+    index -= HPACK_STATIC_ENTRIES + 1;
+    return index < entries.size() ? &entries[index] : NULL;
+}
+
+// Index of the field, or failing that of its name alone (`exact` tells
+// which); 0 when neither is in a table
+size_t HpackTable::find(const std::string& name, const std::string& value, bool& exact) const {
+    size_t by_name = 0;
+    exact = false;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES + entries.size(); i++) {
+        const HeaderField& field = i < HPACK_STATIC_ENTRIES ? static_table[i] : entries[i - HPACK_STATIC_ENTRIES];
+        if (field.first != name)
+            continue;
+        if (field.second == value) {
+            exact = true;
+            return i + 1;
+        }
+        if (by_name == 0)
+            by_name = i + 1;
+    }
+    return by_name;
+}
+
+bool HpackDecoder::readString(const uint8_t*& p, const uint8_t* end, std::string& out) {
+    if (p >= end)
+        return false;
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if (!Hpack::readInteger(p, end, 7, len) || len > (uint64_t)(end - p))
+        return false;
+    out.clear();
+    if (huffman) {
+        if (!Hpack::huffmanDecode(p, len, out))
+            return false;
+    } else {
+        out.assign((const char*)p, len);
+    }
+    p += len;
+    return true;
+}
+
+bool HpackDecoder::decode(const uint8_t* data, size_t len, HeaderList& headers) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    size_t list_size = 0;
+    uint64_t index;
+    while (p < end) {
+        uint8_t first = *p;
+        if (first & 0x80) {
+            // Indexed field (6.1)
+            if (!Hpack::readInteger(p, end, 7, index))
+                return false;
+            const HeaderField* field = table.get(index);
+            if (!field)
+                return false;
+            headers.push_back(*field);
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update (6.3), within what our SETTINGS allow
+            if (!Hpack::readInteger(p, end, 5, index) || index > HPACK_TABLE_SIZE)
+                return false;
+            table.resize(index);
+            continue;
+        } else {
+            // Literal with incremental indexing (6.2.1), without indexing
+            // (6.2.2) or never indexed (6.2.3)
+            bool indexing = (first & 0xc0) == 0x40;
+            if (!Hpack::readInteger(p, end, indexing ? 6 : 4, index))
+                return false;
+            HeaderField field;
+            if (index == 0) {
+                if (!readString(p, end, field.first))
+                    return false;
+            } else {
+                const HeaderField* named = table.get(index);
+                if (!named)
+                    return false;
+                field.first = named->first;
+            }
+            if (!readString(p, end, field.second))
+                return false;
+            if (indexing)
+                table.add(field.first, field.second);
+            headers.push_back(field);
+        }
+        list_size += headers.back().first.size() + headers.back().second.size() + HPACK_ENTRY_OVERHEAD;
+        if (list_size > HPACK_MAX_HEADER_LIST)
+            return false;
+    }
+    return true;
+}
+
+// The peer's SETTINGS_HEADER_TABLE_SIZE bounds our table; we never use
+// more than the default even when it allows it
+void HpackEncoder::setMaxSize(size_t size) {
+    if (size > HPACK_TABLE_SIZE)
+        size = HPACK_TABLE_SIZE;
+    if (size == table.maxSize())
+        return;
+    table.resize(size);
+    size_changed = true;
+}
+
+void HpackEncoder::writeString(std::string& out, const std::string& text) {
+    size_t huffman = Hpack::huffmanLength(text);
+    if (huffman < text.size()) {
+        Hpack::writeInteger(out, 0x80, 7, huffman);
+        Hpack::huffmanEncode(out, text);
+    } else {
+        Hpack::writeInteger(out, 0x00, 7, text.size());
+        out += text;
+    }
+}
+
+// Names must already be lowercase
+void HpackEncoder::encode(const HeaderList& headers, std::string& out) {
+    if (size_changed) {
+        Hpack::writeInteger(out, 0x20, 5, table.maxSize());
+        size_changed = false;
+    }
+    for (const HeaderField& field : headers) {
+        bool exact;
+        size_t index = table.find(field.first, field.second, exact);
+        if (exact) {
+            Hpack::writeInteger(out, 0x80, 7, index);
+            continue;
+        }
+        bool indexing = !volatileField(field.first)
+                        && field.first.size() + field.second.size() + HPACK_ENTRY_OVERHEAD <= table.maxSize() / 2;
+        if (indexing)
+            Hpack::writeInteger(out, 0x40, 6, index);
+        else
+            Hpack::writeInteger(out, 0x00, 4, index);
+        if (index == 0)
+            writeString(out, field.first);
+        writeString(out, field.second);
+        if (indexing)
+            table.add(field.first, field.second);
+    }
+}
+
+// Integer with an N-bit prefix (5.1); `first` holds the bits above it
+void Hpack::writeInteger(std::string& out, uint8_t first, int prefix_bits, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out += (char)(first | value);
+        return;
+    }
+    out += (char)(first | max_prefix);
+    value -= max_prefix;
+    while (value >= 128) {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+// Values past 2^32 are refused: no length or index gets near that. Nor
+// does one need more than five continuation bytes, and refusing a sixth
+// keeps the shift below 64 however many zero-payload bytes are sent.
+bool Hpack::readInteger(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value) {
+    if (p >= end)
+        return false;
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *p++ & max_prefix;
+    if (value < max_prefix)
+        return true;
+    for (int shift = 0; p < end && shift <= 28; shift += 7) {
+        uint8_t byte = *p++;
+        value += (uint64_t)(byte & 0x7f) << shift;
+        if (value > UINT32_MAX)
+            return false;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+size_t Hpack::huffmanLength(const std::string& text) {
+    uint64_t bits = 0;
+    for (unsigned char c : text)
+        bits += huffman_lengths[c];
+    return (bits + 7) / 8;
+}
+
+// Padded with the most significant bits of EOS, all ones
+void Hpack::huffmanEncode(std::string& out, const std::string& text) {
+    uint64_t acc = 0;
+    int bits = 0;
+    for (unsigned char c : text) {
+        acc = (acc << huffman_lengths[c]) | huffman_codes[c];
+        bits += huffman_lengths[c];
+        while (bits >= 8) {
+            bits -= 8;
+            out += (char)(acc >> bits);
+        }
+    }
+    if (bits > 0)
+        out += (char)((acc << (8 - bits)) | (0xff >> bits));
+}
+
+std::vector<int16_t> Hpack::huffman_tree;
+
+// Children of node n are at 2n (bit 0) and 2n+1 (bit 1): a positive value
+// is the next node, a negative one the leaf of symbol -value-1
+void Hpack::buildTree() {
+    huffman_tree.assign(2, 0);
+    for (int symbol = 0; symbol < 257; symbol++) {
+        int node = 0;
+        for (int bit = huffman_lengths[symbol] - 1; bit >= 0; bit--) {
+            size_t slot = 2 * node + ((huffman_codes[symbol] >> bit) & 1);
+            if (bit == 0) {
+                huffman_tree[slot] = -symbol - 1;
+            } else {
+                if (huffman_tree[slot] == 0) {
+                    huffman_tree[slot] = huffman_tree.size() / 2;
+                    huffman_tree.resize(huffman_tree.size() + 2, 0);
+                }
+                node = huffman_tree[slot];
+            }
+        }
+    }
+}
+
+// Fails on EOS in the string and on padding longer than 7 bits or not made
+// of ones (5.2)
+bool Hpack::huffmanDecode(const uint8_t* data, size_t len, std::string& out) {
+    if (huffman_tree.empty())
+        buildTree();
+    int node = 0;
+    int pending_bits = 0;
+    bool all_ones = true;
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int set = (data[i] >> bit) & 1;
+            int next = huffman_tree[2 * node + set];
+            if (next < 0) {
+                if (next == -257)
+                    return false;
+                out += (char)(-next - 1);
+                node = 0;
+                pending_bits = 0;
+                all_ones = true;
+            } else {
+                node = next;
+                pending_bits++;
+                all_ones = all_ones && set;
+            }
+        }
+    }
+    return pending_bits <= 7 && all_ones;
+}
+
+const uint32_t Hpack::huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+const uint8_t Hpack::huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
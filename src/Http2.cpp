@@ -0,0 +1,287 @@
+#include "../includes/Http2.hpp"
+#include <strings.h>
+#include <cstdlib>
+#include <cctype>
+
+uint32_t Http2::read32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put32(std::string& out, uint32_t value) {
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+void Http2::frame(std::string& out, uint8_t type, uint8_t flags, uint32_t stream,
+                  const char* payload, size_t len) {
+    out += (char)(len >> 16);
+    out += (char)(len >> 8);
+    out += (char)len;
+    out += (char)type;
+    out += (char)flags;
+    put32(out, stream & 0x7fffffff);
+    out.append(payload, len);
+}
+
+// A header block split into HEADERS and CONTINUATION frames, back to back
+// as the peer's decoder requires
+void Http2::headers(std::string& out, uint32_t stream, const std::string& block, bool end_stream,
+                    uint32_t max_frame) {
+    size_t offset = 0;
+    uint8_t type = H2Headers;
+    uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+    do {
+        size_t len = block.size() - offset < max_frame ? block.size() - offset : max_frame;
+        if (offset + len == block.size())
+            flags |= H2_FLAG_END_HEADERS;
+        frame(out, type, flags, stream, block.data() + offset, len);
+        offset += len;
+        type = H2Continuation;
+        flags = 0;
+    } while (offset < block.size());
+}
+
+// Our SETTINGS, and the connection window opened to H2_WINDOW
+void Http2::settings(std::string& out) {
+    std::string payload;
+    const uint32_t values[][2] = {
+        {H2MaxConcurrentStreams, H2_MAX_STREAMS},
+        {H2InitialWindowSize, H2_WINDOW},
+        {H2EnablePush, 0},
+        {H2MaxHeaderListSize, HPACK_MAX_HEADER_LIST},
+    };
+    for (const auto& setting : values) {
+        payload += (char)(setting[0] >> 8);
+        payload += (char)setting[0];
+        put32(payload, setting[1]);
+    }
+    frame(out, H2Settings, 0, 0, payload.data(), payload.size());
+    windowUpdate(out, 0, H2_WINDOW - H2_DEFAULT_WINDOW);
+}
+
+void Http2::windowUpdate(std::string& out, uint32_t stream, uint32_t increment) {
+    std::string payload;
+    put32(payload, increment);
+    frame(out, H2WindowUpdate, 0, stream, payload.data(), payload.size());
+}
+
+void Http2::rstStream(std::string& out, uint32_t stream, uint32_t error) {
+    std::string payload;
+    put32(payload, error);
+    frame(out, H2RstStream, 0, stream, payload.data(), payload.size());
+}
+
+void Http2::goaway(std::string& out, uint32_t last_stream, uint32_t error) {
+    std::string payload;
+    put32(payload, last_stream);
+    put32(payload, error);
+    frame(out, H2Goaway, 0, 0, payload.data(), payload.size());
+}
+
+// Applies the peer's SETTINGS payload; returns the connection error it
+// calls for, H2NoError if none
+uint32_t Http2::applySettings(H2Connection& conn, const uint8_t* payload, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = read32(payload + i + 2);
+        switch (id) {
+            case H2HeaderTableSize:
+                conn.encoder.setMaxSize(value);
+                break;
+            case H2EnablePush:
+                if (value > 1)
+                    return H2ProtocolError;
+                break;
+            case H2InitialWindowSize: {
+                if (value > H2_MAX_WINDOW)
+                    return H2FlowControlError;
+                // Applies to the windows of open streams too (6.9.2)
+                int64_t delta = (int64_t)value - conn.peer_window;
+                for (auto& entry : conn.streams) {
+                    entry.second.send_window += delta;
+                    if (entry.second.send_window > H2_MAX_WINDOW)
+                        return H2FlowControlError;
+                }
+                conn.peer_window = value;
+                break;
+            }
+            case H2MaxFrameSize:
+                if (value < H2_MAX_FRAME || value > 0xffffff)
+                    return H2ProtocolError;
+                conn.peer_max_frame = value;
+                break;
+            default:
+                break; // Unknown settings are ignored
+        }
+    }
+    return H2NoError;
+}
+
+// The HTTP2-Settings header of an h2c upgrade: a SETTINGS payload in
+// unpadded base64url (RFC 7540 3.2.1)
+bool Http2::decodeSettingsHeader(const std::string& value, std::string& payload) {
+    uint32_t acc = 0;
+    int bits = 0;
+    payload.clear();
+    for (char c : value) {
+        int digit;
+        if (c >= 'A' && c <= 'Z')
+            digit = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            digit = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            digit = c - '0' + 52;
+        else if (c == '-')
+            digit = 62;
+        else if (c == '_')
+            digit = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        acc = (acc << 6) | digit;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            payload += (char)(acc >> bits);
+        }
+    }
+    return payload.size() % 6 == 0;
+}
+
+// "content-type" -> "Content-Type", as the handlers spell header names
+static std::string canonicalName(const std::string& name) {
+    std::string out = name;
+    bool upper = true;
+    for (char& c : out) {
+        if (upper)
+            c = toupper((unsigned char)c);
+        upper = c == '-';
+    }
+    return out;
+}
+
+static bool connectionSpecific(const std::string& name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+           || name == "transfer-encoding" || name == "upgrade";
+}
+
+// The request of a HEADERS block as the HTTP/1.1 head the handlers parse,
+// without its final empty line (the caller adds Content-Length, and gets
+// the client's in `content_length`, -1 if none). False for a malformed
+// request (8.1.1), which the stream is reset for.
+bool Http2::requestHead(const HeaderList& headers, std::string& head, std::string& method,
+                        int64_t& content_length) {
+    std::string path, authority, scheme, fields, cookies;
+    bool regular_seen = false;
+    method.clear();
+    content_length = -1;
+    for (const HeaderField& field : headers) {
+        const std::string& name = field.first;
+        // Anything that would end the line early or smuggle a second header
+        if (name.empty() || field.second.find_first_of("\r\n", 0) != std::string::npos
+            || field.second.find('\0') != std::string::npos)
+            return false;
+        if (name[0] == ':') {
+            if (regular_seen)
+                return false;
+            std::string* target = name == ":method" ? &method : name == ":path" ? &path
+                                  : name == ":authority" ? &authority : name == ":scheme" ? &scheme : NULL;
+            if (!target || !target->empty())
+                return false;
+            *target = field.second;
+            continue;
+        }
+        regular_seen = true;
+        for (char c : name) {
+            if (isupper((unsigned char)c) || c == ':' || c <= ' ')
+                return false;
+        }
+        if (connectionSpecific(name) || (name == "te" && field.second != "trailers"))
+            return false;
+        if (name == "content-length") {
+            const std::string& value = field.second;
+            if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string::npos
+                || (content_length >= 0 && content_length != atoll(value.c_str())))
+                return false;
+            content_length = atoll(value.c_str());
+        }
+        if (name == "cookie")
+            cookies += (cookies.empty() ? "" : "; ") + field.second;
+        else if (name == "content-length" || (name == "host" && !authority.empty()) || name == "te")
+            continue; // Content-Length is set from the body that came
+        else
+            fields += canonicalName(name) + ": " + field.second + "\r\n";
+    }
+    if (method.empty() || scheme.empty() || path.empty() || (path[0] != '/' && path != "*"))
+        return false;
+    if (path.find_first_of(" \t") != std::string::npos)
+        return false;
+    head = method + " " + path + " HTTP/1.1\r\n";
+    if (!authority.empty())
+        head += "Host: " + authority + "\r\n";
+    head += fields;
+    if (!cookies.empty())
+        head += "Cookie: " + cookies + "\r\n";
+    return true;
+}
+
+// The HTTP/1.1 head of a response as HTTP/2 fields, and how its body is
+// framed. False if it cannot be parsed.
+bool Http2::responseHeaders(const std::string& head, const std::string& method, HeaderList& headers,
+                            H2BodyFraming& framing, unsigned long long& length) {
+    if (head.compare(0, 5, "HTTP/") != 0)
+        return false;
+    size_t space = head.find(' ');
+    if (space == std::string::npos || space + 4 > head.size())
+        return false;
+    std::string status = head.substr(space + 1, 3);
+    int code = atoi(status.c_str());
+    if (code < 100 || code > 999)
+        return false;
+    headers.clear();
+    headers.push_back(HeaderField(":status", status));
+
+    bool chunked = false;
+    bool has_length = false;
+    length = 0;
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < head.size()) {
+        size_t start = pos + 2;
+        size_t end = head.find("\r\n", start);
+        if (end == std::string::npos || end == start)
+            break;
+        pos = end;
+        size_t colon = head.find(':', start);
+        if (colon >= end)
+            continue;
+        std::string name = head.substr(start, colon - start);
+        for (char& c : name)
+            c = tolower((unsigned char)c);
+        size_t value_start = head.find_first_not_of(" \t", colon + 1);
+        std::string value = value_start < end ? head.substr(value_start, end - value_start) : "";
+        if (name == "transfer-encoding") {
+            chunked = strcasecmp(value.c_str(), "chunked") == 0;
+            continue;
+        }
+        if (connectionSpecific(name))
+            continue;
+        if (name == "content-length") {
+            has_length = true;
+            length = strtoull(value.c_str(), NULL, 10);
+        }
+        headers.push_back(HeaderField(name, value));
+    }
+
+    if (method == "HEAD" || code < 200 || code == 204 || code == 304)
+        framing = H2BodyNone;
+    else if (chunked)
+        framing = H2BodyChunked;
+    else if (has_length)
+        framing = H2BodyLength;
+    else
+        framing = H2BodyUntilClose;
+    return true;
+}
@@ -0,0 +1,28 @@
+#include "../includes/Log.hpp"
+#include <ctime>
+#include <unistd.h>
+
+LogLevel Log::level = LogInfo;
+
+static const char* LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+bool Log::parseLevel(const std::string& name, LogLevel& lvl) {
+    for (int i = LogDebug; i <= LogError; i++) {
+        if (name == LEVEL_NAMES[i]) {
+            lvl = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Log::write(LogLevel lvl, const std::string& message) {
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y/%m/%d %H:%M:%S", &tm);
+    std::string line = std::string(stamp) + " [" + LEVEL_NAMES[lvl] + "] " + message + "\n";
+    ssize_t n = ::write(STDERR_FILENO, line.data(), line.size());
+    (void)n;
+}
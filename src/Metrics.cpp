@@ -0,0 +1,175 @@
+#include "../includes/Metrics.hpp"
+#include "../includes/EventLoop.hpp"
+#include <sstream>
+#include <cstdlib>
+#include <ctime>
+
+uint64_t Metrics::accepted = 0;
+uint64_t Metrics::active = 0;
+uint64_t Metrics::reading = 0;
+uint64_t Metrics::writing = 0;
+uint64_t Metrics::bytes_in = 0;
+uint64_t Metrics::bytes_out = 0;
+uint64_t Metrics::cgi_spawns = 0;
+uint64_t Metrics::cgi_spawn_failures = 0;
+uint64_t Metrics::cgi_timeouts = 0;
+uint64_t Metrics::file_cache_hits = 0;
+uint64_t Metrics::file_cache_misses = 0;
+uint64_t Metrics::listing_cache_hits = 0;
+uint64_t Metrics::listing_cache_misses = 0;
+uint64_t Metrics::response_cache_hits = 0;
+uint64_t Metrics::response_cache_misses = 0;
+uint64_t Metrics::response_cache_waits = 0;
+uint64_t Metrics::response_cache_passes = 0;
+uint64_t Metrics::tls_handshakes = 0;
+uint64_t Metrics::tls_resumed = 0;
+uint64_t Metrics::tls_handshake_failures = 0;
+uint64_t Metrics::http2_connections = 0;
+uint64_t Metrics::http2_streams = 0;
+uint64_t Metrics::event_waits = 0;
+uint64_t Metrics::event_syscalls = 0;
+uint64_t Metrics::limit_req_passed = 0;
+uint64_t Metrics::limit_req_delayed = 0;
+uint64_t Metrics::limit_req_rejected = 0;
+uint64_t Metrics::limit_conn_rejected = 0;
+std::map<int, uint64_t> Metrics::requests;
+std::map<std::string, LatencyHistogram> Metrics::latency;
+
+uint64_t monotonic_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucketIndex(uint64_t micros) {
+    if (micros < METRICS_SUB_BUCKETS)
+        return (int)micros;
+    int exponent = 63 - __builtin_clzll(micros);
+    if (exponent > METRICS_MAX_EXPONENT)
+        return METRICS_BUCKETS - 1; // Only counted in +Inf
+    int sub = (int)(micros >> (exponent - 2)) & (METRICS_SUB_BUCKETS - 1);
+    return METRICS_SUB_BUCKETS + (exponent - 2) * METRICS_SUB_BUCKETS + sub;
+}
+
+// Largest value (in us) that falls in bucket `index`
+static uint64_t bucketLimit(int index) {
+    if (index < METRICS_SUB_BUCKETS)
+        return index;
+    int exponent = (index - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS + 2;
+    int sub = (index - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+    return ((uint64_t)(METRICS_SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+}
+
+// Counts a response by the status code in its status line; returns the code, 0 if none
+int Metrics::countResponse(const std::string& response) {
+    if (response.size() < 12 || response.compare(0, 5, "HTTP/") != 0)
+        return 0;
+    int status = atoi(response.c_str() + 9);
+    requests[status]++;
+    return status;
+}
+
+void Metrics::observeLatency(const std::string& location, uint64_t micros) {
+    LatencyHistogram& histogram = latency[location];
+    histogram.counts[bucketIndex(micros)]++;
+    histogram.count++;
+    histogram.sum_us += micros;
+}
+
+static std::string escapeLabel(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            out += '\\';
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+    return out;
+}
+
+static void counter(std::ostringstream& out, const char* name, const char* help, uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " counter\n"
+        << name << " " << value << "\n";
+}
+
+// Prometheus text exposition format, version 0.0.4
+std::string Metrics::render() {
+    std::ostringstream out;
+    counter(out, "webserv_connections_accepted_total", "Client connections accepted.", accepted);
+    out << "# HELP webserv_connections Client connections by state.\n"
+        << "# TYPE webserv_connections gauge\n"
+        << "webserv_connections{state=\"active\"} " << active << "\n"
+        << "webserv_connections{state=\"reading\"} " << reading << "\n"
+        << "webserv_connections{state=\"writing\"} " << writing << "\n"
+        << "webserv_connections{state=\"waiting\"} "
+        << (active > reading + writing ? active - reading - writing : 0) << "\n";
+
+    out << "# HELP webserv_requests_total Responses sent, by status code.\n"
+        << "# TYPE webserv_requests_total counter\n";
+    for (const auto& status : requests)
+        out << "webserv_requests_total{code=\"" << status.first << "\"} " << status.second << "\n";
+
+    counter(out, "webserv_received_bytes_total", "Bytes read from clients.", bytes_in);
+    counter(out, "webserv_sent_bytes_total", "Bytes written to clients.", bytes_out);
+    counter(out, "webserv_cgi_spawns_total", "CGI scripts started.", cgi_spawns);
+    counter(out, "webserv_cgi_spawn_failures_total", "CGI scripts that could not be started.",
+            cgi_spawn_failures);
+    counter(out, "webserv_cgi_timeouts_total", "CGI scripts stopped by cgi_timeout.", cgi_timeouts);
+
+    out << "# HELP webserv_cache_lookups_total Cache lookups by cache and result.\n"
+        << "# TYPE webserv_cache_lookups_total counter\n"
+        << "webserv_cache_lookups_total{cache=\"file\",result=\"hit\"} " << file_cache_hits << "\n"
+        << "webserv_cache_lookups_total{cache=\"file\",result=\"miss\"} " << file_cache_misses << "\n"
+        << "webserv_cache_lookups_total{cache=\"listing\",result=\"hit\"} " << listing_cache_hits << "\n"
+        << "webserv_cache_lookups_total{cache=\"listing\",result=\"miss\"} " << listing_cache_misses << "\n"
+        << "webserv_cache_lookups_total{cache=\"response\",result=\"hit\"} " << response_cache_hits << "\n"
+        << "webserv_cache_lookups_total{cache=\"response\",result=\"miss\"} " << response_cache_misses << "\n"
+        << "webserv_cache_lookups_total{cache=\"response\",result=\"wait\"} " << response_cache_waits << "\n"
+        << "webserv_cache_lookups_total{cache=\"response\",result=\"pass\"} " << response_cache_passes << "\n";
+
+    out << "# HELP webserv_tls_handshakes_total TLS handshakes by result.\n"
+        << "# TYPE webserv_tls_handshakes_total counter\n"
+        << "webserv_tls_handshakes_total{result=\"full\"} " << tls_handshakes << "\n"
+        << "webserv_tls_handshakes_total{result=\"resumed\"} " << tls_resumed << "\n"
+        << "webserv_tls_handshakes_total{result=\"failed\"} " << tls_handshake_failures << "\n";
+    counter(out, "webserv_http2_connections_total", "Connections switched to HTTP/2.", http2_connections);
+    counter(out, "webserv_http2_streams_total", "HTTP/2 requests.", http2_streams);
+
+    out << "# HELP webserv_event_loop_waits_total Event loop iterations, by backend.\n"
+        << "# TYPE webserv_event_loop_waits_total counter\n"
+        << "webserv_event_loop_waits_total{backend=\"" << EventLoop::name() << "\"} " << event_waits << "\n"
+        << "# HELP webserv_event_loop_syscalls_total System calls of the event backend (waits and interest changes).\n"
+        << "# TYPE webserv_event_loop_syscalls_total counter\n"
+        << "webserv_event_loop_syscalls_total{backend=\"" << EventLoop::name() << "\"} " << event_syscalls << "\n";
+
+    out << "# HELP webserv_limit_req_total Requests checked against limit_req, by result.\n"
+        << "# TYPE webserv_limit_req_total counter\n"
+        << "webserv_limit_req_total{result=\"passed\"} " << limit_req_passed << "\n"
+        << "webserv_limit_req_total{result=\"delayed\"} " << limit_req_delayed << "\n"
+        << "webserv_limit_req_total{result=\"rejected\"} " << limit_req_rejected << "\n";
+    counter(out, "webserv_limit_conn_rejected_total", "Connections refused by limit_conn.", limit_conn_rejected);
+
+    out << "# HELP webserv_request_duration_seconds Time from complete request to last byte sent.\n"
+        << "# TYPE webserv_request_duration_seconds histogram\n";
+    for (const auto& entry : latency) {
+        const LatencyHistogram& histogram = entry.second;
+        std::string label = "location=\"" + escapeLabel(entry.first) + "\"";
+        int last = METRICS_BUCKETS - 2;
+        while (last > 0 && histogram.counts[last] == 0)
+            last--;
+        uint64_t cumulative = 0;
+        for (int i = 0; i <= last; i++) {
+            cumulative += histogram.counts[i];
+            out << "webserv_request_duration_seconds_bucket{" << label << ",le=\""
+                << bucketLimit(i) / 1e6 << "\"} " << cumulative << "\n";
+        }
+        out << "webserv_request_duration_seconds_bucket{" << label << ",le=\"+Inf\"} "
+            << histogram.count << "\n"
+            << "webserv_request_duration_seconds_sum{" << label << "} " << histogram.sum_us / 1e6 << "\n"
+            << "webserv_request_duration_seconds_count{" << label << "} " << histogram.count << "\n";
+    }
+    return out.str();
+}
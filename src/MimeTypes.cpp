@@ -0,0 +1,52 @@
+#include "../includes/MimeTypes.hpp"
+#include <cctype>
+
+MimeTable MimeTypes::types;
+unsigned long MimeTypes::changes = 1; // New cache entries hold 0
+
+// Used when the configuration declares no types at all
+static const char* const DEFAULT_TYPES[][2] = {
+    {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"},
+    {"txt", "text/plain"}, {"csv", "text/csv"}, {"xml", "text/xml"},
+    {"js", "text/javascript"}, {"mjs", "text/javascript"},
+    {"json", "application/json"}, {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"}, {"zip", "application/zip"}, {"gz", "application/gzip"},
+    {"doc", "application/msword"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"png", "image/png"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"gif", "image/gif"},
+    {"svg", "image/svg+xml"}, {"svgz", "image/svg+xml"}, {"webp", "image/webp"},
+    {"ico", "image/x-icon"}, {"avif", "image/avif"},
+    {"woff", "font/woff"}, {"woff2", "font/woff2"}, {"ttf", "font/ttf"}, {"otf", "font/otf"},
+    {"mp3", "audio/mpeg"}, {"ogg", "audio/ogg"}, {"wav", "audio/wav"},
+    {"mp4", "video/mp4"}, {"webm", "video/webm"}, {"mov", "video/quicktime"},
+};
+
+void MimeTypes::add(MimeTable& table, const std::string& extension, const std::string& type) {
+    std::string key = extension;
+    for (size_t i = 0; i < key.size(); i++)
+        key[i] = tolower(key[i]);
+    table[key] = type;
+}
+
+void MimeTypes::loadDefaults(MimeTable& table) {
+    for (const auto& entry : DEFAULT_TYPES)
+        add(table, entry[0], entry[1]);
+}
+
+void MimeTypes::replace(const MimeTable& table) {
+    types = table;
+    changes++;
+}
+
+// Type registered for the extension of `path`, or "" if there is none
+const std::string& MimeTypes::lookup(const std::string& path) {
+    static const std::string none;
+    size_t dot = path.find_last_of("./");
+    if (dot == std::string::npos || path[dot] != '.' || dot + 1 == path.size())
+        return none;
+    std::string key = path.substr(dot + 1);
+    for (size_t i = 0; i < key.size(); i++)
+        key[i] = tolower(key[i]);
+    auto it = types.find(key);
+    return it == types.end() ? none : it->second;
+}
@@ -0,0 +1,285 @@
+#include "../includes/Proxy.hpp"
+#include "../includes/Utils.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+std::map<std::string, std::vector<int> > Proxy::idle;
+
+// "http://host[:port][/path]" -> upstream "host:port" and the path, if any,
+// that replaces the location prefix
+bool Proxy::parsePass(const std::string& pass, std::string& upstream, std::string& path) {
+    if (pass.compare(0, 7, "http://") != 0)
+        return false;
+    size_t slash = pass.find('/', 7);
+    std::string authority = pass.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    path = slash == std::string::npos ? "" : pass.substr(slash);
+    if (authority.empty() || authority[0] == ':')
+        return false;
+    size_t colon = authority.rfind(':');
+    if (colon == std::string::npos || authority.find(']', colon) != std::string::npos)
+        authority += ":80";
+    upstream = authority;
+    return true;
+}
+
+// Headers that describe one connection, not the message (RFC 7230 6.1)
+bool Proxy::isHopByHop(const std::string& name) {
+    static const char* names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+                                  "Transfer-Encoding", "Upgrade", NULL};
+    for (size_t i = 0; names[i]; i++) {
+        if (strcasecmp(name.c_str(), names[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Lower-cased tokens of comma-separated header values, e.g. Connection
+static std::vector<std::string> headerTokens(const std::string& value) {
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+    while (pos <= value.size()) {
+        size_t comma = value.find(',', pos);
+        if (comma == std::string::npos)
+            comma = value.size();
+        size_t start = value.find_first_not_of(" \t", pos);
+        size_t end = value.find_last_not_of(" \t", comma - 1);
+        if (start != std::string::npos && start < comma && end != std::string::npos && end >= start) {
+            std::string token = value.substr(start, end - start + 1);
+            for (char& c : token)
+                c = tolower((unsigned char)c);
+            tokens.push_back(token);
+        }
+        pos = comma + 1;
+    }
+    return tokens;
+}
+
+static bool hasToken(const std::vector<std::string>& tokens, const std::string& name) {
+    std::string lower = name;
+    for (char& c : lower)
+        c = tolower((unsigned char)c);
+    for (const std::string& token : tokens) {
+        if (token == lower)
+            return true;
+    }
+    return false;
+}
+
+static std::string peerAddress(const struct sockaddr_storage& peer) {
+    char buf[INET6_ADDRSTRLEN];
+    const char* addr = NULL;
+    if (peer.ss_family == AF_INET)
+        addr = inet_ntop(AF_INET, &((const struct sockaddr_in*)&peer)->sin_addr, buf, sizeof(buf));
+    else if (peer.ss_family == AF_INET6)
+        addr = inet_ntop(AF_INET6, &((const struct sockaddr_in6*)&peer)->sin6_addr, buf, sizeof(buf));
+    return addr ? addr : "";
+}
+
+// proxy_set_header values may use $host (the client's Host), $remote_addr
+// and $proxy_host (the upstream's)
+static std::string expandValue(const std::string& value, const std::string& client_host,
+                               const std::string& remote_addr, const std::string& proxy_host) {
+    if (value.find('$') == std::string::npos)
+        return value;
+    std::string out;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value.compare(i, 11, "$proxy_host") == 0) {
+            out += proxy_host;
+            i += 10;
+        } else if (value.compare(i, 12, "$remote_addr") == 0) {
+            out += remote_addr;
+            i += 11;
+        } else if (value.compare(i, 5, "$host") == 0) {
+            out += client_host;
+            i += 4;
+        } else {
+            out += value[i];
+        }
+    }
+    return out;
+}
+
+// The request line and headers sent upstream. Hop-by-hop headers (and any
+// the client lists in Connection) stop here; X-Forwarded-* and X-Real-IP
+// are added; proxy_set_header replaces (or, when empty, removes) a header.
+std::string Proxy::encodeHead(const ProxyJob& job, const struct sockaddr_storage& peer, bool https) {
+    std::string remote_addr = peerAddress(peer);
+    std::string client_host, forwarded_for;
+    std::vector<std::string> connection;
+    for (const auto& header : job.headers) {
+        if (strcasecmp(header.first.c_str(), "Host") == 0)
+            client_host = header.second;
+        else if (strcasecmp(header.first.c_str(), "X-Forwarded-For") == 0)
+            forwarded_for = header.second;
+        else if (strcasecmp(header.first.c_str(), "Connection") == 0)
+            connection = headerTokens(header.second);
+    }
+
+    std::map<std::string, std::string> set;   // Lower-cased name -> value
+    for (const auto& header : job.set_headers) {
+        std::string lower = header.first;
+        for (char& c : lower)
+            c = tolower((unsigned char)c);
+        set[lower] = expandValue(header.second, client_host, remote_addr, job.host);
+    }
+    auto overridden = [&](const std::string& name) {
+        std::string lower = name;
+        for (char& c : lower)
+            c = tolower((unsigned char)c);
+        return set.count(lower) != 0;
+    };
+
+    std::string head = job.method + " " + job.target + " HTTP/1.1\r\n";
+    if (!overridden("Host"))
+        head += "Host: " + job.host + "\r\n";
+    static const char* replaced[] = {"Host", "Content-Length", "Expect", "X-Forwarded-For", "X-Real-IP",
+                                     "X-Forwarded-Proto", "X-Forwarded-Host", NULL};
+    for (const auto& header : job.headers) {
+        bool skip = isHopByHop(header.first) || hasToken(connection, header.first) || overridden(header.first);
+        for (size_t i = 0; !skip && replaced[i]; i++)
+            skip = strcasecmp(header.first.c_str(), replaced[i]) == 0;
+        if (!skip)
+            head += header.first + ": " + header.second + "\r\n";
+    }
+    const std::pair<const char*, std::string> forwarded[] = {
+        {"X-Forwarded-For", forwarded_for.empty() ? remote_addr : forwarded_for + ", " + remote_addr},
+        {"X-Real-IP", remote_addr},
+        {"X-Forwarded-Proto", https ? "https" : "http"},
+        {"X-Forwarded-Host", client_host},
+    };
+    for (const auto& header : forwarded) {
+        if (!header.second.empty() && !overridden(header.first))
+            head += std::string(header.first) + ": " + header.second + "\r\n";
+    }
+    for (const auto& header : job.set_headers) {
+        std::string lower = header.first;
+        for (char& c : lower)
+            c = tolower((unsigned char)c);
+        if (!set[lower].empty())
+            head += header.first + ": " + set[lower] + "\r\n";
+    }
+
+    if (job.stream_body && job.chunked)
+        head += "Transfer-Encoding: chunked\r\n";
+    else if (job.stream_body)
+        head += "Content-Length: " + std::to_string(job.content_length) + "\r\n";
+    else if (!job.body.empty() || job.method == "POST" || job.method == "PUT" || job.method == "PATCH")
+        head += "Content-Length: " + std::to_string(job.body.size()) + "\r\n";
+    if (job.keepalive == 0)
+        head += "Connection: close\r\n";
+    return head + "\r\n";
+}
+
+// One chunk of a streamed body; the empty chunk ends it
+std::string Proxy::encodeChunk(const std::string& data) {
+    if (data.empty())
+        return "0\r\n\r\n";
+    char size[32];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    return size + data + "\r\n";
+}
+
+// Parses the status line and headers in `raw` (up to and including the
+// blank line) and rewrites them for the client, which is always answered
+// with Connection: close. Returns false if this is not an HTTP/1.x response.
+bool Proxy::parseResponseHead(const std::string& raw, bool head_request, ProxyResponseHead& out) {
+    size_t line_end = raw.find("\r\n");
+    if (line_end == std::string::npos || raw.compare(0, 7, "HTTP/1.") != 0 || line_end < 12
+        || raw[8] != ' ' || !isdigit((unsigned char)raw[9]) || !isdigit((unsigned char)raw[10])
+        || !isdigit((unsigned char)raw[11]))
+        return false;
+    bool http11 = raw[7] == '1';
+    out.status = atoi(raw.c_str() + 9);
+    out.head = "HTTP/1.1" + raw.substr(8, line_end - 8) + "\r\n";
+    out.length = 0;
+
+    bool chunked = false, has_length = false;
+    std::vector<std::string> connection;
+    std::vector<std::pair<std::string, std::string> > headers;
+    size_t pos = line_end + 2;
+    while (pos < raw.size()) {
+        size_t end = raw.find("\r\n", pos);
+        if (end == std::string::npos || end == pos)
+            break;
+        size_t colon = raw.find(':', pos);
+        if (colon == std::string::npos || colon > end)
+            return false;
+        std::string name = raw.substr(pos, colon - pos);
+        size_t value_start = raw.find_first_not_of(" \t", colon + 1);
+        std::string value = value_start < end ? raw.substr(value_start, end - value_start) : "";
+        headers.push_back(std::make_pair(name, value));
+        if (strcasecmp(name.c_str(), "Connection") == 0) {
+            connection = headerTokens(value);
+        } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            std::vector<std::string> codings = headerTokens(value);
+            chunked = !codings.empty() && codings.back() == "chunked";
+        } else if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            char* num_end;
+            errno = 0;
+            out.length = strtoull(value.c_str(), &num_end, 10);
+            if (value.empty() || *num_end != '\0' || errno != 0)
+                return false;
+            has_length = true;
+        }
+        pos = end + 2;
+    }
+
+    for (const auto& header : headers) {
+        // Transfer-Encoding goes through with the chunks it describes
+        if ((isHopByHop(header.first) && strcasecmp(header.first.c_str(), "Transfer-Encoding") != 0)
+            || hasToken(connection, header.first))
+            continue;
+        out.head += header.first + ": " + header.second + "\r\n";
+    }
+    out.head += "Connection: close\r\n\r\n";
+
+    if (head_request || out.status < 200 || out.status == 204 || out.status == 304)
+        out.framing = ProxyNoBody;
+    else if (chunked)
+        out.framing = ProxyChunked;
+    else if (has_length)
+        out.framing = ProxyLength;
+    else
+        out.framing = ProxyUntilClose;
+    out.keep_alive = out.framing != ProxyUntilClose
+                     && (http11 ? !hasToken(connection, "close") : hasToken(connection, "keep-alive"));
+    return true;
+}
+
+// Hands out a pooled connection that is still open, or a new one
+int Proxy::acquire(const std::string& upstream, bool& reused, bool& in_progress) {
+    std::vector<int>& pool = idle[upstream];
+    in_progress = false;
+    while (!pool.empty()) {
+        int fd = pool.back();
+        pool.pop_back();
+        char probe;
+        ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            reused = true;
+            return fd;
+        }
+        close(fd); // Closed by the upstream (or sent junk) while idle
+    }
+    reused = false;
+    int fd = connect_nonblocking(upstream, in_progress);
+    if (fd < 0 && errno != 0)
+        perror("connect proxy upstream");
+    return fd;
+}
+
+// Keeps the connection for the next request, up to `keepalive` per upstream
+void Proxy::release(const std::string& upstream, int fd, size_t keepalive) {
+    std::vector<int>& pool = idle[upstream];
+    if (pool.size() >= keepalive) {
+        close(fd);
+        return;
+    }
+    pool.push_back(fd);
+}
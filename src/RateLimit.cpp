@@ -0,0 +1,202 @@
+#include "../includes/RateLimit.hpp"
+#include "../includes/Metrics.hpp"
+#include <netinet/in.h>
+#include <cstring>
+#include <cstdlib>
+
+std::map<std::string, AddressTable> RateLimit::zones;
+AddressTable RateLimit::connections(LIMIT_CONN_ENTRIES, false);
+
+// An IPv4 client has the key of its IPv4-mapped IPv6 address
+static void addressKey(const struct sockaddr_storage& peer, int port, unsigned char* key) {
+    memset(key, 0, ADDRESS_KEY_LEN);
+    if (peer.ss_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in*)&peer)->sin_addr, 4);
+    } else if (peer.ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6*)&peer)->sin6_addr, 16);
+    }
+    key[16] = port >> 8;
+    key[17] = port & 0xff;
+}
+
+// FNV-1a with a final avalanche: addresses of one subnet differ only in
+// their last bytes
+static uint64_t addressHash(const unsigned char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < ADDRESS_KEY_LEN; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+AddressTable::AddressTable(size_t capacity, bool evict_oldest)
+    : entries(capacity), free_entries(capacity ? 0 : -1), newest(-1), oldest(-1), evict(evict_oldest) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    buckets.assign(size, -1);
+    for (size_t i = 0; i + 1 < capacity; i++)
+        entries[i].next = i + 1;
+}
+
+int32_t& AddressTable::bucket(const unsigned char* key) {
+    return buckets[addressHash(key) & (buckets.size() - 1)];
+}
+
+// Takes the entry out of its hash chain and the LRU list
+void AddressTable::unlink(int32_t index) {
+    AddressEntry& entry = entries[index];
+    int32_t* link = &bucket(entry.key);
+    while (*link != index)
+        link = &entries[*link].next;
+    *link = entry.next;
+    (entry.newer >= 0 ? entries[entry.newer].older : newest) = entry.older;
+    (entry.older >= 0 ? entries[entry.older].newer : oldest) = entry.newer;
+}
+
+// Makes the entry the most recently used
+void AddressTable::touch(int32_t index) {
+    AddressEntry& entry = entries[index];
+    if (newest == index)
+        return;
+    // Not the newest, so it has a newer neighbour
+    entries[entry.newer].older = entry.older;
+    (entry.older >= 0 ? entries[entry.older].newer : oldest) = entry.newer;
+    entry.older = newest;
+    entry.newer = -1;
+    entries[newest].newer = index;
+    newest = index;
+}
+
+// The entry of the address, added if `create` (NULL when the table is full
+// and does not evict)
+AddressEntry* AddressTable::find(const struct sockaddr_storage& peer, int port, bool create) {
+    if (entries.empty())
+        return NULL;
+    unsigned char key[ADDRESS_KEY_LEN];
+    addressKey(peer, port, key);
+    for (int32_t index = bucket(key); index >= 0; index = entries[index].next) {
+        if (memcmp(entries[index].key, key, ADDRESS_KEY_LEN) == 0) {
+            touch(index);
+            return &entries[index];
+        }
+    }
+    if (!create)
+        return NULL;
+    int32_t index = free_entries;
+    if (index >= 0) {
+        free_entries = entries[index].next;
+    } else if (evict) {
+        index = oldest;
+        unlink(index);
+    } else {
+        return NULL;
+    }
+    AddressEntry& entry = entries[index];
+    entry = AddressEntry();
+    memcpy(entry.key, key, ADDRESS_KEY_LEN);
+    int32_t& head = bucket(key);
+    entry.next = head;
+    head = index;
+    entry.older = newest;
+    (newest >= 0 ? entries[newest].newer : oldest) = index;
+    newest = index;
+    return &entry;
+}
+
+void AddressTable::erase(AddressEntry* entry) {
+    int32_t index = entry - &entries[0];
+    unlink(index);
+    entry->next = free_entries;
+    free_entries = index;
+}
+
+// Installs the zones of the configuration in use, by name and size in bytes.
+// A zone holds as many addresses as fit in its size; one that had the same
+// size before keeps its state.
+void RateLimit::setZones(const std::map<std::string, size_t>& sizes) {
+    std::map<std::string, AddressTable> next;
+    for (const auto& declared : sizes) {
+        size_t capacity = declared.second / (sizeof(AddressEntry) + sizeof(int32_t));
+        if (capacity < 1)
+            capacity = 1;
+        auto zone = zones.find(declared.first);
+        if (zone != zones.end() && zone->second.capacity() == capacity)
+            next[declared.first] = std::move(zone->second);
+        else
+            next[declared.first] = AddressTable(capacity, true);
+    }
+    zones.swap(next);
+}
+
+// "10r/s" or "600r/m", in thousandths of a request per second
+bool RateLimit::parseRate(const std::string& value, uint64_t& rate) {
+    char* end;
+    unsigned long long count = strtoull(value.c_str(), &end, 10);
+    if (end == value.c_str() || count == 0 || count > 1000000)
+        return false;
+    if (strcmp(end, "r/s") == 0)
+        rate = count * 1000;
+    else if (strcmp(end, "r/m") == 0)
+        rate = count * 1000 / 60;
+    else
+        return false;
+    return rate > 0;
+}
+
+// Leaky bucket, as nginx's limit_req: each request adds one to the
+// client's excess, which drains at the zone's rate. Past the burst the
+// request is rejected and not counted. Within it, it is delayed until the
+// excess ahead of it has drained, unless nodelay. A client's first request
+// always passes.
+LimitResult RateLimit::request(const LimitReq& limit, const struct sockaddr_storage& peer,
+                               uint64_t now, uint64_t& delay) {
+    delay = 0;
+    auto zone = zones.find(limit.zone);
+    AddressEntry* entry = zone == zones.end() ? NULL : zone->second.find(peer, 0, true);
+    if (!entry)
+        return LimitPass;
+    uint64_t excess = 0;
+    if (entry->last) {
+        double level = (double)entry->excess + 1000 - (double)limit.rate * (now - entry->last) / 1000000;
+        excess = level > 0 ? (uint64_t)level : 0;
+        if (excess > limit.burst) {
+            Metrics::limit_req_rejected++;
+            return LimitReject;
+        }
+    }
+    entry->excess = excess;
+    entry->last = now;
+    if (excess == 0 || limit.nodelay) {
+        Metrics::limit_req_passed++;
+        return LimitPass;
+    }
+    delay = excess * 1000000 / limit.rate;
+    Metrics::limit_req_delayed++;
+    return LimitDelay;
+}
+
+// Counts a new connection of the address to `port`; false, and not counted,
+// if that would make more than `limit` (0 = no limit) open there at once
+bool RateLimit::connect(const struct sockaddr_storage& peer, int port, size_t limit) {
+    AddressEntry* entry = connections.find(peer, port, true);
+    if (!entry)
+        return limit == 0;
+    if (limit && entry->conns >= limit) {
+        Metrics::limit_conn_rejected++;
+        return false;
+    }
+    entry->conns++;
+    return true;
+}
+
+void RateLimit::disconnect(const struct sockaddr_storage& peer, int port) {
+    AddressEntry* entry = connections.find(peer, port, false);
+    if (entry && entry->conns > 0 && --entry->conns == 0)
+        connections.erase(entry);
+}
@@ -1,4 +1,5 @@
 #include "Request.hpp"
+#include "../includes/Log.hpp"
 
 void Request::parseRequest(const std::string& raw) {
 
@@ -7,7 +8,8 @@ void Request::parseRequest(const std::string& raw) {
     parseHeaders(request_stream);
     parseBody(raw);
     parseContentType();
-    printRequest();
+    if (Log::enabled(LogDebug))
+        printRequest();
 }
 
 void Request::parseRequestLine(std::istringstream& raw_req) {
@@ -20,6 +22,7 @@ void Request::parseRequestLine(std::istringstream& raw_req) {
             line.pop_back();
         std::istringstream first_line(line);
         first_line >> req_line.method >> req_line.url >> req_line.http_version;
+        req_line.target = req_line.url;
         req_line.url = urlDecode(req_line.url);
     }
 }
@@ -45,8 +48,6 @@ void Request::parseHeaders(std::istringstream& raw_req) {
 void Request::parseBody(const std::string& raw) {
     std::string content_length_value;
     std::string transfer_encoding_value;
-    std::ostringstream oss;
-    std::string line;
 
     size_t header_end = raw.find("\r\n\r\n");
     if (header_end == std::string::npos) {
@@ -61,15 +62,8 @@ void Request::parseBody(const std::string& raw) {
             transfer_encoding_value = header.second;
         }
     }
-    std::istringstream body_stream(body);
-    if (transfer_encoding_value == "chunked") {
-        while (std::getline(body_stream, line)) {
-            if (!line.empty() && line.back() == '\r')
-                line.pop_back();
-            oss << line << "\n";
-        }
-        body = encodeChunkedBody(oss.str());
-    }
+    if (transfer_encoding_value == "chunked")
+        body = encodeChunkedBody(body); // Raw bytes: chunk data may contain CRLFs of its own
 }
 
 void Request::parseContentType() {
@@ -1,17 +1,16 @@
 #include "../includes/Server.hpp"
 #include "../includes/Request.hpp"
 #include "../includes/Response.hpp"
+#include <strings.h>
 
+// Request line and headers as one debug line; the body only by its size
 void Request::printRequest() {
-    std::cout << "---request line---" << std::endl;
-    std::cout << "method: " << req_line.method;
-    std::cout << " | url: " << req_line.url;
-    std::cout << " | http_version: " << req_line.http_version << std::endl;
-    std::cout << "---headers---" << std::endl;
-    for (const auto& headers : headers)
-        std::cout << headers.first << " : " << headers.second << std::endl;
-    std::cout << "---body---" << std::endl;
-    std::cout << body << std::endl;
+    std::ostringstream out;
+    out << req_line.method << " " << req_line.url << " " << req_line.http_version;
+    for (const auto& header : headers)
+        out << "\n    " << header.first << ": " << header.second;
+    out << "\n    (" << body.size() << " bytes of body)";
+    Log::write(LogDebug, out.str());
 }
 
 bool Request::isMalformedRequest(std::string& raw_req) {
@@ -55,29 +54,22 @@ bool Request::isMalformedRequest(std::string& raw_req) {
 // "E\r\n in\r\n\r\nchunks.\r\n"
 // "0\r\n\r\n"
 std::string Request::encodeChunkedBody(const std::string& body) {
-    std::istringstream iss(body);
+    ChunkedDecoder decoder;
     std::string decoded_body;
-    std::string line;
-    int chunk_size = 0;
-    std::istringstream sizeStream;
-    char *buf;
-
-    while (std::getline(iss, line)) {
-        if (!line.empty() && line.back() == '\r')
-            line.pop_back();
-        sizeStream.str(line);
-        sizeStream >> std::hex >> chunk_size;
-        if (chunk_size == 0)
-            break; // End of chunks
-        buf = new char[chunk_size];
-        iss.read(buf, chunk_size);
-        decoded_body.append(buf, chunk_size);
-        delete[] buf;
-        iss.ignore(2); // Ignore CRLF after chunk
-    }
+    decoder.feed(body.data(), body.size(), &decoded_body);
     return decoded_body;
 }
 
 s_request Request::getRequestLine() {
 	return req_line;
 }
+
+// Header names are case-insensitive (RFC 7230 3.2); returns "" when absent
+std::string Request::getHeader(const std::string& name) const {
+    for (const std::pair<std::string, std::string>& header : headers) {
+        if (header.first.size() == name.size()
+            && strncasecmp(header.first.c_str(), name.c_str(), name.size()) == 0)
+            return header.second;
+    }
+    return "";
+}
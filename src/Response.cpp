@@ -2,10 +2,15 @@
 #include "../includes/Response.hpp"
 #include "../includes/Router.hpp"
 #include "../includes/Request.hpp"
+#include "../includes/Utils.hpp"
 
-Response::Response(std::vector<ServerConfig> config): Rconfig(config) {}
+Response::Response(std::vector<ServerConfig> config)
+    : Rconfig(config), body_fd(-1) {}
 
-Response::~Response() {}
+Response::~Response() {
+    if (body_fd >= 0)
+        close(body_fd);
+}
 
 bool Response::isCGIRequest(const std::string& url) {
   // First check if it's in the CGI directory
@@ -25,19 +30,78 @@ bool Response::isCGIRequest(const std::string& url) {
   return has_script_ext;
 }
 
+// Whether the request goes to a CGI script or a proxy_pass upstream that can
+// read its body while it is still arriving (FastCGI requests are encoded
+// with the whole body). A script is given CONTENT_LENGTH (RFC 3875 4.1.2),
+// so only a body whose length the client declared is streamed to it; a
+// chunked one is decoded whole first.
+bool Response::canStreamBody(const std::string& url, bool length_known) {
+    Router router(Rconfig);
+    if (isCGIRequest(url))
+        return length_known && router.getRouteConfig(url).fastcgi_pass.empty();
+    // Looked up the way routing() does for non-CGI URLs
+    std::string path = url.substr(0, url.find('?'));
+    if (path.empty() || path.back() != '/')
+        path += '/';
+    return !router.getRouteConfig(path).proxy_pass.empty();
+}
+
+// Marks the body as incomplete: `received` (decoded) goes to the script's
+// stdin first, and the server feeds it the rest from the client socket
+void Response::streamBody(const std::string& received) {
+    stream_body = true;
+    body = received;
+}
+
 std::string Response::routing(std::string method, std::string url) {
     Router router(Rconfig);
     // Check if it's a CGI request before adding a trailing slash
     bool is_cgi = isCGIRequest(url);
 
+    // CGI scripts get the query string in their environment below
+    size_t query_pos = url.find('?');
+    if (!is_cgi && query_pos != std::string::npos) {
+        query_string = url.substr(query_pos + 1);
+        url = url.substr(0, query_pos);
+    }
+    std::string request_path = url;
     // Only add trailing slash for non-CGI URLs that don't already have one
     if (!is_cgi && !url.empty() && url.back() != '/') {
         url += '/';
     }
     t_routeConfig config = router.getRouteConfig(url);
+    route_config = config;
     if (!config.redirect_to.empty())
         url = config.redirect_to;
 
+    // Over the location's limit_req: refused, or answered after a delay
+    if (!checkLimits())
+        return limit_delay ? "" : buildResponse("", LIMIT_REQ_STATUS, "text/html");
+
+    if (config.stub_status)
+        return buildResponse(Metrics::render(), 200, "text/plain; version=0.0.4; charset=utf-8");
+
+    // Dynamic responses may come from the cache instead of the backend
+    std::string cached;
+    if (config.cache_valid > 0 && (is_cgi || !config.proxy_pass.empty() || !config.fastcgi_pass.empty())
+        && lookupCache(method, cached))
+        return cached;
+
+    // Everything under a proxy_pass location belongs to the upstream
+    if (!config.proxy_pass.empty())
+        return executeProxy(method);
+
+    // Everything under a fastcgi_pass location belongs to the backend
+    if (!config.fastcgi_pass.empty()) {
+        std::string query = query_string;
+        size_t pos = request_path.find('?');
+        if (pos != std::string::npos) {
+            query = request_path.substr(pos + 1);
+            request_path = request_path.substr(0, pos);
+        }
+        return executeFastCGI(config.fastcgi_pass, request_path, query, method);
+    }
+
     std::string full_path = config.root_dir + url;
     if (is_cgi) {
       // First check if the path is a directory
@@ -125,20 +189,50 @@ std::string Response::generatingResponse(HttpMethod method, std::string full_url
 }
 
 std::string Response::getGetResponse(const std::string& requested_path, int statusCode) {
-    
-    std::ifstream file(requested_path, std::ifstream::binary);
-    if (!file.is_open())
+    if (statusCode == 200) {
+        // Revalidation is answered from the cached stat, before any open()
+        const FileInfo& cached = FileCache::lookup(requested_path, route_config.etag_hash);
+        if (!cached.exists || !cached.is_regular)
+            return getErrorResponse(404);
+        int condition = evaluatePreconditions(cached);
+        if (condition != 0) {
+            addValidators(cached);
+            return buildResponse("", condition, "text/html");
+        }
+    }
+    int fd = open(requested_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (statusCode != 200) // Error page itself is missing
+            return buildResponse("", statusCode, "text/html");
         return getErrorResponse(404);
-    file.seekg(0, std::ios::end);
-    std::streampos size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    std::string body(size, '\0');
-    if (!file.read(&body[0], size)) {
-        file.close();
-        return getErrorResponse(500); // Read error
     }
-    file.close();
-    return buildResponse(body, statusCode, getMimeType(requested_path));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return getErrorResponse(404);
+    }
+    std::string content_type;
+    if (statusCode == 200) {
+        const FileInfo& info = FileCache::refresh(requested_path, st, route_config.etag_hash);
+        content_type = getMimeType(info);
+        addValidators(info);
+        addHeader("Accept-Ranges", "bytes");
+        if (!getHeader("Range").empty())
+            return getRangeResponse(fd, info);
+    } else {
+        content_type = getMimeType(requested_path);
+    }
+    // Small files go out in the same send() as the headers
+    if (st.st_size <= SENDFILE_MIN_SIZE) {
+        std::string body;
+        bool ok = readFileRange(fd, 0, st.st_size, body);
+        close(fd);
+        if (!ok)
+            return getErrorResponse(500); // Read error
+        return buildResponse(body, statusCode, content_type);
+    }
+    setFileBody(fd, 0, st.st_size);
+    return buildHeaders(st.st_size, statusCode, content_type);
 }
 
 std::string Response::getPostResponse(const std::string& url) {
@@ -171,7 +265,7 @@ std::string Response::getPostResponse(const std::string& url) {
             return getErrorResponse(400);
         std::string boundary = "--" + content_type.substr(boundary_pos + 9);
         std::string upload_path = "./www/uploads/";
-        std::cout << "Upload path: " << upload_path << std::endl;
+        LOG_DEBUG("Upload path: " << upload_path);
         struct stat st;
         if (stat(upload_path.c_str(), &st) == -1) {
             if (mkdir(upload_path.c_str(), 0755) == -1)
@@ -188,16 +282,19 @@ std::string Response::getPostResponse(const std::string& url) {
 
 std::string Response::getDeleteResponse(const std::string& filepath) {
     struct stat st;
-    std::cout << "DEBUG: Deleting file: " << filepath << std::endl;
+    LOG_DEBUG("Deleting file: " << filepath);
     if (stat(filepath.c_str(), &st) != 0) {
         return getErrorResponse(404); // Not found
     }
+    if (evaluatePreconditions(FileCache::refresh(filepath, st)) != 0)
+        return getErrorResponse(412); // Precondition Failed
     if (access(filepath.c_str(), W_OK) != 0) {
         return getErrorResponse(403); // Forbidden
     }
     if (remove(filepath.c_str()) != 0) {
         return getErrorResponse(500); // Failed to delete
     }
+    FileCache::invalidate(filepath);
     return buildResponse("File deleted successfully", 200, "text/plain");
 }
 
@@ -207,20 +304,23 @@ std::string Response::getErrorResponse(int statusCode) {
 }
 
 std::string Response::getHeadResponse(const std::string& requested_path, int statusCode) {
-  // Similar to GET but without body
-  std::ifstream file(requested_path, std::ifstream::binary);
-  if (!file.is_open())
+  // Similar to GET but without body, and without opening the file
+  const FileInfo& info = FileCache::lookup(requested_path, route_config.etag_hash);
+  if (!info.exists || !info.is_regular)
       return getErrorResponse(404);
-  
-  file.seekg(0, std::ios::end);
-  std::streampos size = file.tellg();
-  file.close();
+  addValidators(info);
+  int condition = evaluatePreconditions(info);
+  if (condition != 0)
+      return buildResponse("", condition, "text/html");
   
   // Create response with headers only
   std::stringstream res;
   res << "HTTP/1.1 " << statusCode << " OK\r\n";
-  res << "Content-Type: " << getMimeType(requested_path) << "\r\n";
-  res << "Content-Length: " << size << "\r\n";
+  res << "Content-Type: " << getMimeType(info) << "\r\n";
+  res << "Connection: close\r\n";
+  res << "Content-Length: " << info.size << "\r\n";
+  res << "Accept-Ranges: bytes\r\n";
+  res << extra_headers;
   res << "\r\n";
   
   return res.str();
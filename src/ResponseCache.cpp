@@ -0,0 +1,162 @@
+#include "../includes/ResponseCache.hpp"
+#include "../includes/Utils.hpp"
+#include "../includes/Metrics.hpp"
+#include <strings.h>
+#include <cstdlib>
+#include <cctype>
+
+std::map<std::string, CacheZone> ResponseCache::zones;
+std::unordered_map<std::string, CacheZone*> ResponseCache::filling;
+
+// Finds `key` in the location's zone. A fresh copy comes back with an Age
+// header; an expired one is dropped and the key filled again.
+CacheLookup ResponseCache::lookup(const std::string& location, size_t max_size, time_t valid,
+                                  const std::string& key, std::string& response) {
+    CacheZone& zone = zones[location];
+    zone.max_size = max_size; // A reload may have changed them
+    zone.valid = valid;
+    time_t now = time(NULL);
+    auto it = zone.entries.find(key);
+    if (it != zone.entries.end() && now >= it->second.expires) {
+        erase(zone, it);
+        it = zone.entries.end();
+    }
+    if (it != zone.entries.end()) {
+        const CacheEntry& entry = it->second;
+        if (entry.response.empty()) {
+            Metrics::response_cache_passes++;
+            return CachePass;
+        }
+        zone.lru.splice(zone.lru.begin(), zone.lru, entry.lru);
+        size_t line_end = entry.response.find("\r\n") + 2;
+        response.reserve(entry.response.size() + 48);
+        response.assign(entry.response, 0, line_end);
+        response += "Age: " + std::to_string(now - entry.stored) + "\r\nX-Cache-Status: HIT\r\n";
+        response.append(entry.response, line_end, std::string::npos);
+        Metrics::response_cache_hits++;
+        return CacheHit;
+    }
+    if (filling.count(key)) {
+        Metrics::response_cache_waits++;
+        return CacheWait;
+    }
+    filling[key] = &zone;
+    Metrics::response_cache_misses++;
+    return CacheMiss;
+}
+
+// Ends the fill of `key` with the backend's response, storing it if it may
+// be. Returns whether the requests that waited for it may have it too.
+bool ResponseCache::complete(const std::string& key, const std::string& response) {
+    auto it = filling.find(key);
+    if (it == filling.end())
+        return false;
+    CacheZone& zone = *it->second;
+    filling.erase(it);
+    time_t now = time(NULL);
+    bool shared;
+    time_t ttl = freshness(response, zone.valid, now, shared);
+    if (ttl > 0 && response.size() <= RESPONSE_CACHE_MAX_ENTRY && key.size() + response.size() <= zone.max_size)
+        insert(zone, key, response, now, ttl);
+    else if (!shared)
+        insert(zone, key, "", now, zone.valid);
+    return shared;
+}
+
+// Ends a fill that produced no response (the backend or its client went
+// away), or one too big to keep: with `pass` the key bypasses the cache
+// for cache_valid seconds rather than being filled again at once
+void ResponseCache::abort(const std::string& key, bool pass) {
+    auto it = filling.find(key);
+    if (it == filling.end())
+        return;
+    CacheZone& zone = *it->second;
+    filling.erase(it);
+    if (pass)
+        insert(zone, key, "", time(NULL), zone.valid);
+}
+
+void ResponseCache::insert(CacheZone& zone, const std::string& key, const std::string& response,
+                           time_t now, time_t ttl) {
+    auto old = zone.entries.find(key);
+    if (old != zone.entries.end())
+        erase(zone, old);
+    zone.lru.push_front(key);
+    CacheEntry entry = {response, now, now + ttl, zone.lru.begin()};
+    zone.entries[key] = entry;
+    zone.size += key.size() + response.size();
+    // Least recently used first, never the entry just stored
+    while (zone.size > zone.max_size && zone.lru.size() > 1)
+        erase(zone, zone.entries.find(zone.lru.back()));
+}
+
+void ResponseCache::erase(CacheZone& zone, std::unordered_map<std::string, CacheEntry>::iterator it) {
+    zone.size -= it->first.size() + it->second.response.size();
+    zone.lru.erase(it->second.lru);
+    zone.entries.erase(it);
+}
+
+// Seconds `response` may be served from the cache (RFC 9111 4.2.1):
+// s-maxage, then max-age, then Expires, then cache_valid. 0 for statuses
+// that are not cacheable by default and for no-cache. `shared` is false
+// when the response belongs to its client alone (no-store, private,
+// Set-Cookie, Vary: *); such a response is never given to other requests.
+time_t ResponseCache::freshness(const std::string& response, time_t valid, time_t now, bool& shared) {
+    shared = true;
+    int status = response.size() > 12 ? atoi(response.c_str() + 9) : 0;
+    bool cacheable = status == 200 || status == 203 || status == 204 || status == 301
+                     || status == 404 || status == 410;
+    long max_age = -1, s_maxage = -1;
+    time_t expires = -1;
+    bool no_cache = false;
+
+    size_t head_end = response.find("\r\n\r\n");
+    size_t pos = response.find("\r\n");
+    while (pos != std::string::npos && pos < head_end) {
+        size_t start = pos + 2;
+        size_t end = response.find("\r\n", start);
+        size_t colon = response.find(':', start);
+        pos = end;
+        if (colon >= end)
+            continue;
+        std::string name = response.substr(start, colon - start);
+        size_t value_start = response.find_first_not_of(" \t", colon + 1);
+        std::string value = value_start < end ? response.substr(value_start, end - value_start) : "";
+        if (strcasecmp(name.c_str(), "Set-Cookie") == 0 || (strcasecmp(name.c_str(), "Vary") == 0 && value == "*")) {
+            shared = false;
+        } else if (strcasecmp(name.c_str(), "Expires") == 0) {
+            expires = parse_http_date(value);
+            if (expires < 0)
+                expires = 0; // An invalid date means already expired
+        } else if (strcasecmp(name.c_str(), "Cache-Control") == 0) {
+            size_t token_start = 0;
+            while (token_start <= value.size()) {
+                size_t comma = value.find(',', token_start);
+                if (comma == std::string::npos)
+                    comma = value.size();
+                std::string token = value.substr(token_start, comma - token_start);
+                token.erase(0, token.find_first_not_of(" \t"));
+                for (char& c : token)
+                    c = tolower((unsigned char)c);
+                if (token == "no-store" || token == "private")
+                    shared = false;
+                else if (token == "no-cache")
+                    no_cache = true;
+                else if (token.compare(0, 8, "max-age=") == 0)
+                    max_age = strtol(token.c_str() + 8, NULL, 10);
+                else if (token.compare(0, 9, "s-maxage=") == 0)
+                    s_maxage = strtol(token.c_str() + 9, NULL, 10);
+                token_start = comma + 1;
+            }
+        }
+    }
+    if (!shared || !cacheable || no_cache)
+        return 0;
+    if (s_maxage >= 0)
+        return s_maxage;
+    if (max_age >= 0)
+        return max_age;
+    if (expires >= 0)
+        return expires > now ? expires - now : 0;
+    return valid;
+}
@@ -1,5 +1,7 @@
 #include "../includes/Response.hpp"
 #include "../includes/Server.hpp"
+#include "../includes/CGISpawn.hpp"
+#include <strings.h>
 
 
 // Returns true if the file exists and is executable
@@ -44,150 +46,135 @@ void extractScriptAndPathInfo(const std::string& fullPath, std::string& scriptPa
   }
 }
 
+// CGI/1.1 meta-variables (RFC 3875 4.1), request headers included as HTTP_*
+std::vector<std::pair<std::string, std::string> > Response::cgiParams(const std::string& scriptName,
+        const std::string& scriptFilename, const std::string& pathInfo,
+        const std::string& query, const std::string& method) {
+    std::vector<std::pair<std::string, std::string> > params;
+    params.push_back(std::make_pair("SERVER_SOFTWARE", "WebServ/1.0"));
+    params.push_back(std::make_pair("SERVER_NAME", "localhost"));
+    params.push_back(std::make_pair("GATEWAY_INTERFACE", "CGI/1.1"));
+    params.push_back(std::make_pair("SERVER_PROTOCOL", "HTTP/1.1"));
+    params.push_back(std::make_pair("REQUEST_METHOD", method));
+    params.push_back(std::make_pair("REQUEST_URI", req_line.url));
+    params.push_back(std::make_pair("QUERY_STRING", query));
+    params.push_back(std::make_pair("SCRIPT_NAME", scriptName));
+    params.push_back(std::make_pair("SCRIPT_FILENAME", scriptFilename));
+    params.push_back(std::make_pair("PATH_INFO", pathInfo));
+    params.push_back(std::make_pair("CONTENT_TYPE", content_type));
+    // A streamed body is one with Content-Length (see canStreamBody())
+    if (!stream_body)
+        params.push_back(std::make_pair("CONTENT_LENGTH", std::to_string(body.length())));
+    else
+        params.push_back(std::make_pair("CONTENT_LENGTH", getHeader("Content-Length")));
+    for (const std::pair<std::string, std::string>& header : headers) {
+        std::string name = "HTTP_";
+        for (char c : header.first)
+            name += c == '-' ? '_' : toupper(c);
+        if (name == "HTTP_CONTENT_TYPE" || name == "HTTP_CONTENT_LENGTH")
+            continue;
+        params.push_back(std::make_pair(name, header.second));
+    }
+    return params;
+}
+
+// Splits CGI output into its header block and body (RFC 3875 6.2), accepting
+// bare LF line ends. Status, Content-Type and Content-Length are returned;
+// every other header (Location, Set-Cookie, ...) is queued with addHeader.
+// Returns false while the end of the header block has not been seen.
+bool Response::parseCGIHeaders(const std::string& output, size_t& body_start, int& status,
+                               std::string& contentType, long long& contentLength) {
+    size_t crlf = output.find("\r\n\r\n");
+    size_t lf = output.find("\n\n");
+    size_t header_end = std::min(crlf, lf);
+    if (header_end == std::string::npos)
+        return false;
+    body_start = header_end + (header_end == crlf ? 4 : 2);
+    status = 200;
+    contentType = "text/html";
+    contentLength = -1;
+    bool has_status = false;
+    bool has_location = false;
+
+    std::istringstream header_stream(output.substr(0, header_end));
+    std::string line;
+    while (std::getline(header_stream, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string name = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        if (strcasecmp(name.c_str(), "Status") == 0) {
+            status = std::atoi(value.c_str());
+            has_status = true;
+        } else if (strcasecmp(name.c_str(), "Content-Type") == 0) {
+            contentType = value;
+        } else if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            contentLength = std::atoll(value.c_str());
+        } else {
+            if (strcasecmp(name.c_str(), "Location") == 0)
+                has_location = true;
+            addHeader(name, value);
+        }
+    }
+    if (has_location && !has_status)
+        status = 302; // Client redirect response
+    if (status < 100 || status > 999)
+        status = 500;
+    return true;
+}
+
 std::string Response::executeCGI(const std::string& path, const std::string& query, const std::string& method) {
     std::string scriptPath, pathInfo;
     extractScriptAndPathInfo(path, scriptPath, pathInfo);
 
     // Check if the file exists and is executable
     if (!isCGIScript(path) && !isScriptExtension(path)) {
-      std::cout << "DEBUG: Script not found or not executable: " << path << std::endl;
+      LOG_DEBUG("Script not found or not executable: " << path);
       return getErrorResponse(404);
     }
-    // Add debugging output
-    std::cout << "DEBUG: Executing CGI script at: " << scriptPath << std::endl;
-    std::cout << "DEBUG: PATH_INFO: " << pathInfo << std::endl;
-    std::cout << "DEBUG: POST body length: " << body.length() << std::endl;
-    int pipe_in[2];  // Parent writes to child (CGI input)
-    int pipe_out[2]; // Child writes to parent (CGI output)
-
-    if (pipe(pipe_in) < 0 || pipe(pipe_out) < 0) {
-        perror("pipe");
-        return getErrorResponse(500);
-    }
-
-    // Make pipes non-blocking for poll
-    fcntl(pipe_in[0], F_SETFL, O_NONBLOCK);
-    fcntl(pipe_in[1], F_SETFL, O_NONBLOCK);
-    fcntl(pipe_out[0], F_SETFL, O_NONBLOCK);
-    fcntl(pipe_out[1], F_SETFL, O_NONBLOCK);
-
-    pid_t pid = fork();
-
-    if (pid < 0) {
-        perror("fork");
-        close(pipe_in[0]);
-        close(pipe_in[1]);
-        close(pipe_out[0]);
-        close(pipe_out[1]);
-        return getErrorResponse(500);
-    }
-
-    if (pid == 0) { // Child process (CGI script)
-        // Close unused pipe ends
-        close(pipe_in[1]);  // Close write end of input pipe
-        close(pipe_out[0]); // Close read end of output pipe
-
-        // Redirect stdin to read from pipe_in
-        dup2(pipe_in[0], STDIN_FILENO);
-        close(pipe_in[0]);
-
-        // Redirect stdout to write to pipe_out
-        dup2(pipe_out[1], STDOUT_FILENO);
-        close(pipe_out[1]);
-
-        // Prepare environment variables
-        // Since we can't use setenv(), we'll build an envp array for execve
-        std::vector<std::string> env_strings;
-        env_strings.push_back("SERVER_SOFTWARE=WebServ/1.0");
-        env_strings.push_back("SERVER_NAME=localhost");
-        env_strings.push_back("GATEWAY_INTERFACE=CGI/1.1");
-        env_strings.push_back("SERVER_PROTOCOL=HTTP/1.1");
-        env_strings.push_back("REQUEST_METHOD=" + method);
-        env_strings.push_back("QUERY_STRING=" + query);
-        env_strings.push_back("SCRIPT_NAME=" + scriptPath);
-        env_strings.push_back("PATH_INFO=" + pathInfo);
-        env_strings.push_back("CONTENT_TYPE=" + content_type);
-    
-        std::string content_length = std::to_string(body.length());
-        env_strings.push_back("CONTENT_LENGTH=" + content_length);
-
-        // Convert string vector to char* array for execve
-        char* envp[env_strings.size() + 1];
-        for (size_t i = 0; i < env_strings.size(); i++) {
-            envp[i] = strdup(env_strings[i].c_str());
-        }
-        envp[env_strings.size()] = NULL;
-        // Execute the CGI script
-        char* argv[3]; // Increase size to 3
-        if (path.find(".py") != std::string::npos) {
-            argv[0] = strdup("/usr/bin/python3"); // Use the interpreter path
-            argv[1] = strdup(scriptPath.c_str()); // Script path becomes argument
-            argv[2] = NULL;
-            execve(argv[0], argv, envp); // Execute the interpreter
-        } else {
-            // For other scripts, try direct execution
-            argv[0] = strdup(path.c_str());
-            argv[1] = NULL;
-            execve(path.c_str(), argv, envp);
-        }
-
-        // If execve returns, there was an error
-        perror("execve");
-        exit(EXIT_FAILURE);
-    }
-
-    // Parent process
-    close(pipe_in[0]);  // Close read end of input pipe
-    close(pipe_out[1]); // Close write end of output pipe
-
-    // Register with the main server poll loop instead of local polling
-    CGIState state = {pid, pipe_in[1], pipe_out[0], body, "", Server::current_client_fd, false};
-    Server::cgi_states[pipe_out[0]] = state;
-    
-    // Add stdout pipe to poll for reading
-    Server::poll_fds.push_back({pipe_out[0], POLLIN, 0});
-    
-    // Add stdin pipe to poll for writing if there's data to send
-    if (method == "POST" && !body.empty()) {
-      std::cout << "DEBUG: Writing " << body.size() << " bytes to CGI stdin" << std::endl;
-      
-      // For smaller bodies, try immediate write
-      ssize_t written = write(pipe_in[1], body.c_str(), body.size());
-      
-      if (written == (ssize_t)body.size()) {
-        // All data written successfully
-        std::cout << "DEBUG: Wrote all " << written << " bytes immediately" << std::endl;
-        
-        // Close pipe after successful write
-        close(pipe_in[1]);
-        state.stdin_fd = -1;
-        Server::cgi_states[pipe_out[0]] = state;
-      }
-      else if (written > 0) {
-          // Partial write - update the input buffer to only include remaining data
-          std::cout << "DEBUG: Partial write of " << written << " bytes" << std::endl;
-          state.input_buffer = body.substr(written);
-          
-          // Add stdin pipe to poll for writing the rest
-          Server::poll_fds.push_back({pipe_in[1], POLLOUT, 0});
-          Server::cgi_states[pipe_out[0]] = state;
-          return ""; // Return empty response - the real response will be sent later
-      }
-      else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          // No data written due to non-blocking pipe
-          std::cout << "DEBUG: Would block, queuing entire body" << std::endl;
-          Server::poll_fds.push_back({pipe_in[1], POLLOUT, 0});
-          Server::cgi_states[pipe_out[0]] = state;
-          return ""; // Return empty response - the real response will be sent later
-      }
-      else {
-          perror("write to CGI stdin");
-          
-          // Close the pipe if write failed with an error other than would block
-          close(pipe_in[1]);
-          state.stdin_fd = -1;
-          Server::cgi_states[pipe_out[0]] = state;
-      }
+    LOG_DEBUG("Executing CGI script at: " << scriptPath << ", PATH_INFO: " << pathInfo
+              << ", body length: " << body.length());
+    std::vector<std::string> env;
+    for (const auto& param : cgiParams(scriptPath, scriptPath, pathInfo, query, method))
+        env.push_back(param.first + "=" + param.second);
+
+    // Interpreter from the location's cgi directives, python3 for .py by default
+    std::string interpreter;
+    size_t dot = scriptPath.find_last_of('.');
+    if (dot != std::string::npos) {
+        auto handler = route_config.cgi_handlers.find(scriptPath.substr(dot));
+        if (handler != route_config.cgi_handlers.end())
+            interpreter = handler->second;
     }
+    if (interpreter.empty() && path.find(".py") != std::string::npos)
+        interpreter = "/usr/bin/python3";
+
+    CGIJob job;
+    if (!interpreter.empty())
+        job.argv.push_back(interpreter); // Script path becomes argument
+    job.argv.push_back(scriptPath);
+    job.env = env;
+    job.input = body;
+    job.stream_body = stream_body;
+    job.pooled = !interpreter.empty() && route_config.cgi_pool > 0;
+    job.client_fd = Server::current_client_fd;
+    job.relay = RelaySplice;
+    if (route_config.cgi_relay == "off")
+        job.relay = RelayOff;
+    else if (route_config.cgi_relay == "copy")
+        job.relay = RelayCopy;
+    if (!cache_fill.empty())
+        job.relay = RelayOff; // The whole output is needed for the cache
+    job.cache_key = cache_fill;
+    job.location = route_config.location;
+    job.max_concurrency = route_config.cgi_max_concurrency;
+    job.timeout = route_config.cgi_timeout;
+    job.queued_at = 0;
+
+    int status = Server::submitCGI(job);
+    if (status != 0)
+        return getErrorResponse(status);
     return ""; // Return empty string - CGI process is running asynchronously
 }
@@ -0,0 +1,31 @@
+#include "../includes/Response.hpp"
+
+// Consults the response cache of a cache_valid location. Returns true when
+// the request is answered: by the stored copy, or later (response "") by the
+// request already filling the same key. On a miss the request becomes the
+// fill, and its backend's answer is stored for the next ones.
+bool Response::lookupCache(const std::string& method, std::string& response) {
+    // Only plain GETs and HEADs are alike enough to share an answer
+    if ((method != "GET" && method != "HEAD") || !body.empty() || stream_body
+        || !getHeader("Authorization").empty())
+        return false;
+    std::string key = route_config.location + "\n" + method + " " + getHeader("Host") + req_line.target;
+    for (const std::string& name : route_config.cache_key_headers)
+        key += "\n" + getHeader(name);
+
+    switch (ResponseCache::lookup(route_config.location, route_config.cache_max_size,
+                                  route_config.cache_valid, key, response)) {
+    case CacheHit:
+        return true;
+    case CacheWait:
+        cache_wait = key;
+        response.clear();
+        return true;
+    case CacheMiss:
+        cache_fill = key;
+        return false;
+    case CachePass:
+        break;
+    }
+    return false;
+}
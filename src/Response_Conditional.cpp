@@ -0,0 +1,55 @@
+#include "../includes/Response.hpp"
+#include "../includes/Utils.hpp"
+
+// True if the comma separated entity-tag list names `etag` or is "*".
+// Weak comparison ignores the W/ prefix; strong comparison never matches it.
+static bool etagListMatches(const std::string& list, const std::string& etag, bool weak) {
+    std::istringstream iss(list);
+    std::string tag;
+    while (std::getline(iss, tag, ',')) {
+        size_t start = tag.find_first_not_of(" \t");
+        if (start == std::string::npos)
+            continue;
+        tag = tag.substr(start, tag.find_last_not_of(" \t") - start + 1);
+        if (tag == "*")
+            return true;
+        if (tag.compare(0, 2, "W/") == 0) {
+            if (!weak)
+                continue;
+            tag = tag.substr(2);
+        }
+        if (tag == etag)
+            return true;
+    }
+    return false;
+}
+
+// Evaluates If-Match, If-None-Match and If-Modified-Since in the order of
+// RFC 7232 section 6. Returns 0 to go on with the request, or 304/412.
+int Response::evaluatePreconditions(const FileInfo& info) {
+    bool safe = req_line.method == "GET" || req_line.method == "HEAD";
+
+    std::string if_match = getHeader("If-Match");
+    if (!if_match.empty() && !etagListMatches(if_match, info.etag, false))
+        return 412;
+
+    std::string if_none_match = getHeader("If-None-Match");
+    if (!if_none_match.empty()) {
+        if (etagListMatches(if_none_match, info.etag, true))
+            return safe ? 304 : 412;
+        return 0;
+    }
+
+    std::string if_modified_since = getHeader("If-Modified-Since");
+    if (safe && !if_modified_since.empty()) {
+        time_t since = parse_http_date(if_modified_since);
+        if (since != -1 && info.mtime <= since)
+            return 304;
+    }
+    return 0;
+}
+
+void Response::addValidators(const FileInfo& info) {
+    addHeader("ETag", info.etag);
+    addHeader("Last-Modified", info.last_modified);
+}
@@ -0,0 +1,15 @@
+#include "../includes/Response.hpp"
+#include "../includes/Server.hpp"
+#include "../includes/FastCGI.hpp"
+
+// Hands the request to a fastcgi_pass backend. Like executeCGI, the real
+// response is queued by the server loop once the backend has answered.
+std::string Response::executeFastCGI(const std::string& backend, const std::string& scriptName,
+                                     const std::string& query, const std::string& method) {
+    std::string filename = route_config.root_dir + scriptName;
+    std::string request = FastCGI::encodeRequest(cgiParams(scriptName, filename, "", query, method), body);
+    if (!Server::startFastCGI(backend, request, Server::current_client_fd, cache_fill,
+                              route_config.fastcgi_connect_timeout, route_config.fastcgi_read_timeout))
+        return getErrorResponse(502);
+    return ""; // Empty for now - the backend's answer is sent later
+}
@@ -0,0 +1,15 @@
+#include "../includes/Response.hpp"
+
+// Who the request is from; `limited` if it already passed limit_req
+void Response::setClient(const struct sockaddr_storage& address, bool limited) {
+    peer = address;
+    limit_checked = limited;
+}
+
+// limit_req of the matched location. False when the request is not served
+// now: limitDelay() is then how long it waits, or 0 if it is refused.
+bool Response::checkLimits() {
+    if (route_config.limit_req.zone.empty() || limit_checked)
+        return true;
+    return RateLimit::request(route_config.limit_req, peer, monotonic_micros(), limit_delay) == LimitPass;
+}
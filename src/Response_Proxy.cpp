@@ -0,0 +1,53 @@
+#include "../includes/Response.hpp"
+#include <algorithm>
+
+// Prepares the request for a proxy_pass upstream. The server loop takes the
+// job with releaseProxyJob() and relays the upstream's answer as it comes.
+std::string Response::executeProxy(const std::string& method) {
+    std::string upstream, path;
+    if (!Proxy::parsePass(route_config.proxy_pass, upstream, path))
+        return getErrorResponse(502);
+
+    std::shared_ptr<ProxyJob> job = std::make_shared<ProxyJob>();
+    job->upstream = upstream;
+    job->host = upstream.size() > 3 && upstream.compare(upstream.size() - 3, 3, ":80") == 0
+                ? upstream.substr(0, upstream.size() - 3) : upstream;
+    job->group = route_config.proxy_upstream;
+    if (job->group) {
+        // The peer is picked when connecting; Host stays the group's name
+        job->upstream.clear();
+        const std::string& key = job->group->hash_key;
+        if (key == "$request_uri")
+            job->hash_key = req_line.target;
+        else if (!key.empty()) {
+            std::string name = key.substr(6); // After "$http_"
+            std::replace(name.begin(), name.end(), '_', '-');
+            job->hash_key = getHeader(name);
+        }
+    }
+    job->method = method;
+    job->target = req_line.target;
+    // A path in proxy_pass takes the place of the location prefix
+    const std::string& prefix = route_config.location;
+    if (!path.empty() && job->target.compare(0, prefix.size(), prefix) == 0)
+        job->target = path + job->target.substr(prefix.size());
+    job->headers = headers;
+    job->set_headers = route_config.proxy_set_headers;
+    job->body = body;
+    job->stream_body = stream_body;
+    job->chunked = stream_body && getHeader("Transfer-Encoding") == "chunked";
+    job->content_length = stream_body && !job->chunked ? content_len : body.size();
+    job->connect_timeout = route_config.proxy_connect_timeout;
+    job->send_timeout = route_config.proxy_send_timeout;
+    job->read_timeout = route_config.proxy_read_timeout;
+    job->keepalive = route_config.proxy_keepalive;
+    job->cache_key = cache_fill;
+    proxy_job = job;
+    return ""; // Empty for now - the upstream's answer is relayed later
+}
+
+std::shared_ptr<ProxyJob> Response::releaseProxyJob() {
+    std::shared_ptr<ProxyJob> job = proxy_job;
+    proxy_job.reset();
+    return job;
+}
@@ -0,0 +1,168 @@
+#include "../includes/Response.hpp"
+#include <strings.h>
+#include <algorithm>
+
+static std::string trim(const std::string& str) {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return "";
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+}
+
+static bool parseOffset(const std::string& str, off_t& out) {
+    if (str.empty() || str.size() > 18)
+        return false;
+    out = 0;
+    for (char c : str) {
+        if (c < '0' || c > '9')
+            return false;
+        out = out * 10 + (c - '0');
+    }
+    return true;
+}
+
+// Parses "bytes=a-b, c-, -n" (RFC 7233 2.1) against a file of `size` bytes.
+// Returns 1 with the satisfiable ranges, -1 if none is satisfiable (416),
+// or 0 if the header must be ignored and the whole file served. Ranges that
+// overlap or touch are coalesced (4.1). If the parts left, with their part
+// headers, would come to more than the file itself, the header is ignored:
+// the whole file is cheaper to send than what was asked.
+int Response::parseRangeHeader(const std::string& value, off_t size,
+                               std::vector<std::pair<off_t, off_t> >& ranges) {
+    std::string spec = trim(value);
+    if (spec.size() < 6 || strncasecmp(spec.c_str(), "bytes=", 6) != 0)
+        return 0; // Unknown range unit
+    std::istringstream iss(spec.substr(6));
+    std::string item;
+    size_t count = 0;
+
+    while (std::getline(iss, item, ',')) {
+        item = trim(item);
+        if (item.empty())
+            continue;
+        if (++count > MAX_BYTE_RANGES)
+            return 0;
+        size_t dash = item.find('-');
+        if (dash == std::string::npos)
+            return 0;
+        std::string first = item.substr(0, dash);
+        std::string last = item.substr(dash + 1);
+        off_t start, end;
+
+        if (first.empty()) {
+            // Suffix range: the last N bytes
+            if (!parseOffset(last, end))
+                return 0;
+            if (end == 0 || size == 0)
+                continue;
+            start = end >= size ? 0 : size - end;
+            end = size - 1;
+        } else {
+            if (!parseOffset(first, start))
+                return 0;
+            if (last.empty())
+                end = size - 1;
+            else if (!parseOffset(last, end) || end < start)
+                return 0;
+            if (start >= size)
+                continue;
+            if (end >= size)
+                end = size - 1;
+        }
+        ranges.push_back(std::make_pair(start, end));
+    }
+    if (count == 0)
+        return 0;
+    if (ranges.empty())
+        return -1;
+    std::sort(ranges.begin(), ranges.end());
+    size_t last = 0;
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (ranges[i].first <= ranges[last].second + 1)
+            ranges[last].second = std::max(ranges[last].second, ranges[i].second);
+        else
+            ranges[++last] = ranges[i];
+    }
+    ranges.resize(last + 1);
+    if (ranges.size() > 1) {
+        off_t total = 0;
+        for (size_t i = 0; i < ranges.size(); i++)
+            total += ranges[i].second - ranges[i].first + 1 + RANGE_PART_OVERHEAD;
+        if (total > size) {
+            ranges.clear();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+bool Response::readFileRange(int fd, off_t offset, off_t length, std::string& out) {
+    size_t pos = out.size();
+    out.resize(pos + length);
+    while (length > 0) {
+        ssize_t n = pread(fd, &out[pos], length, offset);
+        if (n <= 0)
+            return false;
+        pos += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Serves a request carrying a Range header. A single range is sent from its
+// file offset through the sendfile path; several ranges become one
+// multipart/byteranges body, each part sent the same way after its headers.
+// Takes ownership of `fd`.
+std::string Response::getRangeResponse(int fd, const FileInfo& info) {
+    std::string mime = getMimeType(info);
+    std::string if_range = getHeader("If-Range");
+    std::vector<std::pair<off_t, off_t> > ranges;
+    int status = 0;
+
+    // A stale If-Range validator means the client wants the whole new file;
+    // entity-tags must match strongly, so a weak W/ tag never does
+    if_range = trim(if_range);
+    if (if_range.empty() || if_range == info.etag || if_range == info.last_modified)
+        status = parseRangeHeader(getHeader("Range"), info.size, ranges);
+
+    if (status == 0) {
+        setFileBody(fd, 0, info.size);
+        return buildHeaders(info.size, 200, mime);
+    }
+    if (status < 0) {
+        close(fd);
+        addHeader("Content-Range", "bytes */" + std::to_string(info.size));
+        return buildResponse("", 416, "text/html");
+    }
+    if (ranges.size() == 1) {
+        off_t start = ranges[0].first;
+        off_t end = ranges[0].second;
+        addHeader("Content-Range", "bytes " + std::to_string(start) + "-"
+                  + std::to_string(end) + "/" + std::to_string(info.size));
+        setFileBody(fd, start, end - start + 1);
+        return buildHeaders(end - start + 1, 206, mime);
+    }
+
+    std::ostringstream boundary;
+    boundary << "webserv_" << std::hex << info.inode << info.mtime;
+    body_fd = fd;
+    body_segments.clear();
+    size_t length = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        FileSegment part;
+        part.prefix = (i > 0 ? "\r\n--" : "--") + boundary.str() + "\r\n";
+        part.prefix += "Content-Type: " + mime + "\r\n";
+        part.prefix += "Content-Range: bytes " + std::to_string(ranges[i].first) + "-"
+                       + std::to_string(ranges[i].second) + "/" + std::to_string(info.size) + "\r\n\r\n";
+        part.offset = ranges[i].first;
+        part.length = ranges[i].second - ranges[i].first + 1;
+        length += part.prefix.size() + part.length;
+        body_segments.push_back(part);
+    }
+    FileSegment end = {"\r\n--" + boundary.str() + "--\r\n", 0, 0};
+    length += end.prefix.size();
+    body_segments.push_back(end);
+    return buildHeaders(length, 206, "multipart/byteranges; boundary=" + boundary.str());
+}
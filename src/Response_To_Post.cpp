@@ -29,37 +29,29 @@ bool Response::handleFileUpload(const std::string& path, const std::string& body
         if (file_content.size() >= 2 && file_content.substr(file_content.size() - 2) == "\r\n")
             file_content = file_content.substr(0, file_content.size() - 2);
         std::string full_path = path + filename;
-        std::cout << "Saving file: " << full_path << std::endl;
+        LOG_DEBUG("Saving file: " << full_path);
         std::ofstream outfile(full_path, std::ios::binary);
         if (!outfile) {
-            std::cerr << "[ERROR] Cannot write to: " << full_path << std::endl;
+            LOG_ERROR("Cannot write to: " << full_path);
             return false;
         }
         outfile.write(file_content.data(), file_content.size());
         outfile.close();
+        FileCache::invalidate(full_path);
         fileSaved = true;
         break; // Only handle one file per request
     }
     return fileSaved;
 }
 
-static bool endsWith(const std::string& str, const std::string& suffix) {
-    if (str.length() < suffix.length()) return false;
-    return str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+std::string Response::getMimeType(const std::string& path) {
+    const std::string& type = MimeTypes::lookup(path);
+    return type.empty() ? route_config.default_type : type;
 }
 
-std::string Response::getMimeType(const std::string& path) {
-    if (endsWith(path, ".html")) return "text/html";
-    if (endsWith(path, ".txt")) return "text/plain";
-    if (endsWith(path, ".jpg") || endsWith(path, ".jpeg")) return "image/jpeg";
-    if (endsWith(path, ".png")) return "image/png";
-    if (endsWith(path, ".css")) return "text/css";
-    if (endsWith(path, ".js")) return "application/javascript";
-    if (endsWith(path, ".pdf")) return "application/pdf";
-    if (endsWith(path, ".docx")) return "application/vnd.openxmlformats-officedocument.wordprocessingml.document";
-    if (endsWith(path, ".doc")) return "application/msword";
-    // Add more as needed
-    return "application/octet-stream";
+// Same, from the type worked out when the file entered the cache
+const std::string& Response::getMimeType(const FileInfo& info) {
+    return info.mime_type.empty() ? route_config.default_type : info.mime_type;
 }
 
 std::string Response::responseApplication(std::string body) {
@@ -19,40 +19,50 @@ std::string Response::getStatusLine(int statusCode) {
     std::string reason;
     switch (statusCode) {
         case 200: reason = "OK"; break;
+        case 201: reason = "Created"; break;
+        case 204: reason = "No Content"; break;
+        case 206: reason = "Partial Content"; break;
+        case 301: reason = "Moved Permanently"; break;
+        case 302: reason = "Found"; break;
+        case 303: reason = "See Other"; break;
+        case 304: reason = "Not Modified"; break;
+        case 307: reason = "Temporary Redirect"; break;
+        case 308: reason = "Permanent Redirect"; break;
         case 400: reason = "Bad Request"; break;
+        case 403: reason = "Forbidden"; break;
         case 404: reason = "Not Found"; break;
         case 500: reason = "Internal Server Error"; break;
+        case 502: reason = "Bad Gateway"; break;
+        case 503: reason = "Service Unavailable"; break;
+        case 504: reason = "Gateway Timeout"; break;
         case 405: reason = "Method Not Allowed"; break;
+        case 412: reason = "Precondition Failed"; break;
+        case 413: reason = "Payload Too Large"; break;
+        case 415: reason = "Unsupported Media Type"; break;
+        case 416: reason = "Range Not Satisfiable"; break;
+        case 429: reason = "Too Many Requests"; break;
         default: reason = "Unknown"; break;
     }
     return "HTTP/1.1 " + std::to_string(statusCode) + " " + reason + "\r\n";
 }
 
+// Starts an autoindex page; the entries themselves are produced by a
+// DirListingStream while the response is being written
 std::string Response::generateDirectoryListing(const std::string& fsPath, const std::string& urlPath) {
-    std::string content = "<html><head><title>Index of " + urlPath + "</title></head><body>";
-    content += "<h1>Index of " + urlPath + "</h1><hr><ul class=\"file-list\">";
+    struct stat st;
+    if (stat(fsPath.c_str(), &st) != 0)
+        return getErrorResponse(404);
 
-    DIR* dir = opendir(fsPath.c_str());
-    if (dir != NULL) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (entry->d_name[0] != '.') {  // Skip hidden files
-                std::string filename = entry->d_name;
+    size_t page = 0;
+    size_t page_pos = query_string.find("page=");
+    if (route_config.autoindex_page_size && page_pos != std::string::npos)
+        page = std::strtoul(query_string.c_str() + page_pos + 5, NULL, 10);
 
-                std::string fileUrl = urlPath;
-                if (fileUrl.back() != '/') {
-                    fileUrl += '/';
-                }
-                fileUrl += filename;
-
-                content += "<li><a href=\"" + fileUrl + "\">" + filename + "</a></li>";
-            }
-        }
-        closedir(dir);
-    }
-
-    content += "</ul><hr></body></html>";
-    return buildResponse(content, 200, content_type);
+    // HTTP/1.0 has no chunked encoding; the body then ends when we close
+    bool chunked = req_line.http_version != "HTTP/1.0";
+    listing_body = std::make_shared<DirListingStream>(fsPath, urlPath, st, page,
+                                                      route_config.autoindex_page_size, chunked);
+    return buildHeaders(chunked ? LENGTH_CHUNKED : LENGTH_UNTIL_CLOSE, 200, "text/html; charset=utf-8");
 }
 
 size_t Response::getContentLength(const std::string &headers) const {
@@ -68,33 +78,59 @@ size_t Response::getContentLength(const std::string &headers) const {
 }
 
 std::string Response::buildResponse(const std::string& body, int statusCode, const std::string& contentType) {
+    return buildHeaders(body.size(), statusCode, contentType) + body;
+}
+
+// Every HTTP/1.1 connection is closed after its response, and says so
+// (HTTP/2 drops the header)
+std::string Response::buildHeaders(std::size_t contentLength, int statusCode, const std::string& contentType) {
     std::stringstream res;
-    if (statusCode == 404)
-        res << "HTTP/1.1 " << statusCode << " Not Found\r\n";
-    if (statusCode == 400)
-        res << "HTTP/1.1 " << statusCode << " Bad Request\r\n";
-    if (statusCode == 405)
-        res << "HTTP/1.1 " << statusCode << " Method Not Allowed\r\n";
-    if (statusCode == 500)
-        res << "HTTP/1.1 " << statusCode << " Internal Server Error\r\n";
-    if (statusCode == 403)
-        res << "HTTP/1.1 " << statusCode << " Forbidden\r\n";
-    if (statusCode == 413)
-        res << "HTTP/1.1 " << statusCode << " Payload Too Large\r\n";
-    if (statusCode == 200)
-        res << "HTTP/1.1 " << statusCode << " OK\r\n";
+    if (statusCode == 304) // No body, so no representation headers either
+        return "HTTP/1.1 304 Not Modified\r\nConnection: close\r\n" + extra_headers + "\r\n";
+    res << getStatusLine(statusCode);
     res << "Content-Type: " << contentType << "\r\n";
-    res << "Content-Length: " << body.size() << "\r\n";
+    res << "Connection: close\r\n";
+    if (contentLength == LENGTH_CHUNKED)
+        res << "Transfer-Encoding: chunked\r\n";
+    else if (contentLength != LENGTH_UNTIL_CLOSE)
+        res << "Content-Length: " << contentLength << "\r\n";
+    res << extra_headers;
     res << "\r\n";
-    res << body;
     return res.str();
 }
 
+void Response::addHeader(const std::string& name, const std::string& value) {
+    extra_headers += name + ": " + value + "\r\n";
+}
+
+// Sends `length` bytes of `fd` from `offset` after the headers, with sendfile()
+void Response::setFileBody(int fd, off_t offset, off_t length) {
+    FileSegment segment = {"", offset, length};
+    body_fd = fd;
+    body_segments.assign(1, segment);
+}
+
+// Hands the pending sendfile() body over to the caller, who must close the fd
+int Response::releaseFileBody(std::deque<FileSegment>& segments) {
+    int fd = body_fd;
+    segments.swap(body_segments);
+    body_segments.clear();
+    body_fd = -1;
+    return fd;
+}
+
+std::shared_ptr<DirListingStream> Response::releaseListingBody() {
+    std::shared_ptr<DirListingStream> listing = listing_body;
+    listing_body.reset();
+    return listing;
+}
+
 
 std::string Response::responseTextPlain(const std::string& body) {
     std::string response;
     response += "HTTP/1.1 200 OK\r\n";
     response += "Content-Type: text/plain\r\n";
+    response += "Connection: close\r\n";
     response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
     response += "\r\n";
     response += body;
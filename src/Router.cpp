@@ -59,6 +59,31 @@ t_routeConfig Router::convertToRouteConfig(const RouteConfigFromConfigFile& cfg)
     config.autoindex = cfg.autoindex;
     config.client_max_body_size = cfg.client_max_body_size;
     config.default_file = cfg.default_file;
+    config.etag_hash = cfg.etag_hash;
+    config.autoindex_page_size = cfg.autoindex_page_size;
+    config.fastcgi_pass = cfg.fastcgi_pass;
+    config.fastcgi_connect_timeout = cfg.fastcgi_connect_timeout;
+    config.fastcgi_read_timeout = cfg.fastcgi_read_timeout;
+    config.cgi_handlers = cfg.cgi_handlers;
+    config.cgi_pool = cfg.cgi_pool;
+    config.cgi_relay = cfg.cgi_relay;
+    config.location = cfg.path;
+    config.cgi_timeout = cfg.cgi_timeout;
+    config.cgi_max_concurrency = cfg.cgi_max_concurrency;
+    config.stub_status = cfg.stub_status;
+    config.proxy_pass = cfg.proxy_pass;
+    config.proxy_connect_timeout = cfg.proxy_connect_timeout;
+    config.proxy_send_timeout = cfg.proxy_send_timeout;
+    config.proxy_read_timeout = cfg.proxy_read_timeout;
+    config.proxy_set_headers = cfg.proxy_set_headers;
+    config.proxy_keepalive = cfg.proxy_keepalive;
+    config.proxy_upstream = cfg.proxy_upstream;
+    config.cache_valid = cfg.cache_valid;
+    config.cache_max_size = cfg.cache_max_size;
+    config.cache_key_headers = cfg.cache_key_headers;
+    config.limit_req = cfg.limit_req;
+    if (!cfg.default_type.empty())
+        config.default_type = cfg.default_type;
     return config;
 }
 
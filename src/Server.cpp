@@ -1,31 +1,121 @@
 #include "../includes/Server.hpp"
+#include <algorithm>
 
 std::vector<struct pollfd> Server::poll_fds;
 std::map<int, CGIState> Server::cgi_states;
+std::map<int, FastCGIState> Server::fcgi_states;
+std::map<int, int> Server::fcgi_clients;
 int Server::current_client_fd = -1;
+std::map<pid_t, CGIChild> Server::cgi_children;
+std::map<std::string, size_t> Server::cgi_running;
+std::map<std::string, std::deque<CGIJob> > Server::cgi_queue;
+int Server::sigchld_pipe[2] = {-1, -1};
+std::map<int, int> Server::cgi_uploads;
 
 volatile sig_atomic_t gSignal = 1;
 
 bool Server::running = true;
+bool Server::reload_pending = false;
+bool Server::shutdown_pending = false;
 
-Server::Server(std::vector<ServerConfig> config) : config(config) {
+Server::Server(std::vector<ServerConfig> config, const std::string& config_path)
+	: current_config(std::make_shared<const std::vector<ServerConfig> >(config)), config_path(config_path) {
 	setupPorts();
+	configureCGIPools();
 }
 
 Server::~Server() {
 }
 
+// Pools only grow: a reload that drops a cgi_pool leaves its workers idle
+void Server::configureCGIPools() {
+	for (const ServerConfig& server : *current_config) {
+		for (const RouteConfigFromConfigFile& route : server.routes) {
+			if (route.cgi_pool == 0)
+				continue;
+			CGIWorkerPool::configure("/usr/bin/python3", route.cgi_pool);
+			for (const auto& handler : route.cgi_handlers)
+				CGIWorkerPool::configure(handler.second, route.cgi_pool);
+		}
+	}
+	CGIWorkerPool::replenish();
+}
+
+// The configuration the client's connection was accepted under
+const std::vector<ServerConfig>& Server::configFor(int client_fd) const {
+	auto it = client_info.find(client_fd);
+	if (it == client_info.end() || !it->second.config)
+		return *current_config;
+	return *it->second.config;
+}
+
+// Runs from the loop after SIGHUP. An invalid file, or a new port that
+// cannot be bound, leaves the running configuration as it was. Otherwise
+// connections accepted from now on get the new snapshot, and the old one is
+// freed when the last connection holding it closes.
+void Server::reload() {
+	reload_pending = false;
+	ConfigManager manager;
+	std::string error;
+	bool loaded;
+	try {
+		loaded = manager.loadFromFile(config_path);
+	} catch (const std::exception& e) {
+		LOG_ERROR("Reload failed, keeping the running configuration: " << e.what());
+		return;
+	}
+	if (!loaded) {
+		LOG_ERROR("Reload failed, keeping the running configuration: " << manager.getErrorMessage());
+		return;
+	}
+	ConfigSnapshot next = std::make_shared<const std::vector<ServerConfig> >(manager.getServerConfigs());
+	if (!checkPorts(*next, error) || !openListeners(*next, error)) {
+		LOG_ERROR("Reload failed, keeping the running configuration: " << error);
+		return;
+	}
+	// Connections already queued on a dropped port are served by the old snapshot
+	closeListeners(*next);
+	manager.apply();
+	current_config = next;
+	for (const ServerConfig& server : *current_config)
+		serverSockets[listeners[server.port]] = server;
+	configureCGIPools();
+	LOG_INFO("Configuration reloaded from " << config_path);
+}
+
 void Server::run() {
 	signal(SIGINT, signalHandler);
 	signal(SIGTERM, signalHandler);
+	signal(SIGQUIT, signalHandler);
+	signal(SIGHUP, sighupHandler);
+	// A peer closing early must surface as EPIPE, not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	// Children are reaped from the loop, woken through a self-pipe
+	if (!makePipe(sigchld_pipe)) {
+		perror("pipe");
+		return ;
+	}
+	fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+	addPollFd(sigchld_pipe[0], POLLIN);
+	signal(SIGCHLD, sigchldHandler);
+	EventLoop::init();
 
 	mainLoop();
 	cleanup();
 }
 
+// SIGTERM and SIGQUIT ask for a graceful shutdown; a second one, or
+// SIGINT, stops at once
 void Server::signalHandler(int signum) {
+	if (signum == SIGINT || shutdown_pending)
+		running = false;
+	shutdown_pending = true;
+}
+
+void Server::sighupHandler(int signum) {
 	(void)signum;
-	running = false;
+	reload_pending = true;
 }
 
 void stopLoop(int) {
@@ -34,13 +124,20 @@ void stopLoop(int) {
 
 void Server::mainLoop() {
     while (running) {
-        int poll_count = poll(poll_fds.data(), poll_fds.size(), 1000);
+        if (shutdown_pending && !shutdown_deadline)
+            beginShutdown();
+        else if (reload_pending && !shutdown_deadline)
+            reload();
+        bool buffered = Tls::anyBuffered(poll_fds);
+        int poll_count = EventLoop::wait(poll_fds, buffered ? 0 : waitTimeout());
         if (poll_count < 0) {
             if (errno == EINTR)
                 continue;
-            perror("poll");
+            perror(EventLoop::name());
             break;
         }
+        if (buffered)
+            Tls::markBuffered(poll_fds);
 
         for (size_t i = 0; i < poll_fds.size(); i++) {
             int fd = poll_fds[i].fd;
@@ -49,64 +146,196 @@ void Server::mainLoop() {
             if (poll_fds[i].revents == 0)
                 continue;
 
+            if (fd == sigchld_pipe[0]) {
+                reapChildren();
+                continue;
+            }
             // Check if it's a CGI pipe
-            if (cgi_states.find(fd) != cgi_states.end()) {
+            if (findCGIState(fd) != cgi_states.end()) {
                 handleCGIPipeEvents(i);
                 continue;
             }
+            if (fcgi_states.find(fd) != fcgi_states.end()) {
+                handleFastCGIEvents(i);
+                continue;
+            }
+            if (proxy_states.find(fd) != proxy_states.end()) {
+                handleProxyEvents(i);
+                continue;
+            }
+            if (h2_connections.find(fd) != h2_connections.end()) {
+                handleHttp2Events(i);
+                continue;
+            }
 
             // Otherwise, handle normal socket events
             handleSocketEvents(i);
         }
+        Metrics::active = clientConfigs.size();
+        Metrics::reading = client_sessions.size();
+        Metrics::writing = responses.size();
+        checkCGITimeouts();
+        checkProxyTimeouts();
+        checkFastCGITimeouts();
+        releaseDelayedRequests();
+        CGIWorkerPool::replenish();
+        AccessLog::flush(false);
+        if (shutdown_deadline && drainConnections())
+            break;
+    }
+}
+
+// Stops accepting and lets connections finish what they have started.
+// HTTP/2 clients get GOAWAY: their open streams are still answered.
+void Server::beginShutdown() {
+	size_t timeout = 0;
+	for (const ServerConfig& server : *current_config)
+		timeout = std::max(timeout, server.shutdown_timeout);
+	shutdown_deadline = time(NULL) + timeout;
+	for (const auto& listener : listeners) {
+		removePollFd(listener.second);
+		serverSockets.erase(listener.second);
+		close(listener.second);
+	}
+	listeners.clear();
+	for (auto& entry : h2_connections) {
+		H2Connection& conn = entry.second;
+		if (conn.failed || conn.closing)
+			continue;
+		Http2::goaway(conn.output, conn.last_stream, H2NoError);
+		conn.closing = true;
+		watchHttp2Output(entry.first);
+	}
+	LOG_INFO("Shutting down: waiting up to " << timeout << "s for " << clientConfigs.size()
+	         << " connections and " << cgi_children.size() << " CGI scripts");
+}
+
+// A tick of a graceful shutdown: closes the connections that have become
+// idle. True once every connection is closed and every script reaped, or
+// shutdown_timeout is over.
+bool Server::drainConnections() {
+	std::vector<int> idle;
+	for (const auto& client : clientConfigs) {
+		if (client.first < H2_CLIENT_BASE && !h2_connections.count(client.first) && !clientBusy(client.first))
+			idle.push_back(client.first);
+	}
+	for (int client_fd : idle)
+		closeClient(client_fd);
+	if (clientConfigs.empty() && cgi_children.empty())
+		return true;
+	if (time(NULL) < shutdown_deadline)
+		return false;
+	LOG_WARN("shutdown_timeout reached with " << clientConfigs.size() << " connections and "
+	         << cgi_children.size() << " CGI scripts left");
+	return true;
+}
+
+// In the middle of a request: part of one read, a response or body to
+// send, or a backend, queue or timer holding it
+bool Server::clientBusy(int client_fd) const {
+	auto session = client_sessions.find(client_fd);
+	if ((session != client_sessions.end() && !session->second.buffer.empty()) || responses.count(client_fd)
+		|| hasPendingBody(client_fd) || cgi_uploads.count(client_fd) || cache_waits.count(client_fd)
+		|| delayed_requests.count(client_fd) || fcgi_clients.count(client_fd))
+		return true;
+	for (const auto& cgi : cgi_states) {
+		if (cgi.second.client_fd == client_fd)
+			return true;
+	}
+	for (const auto& queue : cgi_queue) {
+		for (const CGIJob& job : queue.second) {
+			if (job.client_fd == client_fd)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Milliseconds the loop may wait for events: a second, or less when a
+// delayed request is due sooner
+int Server::waitTimeout() const {
+    if (delay_queue.empty())
+        return 1000;
+    uint64_t now = monotonic_micros();
+    uint64_t due = delay_queue.begin()->first;
+    if (due <= now)
+        return 0;
+    uint64_t millis = (due - now + 999) / 1000;
+    return millis < 1000 ? (int)millis : 1000;
+}
+
+// Routes the requests whose limit_req delay is over
+void Server::releaseDelayedRequests() {
+    uint64_t now = monotonic_micros();
+    while (!delay_queue.empty() && delay_queue.begin()->first <= now) {
+        uint64_t due = delay_queue.begin()->first;
+        int client_fd = delay_queue.begin()->second;
+        delay_queue.erase(delay_queue.begin());
+        auto delayed = delayed_requests.find(client_fd);
+        if (delayed == delayed_requests.end() || delayed->second.due != due)
+            continue; // Closed meanwhile
+        ClientSession& session = client_sessions[client_fd] = delayed->second.session;
+        delayed_requests.erase(delayed);
+        current_client_fd = client_fd;
+        processRequest(client_fd, session);
     }
 }
 
+// CGI state owning `fd`, whether it is the stdout (map key) or the stdin pipe
+std::map<int, CGIState>::iterator Server::findCGIState(int fd) {
+    std::map<int, CGIState>::iterator it = cgi_states.find(fd);
+    if (it != cgi_states.end())
+        return it;
+    for (it = cgi_states.begin(); it != cgi_states.end(); ++it) {
+        if (it->second.stdin_fd == fd)
+            return it;
+    }
+    return cgi_states.end();
+}
+
 void Server::handleCGIPipeEvents(size_t i) {
     int fd = poll_fds[i].fd;
-    auto cgi_it = cgi_states.find(fd);
+    auto cgi_it = findCGIState(fd);
     if (cgi_it == cgi_states.end())
         return;
 
-    // Handle reading from CGI stdout
-    if (poll_fds[i].revents & POLLIN) {
-        char buf[4096];
-        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    // Handle reading from CGI stdout (Linux reports a closed pipe as POLLHUP alone)
+    if (fd == cgi_it->first && (poll_fds[i].revents & (POLLIN | POLLHUP))) {
+        if (cgi_it->second.relaying) {
+            // More body (or EOF) is waiting: the client side pulls it from here
+            removePollFd(fd);
+            enableWriteEvents(cgi_it->second.client_fd);
+            return;
+        }
+        char buf[BUF_SIZE];
+        ssize_t n = read(fd, buf, sizeof(buf));
 
         if (n > 0) {
             cgi_it->second.output_buffer.append(buf, n);
+            if (cgi_it->second.relay != RelayOff)
+                startCGIRelay(cgi_it);
         } else if (n == 0) {
             int client_fd = cgi_it->second.client_fd;
 
-            // Check if client still exists
-            bool client_exists = false;
-            for (const auto& pfd : poll_fds) {
-                if (pfd.fd == client_fd) {
-                    client_exists = true;
-                    break;
-                }
-            }
-
-            if (client_exists) {
-                std::string response = processCGIOutput(cgi_it->second.output_buffer);
-                responses[client_fd] = response;
-
-                for (auto& pfd : poll_fds) {
-                    if (pfd.fd == client_fd) {
-                        pfd.events = POLLOUT;
-                        pfd.revents = 0;
-                        break;
-                    }
+            // Check if client still exists (an HTTP/2 stream has no pollfd of its own)
+            bool client_exists = clientConfigs.count(client_fd) != 0;
+
+            // A cache fill is completed even for a client that has left
+            std::string cache_key;
+            cache_key.swap(cgi_it->second.cache_key);
+            if (client_exists || !cache_key.empty()) {
+                std::string response = processCGIOutput(client_fd, cgi_it->second.output_buffer);
+                if (!cache_key.empty())
+                    completeCacheFill(cache_key, response);
+                if (client_exists) {
+                    noteResponse(client_fd, response);
+                    responses[client_fd] = response;
+                    enableWriteEvents(client_fd);
                 }
             }
 
-            if (cgi_it->second.stdin_fd > 0)
-                close(cgi_it->second.stdin_fd);
-            close(fd);
-            waitpid(cgi_it->second.pid, NULL, 0);
-
-            cgi_states.erase(fd);
-            poll_fds.erase(poll_fds.begin() + i);
-            i--;
+            // The process is reaped once SIGCHLD says it has exited
+            dropCGIState(fd);
         } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             perror("read CGI pipe");
         }
@@ -114,100 +343,159 @@ void Server::handleCGIPipeEvents(size_t i) {
     }
 
     // Handle writing to CGI stdin
-    if (fd == cgi_it->second.stdin_fd && (poll_fds[i].revents & POLLOUT)) {
-        std::string& input = cgi_it->second.input_buffer;
-        if (!input.empty()) {
-            ssize_t n = write(fd, input.c_str(), input.size());
-            if (n > 0) {
-                input.erase(0, n);
-            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("write CGI pipe");
-            }
-        }
-
-        if (input.empty()) {
-            close(fd);
-            cgi_it->second.stdin_fd = -1;
-            poll_fds.erase(poll_fds.begin() + i);
-            i--;
+    if (fd == cgi_it->second.stdin_fd && (poll_fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+        if (writeCGIInput(cgi_it->second) && cgi_it->second.stdin_streaming) {
+            // Pipe drained: go back to reading the body from the client
+            removePollFd(fd);
+            setPollEvents(cgi_it->second.client_fd, POLLIN);
         }
-        return;
     }
 }
 
 void Server::handleSocketEvents(size_t i) {
     int fd = poll_fds[i].fd;
 
+    if (Tls::handshaking(fd)) {
+        continueHandshake(fd);
+        return;
+    }
     if (poll_fds[i].revents & POLLIN) {
-        if (std::find(ss_Fds.begin(), ss_Fds.end(), fd) != ss_Fds.end()) {
+        if (serverSockets.count(fd)) {
             handleNewConnection(fd);
         } else {
             handleClientData(fd);
         }
     } else if (poll_fds[i].revents & POLLOUT) {
         handleClientWrite(fd);
+    } else if (poll_fds[i].revents & (POLLERR | POLLHUP)) {
+        closeClient(fd); // Gone while we were not polling it for anything
     }
 }
 
-void Server::handleNewConnection(int listen_id) {
+// Returns false once the listener has nothing more to accept
+bool Server::handleNewConnection(int listen_id) {
 	// std::cout << "DEBUG: handleNewConnection" << std::endl;
-	int client_fd = accept(listen_id, nullptr, nullptr);
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof(peer);
+#ifdef __linux__
+	int client_fd = accept4(listen_id, (struct sockaddr*)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int client_fd = accept(listen_id, (struct sockaddr*)&peer, &peer_len);
+#endif
 		if (client_fd < 0) {
-			perror("accept");
-			return ;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return false;
 		}
-	struct pollfd pfd = {client_fd, POLLIN, 0};
-	poll_fds.push_back(pfd);
+#ifndef __linux__
+	if (fcntl(client_fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(client_fd, F_SETFD, FD_CLOEXEC) < 0) {
+		perror("fcntl");
+		close(client_fd);
+		return true;
+	}
+#endif
+	const ServerConfig& listener = serverSockets[listen_id];
+	if (!RateLimit::connect(peer, listener.port, listener.limit_conn)) {
+		// A TLS client could not read the answer before a handshake
+		if (listener.tls < 0)
+			send(client_fd, LIMIT_CONN_RESPONSE, sizeof(LIMIT_CONN_RESPONSE) - 1, 0);
+		close(client_fd);
+		return true;
+	}
+	if (listener.tls >= 0 && !Tls::accept(client_fd, listener.tls)) {
+		RateLimit::disconnect(peer, listener.port);
+		close(client_fd);
+		return true;
+	}
+	Metrics::accepted++;
+	addPollFd(client_fd, POLLIN);
 	clientConfigs[client_fd] = serverSockets[listen_id];
+	ClientInfo info = {peer, monotonic_micros(), current_config};
+	client_info[client_fd] = info;
+	Capture::opened(client_fd);
+	return true;
 }
 
 void Server::handleClientData(int client_fd) {
     current_client_fd = client_fd;
     // std::cout << "DEBUG: handleClientData" << std::endl;
 
+    auto streaming = client_sessions.find(client_fd);
+    if (streaming != client_sessions.end() && streaming->second.streaming) {
+        if (proxy_clients.count(client_fd))
+            handleProxyUpload(client_fd, streaming->second);
+        else
+            handleCGIUpload(client_fd, streaming->second);
+        return;
+    }
+    if (client_fd >= H2_CLIENT_BASE)
+        return; // A stream's body is read only while streamed to its handler
     if (!receiveData(client_fd)) {
         closeClient(client_fd);
         return;
     }
     ClientSession& session = client_sessions[client_fd];
+    if (!session.headers_received && detectHttp2(client_fd, session))
+        return;
     if (!processHeaders(session))
         return; // wait for more data
 
-    if (isFullRequestReceived(session))
-        processRequest(client_fd, session);
+    if (isFullRequestReceived(client_fd, session)) {
+        if (!upgradeHttp2(client_fd, session))
+            processRequest(client_fd, session);
+    } else if (!session.stream_checked) {
+        session.stream_checked = true;
+        if (canStreamBody(client_fd, session)) {
+            session.streaming = true;
+            processRequest(client_fd, session);
+        }
+    }
 }
 
 void Server::handleClientWrite(int client_fd) {
 	// std::cout << "DEBUG: handleClientWrite" << std::endl;
 	auto it = responses.find(client_fd);
 	if (it == responses.end()) {
-		std::cerr << "No response found for client " << client_fd << std::endl;
+		LOG_WARN("No response found for client " << client_fd);
 		return ;
 	}
 	const std::string& response = it->second;
-  if (response.empty()) {
+  if (response.empty() && !hasPendingBody(client_fd)) {
     // For CGI requests that return empty responses, keep the connection open
     responses.erase(client_fd);
+    response_offsets.erase(client_fd);
     
     // Reset to POLLIN to allow for further requests
-    for (auto& pfd : poll_fds) {
-        if (pfd.fd == client_fd) {
-            pfd.events = POLLIN;
-            pfd.revents = 0;
-            break;
-        }
-    }
+    setPollEvents(client_fd, POLLIN);
     return;
   }
-	ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), 0);
-	if (bytes_sent <= 0) {
-		perror("send");
+	size_t& sent = response_offsets[client_fd];
+	if (sent < response.length()) {
+		int flags = hasPendingBody(client_fd) ? MSG_MORE : 0;
+		ssize_t bytes_sent = sendToClient(client_fd, response.c_str() + sent, response.length() - sent, flags);
+		if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return ; // TLS record not out yet
+		if (bytes_sent <= 0) {
+			perror("send");
+			closeClient(client_fd);
+			return ;
+		}
+		sent += bytes_sent;
+		countSent(client_fd, bytes_sent);
+		if (sent < response.length())
+			return ; // Socket buffer full, wait for the next POLLOUT
+	}
+	if (!sendFileBody(client_fd) || !sendListingBody(client_fd) || !sendRelayBody(client_fd)
+		|| !sendProxyBody(client_fd) || !sendFastCGIBody(client_fd)) {
 		closeClient(client_fd);
-		responses.erase(client_fd);
 		return ;
 	}
+	if (hasPendingBody(client_fd))
+		return ; // Rest of the body goes out on the next POLLOUT
 	// std::cout << "Sent response to client :\n" << response << std::endl;
 	responses.erase(client_fd);
+	response_offsets.erase(client_fd);
+	finishRequest(client_fd, true);
 
 	 // Check if this client is waiting for CGI response
     bool is_cgi_client = false;
@@ -218,23 +506,201 @@ void Server::handleClientWrite(int client_fd) {
         }
     }
     
-    // Only close the client if it's not waiting for CGI output
-    if (!is_cgi_client) {
+    // Only close the client if it's not waiting for CGI output; a stream
+    // is over with its response either way
+    if (!is_cgi_client || client_fd >= H2_CLIENT_BASE) {
         closeClient(client_fd);
     } else {
         // For CGI clients, reset to POLLIN for possible future data
-        for (auto& pfd : poll_fds) {
-            if (pfd.fd == client_fd) {
-                pfd.events = POLLIN;
-                pfd.revents = 0;
-                break;
-            }
-        }
+        setPollEvents(client_fd, POLLIN);
     }
 }
 
+// Streams the pending file body, if any. Returns false on a socket error.
+bool Server::sendFileBody(int client_fd) {
+	auto it = file_transfers.find(client_fd);
+	if (it == file_transfers.end())
+		return true;
+	FileTransfer& transfer = it->second;
+	while (!transfer.segments.empty()) {
+		FileSegment& segment = transfer.segments.front();
+		ssize_t n;
+		if (transfer.prefix_sent < segment.prefix.size()) {
+			n = sendToClient(client_fd, segment.prefix.data() + transfer.prefix_sent,
+							 segment.prefix.size() - transfer.prefix_sent, 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return true;
+			if (n <= 0) {
+				perror("send");
+				return false;
+			}
+			transfer.prefix_sent += n;
+			countSent(client_fd, n);
+			continue;
+		}
+		if (segment.length == 0) {
+			transfer.segments.pop_front();
+			transfer.prefix_sent = 0;
+			continue;
+		}
+		size_t chunk = segment.length < SENDFILE_CHUNK ? segment.length : SENDFILE_CHUNK;
+		if (!plainSocket(client_fd)) {
+			// The kernel cannot encrypt or frame: copy it through a buffer, read again
+			// from the same offset after a short write so the retry sees the same bytes
+			char buf[TLS_RECORD_LARGE];
+			n = pread(transfer.fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf), segment.offset);
+			if (n > 0)
+				n = sendToClient(client_fd, buf, n, 0);
+			if (n > 0)
+				segment.offset += n;
+		} else {
+#ifdef __linux__
+			n = sendfile(client_fd, transfer.fd, &segment.offset, chunk);
+#else
+			off_t len = chunk;
+			n = sendfile(transfer.fd, client_fd, segment.offset, &len, NULL, 0);
+			if (len > 0) {
+				segment.offset += len;
+				n = len;
+			}
+#endif
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0) {
+			perror("sendfile");
+			return false;
+		}
+		segment.length -= n;
+		countSent(client_fd, n);
+	}
+	close(transfer.fd);
+	file_transfers.erase(it);
+	return true;
+}
+
+// Sends autoindex chunks as the stream produces them. Returns false on a socket error.
+bool Server::sendListingBody(int client_fd) {
+	auto it = listing_transfers.find(client_fd);
+	if (it == listing_transfers.end())
+		return true;
+	ListingTransfer& transfer = it->second;
+	while (true) {
+		if (transfer.offset == transfer.chunk.size()) {
+			if (transfer.last) {
+				listing_transfers.erase(it);
+				return true;
+			}
+			transfer.chunk.clear();
+			transfer.offset = 0;
+			transfer.last = transfer.stream->produceChunk(transfer.chunk);
+			if (transfer.chunk.empty() && !transfer.last)
+				return true; // Still reading the directory, try again next POLLOUT
+			continue;
+		}
+		ssize_t n = sendToClient(client_fd, transfer.chunk.c_str() + transfer.offset,
+						 transfer.chunk.size() - transfer.offset, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0) {
+			perror("send");
+			return false;
+		}
+		transfer.offset += n;
+		countSent(client_fd, n);
+	}
+}
+
+// Bytes written to a client, for the metrics and the request's access log line
+void Server::countSent(int client_fd, size_t bytes) {
+	Metrics::bytes_out += bytes;
+	auto record = request_records.find(client_fd);
+	if (record == request_records.end())
+		return;
+	if (record->second.response_start == 0 && bytes > 0)
+		record->second.response_start = monotonic_micros();
+	record->second.bytes_sent += bytes;
+}
+
+// Closes the books on the client's request: its latency once the last byte is
+// out, and its access log line either way (499 if it left before any response)
+void Server::finishRequest(int client_fd, bool complete) {
+	auto it = request_records.find(client_fd);
+	if (it == request_records.end())
+		return;
+	RequestRecord& record = it->second;
+	uint64_t now = monotonic_micros();
+	if (complete)
+		Metrics::observeLatency(record.location, now - record.received);
+	else if (record.status == 0)
+		record.status = 499;
+	AccessLog::write(record.access_log, record, now);
+	if (record.traced)
+		Trace::write(client_fd, record, now);
+	request_records.erase(it);
+}
+
+bool Server::hasPendingBody(int client_fd) const {
+	auto fastcgi = fcgi_clients.find(client_fd);
+	return file_transfers.count(client_fd) || listing_transfers.count(client_fd)
+		|| cgi_relays.count(client_fd) || proxy_clients.count(client_fd)
+		|| (fastcgi != fcgi_clients.end() && fcgi_states[fastcgi->second].relaying);
+}
+
+void Server::addPollFd(int fd, short events) {
+	EventLoop::added(fd);
+	poll_fds.push_back({fd, events, 0});
+}
+
+void Server::removePollFd(int fd) {
+	for (std::vector<struct pollfd>::iterator it = poll_fds.begin(); it != poll_fds.end(); ++it) {
+		if (it->fd == fd) {
+			poll_fds.erase(it);
+			break;
+		}
+	}
+}
+
 void Server::closeClient(int client_fd){
-	close (client_fd);
+	// Before the transfers that tell whether a stream's response is whole are dropped
+	if (client_fd >= H2_CLIENT_BASE)
+		endHttp2Stream(client_fd);
+	else
+		closeHttp2(client_fd);
+	if (cgi_relays.count(client_fd))
+		finishRelay(client_fd, true);
+	if (cgi_uploads.count(client_fd))
+		abortCGIUpload(client_fd, 0);
+	dropClientCGI(client_fd);
+	auto proxied = proxy_clients.find(client_fd);
+	if (proxied != proxy_clients.end())
+		finishProxy(proxied->second, false);
+	auto fastcgi = fcgi_clients.find(client_fd);
+	if (fastcgi != fcgi_clients.end())
+		abortFastCGI(fastcgi->second);
+	client_sessions.erase(client_fd);
+	cache_waits.erase(client_fd);
+	delayed_requests.erase(client_fd);
+	if (client_fd < H2_CLIENT_BASE) {
+		auto info = client_info.find(client_fd);
+		auto listener = clientConfigs.find(client_fd);
+		if (info != client_info.end() && listener != clientConfigs.end())
+			RateLimit::disconnect(info->second.peer, listener->second.port);
+		Capture::closed(client_fd);
+		Tls::close(client_fd);
+		close (client_fd);
+	}
+
+	auto transfer = file_transfers.find(client_fd);
+	if (transfer != file_transfers.end()) {
+		close(transfer->second.fd);
+		file_transfers.erase(transfer);
+	}
+	listing_transfers.erase(client_fd);
+	finishRequest(client_fd, false);
+	client_info.erase(client_fd);
+	responses.erase(client_fd);
+	response_offsets.erase(client_fd);
 
 	for (std::vector<struct pollfd>::iterator it = poll_fds.begin(); it != poll_fds.end(); ++it) {
 		if (it->fd == client_fd) {
@@ -250,92 +716,127 @@ void Server::cleanup () {
 		close(poll_fds[i].fd);
 	}
 	poll_fds.clear();
+	for (const auto& child : cgi_children) {
+		kill(child.first, SIGKILL);
+		waitpid(child.first, NULL, 0);
+	}
+	cgi_children.clear();
+	if (sigchld_pipe[1] >= 0)
+		close(sigchld_pipe[1]);
+	CGIWorkerPool::shutdown();
+	AccessLog::flush(true);
+	EventLoop::shutdown();
 }
 
 void Server::setupPorts() {
+	std::string error;
+	if (!checkPorts(*current_config, error) || !openListeners(*current_config, error)) {
+		std::cerr << "Error: " << error << "\n";
+		exit(1);
+	}
+	for (const ServerConfig& server : *current_config)
+		serverSockets[listeners[server.port]] = server;
+}
+
+bool Server::checkPorts(const std::vector<ServerConfig>& config, std::string& error) {
 	std::set<int> seenPorts;
-	for (std::vector<ServerConfig>::iterator it = config.begin(); it != config.end(); ++it) {
+	for (std::vector<ServerConfig>::const_iterator it = config.begin(); it != config.end(); ++it) {
 		if (!seenPorts.insert(it->port).second) {
-			std::cerr << "Error: Port " << it->port << " is declared more than once in the config.\n";
-			exit(1);
+			error = "Port " + std::to_string(it->port) + " is declared more than once in the config.";
+			return false;
 		}
 	}
+	return true;
+}
 
-	std::vector<ServerConfig>::iterator it = config.begin();
-	std::vector<ServerConfig>::iterator it_end = config.end();
-
-	while (it != it_end) {
-		if(std::find(uniqPorts.begin(), uniqPorts.end(), it->port) == uniqPorts.end()) {
-
-			it->sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if(it->sock_fd  < 0) {
-				std::cerr << "Failed to create socket\n";
-				exit(1);
-			}
-			int opt = 1;
-			if (setsockopt(it->sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-				perror("setsockopt");
-				exit(1);
-			}
+// Returns the listening socket, or -1 with `error` set
+int Server::openListener(int port, std::string& error) {
+	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock_fd < 0) {
+		error = "Failed to create socket";
+		return -1;
+	}
+	int opt = 1;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0
+		|| fcntl(sock_fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(sock_fd, F_SETFD, FD_CLOEXEC) < 0) {
+		error = std::string("Failed to set up socket: ") + strerror(errno);
+		close(sock_fd);
+		return -1;
+	}
 
-			if (fcntl(it->sock_fd, F_SETFL, O_NONBLOCK) < 0) {
-				perror("fcntl");
-				exit(1);
-			}
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
 
-			sockaddr_in addr;
-			memset(&addr, 0, sizeof(addr));
-			addr.sin_family = AF_INET;
-			addr.sin_addr.s_addr = INADDR_ANY;
-			addr.sin_port = htons(it->port);
+	if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		error = "Bind failed on port " + std::to_string(port) + ": " + strerror(errno);
+		close(sock_fd);
+		return -1;
+	}
+	if (listen(sock_fd, SOMAXCONN) < 0) {
+		error = "Listen failed on port " + std::to_string(port) + ": " + strerror(errno);
+		close(sock_fd);
+		return -1;
+	}
+	return sock_fd;
+}
 
-			if (bind(it->sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-				std::cerr << "Bind failed\n";
-				return ;
-			}
+// Listens on every port of `config` that has no socket yet. Ports that are
+// already open keep their socket, so nothing queued on them is lost. If one
+// fails, the sockets opened here are closed again.
+bool Server::openListeners(const std::vector<ServerConfig>& config, std::string& error) {
+	std::map<int, int> opened;
+	for (const ServerConfig& server : config) {
+		if (listeners.count(server.port) || opened.count(server.port))
+			continue;
+		int sock_fd = openListener(server.port, error);
+		if (sock_fd < 0) {
+			for (const auto& entry : opened)
+				close(entry.second);
+			return false;
+		}
+		opened[server.port] = sock_fd;
+	}
+	for (const auto& entry : opened) {
+		LOG_INFO("Middle Serv running on the port " << entry.first);
+		addPollFd(entry.second, POLLIN);
+		listeners[entry.first] = entry.second;
+	}
+	return true;
+}
 
-			if (listen(it->sock_fd, SOMAXCONN) < 0) {
-				std::cerr << "Listen failed\n";
-				return ;
-			}
-			std::cout << "Middle Serv running on the port " << it->port << std::endl;
-			struct pollfd pollfd = {it->sock_fd, POLLIN, 0};
-			poll_fds.push_back(pollfd);
-			ss_Fds.push_back(it->sock_fd);
-			uniqPorts.push_back(it->port);
-			serverSockets[it->sock_fd] = *it; //I added the server socket to map
-			// std::cout << "we pushed: "  << "sock_fd: " << it->sock_fd << ", port: " << it->port << std::endl;
+// Stops listening on the ports `config` no longer has, after accepting
+// whatever connections are already waiting on them
+void Server::closeListeners(const std::vector<ServerConfig>& config) {
+	std::set<int> ports;
+	for (const ServerConfig& server : config)
+		ports.insert(server.port);
+	for (auto it = listeners.begin(); it != listeners.end();) {
+		if (ports.count(it->first)) {
+			++it;
+			continue;
 		}
-		++it;
+		while (handleNewConnection(it->second))
+			;
+		removePollFd(it->second);
+		serverSockets.erase(it->second);
+		close(it->second);
+		LOG_INFO("Stopped listening on the port " << it->first);
+		listeners.erase(it++);
 	}
 }
 
-std::string Server::processCGIOutput(const std::string& output) {
-    size_t header_end = output.find("\r\n\r\n");
-    if (header_end == std::string::npos) {
+std::string Server::processCGIOutput(int client_fd, const std::string& output) {
+    Response res(configFor(client_fd));
+    size_t body_start;
+    int status_code;
+    std::string content_type;
+    long long content_length;
+    if (!res.parseCGIHeaders(output, body_start, status_code, content_type, content_length)) {
         // No headers, assume HTML content
-        Response res(config);
         return res.buildResponse(output, 200, "text/html");
     }
-
-    std::string headers = output.substr(0, header_end);
-    std::string body = output.substr(header_end + 4);
-    int status_code = 200;
-    std::string content_type = "text/html";
-
-    std::istringstream header_stream(headers);
-    std::string line;
-    while (std::getline(header_stream, line)) {
-        if (line.empty() || line == "\r") continue;
-        if (!line.empty() && line.back() == '\r') line.pop_back();
-        if (line.find("Status:") == 0) {
-            status_code = std::stoi(line.substr(7));
-        } else if (line.find("Content-Type:") == 0) {
-            content_type = line.substr(13);
-            content_type.erase(0, content_type.find_first_not_of(" \t"));
-        }
-    }
-
-    Response res(config);
-    return res.buildResponse(body, status_code, content_type);
+    return res.buildResponse(output.substr(body_start), status_code, content_type);
 }
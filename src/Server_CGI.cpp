@@ -0,0 +1,314 @@
+#include "../includes/Server.hpp"
+
+// Starts `job` now, or queues it while its location is at cgi_max_concurrency.
+// Returns 0 on success, otherwise the status code to answer with.
+int Server::submitCGI(const CGIJob& job) {
+    if (job.max_concurrency > 0 && cgi_running[job.location] >= job.max_concurrency) {
+        std::deque<CGIJob>& queue = cgi_queue[job.location];
+        if (queue.size() >= CGI_MAX_QUEUE)
+            return 503;
+        queue.push_back(job);
+        queue.back().queued_at = time(NULL);
+        return 0;
+    }
+    return launchCGI(job) ? 0 : 500;
+}
+
+// Spawns the script (or hands it to a warm worker) and registers its pipes
+// with the main poll loop
+bool Server::launchCGI(const CGIJob& job) {
+    CGIWorker worker;
+    std::string input = job.input;
+    if (job.pooled && CGIWorkerPool::take(job.argv[0], worker)) {
+        // Warm interpreter: it learns its environment from stdin
+        input = CGIWorkerPool::preamble(job.env) + job.input;
+    } else if (!spawnCGI(job.argv, job.env, worker)) {
+        perror("spawn CGI");
+        Metrics::cgi_spawn_failures++;
+        return false;
+    }
+    Metrics::cgi_spawns++;
+
+    CGIState state = {worker.pid, worker.stdin_fd, worker.stdout_fd, input, 0, "", job.client_fd,
+                      false, job.relay, false, job.stream_body, job.cache_key};
+    addPollFd(worker.stdout_fd, POLLIN);
+    cgi_states[worker.stdout_fd] = state;
+
+    // Write what fits now; the rest goes out on POLLOUT of the stdin pipe
+    bool drained = writeCGIInput(cgi_states[worker.stdout_fd]);
+    if (!drained)
+        addPollFd(worker.stdin_fd, POLLOUT);
+    if (job.stream_body) {
+        // Read more of the body only once the pipe has taken what we have
+        cgi_uploads[job.client_fd] = worker.stdout_fd;
+        setPollEvents(job.client_fd, drained ? POLLIN : 0);
+    }
+
+    CGIChild child = {job.location, worker.stdout_fd, time(NULL) + job.timeout, 0};
+    cgi_children[worker.pid] = child;
+    cgi_running[job.location]++;
+    return true;
+}
+
+// Writes as much of input_buffer as the stdin pipe takes. Once all of it is
+// out the buffer is released, and the pipe closed so the script sees EOF
+// unless more of the body is still to come. Returns false if the pipe is full.
+bool Server::writeCGIInput(CGIState& state) {
+    std::string& input = state.input_buffer;
+    while (state.input_offset < input.size()) {
+        ssize_t n = write(state.stdin_fd, input.data() + state.input_offset,
+                          input.size() - state.input_offset);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        if (n < 0) {
+            perror("write CGI pipe");
+            state.stdin_streaming = false; // Script stopped reading, drop the rest
+            break;
+        }
+        state.input_offset += n;
+    }
+    input.clear();
+    state.input_offset = 0;
+    if (!state.stdin_streaming && state.stdin_fd > 0) {
+        close(state.stdin_fd);
+        removePollFd(state.stdin_fd);
+        state.stdin_fd = -1;
+    }
+    return true;
+}
+
+// Closes both pipes of a CGI and forgets its state. The process itself is
+// left to reapChildren() (and checkCGITimeouts() if it does not exit).
+// A cache fill it had not completed is given up.
+void Server::dropCGIState(int stdout_fd) {
+    auto it = cgi_states.find(stdout_fd);
+    if (it == cgi_states.end())
+        return;
+    if (it->second.stdin_fd > 0) {
+        close(it->second.stdin_fd);
+        removePollFd(it->second.stdin_fd);
+    }
+    removePollFd(stdout_fd);
+    close(stdout_fd);
+    std::string cache_key = it->second.cache_key;
+    cgi_states.erase(it);
+    if (!cache_key.empty())
+        abortCacheFill(cache_key, false);
+}
+
+// The client has gone, so its fd number may soon belong to another one:
+// its queued jobs are dropped and a script still buffering its answer is
+// stopped. A script filling the response cache runs on for the requests
+// waiting on it, with no client of its own.
+void Server::dropClientCGI(int client_fd) {
+    std::vector<std::string> aborted_fills;
+    for (auto& queue : cgi_queue) {
+        std::deque<CGIJob>& jobs = queue.second;
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            if (it->client_fd != client_fd) {
+                ++it;
+                continue;
+            }
+            if (!it->cache_key.empty())
+                aborted_fills.push_back(it->cache_key);
+            it = jobs.erase(it);
+        }
+    }
+    std::vector<int> stopped;
+    for (auto& entry : cgi_states) {
+        CGIState& state = entry.second;
+        if (state.client_fd != client_fd || state.relaying)
+            continue;
+        state.client_fd = -1;
+        state.relay = RelayOff;
+        if (state.cache_key.empty())
+            stopped.push_back(entry.first);
+    }
+    for (int stdout_fd : stopped) {
+        terminateCGI(cgi_states[stdout_fd].pid);
+        dropCGIState(stdout_fd);
+    }
+    // Last, as a waiter routed again may queue a job of its own
+    for (const std::string& key : aborted_fills)
+        abortCacheFill(key, false);
+}
+
+void Server::sigchldHandler(int signum) {
+    (void)signum;
+    int saved_errno = errno;
+    ssize_t n = write(sigchld_pipe[1], "", 1); // Full pipe: a wakeup is already pending
+    (void)n;
+    errno = saved_errno;
+}
+
+// Runs when the self-pipe is readable: collects every exited child without
+// blocking and gives its concurrency slot to the next queued request.
+void Server::reapChildren() {
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        auto it = cgi_children.find(pid);
+        if (it == cgi_children.end())
+            continue; // A pool worker that died while idle
+        std::string location = it->second.location;
+        cgi_children.erase(it);
+        if (cgi_running[location] > 0)
+            cgi_running[location]--;
+        startQueuedCGI(location);
+    }
+}
+
+void Server::startQueuedCGI(const std::string& location) {
+    auto queue_it = cgi_queue.find(location);
+    if (queue_it == cgi_queue.end())
+        return;
+    std::deque<CGIJob>& queue = queue_it->second;
+    while (!queue.empty()) {
+        if (queue.front().max_concurrency > 0 && cgi_running[location] >= queue.front().max_concurrency)
+            break;
+        CGIJob job = queue.front();
+        queue.pop_front();
+        if (clientConfigs.find(job.client_fd) == clientConfigs.end()) {
+            if (!job.cache_key.empty())
+                abortCacheFill(job.cache_key, false);
+        } else if (!launchCGI(job)) {
+            deliverBackendResponse(job.client_fd, job.cache_key,
+                                   Response(configFor(job.client_fd)).getErrorResponse(500));
+        }
+    }
+}
+
+// SIGTERM for a script still running past its cgi_timeout, SIGKILL if it
+// ignores that for CGI_KILL_GRACE seconds
+void Server::terminateCGI(pid_t pid) {
+    auto it = cgi_children.find(pid);
+    if (it == cgi_children.end() || it->second.signals_sent > 0)
+        return;
+    kill(pid, SIGTERM);
+    it->second.signals_sent = 1;
+    it->second.deadline = time(NULL) + CGI_KILL_GRACE;
+}
+
+// Called once per loop iteration; poll() wakes at least every second
+void Server::checkCGITimeouts() {
+    time_t now = time(NULL);
+    for (auto it = cgi_children.begin(); it != cgi_children.end(); ++it) {
+        CGIChild& child = it->second;
+        if (now < child.deadline || child.signals_sent == 2)
+            continue;
+        if (child.signals_sent == 1) {
+            kill(it->first, SIGKILL);
+            child.signals_sent = 2;
+            continue;
+        }
+        terminateCGI(it->first);
+        Metrics::cgi_timeouts++;
+        auto state = cgi_states.find(child.stdout_fd);
+        if (state == cgi_states.end() || state->second.pid != it->first)
+            continue; // Output already complete, only the process lingers
+        int client_fd = state->second.client_fd;
+        if (state->second.relaying) {
+            closeClient(client_fd); // Headers are out, a 504 is no longer possible
+        } else {
+            // Requests waiting on its cache fill get the 504 too, not another run
+            std::string cache_key;
+            cache_key.swap(state->second.cache_key);
+            dropCGIState(child.stdout_fd);
+            deliverBackendResponse(client_fd, cache_key, Response(configFor(client_fd)).getErrorResponse(504));
+        }
+    }
+
+    for (auto& queue : cgi_queue) {
+        while (!queue.second.empty() && now - queue.second.front().queued_at >= queue.second.front().timeout) {
+            CGIJob job = queue.second.front();
+            queue.second.pop_front();
+            deliverBackendResponse(job.client_fd, job.cache_key,
+                                   Response(configFor(job.client_fd)).getErrorResponse(504));
+        }
+    }
+}
+
+// Moves the next piece of a streamed request body from the client socket
+// to the CGI's stdin. Reading stops while the pipe still holds the previous
+// piece, so at most one buffer of body is in memory per request.
+void Server::handleCGIUpload(int client_fd, ClientSession& session) {
+    auto link = cgi_uploads.find(client_fd);
+    if (link == cgi_uploads.end()) {
+        setPollEvents(client_fd, 0); // Still queued for a cgi_max_concurrency slot
+        return;
+    }
+    auto cgi_it = cgi_states.find(link->second);
+    bool open = cgi_it != cgi_states.end() && cgi_it->second.client_fd == client_fd
+                && cgi_it->second.stdin_fd > 0;
+    if (open && !cgi_it->second.input_buffer.empty()) {
+        setPollEvents(client_fd, 0);
+        return;
+    }
+
+    char buf[BUF_SIZE];
+    size_t want = sizeof(buf);
+    if (!session.chunked && session.body_left < want)
+        want = session.body_left;
+    ssize_t n = recvFromClient(client_fd, buf, want);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        closeClient(client_fd);
+        return;
+    }
+    std::string data;
+    if (session.chunked) {
+        session.chunked_body.feed(buf, n, &data);
+        if (session.chunked_body.failed()) {
+            abortCGIUpload(client_fd, 400);
+            return;
+        }
+        if (session.chunked_body.decodedSize() > configFor(client_fd)[0].client_max_body_size) {
+            abortCGIUpload(client_fd, 413);
+            return;
+        }
+    } else {
+        data.assign(buf, n);
+        session.body_left -= n;
+    }
+    bool complete = session.chunked ? session.chunked_body.done() : session.body_left == 0;
+    if (complete) {
+        cgi_uploads.erase(link);
+        client_sessions.erase(client_fd);
+        auto record = request_records.find(client_fd);
+        if (record != request_records.end())
+            record->second.body_done = monotonic_micros();
+    }
+    if (!open)
+        return; // Script gone or done reading: the rest of the body is dropped
+
+    CGIState& state = cgi_it->second;
+    state.input_buffer.swap(data);
+    state.input_offset = 0;
+    if (complete)
+        state.stdin_streaming = false;
+    if (!writeCGIInput(state)) {
+        addPollFd(state.stdin_fd, POLLOUT);
+        setPollEvents(client_fd, 0);
+    }
+}
+
+// Stops a body upload half way: the script gets SIGTERM rather than a
+// truncated body, and the client `status` (none if it is gone, status 0).
+void Server::abortCGIUpload(int client_fd, int status) {
+    auto link = cgi_uploads.find(client_fd);
+    if (link != cgi_uploads.end()) {
+        auto cgi_it = cgi_states.find(link->second);
+        if (cgi_it != cgi_states.end() && cgi_it->second.client_fd == client_fd
+            && cgi_it->second.stdin_streaming) {
+            terminateCGI(cgi_it->second.pid);
+            dropCGIState(link->second);
+        }
+        cgi_uploads.erase(link);
+    }
+    client_sessions.erase(client_fd);
+    if (status != 0)
+        deliverResponse(client_fd, Response(configFor(client_fd)).getErrorResponse(status));
+}
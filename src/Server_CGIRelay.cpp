@@ -0,0 +1,135 @@
+#include "../includes/Server.hpp"
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+// Once the CGI's header block is complete, sends the response head and
+// switches the state to relaying: from then on the body goes from the
+// stdout pipe to the client as the socket accepts it, instead of being
+// collected in output_buffer until the script exits.
+bool Server::startCGIRelay(std::map<int, CGIState>::iterator cgi_it) {
+    CGIState& state = cgi_it->second;
+    if (state.relaying)
+        return true;
+    if (state.stdin_streaming)
+        return false; // The client socket is still needed for reading the body
+
+    Response res(configFor(state.client_fd));
+    size_t body_start;
+    int status_code;
+    std::string content_type;
+    long long content_length;
+    if (!res.parseCGIHeaders(state.output_buffer, body_start, status_code, content_type, content_length)) {
+        if (state.output_buffer.size() > RELAY_MAX_HEADER)
+            state.relay = RelayOff; // Probably no headers at all: answer at EOF as before
+        return false;
+    }
+    if (clientConfigs.find(state.client_fd) == clientConfigs.end())
+        return false;
+
+    // Without a Content-Length from the script the body ends when we close
+    size_t length = content_length >= 0 ? (size_t)content_length : LENGTH_UNTIL_CLOSE;
+    std::string head = res.buildHeaders(length, status_code, content_type);
+    head.append(state.output_buffer, body_start, std::string::npos);
+    state.output_buffer.clear();
+    deliverResponse(state.client_fd, head);
+
+    state.relaying = true;
+    if (state.relay == RelaySplice && !plainSocket(state.client_fd))
+        state.relay = RelayCopy; // splice() would bypass the encryption or the framing
+    cgi_relays[state.client_fd] = cgi_it->first;
+    removePollFd(cgi_it->first); // Polled again only when the client has drained it
+#ifdef F_SETPIPE_SZ
+    // A bigger pipe lets the script run ahead of a slow client for longer
+    fcntl(cgi_it->first, F_SETPIPE_SZ, RELAY_CHUNK);
+#endif
+    return true;
+}
+
+// Moves the next part of a relayed CGI body to the client. Returns false
+// on a socket error; finishes the relay when the script closes stdout.
+bool Server::sendRelayBody(int client_fd) {
+    auto it = cgi_relays.find(client_fd);
+    if (it == cgi_relays.end())
+        return true;
+    int pipe_fd = it->second;
+    CGIState& state = cgi_states[pipe_fd];
+    ssize_t n;
+
+#ifdef __linux__
+    if (state.relay == RelaySplice) {
+        n = splice(pipe_fd, NULL, client_fd, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            countSent(client_fd, n);
+    } else
+#endif
+    {
+        char buf[BUF_SIZE];
+        n = read(pipe_fd, buf, sizeof(buf));
+        if (n > 0) {
+            ssize_t sent = sendToClient(client_fd, buf, n, 0);
+            if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            if (sent < 0)
+                sent = 0;
+            countSent(client_fd, sent);
+            if (sent < n) {
+                // Keep the rest in front of the next read
+                std::string& pending = responses[client_fd];
+                size_t& offset = response_offsets[client_fd];
+                pending.erase(0, offset);
+                offset = 0;
+                pending.append(buf + sent, n - sent);
+            }
+        }
+    }
+
+    if (n == 0) {
+        finishRelay(client_fd, false);
+        return true;
+    }
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        int queued = 0;
+        if (state.relay == RelaySplice && ioctl(pipe_fd, FIONREAD, &queued) == 0 && queued > 0)
+            return true; // The socket is full, wait for POLLOUT
+        // Nothing from the script yet: wait on the pipe instead of the socket
+        setPollEvents(client_fd, 0);
+        removePollFd(pipe_fd);
+        addPollFd(pipe_fd, POLLIN);
+    }
+    return true;
+}
+
+// Closes the script's pipes. An aborted relay (client gone) also
+// terminates the script rather than letting it block on a pipe nobody reads.
+void Server::finishRelay(int client_fd, bool aborted) {
+    auto it = cgi_relays.find(client_fd);
+    if (it == cgi_relays.end())
+        return;
+    int pipe_fd = it->second;
+    cgi_relays.erase(it);
+
+    auto cgi_it = cgi_states.find(pipe_fd);
+    if (cgi_it == cgi_states.end())
+        return;
+    if (aborted)
+        terminateCGI(cgi_it->second.pid);
+    dropCGIState(pipe_fd);
+}
+
+void Server::setPollEvents(int fd, short events) {
+    if (fd >= H2_CLIENT_BASE) {
+        setStreamEvents(fd, events);
+        return;
+    }
+    for (auto& pfd : poll_fds) {
+        if (pfd.fd == fd) {
+            pfd.events = events;
+            pfd.revents = 0;
+            break;
+        }
+    }
+}
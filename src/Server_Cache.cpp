@@ -0,0 +1,44 @@
+#include "../includes/Server.hpp"
+
+// Queues a backend's answer for its client and, for a cache fill, stores
+// it and answers the requests that waited for it
+void Server::deliverBackendResponse(int client_fd, const std::string& cache_key, const std::string& response) {
+    if (!cache_key.empty())
+        completeCacheFill(cache_key, response);
+    deliverResponse(client_fd, response);
+}
+
+void Server::completeCacheFill(const std::string& key, const std::string& response) {
+    bool shared = ResponseCache::complete(key, response);
+    releaseCacheWaiters(key, shared ? &response : NULL);
+}
+
+void Server::abortCacheFill(const std::string& key, bool pass) {
+    ResponseCache::abort(key, pass);
+    releaseCacheWaiters(key, NULL);
+}
+
+// Gives the waiters of `key` the fill's response, or, when there is none
+// they may have, routes their requests again: one becomes the next fill
+// and the others wait for it, or all of them pass to the backend.
+void Server::releaseCacheWaiters(const std::string& key, const std::string* response) {
+    auto it = cache_waiters.find(key);
+    if (it == cache_waiters.end())
+        return;
+    std::vector<int> waiters;
+    waiters.swap(it->second);
+    cache_waiters.erase(it);
+    for (int client_fd : waiters) {
+        auto wait = cache_waits.find(client_fd);
+        if (wait == cache_waits.end() || wait->second.key != key)
+            continue; // Left meanwhile
+        ClientSession session = wait->second.session;
+        cache_waits.erase(wait);
+        if (response) {
+            deliverResponse(client_fd, *response);
+        } else {
+            current_client_fd = client_fd;
+            processRequest(client_fd, session);
+        }
+    }
+}
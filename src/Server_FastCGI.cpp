@@ -0,0 +1,266 @@
+#include "../includes/Server.hpp"
+
+// Sends an encoded request to `backend` on a pooled or new connection.
+// Called from Response while routing, like executeCGI registers its pipes.
+bool Server::startFastCGI(const std::string& backend, const std::string& request, int client_fd,
+                          const std::string& cache_key, time_t connect_timeout, time_t read_timeout) {
+    bool reused, in_progress;
+    int fd = FastCGI::acquire(backend, reused, in_progress);
+    if (fd < 0)
+        return false;
+    FastCGIState state = {backend, client_fd, request, 0, "", "", false, false, in_progress, reused, cache_key,
+                          time(NULL) + (in_progress ? connect_timeout : read_timeout),
+                          connect_timeout, read_timeout};
+    fcgi_states[fd] = state;
+    fcgi_clients[client_fd] = fd;
+    addPollFd(fd, POLLIN | POLLOUT);
+    return true;
+}
+
+void Server::handleFastCGIEvents(size_t i) {
+    int fd = poll_fds[i].fd;
+    short revents = poll_fds[i].revents;
+    FastCGIState& state = fcgi_states[fd];
+    bool nothing_received = !state.relaying && state.input.empty() && state.stdout_data.empty();
+
+    if (state.connecting) {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            errno = err;
+            perror("connect FastCGI backend");
+            finishFastCGI(fd, false);
+            return;
+        }
+        state.connecting = false;
+        state.deadline = time(NULL) + state.read_timeout;
+    }
+
+    if ((revents & POLLOUT) && state.request_offset < state.request.size()) {
+        ssize_t n = send(fd, state.request.c_str() + state.request_offset,
+                         state.request.size() - state.request_offset, 0);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // A pooled connection the backend has just dropped: try a fresh one
+            if (state.reused && nothing_received)
+                retryFastCGI(fd);
+            else
+                finishFastCGI(fd, false);
+            return;
+        }
+        if (n > 0)
+            state.request_offset += n;
+        if (state.request_offset == state.request.size())
+            poll_fds[i].events = POLLIN;
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        char buf[BUF_SIZE];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            if (state.relaying)
+                closeClient(state.client_fd); // Body cut short
+            else if (state.reused && nothing_received)
+                retryFastCGI(fd);
+            else
+                finishFastCGI(fd, false);
+            return;
+        }
+        state.input.append(buf, n);
+        state.deadline = time(NULL) + state.read_timeout;
+
+        size_t pos = 0;
+        unsigned char type;
+        std::string content;
+        while (!state.complete && FastCGI::nextRecord(state.input, pos, type, content)) {
+            if (type == FCGI_STDOUT)
+                state.stdout_data += content;
+            else if (type == FCGI_STDERR)
+                std::cerr << content;
+            else if (type == FCGI_END_REQUEST)
+                state.complete = true;
+        }
+        state.input.erase(0, pos);
+
+        if (!state.relaying) {
+            if (state.complete) {
+                finishFastCGI(fd, true);
+                return;
+            }
+            if (!startFastCGIRelay(state)) {
+                // No header block where one should have ended
+                if (state.cache_key.empty() && state.stdout_data.size() > RELAY_MAX_HEADER)
+                    finishFastCGI(fd, false);
+                return;
+            }
+        }
+        if (state.relaying && (state.complete || !state.stdout_data.empty())) {
+            // Polled again only when the client has drained it
+            state.deadline = 0;
+            removePollFd(fd);
+            enableWriteEvents(state.client_fd);
+        }
+    }
+}
+
+// Once the backend's header block is complete, sends the response head
+// with the body so far; the rest is relayed as FCGI_STDOUT arrives, so
+// only one read of it is held at a time. A cache fill needs the whole
+// answer: it is kept up to RESPONSE_CACHE_MAX_ENTRY, and past that the
+// fill is given up and the answer relayed.
+bool Server::startFastCGIRelay(FastCGIState& state) {
+    if (!state.cache_key.empty()) {
+        if (state.stdout_data.size() <= RESPONSE_CACHE_MAX_ENTRY)
+            return false;
+        std::string key;
+        key.swap(state.cache_key);
+        abortCacheFill(key, true);
+    }
+
+    Response res(configFor(state.client_fd));
+    size_t body_start;
+    int status_code;
+    std::string content_type;
+    long long content_length;
+    if (!res.parseCGIHeaders(state.stdout_data, body_start, status_code, content_type, content_length))
+        return false;
+
+    // Without a Content-Length from the backend the body ends when we close
+    size_t length = content_length >= 0 ? (size_t)content_length : LENGTH_UNTIL_CLOSE;
+    std::string head = res.buildHeaders(length, status_code, content_type);
+    head.append(state.stdout_data, body_start, std::string::npos);
+    state.stdout_data.clear();
+    deliverResponse(state.client_fd, head);
+    state.relaying = true;
+    return true;
+}
+
+// Moves the FCGI_STDOUT content read so far to the client, then goes back
+// to reading the backend. Returns false on a socket error.
+bool Server::sendFastCGIBody(int client_fd) {
+    auto link = fcgi_clients.find(client_fd);
+    if (link == fcgi_clients.end())
+        return true;
+    int fd = link->second;
+    FastCGIState& state = fcgi_states[fd];
+    if (!state.relaying)
+        return true;
+
+    if (!state.stdout_data.empty()) {
+        ssize_t sent = sendToClient(client_fd, state.stdout_data.data(), state.stdout_data.size(), 0);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (sent < 0)
+            sent = 0;
+        countSent(client_fd, sent);
+        if ((size_t)sent < state.stdout_data.size()) {
+            // Keep the rest in front of the next read
+            std::string& pending = responses[client_fd];
+            size_t& offset = response_offsets[client_fd];
+            pending.erase(0, offset);
+            offset = 0;
+            pending.append(state.stdout_data, sent, std::string::npos);
+            state.stdout_data.clear();
+            return true;
+        }
+        state.stdout_data.clear();
+    }
+    if (state.complete) {
+        finishFastCGI(fd, true);
+        return true;
+    }
+    // Nothing from the backend yet: wait on it instead of the socket
+    setPollEvents(client_fd, 0);
+    removePollFd(fd);
+    addPollFd(fd, state.request_offset < state.request.size() ? POLLIN | POLLOUT : POLLIN);
+    state.deadline = time(NULL) + state.read_timeout;
+    return true;
+}
+
+// Ends the request on `fd`. A completed request returns the connection to
+// the pool; anything else closes it and answers `status`, unless the
+// response is already being relayed.
+void Server::finishFastCGI(int fd, bool completed, int status) {
+    FastCGIState state = fcgi_states[fd];
+    fcgi_states.erase(fd);
+    fcgi_clients.erase(state.client_fd);
+    removePollFd(fd);
+    if (completed)
+        FastCGI::release(state.backend, fd);
+    else
+        close(fd);
+
+    if (state.relaying)
+        return;
+    if (completed)
+        deliverBackendResponse(state.client_fd, state.cache_key, processCGIOutput(state.client_fd, state.stdout_data));
+    else
+        deliverBackendResponse(state.client_fd, state.cache_key,
+                               Response(configFor(state.client_fd)).getErrorResponse(status));
+}
+
+void Server::retryFastCGI(int fd) {
+    FastCGIState state = fcgi_states[fd];
+    fcgi_states.erase(fd);
+    fcgi_clients.erase(state.client_fd);
+    removePollFd(fd);
+    close(fd);
+
+    bool in_progress;
+    int new_fd = FastCGI::connectBackend(state.backend, in_progress);
+    if (new_fd < 0) {
+        deliverBackendResponse(state.client_fd, state.cache_key,
+                               Response(configFor(state.client_fd)).getErrorResponse(502));
+        return;
+    }
+    state.request_offset = 0;
+    state.input.clear();
+    state.stdout_data.clear();
+    state.connecting = in_progress;
+    state.reused = false;
+    state.deadline = time(NULL) + (in_progress ? state.connect_timeout : state.read_timeout);
+    fcgi_states[new_fd] = state;
+    fcgi_clients[state.client_fd] = new_fd;
+    addPollFd(new_fd, POLLIN | POLLOUT);
+}
+
+// The client of the request on `fd` has gone: the connection is closed
+// mid-request, so the backend's answer cannot reach whoever gets its fd
+// number next. A cache fill it was making is given up.
+void Server::abortFastCGI(int fd) {
+    auto it = fcgi_states.find(fd);
+    if (it == fcgi_states.end())
+        return;
+    std::string cache_key = it->second.cache_key;
+    fcgi_clients.erase(it->second.client_fd);
+    fcgi_states.erase(it);
+    removePollFd(fd);
+    close(fd);
+    if (!cache_key.empty())
+        abortCacheFill(cache_key, false);
+}
+
+// fastcgi_connect_timeout and fastcgi_read_timeout: the client gets 504,
+// or is cut off if its response is already being relayed
+void Server::checkFastCGITimeouts() {
+    time_t now = time(NULL);
+    std::vector<int> expired;
+    for (const auto& entry : fcgi_states) {
+        if (entry.second.deadline != 0 && now >= entry.second.deadline)
+            expired.push_back(entry.first);
+    }
+    for (int fd : expired) {
+        auto it = fcgi_states.find(fd);
+        if (it == fcgi_states.end())
+            continue;
+        LOG_WARN("FastCGI backend " << it->second.backend << " timed out");
+        if (it->second.relaying)
+            closeClient(it->second.client_fd);
+        else
+            finishFastCGI(fd, false, 504);
+    }
+}
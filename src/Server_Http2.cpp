@@ -0,0 +1,895 @@
+#include "../includes/Server.hpp"
+#include <climits>
+#include <strings.h>
+
+std::map<int, H2Connection> Server::h2_connections;
+std::map<int, std::pair<int, uint32_t> > Server::h2_clients;
+int Server::h2_next_client = H2_CLIENT_BASE;
+
+// Socket a client id is served on: its connection for a stream
+int Server::clientSocket(int client_fd) {
+    auto it = h2_clients.find(client_fd);
+    return it == h2_clients.end() ? client_fd : it->second.first;
+}
+
+// Whether the kernel may write to the client itself with sendfile() or
+// splice(): not through TLS, and not into a stream's DATA frames
+bool Server::plainSocket(int client_fd) {
+    return client_fd < H2_CLIENT_BASE && !Tls::active(client_fd);
+}
+
+// send() for any client: a socket, a TLS connection or an HTTP/2 stream
+ssize_t Server::sendToClient(int client_fd, const void* buf, size_t len, int flags) {
+    if (client_fd >= H2_CLIENT_BASE)
+        return sendToStream(client_fd, (const char*)buf, len);
+    return Tls::send(client_fd, buf, len, flags);
+}
+
+// recv() for any client: a socket, a TLS connection or a stream's body
+ssize_t Server::recvFromClient(int client_fd, char* buf, size_t len) {
+    if (client_fd >= H2_CLIENT_BASE)
+        return recvFromStream(client_fd, buf, len);
+    ssize_t n = Tls::recv(client_fd, buf, len);
+    if (n > 0) {
+        Metrics::bytes_in += n;
+        Capture::received(client_fd, buf, n);
+    }
+    return n;
+}
+
+// Value of a request header, "" when absent
+static std::string headerValue(const std::string& head, const std::string& name) {
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos) {
+        size_t start = pos + 2;
+        size_t end = head.find("\r\n", start);
+        if (end == std::string::npos || end == start)
+            break;
+        pos = end;
+        size_t colon = head.find(':', start);
+        if (colon < end && colon - start == name.size() && strncasecmp(head.c_str() + start, name.c_str(), name.size()) == 0) {
+            size_t value = head.find_first_not_of(" \t", colon + 1);
+            return value < end ? head.substr(value, end - value) : "";
+        }
+    }
+    return "";
+}
+
+// Makes the connection an HTTP/2 one, with `input` as what it has sent so
+// far, and queues our SETTINGS
+H2Connection& Server::startHttp2(int client_fd, const std::string& input) {
+    H2Connection& conn = h2_connections[client_fd];
+    Http2::settings(conn.output);
+    conn.input = input;
+    client_sessions.erase(client_fd);
+    Metrics::http2_connections++;
+    setPollEvents(client_fd, POLLIN | POLLOUT);
+    return conn;
+}
+
+// A connection that opens with the HTTP/2 preface (prior knowledge, RFC
+// 9113 3.3). True when it was taken over, or when too little has come to tell.
+bool Server::detectHttp2(int client_fd, ClientSession& session) {
+    size_t len = session.buffer.size() < H2_PREFACE_LEN ? session.buffer.size() : H2_PREFACE_LEN;
+    if (!clientConfigs[client_fd].http2 || session.buffer.compare(0, len, H2_PREFACE, len) != 0)
+        return false;
+    if (len < H2_PREFACE_LEN)
+        return true;
+    std::string input;
+    input.swap(session.buffer);
+    startHttp2(client_fd, input);
+    processHttp2Input(client_fd);
+    writeHttp2(client_fd);
+    return true;
+}
+
+// h2c upgrade (RFC 7540 3.2) of a request without a body: 101, then the
+// request is answered as stream 1 of the HTTP/2 connection
+bool Server::upgradeHttp2(int client_fd, ClientSession& session) {
+    if (!clientConfigs[client_fd].http2 || Tls::active(client_fd) || session.chunked || session.content_length > 0)
+        return false;
+    size_t header_end = session.buffer.find("\r\n\r\n") + 4;
+    std::string head = session.buffer.substr(0, header_end);
+    std::string upgrade = headerValue(head, "Upgrade");
+    std::string settings;
+    if (strcasecmp(upgrade.c_str(), "h2c") != 0
+        || !Http2::decodeSettingsHeader(headerValue(head, "HTTP2-Settings"), settings))
+        return false;
+
+    ClientSession request = session;
+    request.buffer = head;
+    H2Connection& conn = startHttp2(client_fd, session.buffer.substr(header_end));
+    conn.output.insert(0, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    if (Http2::applySettings(conn, (const uint8_t*)settings.data(), settings.size()) != H2NoError) {
+        failHttp2(conn, H2ProtocolError);
+    } else {
+        conn.last_stream = 1;
+        H2Stream& stream = conn.streams[1];
+        stream.method = head.substr(0, head.find(' '));
+        stream.remote_closed = true;
+        stream.send_window = conn.peer_window;
+        runHttp2Request(client_fd, conn, 1, request);
+    }
+    writeHttp2(client_fd);
+    return true;
+}
+
+void Server::handleHttp2Events(size_t i) {
+    int fd = poll_fds[i].fd;
+    short revents = poll_fds[i].revents;
+    if (revents & POLLIN) {
+        char buf[BUF_SIZE];
+        ssize_t n = Tls::recv(fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeClient(fd);
+            return;
+        }
+        if (n > 0) {
+            Metrics::bytes_in += n;
+            Capture::received(fd, buf, n);
+            h2_connections[fd].input.append(buf, n);
+            processHttp2Input(fd);
+        }
+    } else if (!(revents & POLLOUT)) {
+        closeClient(fd); // POLLERR or POLLHUP alone
+        return;
+    }
+    writeHttp2(fd);
+}
+
+// Handles every complete frame read so far
+void Server::processHttp2Input(int client_fd) {
+    H2Connection& conn = h2_connections[client_fd];
+    size_t pos = 0;
+    if (!conn.preface) {
+        size_t len = conn.input.size() < H2_PREFACE_LEN ? conn.input.size() : H2_PREFACE_LEN;
+        if (conn.input.compare(0, len, H2_PREFACE, len) != 0)
+            failHttp2(conn, H2ProtocolError);
+        if (conn.failed || len < H2_PREFACE_LEN)
+            return;
+        conn.preface = true;
+        pos = H2_PREFACE_LEN;
+    }
+    while (!conn.failed && conn.input.size() - pos >= H2_FRAME_HEADER) {
+        const uint8_t* p = (const uint8_t*)conn.input.data() + pos;
+        size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (len > H2_MAX_FRAME) {
+            failHttp2(conn, H2FrameSizeError);
+            break;
+        }
+        if (conn.input.size() - pos < H2_FRAME_HEADER + len)
+            break;
+        handleHttp2Frame(client_fd, conn, p[3], p[4], Http2::read32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len);
+        pos += H2_FRAME_HEADER + len;
+    }
+    if (conn.failed)
+        conn.input.clear();
+    else
+        conn.input.erase(0, pos);
+}
+
+// Counts a RST_STREAM from the client: true past H2_MAX_RESETS in a second
+static bool resetFlood(H2Connection& conn) {
+    uint64_t now = monotonic_micros();
+    if (now - conn.reset_period >= 1000000) {
+        conn.reset_period = now;
+        conn.resets = 0;
+    }
+    return ++conn.resets > H2_MAX_RESETS;
+}
+
+void Server::handleHttp2Frame(int client_fd, H2Connection& conn, uint8_t type, uint8_t flags, uint32_t id,
+                              const uint8_t* payload, size_t len) {
+    // A header block is not interleaved with any other frame (6.10)
+    if (conn.header_stream != 0 && (type != H2Continuation || id != conn.header_stream)) {
+        failHttp2(conn, H2ProtocolError);
+        return;
+    }
+    switch (type) {
+        case H2Data:
+            readHttp2Data(client_fd, conn, flags, id, payload, len);
+            break;
+        case H2Headers: {
+            if (id == 0 || !(id & 1)) {
+                failHttp2(conn, H2ProtocolError);
+                break;
+            }
+            size_t start = 0, padding = 0;
+            if (flags & H2_FLAG_PADDED) {
+                padding = len > 0 ? payload[0] : 0;
+                start = 1;
+            }
+            if (flags & H2_FLAG_PRIORITY)
+                start += 5; // Priority is left to the client's own ordering
+            if (start + padding > len) {
+                failHttp2(conn, H2ProtocolError);
+                break;
+            }
+            conn.header_stream = id;
+            conn.header_end_stream = flags & H2_FLAG_END_STREAM;
+            conn.header_block.clear();
+            readHttp2HeaderBlock(client_fd, conn, flags, payload + start, len - start - padding);
+            break;
+        }
+        case H2Continuation:
+            if (conn.header_stream == 0)
+                failHttp2(conn, H2ProtocolError);
+            else
+                readHttp2HeaderBlock(client_fd, conn, flags, payload, len);
+            break;
+        case H2Priority:
+            if (id == 0)
+                failHttp2(conn, H2ProtocolError);
+            else if (len != 5)
+                resetHttp2Stream(conn, id, H2FrameSizeError);
+            break;
+        case H2RstStream:
+            if (id == 0 || id > conn.last_stream)
+                failHttp2(conn, H2ProtocolError);
+            else if (len != 4)
+                failHttp2(conn, H2FrameSizeError);
+            else if (resetFlood(conn))
+                failHttp2(conn, H2EnhanceYourCalm); // Streams opened only to be reset
+            else
+                cancelHttp2Stream(conn, id);
+            break;
+        case H2Settings:
+            if (id != 0) {
+                failHttp2(conn, H2ProtocolError);
+            } else if (flags & H2_FLAG_ACK) {
+                if (len != 0)
+                    failHttp2(conn, H2FrameSizeError);
+            } else if (len % 6 != 0) {
+                failHttp2(conn, H2FrameSizeError);
+            } else {
+                uint32_t error = Http2::applySettings(conn, payload, len);
+                if (error != H2NoError)
+                    failHttp2(conn, error);
+                else
+                    Http2::frame(conn.output, H2Settings, H2_FLAG_ACK, 0, "", 0);
+            }
+            break;
+        case H2Ping:
+            if (id != 0)
+                failHttp2(conn, H2ProtocolError);
+            else if (len != 8)
+                failHttp2(conn, H2FrameSizeError);
+            else if (!(flags & H2_FLAG_ACK))
+                Http2::frame(conn.output, H2Ping, H2_FLAG_ACK, 0, (const char*)payload, len);
+            break;
+        case H2Goaway:
+            if (id != 0)
+                failHttp2(conn, H2ProtocolError);
+            else
+                conn.closing = true; // Streams already open are still answered
+            break;
+        case H2WindowUpdate:
+            readHttp2WindowUpdate(conn, id, payload, len);
+            break;
+        case H2PushPromise:
+            failHttp2(conn, H2ProtocolError); // Only servers push
+            break;
+        default:
+            break; // Unknown frame types are ignored (5.5)
+    }
+}
+
+// The connection's window is given back as DATA comes, but for streamed
+// bodies, whose window (the stream's too) waits until their handler has
+// read them. Bodies buffered until END_STREAM take no more in all than
+// client_max_body_size, as much as one HTTP/1.1 connection holds.
+void Server::readHttp2Data(int client_fd, H2Connection& conn, uint8_t flags, uint32_t id,
+                           const uint8_t* payload, size_t len) {
+    size_t start = 0, padding = 0;
+    if (flags & H2_FLAG_PADDED) {
+        padding = len > 0 ? payload[0] : 0;
+        start = 1;
+    }
+    if (id == 0 || start + padding > len) {
+        failHttp2(conn, H2ProtocolError);
+        return;
+    }
+    // Flow control counts the whole payload, padding included
+    conn.recv_unacked += len;
+    if (conn.recv_unacked > H2_WINDOW) {
+        failHttp2(conn, H2FlowControlError);
+        return;
+    }
+    auto it = conn.streams.find(id);
+    if (it == conn.streams.end() || it->second.remote_closed) {
+        if (id > conn.last_stream)
+            failHttp2(conn, H2ProtocolError);
+        else if (it != conn.streams.end())
+            resetHttp2Stream(conn, id, H2StreamClosed);
+        creditHttp2(conn, id, NULL);
+        return; // Otherwise in flight when the stream was reset or answered
+    }
+    H2Stream& stream = it->second;
+    stream.recv_unacked += len;
+    if (stream.recv_unacked > H2_WINDOW) {
+        resetHttp2Stream(conn, id, H2FlowControlError);
+        creditHttp2(conn, id, NULL);
+        return;
+    }
+    const char* data = (const char*)payload + start;
+    size_t data_len = len - start - padding;
+    // A body that does not match its content-length is malformed (8.1.1)
+    stream.data_received += data_len;
+    if (stream.content_length >= 0 && (stream.data_received > (uint64_t)stream.content_length
+        || ((flags & H2_FLAG_END_STREAM) && stream.data_received != (uint64_t)stream.content_length))) {
+        resetHttp2Stream(conn, id, H2ProtocolError);
+        creditHttp2(conn, id, NULL);
+        return;
+    }
+    if (stream.streaming) {
+        auto session = client_sessions.find(stream.client);
+        if (stream.client >= 0 && session != client_sessions.end() && session->second.streaming) {
+            stream.body.append(data, data_len);
+            conn.recv_held += data_len;
+        }
+    } else if (!stream.dispatched) {
+        stream.body.append(data, data_len);
+        conn.buffered += data_len;
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        stream.remote_closed = true;
+        if (!stream.dispatched)
+            dispatchHttp2Stream(client_fd, conn, id);
+        creditHttp2(conn, id, NULL);
+        return;
+    }
+    if (!stream.dispatched) {
+        size_t limit = configFor(client_fd)[0].client_max_body_size;
+        if (stream.body.size() > limit) {
+            // Answered with 413 now; the rest of the body is not waited for
+            dispatchHttp2Stream(client_fd, conn, id);
+        } else if (conn.buffered > limit) {
+            resetHttp2Stream(conn, id, H2RefusedStream);
+        }
+    }
+    it = conn.streams.find(id);
+    creditHttp2(conn, id, it == conn.streams.end() ? NULL : &it->second);
+}
+
+// WINDOW_UPDATEs for the DATA bytes no longer held, once they make half a
+// window. A stream gets its own only while its body is still wanted.
+void Server::creditHttp2(H2Connection& conn, uint32_t id, H2Stream* stream) {
+    if (conn.recv_unacked - conn.recv_held >= H2_WINDOW / 2) {
+        Http2::windowUpdate(conn.output, 0, conn.recv_unacked - conn.recv_held);
+        conn.recv_unacked = conn.recv_held;
+    }
+    if (!stream || stream->remote_closed || (stream->streaming ? stream->client < 0 : stream->dispatched))
+        return;
+    size_t held = stream->streaming ? stream->body.size() - stream->body_read : 0;
+    if (stream->recv_unacked - held >= H2_WINDOW / 2) {
+        Http2::windowUpdate(conn.output, id, stream->recv_unacked - held);
+        stream->recv_unacked = held;
+    }
+}
+
+// Forgets the body a stream still holds, and gives its window back
+void Server::dropHttp2Body(H2Connection& conn, H2Stream& stream) {
+    if (stream.streaming)
+        conn.recv_held -= stream.body.size() - stream.body_read;
+    else if (!stream.dispatched)
+        conn.buffered -= stream.body.size();
+    std::string().swap(stream.body);
+    stream.body_read = 0;
+    creditHttp2(conn, 0, NULL);
+}
+
+// recv() of a stream: its body as its HTTP/1.1 head announces it, with
+// Content-Length or chunked, EAGAIN until more DATA comes. What is read
+// frees its window.
+ssize_t Server::recvFromStream(int client, char* buf, size_t len) {
+    auto ref = h2_clients.find(client);
+    auto conn_it = ref == h2_clients.end() ? h2_connections.end() : h2_connections.find(ref->second.first);
+    if (conn_it == h2_connections.end())
+        return 0;
+    H2Connection& conn = conn_it->second;
+    uint32_t id = ref->second.second;
+    auto it = conn.streams.find(id);
+    if (it == conn.streams.end())
+        return 0;
+    H2Stream& stream = it->second;
+    size_t unread = stream.body.size() - stream.body_read;
+    if (unread == 0) {
+        if (!stream.remote_closed) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (stream.body_end_read || !stream.body_chunked)
+            return 0;
+        stream.body_end_read = true;
+        memcpy(buf, "0\r\n\r\n", 5);
+        return 5;
+    }
+    size_t take, out;
+    if (stream.body_chunked) {
+        // Room for the chunk size line and the CRLF after the data
+        take = unread < len - 16 ? unread : len - 16;
+        int size_line = snprintf(buf, len, "%zx\r\n", take);
+        memcpy(buf + size_line, stream.body.data() + stream.body_read, take);
+        memcpy(buf + size_line + take, "\r\n", 2);
+        out = size_line + take + 2;
+    } else {
+        take = out = unread < len ? unread : len;
+        memcpy(buf, stream.body.data() + stream.body_read, take);
+    }
+    stream.body_read += take;
+    conn.recv_held -= take;
+    if (stream.body_read == stream.body.size()) {
+        stream.body.clear();
+        stream.body_read = 0;
+    } else if (stream.body_read >= H2_STREAM_BUFFER) {
+        stream.body.erase(0, stream.body_read);
+        stream.body_read = 0;
+    }
+    creditHttp2(conn, id, &stream);
+    watchHttp2Output(ref->second.first);
+    return out;
+}
+
+// Whether a stream's handler waits for body it can now read
+bool Server::streamReadable(const H2Stream& stream) const {
+    if (!stream.streaming || stream.client < 0 || !(stream.events & POLLIN))
+        return false;
+    if (stream.body_read == stream.body.size() && (!stream.remote_closed || stream.body_end_read))
+        return false;
+    auto session = client_sessions.find(stream.client);
+    return session != client_sessions.end() && session->second.streaming;
+}
+
+void Server::readHttp2WindowUpdate(H2Connection& conn, uint32_t id, const uint8_t* payload, size_t len) {
+    if (len != 4) {
+        failHttp2(conn, H2FrameSizeError);
+        return;
+    }
+    uint32_t increment = Http2::read32(payload) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0)
+            failHttp2(conn, H2ProtocolError);
+        else if ((conn.send_window += increment) > H2_MAX_WINDOW)
+            failHttp2(conn, H2FlowControlError);
+        return;
+    }
+    auto it = conn.streams.find(id);
+    if (it == conn.streams.end()) {
+        if (id > conn.last_stream)
+            failHttp2(conn, H2ProtocolError);
+        return;
+    }
+    if (increment == 0)
+        resetHttp2Stream(conn, id, H2ProtocolError);
+    else if ((it->second.send_window += increment) > H2_MAX_WINDOW)
+        resetHttp2Stream(conn, id, H2FlowControlError);
+}
+
+void Server::readHttp2HeaderBlock(int client_fd, H2Connection& conn, uint8_t flags, const uint8_t* data, size_t len) {
+    conn.header_block.append((const char*)data, len);
+    if (conn.header_block.size() > H2_MAX_HEADER_BLOCK) {
+        failHttp2(conn, H2EnhanceYourCalm);
+        return;
+    }
+    if (!(flags & H2_FLAG_END_HEADERS))
+        return;
+    uint32_t id = conn.header_stream;
+    conn.header_stream = 0;
+    HeaderList headers;
+    bool decoded = conn.decoder.decode((const uint8_t*)conn.header_block.data(), conn.header_block.size(), headers);
+    conn.header_block.clear();
+    if (!decoded) {
+        failHttp2(conn, H2CompressionError);
+        return;
+    }
+
+    auto it = conn.streams.find(id);
+    if (it != conn.streams.end()) {
+        // Trailers: they end the request body and are dropped
+        if (it->second.remote_closed) {
+            resetHttp2Stream(conn, id, H2StreamClosed);
+        } else if (!conn.header_end_stream) {
+            resetHttp2Stream(conn, id, H2ProtocolError);
+        } else {
+            it->second.remote_closed = true;
+            if (!it->second.dispatched)
+                dispatchHttp2Stream(client_fd, conn, id);
+        }
+        return;
+    }
+    if (id <= conn.last_stream || conn.closing)
+        return; // Trailers of a stream reset meanwhile, or sent after the client's GOAWAY
+    conn.last_stream = id;
+    if (conn.streams.size() >= H2_MAX_STREAMS) {
+        Http2::rstStream(conn.output, id, H2RefusedStream);
+        return;
+    }
+    H2Stream& stream = conn.streams[id];
+    stream.send_window = conn.peer_window;
+    stream.started = monotonic_micros();
+    if (!Http2::requestHead(headers, stream.request, stream.method, stream.content_length)) {
+        resetHttp2Stream(conn, id, H2ProtocolError);
+        return;
+    }
+    stream.remote_closed = conn.header_end_stream;
+    if (stream.remote_closed)
+        dispatchHttp2Stream(client_fd, conn, id);
+    else
+        streamHttp2Body(client_fd, conn, id);
+}
+
+// Hands a stream's request to the handlers as HTTP/1.1 text, once its body
+// is in (or is too big to be taken)
+void Server::dispatchHttp2Stream(int client_fd, H2Connection& conn, uint32_t id) {
+    H2Stream& stream = conn.streams[id];
+    ClientSession session;
+    session.buffer = stream.request;
+    if (!stream.body.empty() || stream.method == "POST" || stream.method == "PUT")
+        session.buffer += "Content-Length: " + std::to_string(stream.body.size()) + "\r\n";
+    session.buffer += "\r\n";
+    session.buffer += stream.body;
+    session.headers_received = true;
+    session.content_length = stream.body.size();
+    session.first_byte = stream.started;
+    session.headers_done = stream.started;
+    std::string().swap(stream.request);
+    conn.buffered -= stream.body.size();
+    std::string().swap(stream.body);
+    runHttp2Request(client_fd, conn, id, session);
+}
+
+// A body bound for a CGI script or proxy_pass is not buffered whole: as for
+// HTTP/1.1, the request is run once its headers are in, and its handler
+// reads the body as a chunked one while DATA comes
+void Server::streamHttp2Body(int client_fd, H2Connection& conn, uint32_t id) {
+    H2Stream& stream = conn.streams[id];
+    ClientSession session;
+    if (stream.content_length >= 0) {
+        session.buffer = stream.request + "Content-Length: " + std::to_string(stream.content_length) + "\r\n\r\n";
+        session.content_length = stream.content_length;
+    } else {
+        session.buffer = stream.request + "Transfer-Encoding: chunked\r\n\r\n";
+        session.chunked = true;
+    }
+    session.headers_received = true;
+    session.first_byte = stream.started;
+    session.headers_done = stream.started;
+    if (!canStreamBody(client_fd, session))
+        return;
+    session.streaming = true;
+    stream.streaming = true;
+    stream.body_chunked = session.chunked;
+    std::string().swap(stream.request);
+    runHttp2Request(client_fd, conn, id, session);
+}
+
+// Gives the stream a client id of its own, under which the usual request
+// handling (processRequest() and all it starts) serves it
+void Server::runHttp2Request(int client_fd, H2Connection& conn, uint32_t id, ClientSession& session) {
+    int client = h2_next_client;
+    h2_next_client = h2_next_client == INT_MAX ? H2_CLIENT_BASE : h2_next_client + 1;
+    H2Stream& stream = conn.streams[id];
+    stream.dispatched = true;
+    stream.client = client;
+    h2_clients[client] = std::make_pair(client_fd, id);
+    clientConfigs[client] = clientConfigs[client_fd];
+    client_info[client] = client_info[client_fd];
+    Metrics::http2_streams++;
+    current_client_fd = client;
+    if (session.streaming) {
+        // Kept, as for a connection, while the body is fed to its handler
+        ClientSession& kept = client_sessions[client] = session;
+        processRequest(client, kept);
+    } else {
+        processRequest(client, session);
+    }
+}
+
+// Stream error (5.4.2)
+void Server::resetHttp2Stream(H2Connection& conn, uint32_t id, uint32_t error) {
+    Http2::rstStream(conn.output, id, error);
+    cancelHttp2Stream(conn, id);
+}
+
+// Drops the stream, stopping whatever its handlers still do
+void Server::cancelHttp2Stream(H2Connection& conn, uint32_t id) {
+    auto it = conn.streams.find(id);
+    if (it == conn.streams.end())
+        return;
+    int client = it->second.client;
+    dropHttp2Body(conn, it->second);
+    conn.streams.erase(it);
+    if (client >= 0)
+        closeClient(client);
+}
+
+// Connection error (5.4.1): GOAWAY, and the connection closes once it is out
+void Server::failHttp2(H2Connection& conn, uint32_t error) {
+    if (conn.failed)
+        return;
+    Http2::goaway(conn.output, conn.last_stream, error);
+    conn.failed = true;
+}
+
+// The handlers' writes to a stream. The HTTP/1.1 head becomes a HEADERS
+// frame; the body is taken out of its chunked or Content-Length framing
+// into the stream's output, which reports EAGAIN at H2_STREAM_BUFFER until
+// DATA frames have drained it.
+ssize_t Server::sendToStream(int client, const char* data, size_t len) {
+    auto ref = h2_clients.find(client);
+    auto conn_it = ref == h2_clients.end() ? h2_connections.end() : h2_connections.find(ref->second.first);
+    if (conn_it == h2_connections.end() || !conn_it->second.streams.count(ref->second.second)) {
+        errno = EPIPE;
+        return -1;
+    }
+    H2Connection& conn = conn_it->second;
+    uint32_t id = ref->second.second;
+    H2Stream& stream = conn.streams[id];
+    size_t used = 0;
+    while (!stream.head_done && used < len) {
+        size_t before = stream.head.size();
+        stream.head.append(data + used, len - used);
+        size_t end = stream.head.find("\r\n\r\n", before > 3 ? before - 3 : 0);
+        if (end == std::string::npos) {
+            if (stream.head.size() > RELAY_MAX_HEADER) {
+                errno = EPROTO;
+                return -1;
+            }
+            return len;
+        }
+        used += end + 4 - before;
+        stream.head.resize(end + 4);
+        HeaderList fields;
+        if (!Http2::responseHeaders(stream.head, stream.method, fields, stream.framing, stream.body_left)) {
+            errno = EPROTO;
+            return -1;
+        }
+        stream.head.clear();
+        // A 1xx head is interim: the final one follows
+        stream.head_done = fields[0].second[0] != '1';
+        stream.body_done = stream.head_done && (stream.framing == H2BodyNone
+                                                || (stream.framing == H2BodyLength && stream.body_left == 0));
+        std::string block;
+        conn.encoder.encode(fields, block);
+        Http2::headers(conn.output, id, block, stream.body_done, conn.peer_max_frame);
+        stream.ended = stream.body_done;
+    }
+    if (stream.body_done || used == len)
+        return len; // The body of a HEAD response, or nothing past the head
+    if (stream.output.size() >= H2_STREAM_BUFFER) {
+        if (used > 0)
+            return used;
+        errno = EAGAIN;
+        return -1;
+    }
+    const char* body = data + used;
+    size_t body_len = len - used;
+    if (stream.framing == H2BodyLength) {
+        size_t take = body_len < stream.body_left ? body_len : stream.body_left;
+        stream.output.append(body, take);
+        stream.body_left -= take;
+        stream.body_done = stream.body_left == 0;
+    } else if (stream.framing == H2BodyChunked) {
+        stream.chunks.feed(body, body_len, &stream.output);
+        stream.body_done = stream.chunks.done() || stream.chunks.failed();
+    } else {
+        stream.output.append(body, body_len);
+    }
+    return len;
+}
+
+// setPollEvents() of a stream: what its handlers wait for. Output wakes
+// the connection's socket for POLLOUT; writeHttp2() then runs them.
+void Server::setStreamEvents(int client, short events) {
+    auto ref = h2_clients.find(client);
+    if (ref == h2_clients.end())
+        return;
+    auto conn = h2_connections.find(ref->second.first);
+    if (conn == h2_connections.end())
+        return;
+    auto stream = conn->second.streams.find(ref->second.second);
+    if (stream == conn->second.streams.end())
+        return;
+    stream->second.events = events;
+    // Body already here is read as output is made: from writeHttp2()
+    if (events & (POLLOUT | POLLIN))
+        watchHttp2Output(ref->second.first);
+}
+
+void Server::watchHttp2Output(int client_fd) {
+    for (auto& pfd : poll_fds) {
+        if (pfd.fd == client_fd) {
+            pfd.events |= POLLOUT;
+            break;
+        }
+    }
+}
+
+// closeClient() of a stream: its handlers are done with it. A response
+// that went out whole ends with END_STREAM once it is framed; one cut
+// short resets the stream.
+void Server::endHttp2Stream(int client) {
+    auto ref = h2_clients.find(client);
+    if (ref == h2_clients.end())
+        return;
+    int client_fd = ref->second.first;
+    uint32_t id = ref->second.second;
+    h2_clients.erase(ref);
+    auto conn = h2_connections.find(client_fd);
+    if (conn == h2_connections.end())
+        return;
+    auto it = conn->second.streams.find(id);
+    if (it == conn->second.streams.end())
+        return;
+    H2Stream& stream = it->second;
+    stream.client = -1;
+    stream.events = 0;
+    dropHttp2Body(conn->second, stream);
+    bool complete = stream.head_done && (stream.body_done || (stream.framing == H2BodyUntilClose
+                                                             && !responses.count(client) && !hasPendingBody(client)));
+    if (complete) {
+        stream.body_done = true;
+    } else {
+        Http2::rstStream(conn->second.output, id, H2InternalError);
+        conn->second.streams.erase(it);
+    }
+    watchHttp2Output(client_fd);
+}
+
+// closeClient() of an HTTP/2 connection: the streams still running go too
+void Server::closeHttp2(int client_fd) {
+    auto it = h2_connections.find(client_fd);
+    if (it == h2_connections.end())
+        return;
+    std::vector<int> clients;
+    for (const auto& entry : it->second.streams) {
+        if (entry.second.client >= 0)
+            clients.push_back(entry.second.client);
+    }
+    h2_connections.erase(it);
+    for (int client : clients)
+        closeClient(client);
+}
+
+// Runs the handlers of streams with output to give while the socket keeps
+// taking frames, up to SENDFILE_CHUNK bytes before other clients get a turn
+void Server::writeHttp2(int client_fd) {
+    auto found = h2_connections.find(client_fd);
+    if (found == h2_connections.end())
+        return;
+    H2Connection& conn = found->second;
+    size_t budget = SENDFILE_CHUNK;
+    while (true) {
+        if (!conn.failed) {
+            std::vector<int> readers;
+            for (const auto& entry : conn.streams) {
+                if (streamReadable(entry.second))
+                    readers.push_back(entry.second.client);
+            }
+            for (int client : readers) {
+                // Until the body here is read, or the handler stops taking it
+                auto ref = h2_clients.find(client);
+                while (ref != h2_clients.end()) {
+                    auto stream = conn.streams.find(ref->second.second);
+                    if (stream == conn.streams.end() || !streamReadable(stream->second))
+                        break;
+                    current_client_fd = client;
+                    handleClientData(client);
+                    ref = h2_clients.find(client);
+                }
+            }
+            std::vector<int> ready;
+            for (const auto& entry : conn.streams) {
+                const H2Stream& stream = entry.second;
+                if (stream.client >= 0 && (stream.events & POLLOUT) && stream.output.size() < H2_STREAM_BUFFER)
+                    ready.push_back(stream.client);
+            }
+            for (int client : ready) {
+                if (conn.output.size() - conn.output_offset >= H2_OUTPUT_BUFFER)
+                    break;
+                if (!h2_clients.count(client))
+                    continue; // Closed by a stream handled before it
+                if (!responses.count(client)) {
+                    setStreamEvents(client, 0);
+                    continue;
+                }
+                current_client_fd = client;
+                handleClientWrite(client);
+            }
+            frameHttp2Output(conn);
+        }
+        ssize_t sent = flushHttp2(client_fd, conn);
+        if (sent < 0) {
+            closeClient(client_fd);
+            return;
+        }
+        if (sent == 0 || conn.output_offset < conn.output.size() || (size_t)sent >= budget)
+            break;
+        budget -= sent;
+    }
+    if ((conn.failed || (conn.closing && conn.streams.empty())) && conn.output.empty()) {
+        closeClient(client_fd);
+        return;
+    }
+    setPollEvents(client_fd, POLLIN | (http2Writable(conn) ? POLLOUT : 0));
+}
+
+// Bytes of queued frames written, -1 if the socket failed
+ssize_t Server::flushHttp2(int client_fd, H2Connection& conn) {
+    size_t total = 0;
+    while (conn.output_offset < conn.output.size()) {
+        ssize_t n = Tls::send(client_fd, conn.output.data() + conn.output_offset,
+                              conn.output.size() - conn.output_offset, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        conn.output_offset += n;
+        total += n;
+    }
+    if (conn.output_offset == conn.output.size()) {
+        conn.output.clear();
+        conn.output_offset = 0;
+    } else if (conn.output_offset >= H2_OUTPUT_BUFFER) {
+        conn.output.erase(0, conn.output_offset);
+        conn.output_offset = 0;
+    }
+    return total;
+}
+
+// Moves response bodies into DATA frames as far as the flow control
+// windows allow, one frame per stream in turn, and drops the streams that
+// are over on both sides
+void Server::frameHttp2Output(H2Connection& conn) {
+    bool more = true;
+    while (more) {
+        more = false;
+        for (auto it = conn.streams.begin(); it != conn.streams.end();) {
+            H2Stream& stream = it->second;
+            if (stream.head_done && !stream.ended && conn.output.size() - conn.output_offset < H2_OUTPUT_BUFFER) {
+                int64_t window = stream.send_window < conn.send_window ? stream.send_window : conn.send_window;
+                size_t len = stream.output.size() < conn.peer_max_frame ? stream.output.size() : conn.peer_max_frame;
+                if ((int64_t)len > window)
+                    len = window > 0 ? window : 0;
+                bool last = stream.body_done && len == stream.output.size();
+                if (len > 0 || last) {
+                    Http2::frame(conn.output, H2Data, last ? H2_FLAG_END_STREAM : 0, it->first,
+                                 stream.output.data(), len);
+                    stream.output.erase(0, len);
+                    stream.send_window -= len;
+                    conn.send_window -= len;
+                    stream.ended = last;
+                    more = more || !stream.output.empty();
+                }
+            }
+            if (stream.ended && stream.client < 0) {
+                if (!stream.remote_closed)
+                    Http2::rstStream(conn.output, it->first, H2NoError); // The rest of the body is not wanted
+                conn.streams.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+// Whether the socket has to wait for POLLOUT: frames are queued, or a
+// stream has output to produce or to frame, or body to read
+bool Server::http2Writable(const H2Connection& conn) const {
+    if (conn.output_offset < conn.output.size())
+        return true;
+    for (const auto& entry : conn.streams) {
+        const H2Stream& stream = entry.second;
+        if (stream.client >= 0 && (stream.events & POLLOUT) && stream.output.size() < H2_STREAM_BUFFER)
+            return true;
+        if (!stream.ended && stream.head_done && (stream.body_done && stream.output.empty()))
+            return true;
+        if (!stream.output.empty() && stream.send_window > 0 && conn.send_window > 0)
+            return true;
+        if (stream.ended && stream.client < 0)
+            return true;
+        if (streamReadable(stream))
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,454 @@
+#include "../includes/Server.hpp"
+
+// Sends a proxy_pass request on a pooled or new upstream connection. The
+// client is not polled again until the upstream wants more of its body or
+// the response head is ready for it.
+bool Server::startProxy(int client_fd, const ProxyJob& job) {
+    ProxyState state;
+    state.upstream = job.upstream;
+    state.group = job.group;
+    state.peer = -1;
+    state.tried = 0;
+    state.hash_key = job.hash_key;
+    state.idempotent = job.method == "GET" || job.method == "HEAD" || job.method == "PUT"
+                       || job.method == "DELETE" || job.method == "OPTIONS" || job.method == "TRACE";
+    state.client_fd = client_fd;
+    state.request = Proxy::encodeHead(job, client_info[client_fd].peer, Tls::active(clientSocket(client_fd)));
+    if (job.stream_body && job.chunked)
+        state.request += job.body.empty() ? "" : Proxy::encodeChunk(job.body);
+    else
+        state.request += job.body;
+    state.request_offset = 0;
+    state.uploading = job.stream_body;
+    state.chunked_upload = job.stream_body && job.chunked;
+    state.retryable = !job.stream_body;
+    state.head_request = job.method == "HEAD";
+    state.relaying = false;
+    state.complete = false;
+    state.framing = ProxyNoBody;
+    state.body_left = 0;
+    state.keep_alive = false;
+    state.connect_timeout = job.connect_timeout;
+    state.send_timeout = job.send_timeout;
+    state.read_timeout = job.read_timeout;
+    state.keepalive = job.keepalive;
+    state.cache_key = job.cache_key;
+    // proxy_keepalive 0 takes no idle connection other locations left either
+    return connectProxy(state, true, job.keepalive > 0) >= 0;
+}
+
+// Connects `state` to its upstream and starts polling it. With an upstream
+// group and `pick_peer`, the balancer chooses the peer, and peers that
+// refuse at once are counted as failed and skipped. -1 if none connects.
+int Server::connectProxy(ProxyState& state, bool pick_peer, bool pooled) {
+    time_t now = time(NULL);
+    while (true) {
+        if (state.group && pick_peer) {
+            state.peer = state.group->pick(state.hash_key, state.tried, now);
+            if (state.peer < 0)
+                return -1;
+            state.tried |= 1ULL << state.peer;
+            state.upstream = state.group->address(state.peer);
+        }
+        bool in_progress;
+        state.reused = false;
+        int fd = pooled ? Proxy::acquire(state.upstream, state.reused, in_progress)
+                        : connect_nonblocking(state.upstream, in_progress);
+        if (fd >= 0) {
+            state.request_offset = 0;
+            state.connecting = in_progress;
+            state.deadline = now + (in_progress ? state.connect_timeout : state.send_timeout);
+            if (state.group)
+                state.group->started(state.peer);
+            proxy_states[fd] = state;
+            proxy_clients[state.client_fd] = fd;
+            addPollFd(fd, POLLIN | POLLOUT);
+            return fd;
+        }
+        if (!state.group || !pick_peer)
+            return -1;
+        state.group->failed(state.peer, now);
+    }
+}
+
+void Server::handleProxyEvents(size_t i) {
+    int fd = poll_fds[i].fd;
+    short revents = poll_fds[i].revents;
+    ProxyState& state = proxy_states[fd];
+
+    if (state.relaying) {
+        // More body (or EOF) is waiting: the client side pulls it from here
+        state.deadline = 0;
+        removePollFd(fd);
+        enableWriteEvents(state.client_fd);
+        return;
+    }
+
+    if (state.connecting) {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            errno = err;
+            perror("connect proxy upstream");
+            failProxy(fd, 502);
+            return;
+        }
+        state.connecting = false;
+        state.deadline = time(NULL) + state.send_timeout;
+    }
+
+    if ((revents & POLLOUT) && state.request_offset < state.request.size()) {
+        ssize_t n = send(fd, state.request.c_str() + state.request_offset,
+                         state.request.size() - state.request_offset, 0);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            failProxy(fd, 502);
+            return;
+        }
+        if (n > 0) {
+            state.request_offset += n;
+            state.deadline = time(NULL) + state.send_timeout;
+        }
+        if (state.request_offset == state.request.size()) {
+            poll_fds[i].events = POLLIN;
+            if (state.uploading) {
+                // Piece written: go back to reading the body from the client
+                state.deadline = 0;
+                setPollEvents(state.client_fd, POLLIN);
+            } else {
+                state.deadline = time(NULL) + state.read_timeout;
+            }
+        }
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR))
+        readProxyHead(fd);
+}
+
+// How many of the `len` upstream bytes belong to the response body; marks
+// the state complete once its end has been seen
+static size_t takeProxyBody(ProxyState& state, const char* data, size_t len) {
+    size_t used = len;
+    if (state.framing == ProxyNoBody) {
+        used = 0;
+    } else if (state.framing == ProxyLength) {
+        if (used > state.body_left)
+            used = state.body_left;
+        state.body_left -= used;
+    } else if (state.framing == ProxyChunked) {
+        used = state.chunks.feed(data, len, NULL);
+        if (state.chunks.failed()) {
+            // Framing we cannot follow: pass it on and stop at EOF instead
+            state.framing = ProxyUntilClose;
+            used = len;
+        }
+    }
+    if (used < len)
+        state.keep_alive = false; // Junk after the body
+    state.complete = state.framing == ProxyNoBody || (state.framing == ProxyLength && state.body_left == 0)
+                     || (state.framing == ProxyChunked && state.chunks.done());
+    return used;
+}
+
+// Collects the response head. Once it is complete it goes to the client
+// with whatever body came along, and the rest of the body is relayed.
+void Server::readProxyHead(int fd) {
+    ProxyState& state = proxy_states[fd];
+    char buf[BUF_SIZE];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        failProxy(fd, 502);
+        return;
+    }
+    state.retryable = false; // The upstream has seen the request, it is not sent elsewhere
+    state.input.append(buf, n);
+    state.deadline = time(NULL) + state.read_timeout;
+
+    ProxyResponseHead head;
+    size_t end;
+    while (true) {
+        end = state.input.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (state.input.size() <= PROXY_MAX_HEAD)
+                return;
+            failProxy(fd, 502);
+            return;
+        }
+        if (!Proxy::parseResponseHead(state.input.substr(0, end + 4), state.head_request, head)
+            || head.status == 101) {
+            failProxy(fd, 502);
+            return;
+        }
+        if (head.status >= 200)
+            break;
+        state.input.erase(0, end + 4); // Interim response: the final one follows
+    }
+
+    if (state.group)
+        state.group->succeeded(state.peer);
+    std::string body = state.input.substr(end + 4);
+    state.input.clear();
+    state.framing = head.framing;
+    state.body_left = head.length;
+    state.keep_alive = head.keep_alive;
+    if (state.uploading || state.request_offset < state.request.size()) {
+        // Answered before the whole request was sent: the rest is not sent
+        state.keep_alive = false;
+        if (state.uploading)
+            client_sessions.erase(state.client_fd);
+        state.uploading = false;
+    }
+    body.resize(takeProxyBody(state, body.data(), body.size()));
+    state.relaying = true;
+    deliverResponse(state.client_fd, head.head + body);
+    copyProxyResponse(state, head.head.data(), head.head.size());
+    copyProxyResponse(state, body.data(), body.size());
+    if (state.complete) {
+        finishProxy(fd, state.keep_alive);
+    } else {
+        state.deadline = 0;
+        removePollFd(fd); // Polled again only when the client has drained it
+    }
+}
+
+// Moves the next part of the upstream's response body to the client.
+// Returns false on a socket error or a body cut short by the upstream.
+bool Server::sendProxyBody(int client_fd) {
+    auto link = proxy_clients.find(client_fd);
+    if (link == proxy_clients.end())
+        return true;
+    int fd = link->second;
+    ProxyState& state = proxy_states[fd];
+    if (!state.relaying)
+        return true;
+
+    size_t budget = SENDFILE_CHUNK; // Leave the loop now and then for other clients
+    while (!state.complete && budget > 0) {
+        char buf[BUF_SIZE];
+        size_t want = sizeof(buf);
+        if (state.framing == ProxyLength && state.body_left < want)
+            want = state.body_left;
+        ssize_t n = recv(fd, buf, want, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Nothing from the upstream yet: wait on it instead of the socket
+            setPollEvents(client_fd, 0);
+            removePollFd(fd);
+            addPollFd(fd, POLLIN);
+            state.deadline = time(NULL) + state.read_timeout;
+            return true;
+        }
+        if (n == 0 && state.framing == ProxyUntilClose) {
+            state.complete = true;
+            break;
+        }
+        if (n <= 0)
+            return false;
+        size_t used = takeProxyBody(state, buf, n);
+        copyProxyResponse(state, buf, used);
+        ssize_t sent = sendToClient(client_fd, buf, used, 0);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (sent < 0)
+            sent = 0;
+        countSent(client_fd, sent);
+        budget -= used < budget ? used : budget;
+        if ((size_t)sent < used) {
+            // Keep the rest in front of the next read
+            std::string& pending = responses[client_fd];
+            size_t& offset = response_offsets[client_fd];
+            pending.erase(0, offset);
+            offset = 0;
+            pending.append(buf + sent, used - sent);
+            return true;
+        }
+    }
+    if (state.complete)
+        finishProxy(fd, state.keep_alive);
+    return true;
+}
+
+// Keeps what is relayed to the client for the response cache fill, and
+// completes the fill with it once the response is whole. One that grows
+// past RESPONSE_CACHE_MAX_ENTRY is relayed without a copy, and the key
+// passes the cache for a while.
+void Server::copyProxyResponse(ProxyState& state, const char* data, size_t len) {
+    if (state.cache_key.empty())
+        return;
+    std::string key;
+    if (state.cache_copy.size() + len > RESPONSE_CACHE_MAX_ENTRY) {
+        key.swap(state.cache_key);
+        std::string().swap(state.cache_copy);
+        abortCacheFill(key, true);
+        return;
+    }
+    state.cache_copy.append(data, len);
+    if (!state.complete)
+        return;
+    key.swap(state.cache_key);
+    std::string response;
+    response.swap(state.cache_copy);
+    completeCacheFill(key, response);
+}
+
+// Passes the next piece of a streamed request body on to the upstream. The
+// client is read again only once that piece has been written.
+void Server::handleProxyUpload(int client_fd, ClientSession& session) {
+    auto link = proxy_clients.find(client_fd);
+    if (link == proxy_clients.end()) {
+        closeClient(client_fd);
+        return;
+    }
+    int fd = link->second;
+    ProxyState& state = proxy_states[fd];
+    if (state.connecting || state.request_offset < state.request.size()) {
+        setPollEvents(client_fd, 0);
+        return;
+    }
+
+    char buf[BUF_SIZE];
+    size_t want = sizeof(buf);
+    if (!session.chunked && session.body_left < want)
+        want = session.body_left;
+    ssize_t n = recvFromClient(client_fd, buf, want);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0) {
+        closeClient(client_fd);
+        return;
+    }
+    std::string data;
+    if (session.chunked) {
+        session.chunked_body.feed(buf, n, &data);
+        if (session.chunked_body.failed()) {
+            failProxy(fd, 400);
+            return;
+        }
+        if (session.chunked_body.decodedSize() > configFor(client_fd)[0].client_max_body_size) {
+            failProxy(fd, 413);
+            return;
+        }
+    } else {
+        data.assign(buf, n);
+        session.body_left -= n;
+    }
+    bool complete = session.chunked ? session.chunked_body.done() : session.body_left == 0;
+
+    if (state.chunked_upload) {
+        state.request = data.empty() ? "" : Proxy::encodeChunk(data);
+        if (complete)
+            state.request += Proxy::encodeChunk("");
+    } else {
+        state.request.swap(data);
+    }
+    state.request_offset = 0;
+    if (complete) {
+        state.uploading = false;
+        client_sessions.erase(client_fd);
+        auto record = request_records.find(client_fd);
+        if (record != request_records.end())
+            record->second.body_done = monotonic_micros();
+    }
+    if (state.request.empty()) {
+        setPollEvents(client_fd, POLLIN); // Only chunk framing so far
+        return;
+    }
+    setPollEvents(client_fd, 0);
+    setPollEvents(fd, POLLIN | POLLOUT);
+    state.deadline = time(NULL) + state.send_timeout;
+}
+
+// The upstream failed before the response head was complete. A stale
+// pooled connection is replaced by a new one while the whole request can
+// still be sent again and is idempotent: the upstream may have acted on it
+// before dropping the connection. In an upstream group the peer's failure is counted,
+// and the request moves to another peer if it never reached this one or is
+// idempotent and has had no answer yet. Otherwise the client gets `status`.
+void Server::failProxy(int fd, int status) {
+    ProxyState& state = proxy_states[fd];
+    if (status == 502 && state.reused && state.retryable && state.idempotent) {
+        retryProxy(fd, false, status);
+        return;
+    }
+    if (state.group && (status == 502 || status == 504)) {
+        state.group->failed(state.peer, time(NULL));
+        if (state.connecting || (state.retryable && state.idempotent)) {
+            LOG_WARN("Proxy upstream " << state.upstream << " failed, trying the next one in " << state.group->name);
+            retryProxy(fd, true, status);
+            return;
+        }
+    }
+    int client_fd = state.client_fd;
+    if (state.uploading)
+        client_sessions.erase(client_fd);
+    std::string cache_key;
+    cache_key.swap(state.cache_key);
+    finishProxy(fd, false);
+    deliverBackendResponse(client_fd, cache_key, Response(configFor(client_fd)).getErrorResponse(status));
+}
+
+// Sends the request again on a new connection to the same upstream, or
+// to the next peer of its group; the client gets `status` if there is none
+void Server::retryProxy(int fd, bool next_peer, int status) {
+    ProxyState state = proxy_states[fd];
+    proxy_states[fd].cache_key.clear(); // The fill goes on with the new connection
+    finishProxy(fd, false);
+    if (connectProxy(state, next_peer, next_peer) < 0) {
+        if (state.uploading)
+            client_sessions.erase(state.client_fd);
+        deliverBackendResponse(state.client_fd, state.cache_key,
+                               Response(configFor(state.client_fd)).getErrorResponse(status));
+    }
+}
+
+// Forgets the request on `fd`. A connection that finished a response it
+// can be reused after goes back to the pool; anything else is closed. A
+// cache fill cut short is given up.
+void Server::finishProxy(int fd, bool reuse) {
+    auto it = proxy_states.find(fd);
+    if (it == proxy_states.end())
+        return;
+    std::string upstream = it->second.upstream;
+    std::string cache_key = it->second.cache_key;
+    size_t keepalive = it->second.keepalive;
+    if (it->second.group)
+        it->second.group->finished(it->second.peer);
+    auto link = proxy_clients.find(it->second.client_fd);
+    if (link != proxy_clients.end() && link->second == fd)
+        proxy_clients.erase(link);
+    proxy_states.erase(it);
+    removePollFd(fd);
+    if (reuse)
+        Proxy::release(upstream, fd, keepalive);
+    else
+        close(fd);
+    if (!cache_key.empty())
+        abortCacheFill(cache_key, false);
+}
+
+// proxy_connect_timeout, proxy_send_timeout and proxy_read_timeout: the
+// client gets 504 if nothing has been sent to it yet (once failProxy has
+// no other peer to try), or is cut off
+void Server::checkProxyTimeouts() {
+    time_t now = time(NULL);
+    std::vector<int> expired;
+    for (const auto& entry : proxy_states) {
+        if (entry.second.deadline != 0 && now >= entry.second.deadline)
+            expired.push_back(entry.first);
+    }
+    for (int fd : expired) {
+        auto it = proxy_states.find(fd);
+        if (it == proxy_states.end())
+            continue;
+        ProxyState& state = it->second;
+        LOG_WARN("Proxy upstream " << state.upstream << " timed out");
+        if (state.relaying) {
+            closeClient(state.client_fd);
+        } else {
+            failProxy(fd, 504);
+        }
+    }
+}
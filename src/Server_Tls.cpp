@@ -0,0 +1,18 @@
+#include "../includes/Server.hpp"
+
+// Drives the TLS handshake of a `listen ... ssl` connection from whichever
+// poll() event it waits for. Once it is done the connection is read as
+// usual, through Tls::recv(), or as HTTP/2 if ALPN picked h2.
+void Server::continueHandshake(int client_fd) {
+    int done = Tls::handshake(client_fd);
+    if (done < 0) {
+        closeClient(client_fd);
+        return;
+    }
+    if (done && Tls::protocol(client_fd) == "h2") {
+        startHttp2(client_fd, "");
+        writeHttp2(client_fd);
+        return;
+    }
+    setPollEvents(client_fd, done ? POLLIN : Tls::waitEvents(client_fd));
+}
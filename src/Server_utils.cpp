@@ -16,6 +16,17 @@ std::string Server::getHostFromHeaders(const std::string& headers) {
     return host;
 }
 
+bool Server::isChunkedRequest(const std::string& headers) {
+    std::string lower = headers;
+    for (size_t i = 0; i < lower.size(); i++)
+        lower[i] = tolower(lower[i]);
+    size_t pos = lower.find("\r\ntransfer-encoding:");
+    if (pos == std::string::npos)
+        return false;
+    size_t end = lower.find("\r\n", pos + 2);
+    return lower.substr(pos, end - pos).find("chunked") != std::string::npos;
+}
+
 const ServerConfig* Server::getServerConfigByHost(const std::vector<ServerConfig>& configs,
                                                   const std::string& host, int port) {
     // Scenario 1: Host and Port match
@@ -45,7 +56,7 @@ int Server::getListeningPortForClient(int client_fd) {
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
     
-    if (getsockname(client_fd, (struct sockaddr*)&addr, &addr_len) == -1) {
+    if (getsockname(clientSocket(client_fd), (struct sockaddr*)&addr, &addr_len) == -1) {
         perror("getsockname failed");
         return -1; // error indicator
     }
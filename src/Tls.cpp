@@ -0,0 +1,339 @@
+#include "../includes/Tls.hpp"
+#include "../includes/Metrics.hpp"
+#include "../includes/Log.hpp"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <climits>
+#include <cstring>
+#include <cerrno>
+#ifdef WEBSERV_TLS
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+# include <openssl/evp.h>
+# include <openssl/rand.h>
+#endif
+
+std::vector<TlsContext> Tls::contexts;
+std::unordered_map<int, TlsConnection> Tls::connections;
+
+#ifdef WEBSERV_TLS
+
+// The oldest queued OpenSSL error, for config errors and the log
+static std::string sslError() {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0)
+        return "unknown error";
+    char buf[256];
+    ERR_error_string_n(code, buf, sizeof(buf));
+    return buf;
+}
+
+static time_t modified(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+}
+
+// Ticket keys of the process (name, HMAC and AES key). Every context uses
+// them, so tickets stay valid across reloads and certificate renewals.
+static bool ticketKeys(unsigned char (&keys)[80]) {
+    static unsigned char made[80];
+    static bool ready = false;
+    if (!ready && RAND_bytes(made, sizeof(made)) != 1)
+        return false;
+    ready = true;
+    memcpy(keys, made, sizeof(made));
+    return true;
+}
+
+// ALPN (RFC 7301): h2 when the client offers it, http/1.1 otherwise
+static int selectProtocol(SSL*, const unsigned char** out, unsigned char* out_len,
+                          const unsigned char* in, unsigned int in_len, void*) {
+    static const unsigned char ours[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char**)out, out_len, ours, sizeof(ours) - 1, in, in_len)
+        != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Registers a certificate; returns its context id, or -1 with `error` set.
+// Same settings and unchanged files give back the loaded context.
+int Tls::context(const TlsSettings& settings, std::string& error) {
+    time_t certificate_time = modified(settings.certificate);
+    time_t key_time = modified(settings.key);
+    for (size_t i = 0; i < contexts.size(); i++) {
+        if (contexts[i].settings == settings && contexts[i].certificate_time == certificate_time
+            && contexts[i].key_time == key_time)
+            return (int)i;
+    }
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        error = "TLS: " + sslError();
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // A client closing without close_notify reads as a plain EOF
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE
+                             | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(ctx, settings.certificate.c_str()) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, settings.key.c_str(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        error = "Cannot load ssl_certificate " + settings.certificate + " with key " + settings.key
+                + ": " + sslError();
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // Sessions and tickets only resume under the certificate they were made for
+    unsigned char id[EVP_MAX_MD_SIZE];
+    unsigned int id_len = 0;
+    EVP_Digest(settings.certificate.data(), settings.certificate.size(), id, &id_len, EVP_sha256(), NULL);
+    SSL_CTX_set_session_id_context(ctx, id, id_len < SSL_MAX_SID_CTX_LENGTH ? id_len : SSL_MAX_SID_CTX_LENGTH);
+    if (settings.session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, settings.session_cache);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx, settings.session_timeout);
+    unsigned char keys[80];
+    if (!settings.session_tickets) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        if (settings.session_cache == 0)
+            SSL_CTX_set_num_tickets(ctx, 0); // TLS 1.3 would still send stateful ones
+    } else if (!ticketKeys(keys) || SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys)) != 1) {
+        error = "TLS: cannot set session ticket keys: " + sslError();
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    if (settings.http2)
+        SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, NULL);
+
+    TlsContext loaded = {settings, certificate_time, key_time, ctx};
+    contexts.push_back(loaded);
+    return (int)contexts.size() - 1;
+}
+
+// Starts the server side of a handshake on a freshly accepted socket
+bool Tls::accept(int fd, int context) {
+    SSL* ssl = SSL_new(contexts[context].ctx);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        LOG_ERROR("TLS: cannot set up connection: " << sslError());
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+    TlsConnection conn = {ssl, true, POLLIN, 0, 0, 0};
+    connections[fd] = conn;
+    return true;
+}
+
+bool Tls::handshaking(int fd) {
+    auto it = connections.find(fd);
+    return it != connections.end() && it->second.handshaking;
+}
+
+// Advances the handshake: 1 once it is done, 0 while it waits for
+// waitEvents(), -1 if it failed
+int Tls::handshake(int fd) {
+    auto it = connections.find(fd);
+    if (it == connections.end())
+        return 1;
+    TlsConnection& conn = it->second;
+    ERR_clear_error();
+    int rc = SSL_do_handshake(conn.ssl);
+    if (rc == 1) {
+        conn.handshaking = false;
+        if (SSL_session_reused(conn.ssl))
+            Metrics::tls_resumed++;
+        else
+            Metrics::tls_handshakes++;
+        return 1;
+    }
+    int reason = SSL_get_error(conn.ssl, rc);
+    if (reason == SSL_ERROR_WANT_READ || reason == SSL_ERROR_WANT_WRITE) {
+        conn.wait_events = reason == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+        return 0;
+    }
+    Metrics::tls_handshake_failures++;
+    LOG_DEBUG("TLS handshake failed on fd " << fd << ": "
+              << (reason == SSL_ERROR_SYSCALL ? strerror(errno) : sslError()));
+    ERR_clear_error();
+    return -1;
+}
+
+// The protocol ALPN agreed on, "" without one
+std::string Tls::protocol(int fd) {
+    auto it = connections.find(fd);
+    if (it == connections.end())
+        return "";
+    const unsigned char* name = NULL;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(it->second.ssl, &name, &len);
+    return std::string((const char*)name, len);
+}
+
+short Tls::waitEvents(int fd) {
+    auto it = connections.find(fd);
+    return it == connections.end() ? POLLIN : it->second.wait_events;
+}
+
+// Maps a failed SSL_read()/SSL_write() to what recv()/send() would say:
+// 0 for the end of the stream, -1 with EAGAIN to try again on the next
+// poll() event, -1 with errno set otherwise
+ssize_t Tls::ioResult(TlsConnection& conn, int rc) {
+    switch (SSL_get_error(conn.ssl, rc)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+                errno = ECONNRESET;
+            ERR_clear_error();
+            return -1;
+        default:
+            LOG_DEBUG("TLS: " << sslError());
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+// One record at most: the rest stays decrypted in OpenSSL, see anyBuffered()
+ssize_t Tls::recv(int fd, void* buf, size_t len) {
+    auto it = connections.find(fd);
+    if (it == connections.end())
+        return ::recv(fd, buf, len, 0);
+    ERR_clear_error();
+    errno = 0;
+    int n = SSL_read(it->second.ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    return n > 0 ? n : ioResult(it->second, n);
+}
+
+// Writes one record per SSL_write(), sized by how warm the connection is:
+// TLS_RECORD_SMALL until TLS_RECORD_BOOST_AFTER bytes have gone out since
+// the last idle second, TLS_RECORD_LARGE after. An SSL_write() that could
+// not finish is repeated with the same length, as OpenSSL requires; the
+// callers always offer the same bytes again.
+ssize_t Tls::send(int fd, const void* buf, size_t len, int flags) {
+    auto it = connections.find(fd);
+    if (it == connections.end())
+        return ::send(fd, buf, len, flags);
+    TlsConnection& conn = it->second;
+    uint64_t now = monotonic_micros();
+    if (conn.retry == 0 && now - conn.last_write >= TLS_RECORD_IDLE_RESET)
+        conn.burst = 0;
+    conn.last_write = now;
+
+    size_t written = 0;
+    while (written < len) {
+        size_t record = conn.retry ? conn.retry
+                        : conn.burst < TLS_RECORD_BOOST_AFTER ? TLS_RECORD_SMALL : TLS_RECORD_LARGE;
+        size_t chunk = len - written < record ? len - written : record;
+        ERR_clear_error();
+        errno = 0;
+        int n = SSL_write(conn.ssl, (const char*)buf + written, (int)chunk);
+        if (n <= 0) {
+            conn.retry = chunk;
+            return written > 0 ? (ssize_t)written : ioResult(conn, n);
+        }
+        conn.retry = 0;
+        conn.burst += n;
+        written += n;
+    }
+    return written;
+}
+
+bool Tls::buffered(int fd) {
+    auto it = connections.find(fd);
+    return it != connections.end() && !it->second.handshaking && SSL_pending(it->second.ssl) > 0;
+}
+
+void Tls::close(int fd) {
+    auto it = connections.find(fd);
+    if (it == connections.end())
+        return;
+    // close_notify, best effort: the socket is closed right after either way
+    if (!it->second.handshaking)
+        SSL_shutdown(it->second.ssl);
+    ERR_clear_error();
+    SSL_free(it->second.ssl);
+    connections.erase(it);
+}
+
+#else
+
+int Tls::context(const TlsSettings& settings, std::string& error) {
+    error = "listen ... ssl for " + settings.certificate + ": built without TLS support (make TLS=1)";
+    return -1;
+}
+
+bool Tls::accept(int, int) {
+    return false;
+}
+
+bool Tls::handshaking(int) {
+    return false;
+}
+
+int Tls::handshake(int) {
+    return 1;
+}
+
+std::string Tls::protocol(int) {
+    return "";
+}
+
+short Tls::waitEvents(int) {
+    return POLLIN;
+}
+
+ssize_t Tls::ioResult(TlsConnection&, int) {
+    return -1;
+}
+
+ssize_t Tls::recv(int fd, void* buf, size_t len) {
+    return ::recv(fd, buf, len, 0);
+}
+
+ssize_t Tls::send(int fd, const void* buf, size_t len, int flags) {
+    return ::send(fd, buf, len, flags);
+}
+
+bool Tls::buffered(int) {
+    return false;
+}
+
+void Tls::close(int) {
+}
+
+#endif
+
+// SSL_read() hands out one record at a time, and bytes OpenSSL has already
+// taken off the socket do not wake poll(): a connection waiting for input
+// with some of them must not make the loop sleep
+bool Tls::anyBuffered(const std::vector<struct pollfd>& fds) {
+    for (const auto& entry : connections) {
+        if (!buffered(entry.first))
+            continue;
+        for (const struct pollfd& pfd : fds) {
+            if (pfd.fd == entry.first && (pfd.events & POLLIN))
+                return true;
+        }
+    }
+    return false;
+}
+
+// ... and gets a POLLIN for them after poll() returns
+void Tls::markBuffered(std::vector<struct pollfd>& fds) {
+    if (connections.empty())
+        return;
+    for (struct pollfd& pfd : fds) {
+        if ((pfd.events & POLLIN) && buffered(pfd.fd))
+            pfd.revents |= POLLIN;
+    }
+}
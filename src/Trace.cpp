@@ -0,0 +1,73 @@
+#include "../includes/Trace.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+
+std::shared_ptr<AccessLogFile> Trace::file;
+size_t Trace::sample_rate = TRACE_DEFAULT_SAMPLE;
+size_t Trace::counter = 0;
+
+// Switches to the trace_file and trace_sample of the configuration in use;
+// a new, empty file starts the JSON array
+void Trace::use(const std::shared_ptr<AccessLogFile>& trace_file, size_t rate) {
+    sample_rate = rate > 0 ? rate : 1;
+    if (trace_file == file)
+        return;
+    file = trace_file;
+    struct stat st;
+    if (file && file->buffer.empty() && fstat(file->fd, &st) == 0 && st.st_size == 0)
+        AccessLog::append(*file, "[\n");
+}
+
+static std::string jsonEscape(const std::string& value) {
+    std::string out;
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// One complete ("X") event; phases that were not reached are left out
+static void span(std::string& out, const char* name, uint64_t from, uint64_t to, int tid,
+                 const std::string& args) {
+    if (from == 0 || to < from)
+        return;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+             name, (unsigned long long)from, (unsigned long long)(to - from), (int)getpid(), tid);
+    out += buf;
+    if (!args.empty())
+        out += ",\"args\":{" + args + "}";
+    out += "},\n";
+}
+
+// Each connection gets its own track (tid = client fd), with the whole
+// request on top and its phases underneath
+void Trace::write(int client_fd, const RequestRecord& record, uint64_t now_us) {
+    if (!file)
+        return;
+    std::string args = "\"method\":\"" + jsonEscape(record.method) + "\",\"uri\":\""
+                       + jsonEscape(record.uri) + "\",\"location\":\"" + jsonEscape(record.location)
+                       + "\",\"status\":" + std::to_string(record.status)
+                       + ",\"bytes_sent\":" + std::to_string(record.bytes_sent);
+    uint64_t response_end = record.response_start ? record.response_start : now_us;
+    std::string out;
+    span(out, "request", record.first_byte ? record.first_byte : record.received, now_us, client_fd, args);
+    span(out, "idle", record.accepted, record.first_byte, client_fd, "");
+    span(out, "read_header", record.first_byte, record.headers_done, client_fd, "");
+    span(out, "read_body", record.headers_done, record.body_done, client_fd, "");
+    span(out, "handler", record.received, response_end, client_fd, "");
+    if (record.response_start)
+        span(out, "send", record.response_start, now_us, client_fd, "");
+    AccessLog::append(*file, out);
+}
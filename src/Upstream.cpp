@@ -0,0 +1,119 @@
+#include "../includes/Upstream.hpp"
+#include "../includes/Log.hpp"
+#include <algorithm>
+
+// FNV-1a with a final avalanche, so similar keys land far apart on the ring
+static uint32_t ringHash(const std::string& text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+UpstreamGroup::UpstreamGroup(const std::string& group_name)
+    : cursor(0), name(group_name), balance(BalanceRoundRobin) {}
+
+void UpstreamGroup::addPeer(const std::string& address, int weight, int max_fails, time_t fail_timeout) {
+    UpstreamPeer peer = {address, weight, max_fails, fail_timeout, 0, 0, 0, 0};
+    peers.push_back(peer);
+}
+
+// Each peer gets UPSTREAM_HASH_POINTS points per unit of weight, so adding
+// or removing one only moves the keys next to its own points
+void UpstreamGroup::buildRing() {
+    ring.clear();
+    if (balance != BalanceHash)
+        return;
+    for (size_t i = 0; i < peers.size(); i++) {
+        for (int point = 0; point < peers[i].weight * UPSTREAM_HASH_POINTS; point++)
+            ring.push_back(std::make_pair(ringHash(peers[i].address + "-" + std::to_string(point)), (uint16_t)i));
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+// Not tried yet for this request and, if `health`, not marked down
+bool UpstreamGroup::usable(size_t peer, uint64_t tried, time_t now, bool health) const {
+    if (tried & (1ULL << peer))
+        return false;
+    const UpstreamPeer& p = peers[peer];
+    return !health || p.max_fails == 0 || p.fails < p.max_fails || now - p.failed_at >= p.fail_timeout;
+}
+
+// Spreads picks in proportion to weight without bursts (as nginx does)
+int UpstreamGroup::roundRobin(uint64_t tried, time_t now, bool health) {
+    int best = -1;
+    int total = 0;
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (!usable(i, tried, now, health))
+            continue;
+        peers[i].current_weight += peers[i].weight;
+        total += peers[i].weight;
+        if (best < 0 || peers[i].current_weight > peers[best].current_weight)
+            best = i;
+    }
+    if (best >= 0)
+        peers[best].current_weight -= total;
+    return best;
+}
+
+int UpstreamGroup::leastConn(uint64_t tried, time_t now, bool health) {
+    int best = -1;
+    for (size_t k = 0; k < peers.size(); k++) {
+        size_t i = (cursor + k) % peers.size();
+        if (!usable(i, tried, now, health))
+            continue;
+        // active / weight, compared without dividing
+        if (best < 0 || (long)peers[i].active * peers[best].weight < (long)peers[best].active * peers[i].weight)
+            best = i;
+    }
+    if (best >= 0)
+        cursor = best + 1; // Ties go round the peers instead of always to the first
+    return best;
+}
+
+// The first usable peer clockwise from the key's point
+int UpstreamGroup::hashed(const std::string& key, uint64_t tried, time_t now, bool health) {
+    if (ring.empty())
+        return -1;
+    auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(ringHash(key), (uint16_t)0));
+    for (size_t k = 0; k < ring.size(); k++, ++it) {
+        if (it == ring.end())
+            it = ring.begin();
+        if (usable(it->second, tried, now, health))
+            return it->second;
+    }
+    return -1;
+}
+
+// The peer for the next request, skipping the ones in `tried`. When every
+// other peer is marked down they are tried anyway rather than failing the
+// request outright. -1 once all of them have been tried.
+int UpstreamGroup::pick(const std::string& key, uint64_t tried, time_t now) {
+    int peer = -1;
+    for (int health = 1; health >= 0 && peer < 0; health--) {
+        if (balance == BalanceLeastConn)
+            peer = leastConn(tried, now, health);
+        else if (balance == BalanceHash)
+            peer = hashed(key, tried, now, health);
+        else
+            peer = roundRobin(tried, now, health);
+    }
+    return peer;
+}
+
+// Counts a failure; max_fails of them within fail_timeout take the peer
+// out of rotation for fail_timeout seconds
+void UpstreamGroup::failed(int peer, time_t now) {
+    UpstreamPeer& p = peers[peer];
+    if (now - p.failed_at >= p.fail_timeout)
+        p.fails = 0;
+    p.fails++;
+    p.failed_at = now;
+    if (p.max_fails > 0 && p.fails == p.max_fails)
+        LOG_WARN("Upstream " << name << ": " << p.address << " marked down for " << p.fail_timeout << "s");
+}
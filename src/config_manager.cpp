@@ -1,7 +1,20 @@
 #include "../includes/Config_Manager.hpp"
+#include "../includes/MimeTypes.hpp"
+#include "../includes/AccessLog.hpp"
+#include "../includes/Log.hpp"
+#include "../includes/Trace.hpp"
+#include "../includes/Capture.hpp"
+#include "../includes/Tls.hpp"
+#include "../includes/ConfigCache.hpp"
+#include "../includes/EventLoop.hpp"
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
 
 // ConfigManager implementation
-ConfigManager::ConfigManager() : m_hasError(false) {}
+ConfigManager::ConfigManager()
+  : m_hasError(false), m_writeCache(false), m_logLevel(LogInfo), m_eventBackend(EventPoll),
+    m_traceSample(TRACE_DEFAULT_SAMPLE) {}
 ConfigManager::~ConfigManager() {}
 
 bool ConfigManager::loadFromFile(const std::string& filename) {
@@ -9,6 +22,14 @@ bool ConfigManager::loadFromFile(const std::string& filename) {
   m_hasError = false;
   m_errorMessage.clear();
   m_serverConfigs.clear();
+  m_upstreams.clear();
+  m_mimeTypes.clear();
+  m_logLevel = LogInfo;
+  m_eventBackend = EventPoll;
+  m_traceFile.reset();
+  m_traceSample = TRACE_DEFAULT_SAMPLE;
+  m_captureFile.reset();
+  m_zones.clear();
   
   // Validate filename
   if (!validateFilename(filename)) {
@@ -17,84 +38,139 @@ bool ConfigManager::loadFromFile(const std::string& filename) {
       return false;
   }
   
-  // Read file content
-  std::ifstream configFile(filename);
-  if (!configFile.is_open()) {
+  std::string content;
+  if (!readConfigText(filename, content)) {
       m_hasError = true;
       m_errorMessage = "Could not open configuration file: " + filename;
       return false;
   }
-  
-  // Read line by line and filter out commented lines
-  std::string line;
-  std::string filteredContent;
-  while (std::getline(configFile, line)) {
-      // Trim leading whitespace
-      size_t firstNonSpace = line.find_first_not_of(" \t");
-      
-      // Skip empty lines or lines that start with # after trimming
-      if (firstNonSpace == std::string::npos || line[firstNonSpace] == '#') {
-          continue;
-      }
-      
-      // For lines with inline comments, only keep the part before #
-      size_t commentPos = line.find('#');
-      if (commentPos != std::string::npos) {
-          line = line.substr(0, commentPos);
-          // If the line is now empty after removing the comment, skip it
-          if (line.find_first_not_of(" \t") == std::string::npos) {
-              continue;
-          }
-      }
-      
-      filteredContent += line + "\n";
+  size_t slash = filename.find_last_of('/');
+  m_configDir = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+
+  // A cache that exists (or is being compiled) is kept in step with the text
+  std::string cachePath = filename + CONFIG_CACHE_SUFFIX;
+  bool cached = m_writeCache || access(cachePath.c_str(), F_OK) == 0;
+  uint64_t hash = cached ? ConfigCache::hash(content) : 0;
+  std::vector<ServerBlock> servers;
+  std::vector<UpstreamBlock> upstreams;
+  bool fromCache = cached && ConfigCache::load(cachePath, hash, content.size(), servers, upstreams);
+  if (!fromCache && !parseText(content, servers, upstreams))
+      return false;
+
+  if (servers.empty()) {
+    m_hasError = true;
+    m_errorMessage = "No server blocks found in configuration file";
+    return false;
   }
-  configFile.close();
-  
-  // Tokenize
-  ConfigTokenizer tokenizer(filteredContent);
-  auto tokens = tokenizer.tokenize();
-  
-  // Extract token values
-  std::vector<std::string> tokenValues;
-  for (const auto& token : tokens) {
-      if (token.type != TokenType::EndOfFile) {
-          tokenValues.push_back(token.value);
+
+  // Build runtime configuration
+  m_serverConfigs = buildConfigs(servers, upstreams);
+  if (m_hasError)
+      return false;
+  if (m_mimeTypes.empty())
+      MimeTypes::loadDefaults(m_mimeTypes);
+  if (cached && !fromCache && !ConfigCache::store(cachePath, hash, content.size(), servers, upstreams)) {
+      if (m_writeCache) {
+          m_hasError = true;
+          m_errorMessage = "Could not write " + cachePath;
+          return false;
       }
+      LOG_WARN("Could not update " << cachePath);
   }
-  
+  return true;
+}
+
+// Nothing outside the configuration's own objects changes while it is
+// loaded, so a reload that fails leaves the running settings as they were
+void ConfigManager::apply() {
+  MimeTypes::replace(m_mimeTypes);
+  Log::level = m_logLevel;
+  EventLoop::requested = m_eventBackend;
+  Trace::use(m_traceFile, m_traceSample);
+  Capture::use(m_captureFile);
+  RateLimit::setZones(m_zones);
+}
+
+bool ConfigManager::compileCache(const std::string& filename) {
+  m_writeCache = true;
+  bool ok = loadFromFile(filename);
+  m_writeCache = false;
+  return ok;
+}
+
+// Lexes and parses the text of the main config file into its blocks
+bool ConfigManager::parseText(const std::string& content, std::vector<ServerBlock>& servers,
+                              std::vector<UpstreamBlock>& upstreams) {
+  ConfigTokenizer tokenizer(content);
+  std::vector<Token> tokens = tokenizer.tokenize();
+  if (tokenizer.hasError()) {
+      m_hasError = true;
+      m_errorMessage = tokenizer.getErrorMessage();
+      return false;
+  }
+
   // Check if tokenization produced any tokens
-  if (tokenValues.empty()) {
+  if (tokens.size() <= 1) {
     m_hasError = true;
     m_errorMessage = "Configuration file is empty or contains only comments";
     return false;
   }
 
   // Validate token content
-  if (!validateContent(tokenValues)) {
+  if (!validateContent(tokens)) {
       m_hasError = true;
-      m_errorMessage = "File does not appear to be a valid configuration file. Expected to start with 'server' block.";
+      m_errorMessage = "File does not appear to be a valid configuration file. Expected to start with 'server' or 'upstream' block.";
       return false;
   }
   
   // Parse
-  ConfigParser parser(tokenValues);
-  std::vector<ServerBlock> servers = parser.parse();
+  ConfigParser parser(tokens);
+  servers = parser.parse(upstreams);
   
   if (parser.hasError()) {
       m_hasError = true;
-      m_errorMessage = "Configuration file parsing failed. Check the error messages above for details.";
+      m_errorMessage = "Configuration file parsing failed: " + parser.getErrorMessage();
       return false;
   }
+  return true;
+}
 
-  if (servers.empty()) {
-    m_hasError = true;
-    m_errorMessage = "No server blocks found in configuration file";
-    return false;
-  }
+// Reads a whole configuration file; comments are left to the tokenizer
+bool ConfigManager::readConfigText(const std::string& filename, std::string& content) {
+  std::ifstream configFile(filename, std::ios::binary);
+  if (!configFile.is_open())
+      return false;
+  std::ostringstream text;
+  text << configFile.rdbuf();
+  content = text.str();
+  return true;
+}
 
-  // Build runtime configuration
-  m_serverConfigs = buildConfigs(servers);
+// `include mime.types;` - a file holding a single nginx-style types block
+bool ConfigManager::loadTypesFile(const std::string& filename) {
+  std::string path = filename[0] == '/' ? filename : m_configDir + filename;
+  std::string content;
+  if (!readConfigText(path, content)) {
+      m_hasError = true;
+      m_errorMessage = "Could not open included file: " + path;
+      return false;
+  }
+  ConfigTokenizer tokenizer(content);
+  std::vector<Token> tokens = tokenizer.tokenize();
+  ConfigParser parser(tokens);
+  std::vector<Directive> types;
+  while (!tokenizer.hasError() && !parser.end() && !parser.hasError())
+      parser.parseTypes(types);
+  if (tokenizer.hasError() || parser.hasError()) {
+      m_hasError = true;
+      m_errorMessage = "Invalid types file " + path + ": "
+                       + (tokenizer.hasError() ? tokenizer.getErrorMessage() : parser.getErrorMessage());
+      return false;
+  }
+  for (const Directive& entry : types) {
+      for (const std::string& ext : entry.args)
+          MimeTypes::add(m_mimeTypes, ext, entry.name);
+  }
   return true;
 }
 
@@ -107,20 +183,173 @@ bool ConfigManager::validateFilename(const std::string& filename) {
   return false;
 }
 
-bool ConfigManager::validateContent(const std::vector<std::string>& tokens) {
-  if (tokens.empty()) return false;
-  
-  // Check if first non-comment token is "server"
-  for (const auto& token : tokens) {
-      if (token == "server") return true;
-      if (!token.empty() && token[0] != '#') return false;
+bool ConfigManager::validateContent(const std::vector<Token>& tokens) {
+  // Comments never become tokens, so the first one has to start a block
+  return !tokens.empty() && tokens[0].type == TokenType::Identifier
+         && (tokens[0].value == "server" || tokens[0].value == "upstream");
+}
+
+// "..." tokens keep their quotes and escapes; directives that take text want neither
+static std::string unquote(const std::string& token) {
+  if (token.size() < 2 || token[0] != '"' || token[token.size() - 1] != '"')
+      return token;
+  std::string text;
+  for (size_t i = 1; i + 1 < token.size(); i++) {
+      if (token[i] == '\\' && i + 2 < token.size())
+          i++;
+      text += token[i];
   }
-  
-  return false;
+  return text;
+}
+
+// Parses a whole number argument; false (with the error set) if it is not one
+bool ConfigManager::parseCount(const std::string& directive, const std::string& value, long& out) {
+  char* end;
+  errno = 0;
+  out = strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || errno != 0 || out < 0) {
+      m_hasError = true;
+      m_errorMessage = "Invalid number '" + value + "' in " + directive;
+      return false;
+  }
+  return true;
+}
+
+// The directive's first argument as a count, into `out` if it is one
+bool ConfigManager::parseCount(const Directive& dir, std::size_t& out) {
+  long count;
+  if (!parseCount(dir.name, dir.args[0], count))
+      return false;
+  out = count;
+  return true;
+}
+
+// limit_req zone=name[:size] rate=N(r/s|r/m) [burst=N] [nodelay];
+// The size is in bytes, or with a k or m suffix
+bool ConfigManager::parseLimitReq(const Directive& dir, LimitReq& limit) {
+  size_t size = LIMIT_ZONE_DEFAULT_SIZE;
+  long count;
+  limit = LimitReq();
+  for (const std::string& arg : dir.args) {
+      size_t eq = arg.find('=');
+      std::string key = arg.substr(0, eq);
+      std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+      if (arg == "nodelay") {
+          limit.nodelay = true;
+      } else if (key == "zone" && !value.empty()) {
+          size_t colon = value.find(':');
+          limit.zone = value.substr(0, colon);
+          if (colon != std::string::npos) {
+              std::string amount = value.substr(colon + 1);
+              size_t unit = 1;
+              if (!amount.empty() && (amount.back() == 'k' || amount.back() == 'K'))
+                  unit = 1024;
+              else if (!amount.empty() && (amount.back() == 'm' || amount.back() == 'M'))
+                  unit = 1024 * 1024;
+              if (unit > 1)
+                  amount.pop_back();
+              if (!parseCount("limit_req zone size", amount, count))
+                  return false;
+              size = count * unit;
+          }
+      } else if (key == "rate") {
+          if (!RateLimit::parseRate(value, limit.rate)) {
+              m_hasError = true;
+              m_errorMessage = "Invalid limit_req rate (expected Nr/s or Nr/m): " + value;
+              return false;
+          }
+      } else if (key == "burst") {
+          if (!parseCount("limit_req burst", value, count))
+              return false;
+          limit.burst = count * 1000;
+      } else {
+          m_hasError = true;
+          m_errorMessage = "Unknown limit_req parameter: " + arg;
+          return false;
+      }
+  }
+  if (limit.zone.empty() || limit.rate == 0) {
+      m_hasError = true;
+      m_errorMessage = "limit_req needs zone=name and rate=N(r/s|r/m)";
+      return false;
+  }
+  m_zones[limit.zone] = size;
+  return true;
+}
+
+// upstream name {
+//     server host[:port] [weight=N] [max_fails=N] [fail_timeout=S];
+//     least_conn;                       # or: hash $request_uri | $http_<name> [consistent];
+// }
+void ConfigManager::buildUpstream(const UpstreamBlock& block) {
+  if (m_upstreams.count(block.name)) {
+      m_hasError = true;
+      m_errorMessage = "Duplicate upstream block: " + block.name;
+      return;
+  }
+  std::shared_ptr<UpstreamGroup> group = std::make_shared<UpstreamGroup>(block.name);
+  for (const Directive& dir : block.directives) {
+      if (dir.name == "server" && !dir.args.empty()) {
+          std::string address = dir.args[0];
+          if (address.find(':') == std::string::npos)
+              address += ":80";
+          long weight = 1, max_fails = UPSTREAM_DEFAULT_MAX_FAILS, fail_timeout = UPSTREAM_DEFAULT_FAIL_TIMEOUT;
+          for (size_t i = 1; i < dir.args.size(); i++) {
+              const std::string& arg = dir.args[i];
+              size_t eq = arg.find('=');
+              std::string key = arg.substr(0, eq);
+              std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+              if (key == "fail_timeout" && !value.empty() && value.back() == 's')
+                  value.pop_back();
+              long* target = key == "weight" ? &weight : key == "max_fails" ? &max_fails
+                             : key == "fail_timeout" ? &fail_timeout : NULL;
+              if (!target) {
+                  m_hasError = true;
+                  m_errorMessage = "Unknown server parameter '" + arg + "' in upstream " + block.name;
+                  return;
+              }
+              if (!parseCount(key, value, *target))
+                  return;
+          }
+          if (weight < 1 || weight > 100) {
+              m_hasError = true;
+              m_errorMessage = "weight must be between 1 and 100 in upstream " + block.name;
+              return;
+          }
+          if (group->size() == UPSTREAM_MAX_PEERS) {
+              m_hasError = true;
+              m_errorMessage = "More than " + std::to_string(UPSTREAM_MAX_PEERS) + " servers in upstream " + block.name;
+              return;
+          }
+          group->addPeer(address, weight, max_fails, fail_timeout);
+      }
+      else if (dir.name == "least_conn")
+          group->balance = BalanceLeastConn;
+      else if (dir.name == "hash" && !dir.args.empty()
+               && (dir.args[0] == "$request_uri" || dir.args[0].compare(0, 6, "$http_") == 0)) {
+          group->balance = BalanceHash;
+          group->hash_key = dir.args[0];
+      }
+      else {
+          m_hasError = true;
+          m_errorMessage = "Invalid directive '" + dir.name + "' in upstream " + block.name;
+          return;
+      }
+  }
+  if (group->size() == 0) {
+      m_hasError = true;
+      m_errorMessage = "No servers in upstream " + block.name;
+      return;
+  }
+  group->buildRing();
+  m_upstreams[block.name] = group;
 }
 
-std::vector<ServerConfig> ConfigManager::buildConfigs(const std::vector<ServerBlock>& blocks) {
+std::vector<ServerConfig> ConfigManager::buildConfigs(const std::vector<ServerBlock>& blocks,
+                                                      const std::vector<UpstreamBlock>& upstreams) {
   std::vector<ServerConfig> configs;
+  for (const UpstreamBlock& block : upstreams)
+      buildUpstream(block);
   for (const auto& block : blocks) {
       configs.push_back(buildServerConfig(block));
   }
@@ -129,16 +358,121 @@ std::vector<ServerConfig> ConfigManager::buildConfigs(const std::vector<ServerBl
 
 ServerConfig ConfigManager::buildServerConfig(const ServerBlock& block) {
   ServerConfig config;
+  bool ssl = false;
+  TlsSettings tls;
+  long count;
 
   for (const Directive& dir : block.directives) {
-      if (dir.name == "listen" && !dir.args.empty())
-          config.port = std::stoi(dir.args[0]);
+      if (dir.name == "listen" && !dir.args.empty()) {
+          if (parseCount(dir.name, dir.args[0], count)) {
+              if (count < 1 || count > 65535) {
+                  m_hasError = true;
+                  m_errorMessage = "Invalid port '" + dir.args[0] + "' in listen";
+              }
+              config.port = count;
+          }
+          ssl = dir.args.size() > 1 && dir.args[1] == "ssl";
+      }
+      else if (dir.name == "ssl_certificate" && !dir.args.empty())
+          tls.certificate = dir.args[0][0] == '/' ? dir.args[0] : m_configDir + dir.args[0];
+      else if (dir.name == "ssl_certificate_key" && !dir.args.empty())
+          tls.key = dir.args[0][0] == '/' ? dir.args[0] : m_configDir + dir.args[0];
+      else if (dir.name == "ssl_session_cache" && !dir.args.empty()) {
+          if (dir.args[0] == "off")
+              tls.session_cache = 0;
+          else if (parseCount(dir.name, dir.args[0], count))
+              tls.session_cache = count;
+      }
+      else if (dir.name == "ssl_session_timeout" && !dir.args.empty()) {
+          if (parseCount(dir.name, dir.args[0], count))
+              tls.session_timeout = count;
+      }
+      else if (dir.name == "ssl_session_tickets" && !dir.args.empty())
+          tls.session_tickets = dir.args[0] == "on";
+      else if (dir.name == "http2" && !dir.args.empty())
+          config.http2 = dir.args[0] == "on";
+      else if (dir.name == "limit_req")
+          parseLimitReq(dir, config.limit_req);
+      else if (dir.name == "limit_conn" && !dir.args.empty()) {
+          if (parseCount(dir.name, dir.args[0], count))
+              config.limit_conn = count;
+      }
+      else if (dir.name == "shutdown_timeout" && !dir.args.empty()) {
+          if (parseCount(dir.name, dir.args[0], count))
+              config.shutdown_timeout = count;
+      }
       else if (dir.name == "server_name")
           config.server_names = dir.args;
       else if (dir.name == "error_page" && dir.args.size() >= 2 && dir.args[0] == "404")
           config.error_page_404 = dir.args[1];
       else if (dir.name == "client_max_body_size" && !dir.args.empty())
-          config.client_max_body_size = std::stoul(dir.args[0]);
+          parseCount(dir, config.client_max_body_size);
+      else if (dir.name == "default_type" && !dir.args.empty())
+          config.default_type = dir.args[0];
+      else if (dir.name == "include" && !dir.args.empty())
+          loadTypesFile(dir.args[0]);
+      else if (dir.name == "access_log" && !dir.args.empty() && dir.args[0] != "off") {
+          // access_log path [format...]; the format may be quoted or bare words
+          std::string format;
+          for (size_t i = 1; i < dir.args.size(); i++)
+              format += (i > 1 ? " " : "") + unquote(dir.args[i]);
+          if (format.empty())
+              format = ACCESS_LOG_DEFAULT_FORMAT;
+          std::string error;
+          config.access_log = AccessLog::open(dir.args[0], format, error);
+          if (!config.access_log) {
+              m_hasError = true;
+              m_errorMessage = error;
+          }
+      }
+      else if (dir.name == "trace_file" && !dir.args.empty()) {
+          std::string error;
+          m_traceFile = AccessLog::openFile(dir.args[0], error);
+          if (!m_traceFile) {
+              m_hasError = true;
+              m_errorMessage = error;
+          }
+      }
+      else if (dir.name == "capture_file" && !dir.args.empty()) {
+          std::string error;
+          m_captureFile = AccessLog::openFile(dir.args[0], error);
+          if (!m_captureFile) {
+              m_hasError = true;
+              m_errorMessage = error;
+          }
+      }
+      else if (dir.name == "trace_sample" && !dir.args.empty()) {
+          if (parseCount(dir.name, dir.args[0], count))
+              m_traceSample = count;
+      }
+      else if (dir.name == "log_level" && !dir.args.empty()) {
+          if (!Log::parseLevel(dir.args[0], m_logLevel)) {
+              m_hasError = true;
+              m_errorMessage = "Unknown log_level: " + dir.args[0];
+          }
+      }
+      else if (dir.name == "event_backend" && !dir.args.empty()) {
+          if (!EventLoop::parseBackend(dir.args[0], m_eventBackend)) {
+              m_hasError = true;
+              m_errorMessage = "Unknown event_backend: " + dir.args[0];
+          }
+      }
+  }
+  for (const Directive& entry : block.types) {
+      for (const std::string& ext : entry.args)
+          MimeTypes::add(m_mimeTypes, ext, entry.name);
+  }
+  if (ssl && (tls.certificate.empty() || tls.key.empty())) {
+      m_hasError = true;
+      m_errorMessage = "listen " + std::to_string(config.port) + " ssl needs ssl_certificate and ssl_certificate_key";
+  } else if (ssl) {
+      std::string error;
+      tls.http2 = config.http2;
+      config.tls = Tls::context(tls, error);
+      if (config.tls < 0) {
+          m_hasError = true;
+          m_errorMessage = error;
+      }
   }
   // for (const LocationBlock& loc : block.locations) {
   //   RouteConfigFromConfigFile route = buildRouteConfigFromLocation(loc, config.client_max_body_size);
@@ -164,12 +498,69 @@ ServerConfig ConfigManager::buildServerConfig(const ServerBlock& block) {
           else if (dir.name == "cgi" && dir.args.size() == 2)
               route.cgi_handlers[dir.args[0]] = dir.args[1];
           else if (dir.name == "client_max_body_size" && !dir.args.empty())
-              route.client_max_body_size = std::stoul(dir.args[0]);
+              parseCount(dir, route.client_max_body_size);
           else if (dir.name == "redirect") {
               route.redirect = dir.args[0];
           }
+          else if (dir.name == "etag_hash" && !dir.args.empty())
+              route.etag_hash = (dir.args[0] == "on");
+          else if (dir.name == "autoindex_page_size" && !dir.args.empty())
+              parseCount(dir, route.autoindex_page_size);
+          else if (dir.name == "fastcgi_pass" && !dir.args.empty())
+              route.fastcgi_pass = dir.args[0];
+          else if (dir.name == "fastcgi_connect_timeout" && !dir.args.empty())
+              parseCount(dir, route.fastcgi_connect_timeout);
+          else if (dir.name == "fastcgi_read_timeout" && !dir.args.empty())
+              parseCount(dir, route.fastcgi_read_timeout);
+          else if (dir.name == "cgi_pool" && !dir.args.empty())
+              parseCount(dir, route.cgi_pool);
+          else if (dir.name == "cgi_relay" && !dir.args.empty())
+              route.cgi_relay = dir.args[0];
+          else if (dir.name == "cgi_timeout" && !dir.args.empty())
+              parseCount(dir, route.cgi_timeout);
+          else if (dir.name == "cgi_max_concurrency" && !dir.args.empty())
+              parseCount(dir, route.cgi_max_concurrency);
+          else if (dir.name == "default_type" && !dir.args.empty())
+              route.default_type = dir.args[0];
+          else if (dir.name == "stub_status")
+              route.stub_status = dir.args.empty() || dir.args[0] == "on";
+          else if (dir.name == "proxy_pass" && !dir.args.empty()) {
+              std::string upstream, path;
+              if (!Proxy::parsePass(dir.args[0], upstream, path)) {
+                  m_hasError = true;
+                  m_errorMessage = "Invalid proxy_pass (expected http://host[:port][/path]): " + dir.args[0];
+              }
+              route.proxy_pass = dir.args[0];
+              // http://name without a port can be an upstream block
+              auto group = m_upstreams.find(upstream.substr(0, upstream.size() - 3));
+              if (dir.args[0].compare(7, upstream.size(), upstream) != 0 && group != m_upstreams.end())
+                  route.proxy_upstream = group->second;
+          }
+          else if (dir.name == "proxy_connect_timeout" && !dir.args.empty())
+              parseCount(dir, route.proxy_connect_timeout);
+          else if (dir.name == "proxy_send_timeout" && !dir.args.empty())
+              parseCount(dir, route.proxy_send_timeout);
+          else if (dir.name == "proxy_read_timeout" && !dir.args.empty())
+              parseCount(dir, route.proxy_read_timeout);
+          else if (dir.name == "proxy_set_header" && !dir.args.empty())
+              route.proxy_set_headers.push_back(std::make_pair(dir.args[0],
+                                                dir.args.size() > 1 ? unquote(dir.args[1]) : ""));
+          else if (dir.name == "proxy_keepalive" && !dir.args.empty())
+              parseCount(dir, route.proxy_keepalive);
+          else if (dir.name == "cache_valid" && !dir.args.empty())
+              parseCount(dir, route.cache_valid);
+          else if (dir.name == "cache_max_size" && !dir.args.empty())
+              parseCount(dir, route.cache_max_size);
+          else if (dir.name == "cache_key_headers")
+              route.cache_key_headers = dir.args;
+          else if (dir.name == "limit_req")
+              parseLimitReq(dir, route.limit_req);
       }
       route.client_max_body_size = config.client_max_body_size;
+      if (route.limit_req.zone.empty())
+          route.limit_req = config.limit_req;
+      if (route.default_type.empty())
+          route.default_type = config.default_type;
       config.routes.push_back(route);
   }
 
@@ -204,135 +595,148 @@ void ConfigManager::printConfigs() const {
 // ConfigTokenizer implementation
 ConfigTokenizer::ConfigTokenizer(const std::string& input) : m_input(input), m_pos(0) {}
 
-std::vector<Token> ConfigTokenizer::tokenize() {
-  std::vector<Token> tokens;
-  int lineNumber = 1;
-  bool lineCommented = false;
-
-  std::regex tokenRegex(
-      R"((\s+)|(#.*$)|("([^"\\]|\\.)*")|([{};])|([^\s{};"#]+))", std::regex::ECMAScript);
+static bool isConfigSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
 
-  std::smatch match;
+// Bare words end at whitespace, a symbol, a quote or a comment
+static bool endsWord(char c) {
+  return isConfigSpace(c) || c == '{' || c == '}' || c == ';' || c == '"' || c == '#';
+}
 
-  while (m_pos < m_input.size()) {
-      // Reset lineCommented flag at the start of each new line
-      if (m_pos == 0 || m_input[m_pos-1] == '\n') {
-        lineCommented = false;
+std::vector<Token> ConfigTokenizer::tokenize() {
+  std::vector<Token> tokens;
+  const std::string& in = m_input;
+  size_t size = in.size();
+  int line = 1;
+  size_t lineStart = 0;
+
+  while (m_pos < size) {
+      char c = in[m_pos];
+      if (c == '\n') {
+          line++;
+          lineStart = ++m_pos;
+          continue;
+      }
+      if (isConfigSpace(c)) {
+          m_pos++;
+          continue;
+      }
+      if (c == '#') {
+          // Comment: skip to the end of the line
+          while (m_pos < size && in[m_pos] != '\n')
+              m_pos++;
+          continue;
       }
 
-      std::string remaining = m_input.substr(m_pos);
-      if (std::regex_search(remaining, match, tokenRegex)) {
-          std::string tokenStr = match.str();
-
-          for (char c : tokenStr) {
-            if (c == '\n') lineNumber++;
-          }
-          
-          // Move position forward by the token's position and length
-          m_pos += match.position();
-          
-          if (match[1].matched) {
-              // Skip whitespace
-          } else if (match[2].matched) {
-              lineCommented = true;
-              // No need to add comment tokens
-          } else if (!lineCommented) {
-              // Only add tokens if the line is not commented
-              if (match[3].matched) {
-                  tokens.push_back({TokenType::String, tokenStr});
-              } else if (match[5].matched) {
-                  tokens.push_back({TokenType::Symbol, tokenStr});
-              } else if (match[6].matched) {
-                  tokens.push_back({TokenType::Identifier, tokenStr});
+      size_t start = m_pos;
+      int column = (int)(start - lineStart) + 1;
+      if (c == '{' || c == '}' || c == ';') {
+          m_pos++;
+          tokens.push_back({TokenType::Symbol, std::string(1, c), line, column});
+      } else if (c == '"') {
+          // Kept with its quotes and escapes, as directives expect; may span lines
+          int startLine = line;
+          m_pos++;
+          while (m_pos < size && in[m_pos] != '"') {
+              if (in[m_pos] == '\\' && m_pos + 1 < size)
+                  m_pos++;
+              if (in[m_pos] == '\n') {
+                  line++;
+                  lineStart = m_pos + 1;
               }
+              m_pos++;
           }
-          
-          // Always advance past the current token
-          m_pos += match.length();
+          if (m_pos >= size) {
+              m_error = "Unterminated string at line " + std::to_string(startLine)
+                        + ", column " + std::to_string(column);
+              std::cerr << "Error: " << m_error << std::endl;
+              break;
+          }
+          m_pos++;
+          tokens.push_back({TokenType::String, in.substr(start, m_pos - start), startLine, column});
       } else {
-        std::cerr << "Error: Unexpected character at line " << lineNumber << std::endl;
-        break;
+          while (m_pos < size && !endsWord(in[m_pos]))
+              m_pos++;
+          tokens.push_back({TokenType::Identifier, in.substr(start, m_pos - start), line, column});
       }
   }
 
-  tokens.push_back({TokenType::EndOfFile, ""});
+  tokens.push_back({TokenType::EndOfFile, "", line, (int)(m_pos - lineStart) + 1});
   return tokens;
 }
 
 // ConfigParser implementation
-ConfigParser::ConfigParser(const std::vector<std::string>& tokens)
+ConfigParser::ConfigParser(const std::vector<Token>& tokens)
   : m_tokens(tokens), m_pos(0), m_hasError(false) {}
 
-std::vector<ServerBlock> ConfigParser::parse() {
+std::vector<ServerBlock> ConfigParser::parse(std::vector<UpstreamBlock>& upstreams) {
   std::vector<ServerBlock> servers;
   while (!end()) {
     if (peek() == "server") {
         servers.push_back(parseServer());
+    } else if (peek() == "upstream") {
+        upstreams.push_back(parseUpstream());
     } else {
-      std::string token = peek();
-      std::cerr << "Error: Unexpected token '" << token << "'. Expected 'server'" << std::endl;
+      error("Unexpected token '" + peek() + "'. Expected 'server' or 'upstream'");
       advance();
-      m_hasError = true;
     }
   }
   return servers;
 }
 
-std::string ConfigParser::peek() const {
-  size_t pos = m_pos;
-  while (pos < m_tokens.size()) {
-    // Skip comments - assuming these are stored as tokens starting with #
-    if (!m_tokens[pos].empty() && m_tokens[pos][0] == '#') {
-        pos++;
-        continue;
-    }
-    return m_tokens[pos];
-  }
-  return "";
+// Prints the error with where it happened; the first one is kept for the caller
+void ConfigParser::error(const std::string& message) {
+  std::string where;
+  if (m_pos < m_tokens.size())
+      where = " (line " + std::to_string(m_tokens[m_pos].line) + ", column "
+              + std::to_string(m_tokens[m_pos].column) + ")";
+  std::cerr << "Error: " << message << where << std::endl;
+  if (!m_hasError)
+      m_error = message + where;
+  m_hasError = true;
 }
 
-std::string ConfigParser::advance() {
-  while (m_pos < m_tokens.size()) {
-    std::string token = m_tokens[m_pos++];
-    // Skip comments
-    if (!token.empty() && token[0] == '#') {
-        continue;
-    }
-    return token;
-  }
-  return "";
+static const std::string NO_TOKEN;
+
+const std::string& ConfigParser::peek() const {
+  return end() ? NO_TOKEN : m_tokens[m_pos].value;
+}
+
+const std::string& ConfigParser::advance() {
+  return end() ? NO_TOKEN : m_tokens[m_pos++].value;
 }
 
 bool ConfigParser::match(const std::string& expected) {
-  if (peek() == expected) {
-      advance();
+  if (!end() && m_tokens[m_pos].value == expected && m_tokens[m_pos].type != TokenType::String) {
+      m_pos++;
       return true;
   }
   return false;
 }
 
 bool ConfigParser::end() const {
-  return m_pos >= m_tokens.size();
+  return m_pos >= m_tokens.size() || m_tokens[m_pos].type == TokenType::EndOfFile;
 }
 
 ServerBlock ConfigParser::parseServer() {
   ServerBlock server;
   match("server");
   if (!match("{")) {
-    std::cerr << "Error: Expected '{' after 'server', but found '" << peek() << "'" << std::endl;
-      m_hasError = true;
+      error("Expected '{' after 'server', but found '" + peek() + "'");
       return server;
   }
   
   while (!match("}")) {
       if (end()) {
-          std::cerr << "Error: Unexpected end of file, expected '}' to close server block" << std::endl;
-          m_hasError = true;
+          error("Unexpected end of file, expected '}' to close server block");
           break;
       }
       
       if (peek() == "location") {
           server.locations.push_back(parseLocation());
+      } else if (peek() == "types") {
+          parseTypes(server.types);
       } else {
           server.directives.push_back(parseDirective());
       }
@@ -346,8 +750,7 @@ LocationBlock ConfigParser::parseLocation() {
   match("location");
   
   if (end()) {
-      std::cerr << "Error: Unexpected end of file, expected location path" << std::endl;
-      m_hasError = true;
+      error("Unexpected end of file, expected location path");
       return location;
   }
   
@@ -357,8 +760,7 @@ LocationBlock ConfigParser::parseLocation() {
     advance(); // Consume the tilde
     
     if (end()) {
-        std::cerr << "Error: Unexpected end of file after '~', expected regex pattern" << std::endl;
-        m_hasError = true;
+        error("Unexpected end of file after '~', expected regex pattern");
         return location;
     }
     
@@ -366,22 +768,19 @@ LocationBlock ConfigParser::parseLocation() {
     location.path = advance();
   } else {
     // Regular path
-    location.path = advance();;
+    location.path = advance();
   }
 
   if (!match("{")) {
-    std::cerr << "Error: Expected '{' after location " 
-              << (location.is_regex ? "regex pattern" : "path") << " '" 
-              << location.path << "', but found '" << peek() << "'" << std::endl;
-    m_hasError = true;
+    error("Expected '{' after location " + std::string(location.is_regex ? "regex pattern" : "path")
+          + " '" + location.path + "', but found '" + peek() + "'");
     return location;
   }
   
   while (!match("}")) {
       if (end()) {
-        std::cerr << "Error: Unexpected end of file, expected '}' to close location block for path '" 
-                  << location.path << "'" << std::endl;
-          m_hasError = true;
+          error("Unexpected end of file, expected '}' to close location block for path '"
+                + location.path + "'");
           break;
       }
       
@@ -391,26 +790,63 @@ LocationBlock ConfigParser::parseLocation() {
   return location;
 }
 
+UpstreamBlock ConfigParser::parseUpstream() {
+  UpstreamBlock upstream;
+  match("upstream");
+  if (end() || m_tokens[m_pos].type != TokenType::Identifier || peek() == "{") {
+      error("Expected a name after 'upstream', but found '" + peek() + "'");
+      return upstream;
+  }
+  upstream.name = advance();
+  if (!match("{")) {
+      error("Expected '{' after upstream '" + upstream.name + "', but found '" + peek() + "'");
+      return upstream;
+  }
+  while (!match("}")) {
+      if (end()) {
+          error("Unexpected end of file, expected '}' to close upstream block '" + upstream.name + "'");
+          break;
+      }
+      upstream.directives.push_back(parseDirective());
+  }
+  return upstream;
+}
+
+// types { text/html html htm; ... } - each entry reads like a directive
+// named after the media type, with the extensions as its arguments
+void ConfigParser::parseTypes(std::vector<Directive>& types) {
+  match("types");
+  if (!match("{")) {
+      error("Expected '{' after 'types', but found '" + peek() + "'");
+      return;
+  }
+  while (!match("}")) {
+      if (end()) {
+          error("Unexpected end of file, expected '}' to close types block");
+          return;
+      }
+      types.push_back(parseDirective());
+  }
+}
+
 Directive ConfigParser::parseDirective() {
   Directive directive;
   
   if (end()) {
-      std::cerr << "Error: Unexpected end of file, expected directive name" << std::endl;
-      m_hasError = true;
+      error("Unexpected end of file, expected directive name");
       return directive;
   }
   
   directive.name = advance();
   
-  while (peek() != ";" && !end()) {
+  while (!end() && m_tokens[m_pos].type != TokenType::Symbol) {
       directive.args.push_back(advance());
   }
   
   if (!match(";")) {
-    std::cerr << "Error: Expected ';' after directive '" << directive.name 
-              << "' with " << directive.args.size() << " arguments, but found '" 
-              << (end() ? "end of file" : peek()) << "'" << std::endl;
-      m_hasError = true;
+      error("Expected ';' after directive '" + directive.name + "' with "
+            + std::to_string(directive.args.size()) + " arguments, but found '"
+            + (end() ? "end of file" : peek()) + "'");
   }
   
   return directive;
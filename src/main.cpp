@@ -3,19 +3,29 @@
 #include <iostream>
 
 int main(int argc, char *argv[]) {
-  if (argc != 2)
+  bool compile = argc == 3 && std::string(argv[1]) == "--compile";
+  if (argc != 2 && !compile)
   {
-    std::cerr << "Usage: " << argv[0] << " <config_file>" << std::endl;
+    std::cerr << "Usage: " << argv[0] << " [--compile] <config_file>" << std::endl;
     return (0);
   }
-  std::string configFile = argv[1];
+  std::string configFile = argv[argc - 1];
   ConfigManager configManager;
+  if (compile) {
+    // Writes <config_file>.cache, which later starts load instead of parsing
+    if (!configManager.compileCache(configFile)) {
+      std::cerr << "Configuration error: " << configManager.getErrorMessage() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
   if (!configManager.loadFromFile(configFile)) {
     std::cerr << "Configuration error: " << configManager.getErrorMessage() << std::endl;
     return 1;
   }
+  configManager.apply();
   // configManager.printConfigs();
-	Server myServer(configManager.getServerConfigs());
+	Server myServer(configManager.getServerConfigs(), configFile);
 
 	myServer.run();
 
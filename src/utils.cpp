@@ -1,6 +1,13 @@
 #include "../includes/Utils.hpp"
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 std::string read_file (const std::string& path) {
 	std::ifstream file(path.c_str());
@@ -9,4 +16,80 @@ std::string read_file (const std::string& path) {
 	std::ostringstream ss;
 	ss << file.rdbuf();
 	return ss.str();
-}
\ No newline at end of file
+}
+
+// IMF-fixdate as used by Date, Last-Modified and If-Range (RFC 7231 7.1.1.1)
+std::string http_date(time_t t) {
+	char buf[64];
+	struct tm gmt;
+	gmtime_r(&t, &gmt);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	return buf;
+}
+
+// Accepts IMF-fixdate only; returns -1 for anything else (RFC 7232 3.3: ignore it)
+time_t parse_http_date(const std::string& str) {
+	struct tm gmt = {};
+	const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	if (!end || *end != '\0')
+		return -1;
+	return timegm(&gmt);
+}
+
+// Non-blocking stream connection to "unix:/path" or "host:port". Returns
+// the socket with in_progress set while connect() completes, or -1 (errno
+// is 0 if the address could not be resolved).
+int connect_nonblocking(const std::string& address, bool& in_progress) {
+	int fd = -1;
+	int res;
+	in_progress = false;
+	errno = 0;
+
+	if (address.compare(0, 5, "unix:") == 0) {
+		struct sockaddr_un addr;
+		std::string path = address.substr(5);
+		if (path.size() >= sizeof(addr.sun_path))
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		res = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+	} else {
+		size_t colon = address.rfind(':');
+		if (colon == std::string::npos)
+			return -1;
+		struct addrinfo hints;
+		struct addrinfo* info;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(),
+						&hints, &info) != 0) {
+			errno = 0;
+			return -1;
+		}
+		fd = socket(info->ai_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			freeaddrinfo(info);
+			return -1;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		res = connect(fd, info->ai_addr, info->ai_addrlen);
+		freeaddrinfo(info);
+	}
+	if (res < 0 && (errno == EINPROGRESS || errno == EAGAIN)) {
+		in_progress = true;
+	} else if (res < 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
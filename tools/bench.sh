@@ -0,0 +1,222 @@
+#!/bin/sh
+# Runs the load generator against a freshly started webserv and prints the
+# results as JSON (or writes them to $1). Used by `make bench`.
+#
+# Knobs: BENCH_DURATION (seconds per scenario, default 3), BENCH_CONNS
+# (connections, default 16), BENCH_RATE (open-loop requests/s, default 2000),
+# BENCH_PORT (default 18080; the stand-in proxy upstream gets the next port,
+# the TLS scenarios the one after and the event backend servers the next),
+# BENCH_TLS (0 skips the TLS scenarios, which also need the openssl command
+# for a throwaway certificate), BENCH_IDLE (idle connections held open in the
+# event backend scenarios, default 1000), BENCH_HEAP_MB (cached responses the
+# server holds, in MiB, before the Python CGI scenarios run again, default 256).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WEBSERV="$ROOT/webserv"
+LOADGEN="$ROOT/tools/loadgen"
+UPSTREAM="$ROOT/tools/upstream"
+DURATION=${BENCH_DURATION:-3}
+CONNS=${BENCH_CONNS:-16}
+RATE=${BENCH_RATE:-2000}
+PORT=${BENCH_PORT:-18080}
+UPSTREAM_PORT=$((PORT + 1))
+TLS_PORT=$((PORT + 2))
+EVENT_PORT=$((PORT + 3))
+IDLE=${BENCH_IDLE:-1000}
+TLS=${BENCH_TLS:-1}
+command -v openssl > /dev/null 2>&1 || TLS=0
+HEAP_MB=${BENCH_HEAP_MB:-256}
+PYTHON=1
+[ -x /usr/bin/python3 ] || PYTHON=0
+OUT=${1:-/dev/stdout}
+
+WORK=$(mktemp -d /tmp/webserv-bench.XXXXXX)
+SERVER_PID=
+UPSTREAM_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    [ -n "$UPSTREAM_PID" ] && kill "$UPSTREAM_PID" 2>/dev/null && wait "$UPSTREAM_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# Document tree: a small and a large file, a directory to list, a CGI script
+# (also in a cache_valid location), a CGI download of 64 MiB relayed with
+# splice() or through a userspace buffer (cgi_relay), a Python CGI script run
+# by a fresh interpreter or a cgi_pool one, and a script of about 1 MB whose
+# cached answers make the server's heap large
+mkdir -p "$WORK/www/static" "$WORK/www/list" "$WORK/www/cgi" "$WORK/www/cgi_cached" "$WORK/www/uploads" \
+    "$WORK/www/cgi_splice" "$WORK/www/cgi_copy" "$WORK/www/cgi_py" "$WORK/www/cgi_pool" "$WORK/www/heap"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$WORK/www/static/small.html"
+head -c 10485760 /dev/zero > "$WORK/www/static/large.bin"
+i=0
+while [ $i -lt 500 ]; do
+    : > "$WORK/www/list/file-$i.txt"
+    i=$((i + 1))
+done
+printf '#!/bin/sh\nprintf "Content-Type: text/plain\\r\\n\\r\\nhello\\n"\n' > "$WORK/www/cgi/hello.cgi"
+chmod +x "$WORK/www/cgi/hello.cgi"
+cp "$WORK/www/cgi/hello.cgi" "$WORK/www/cgi_cached/hello.cgi"
+printf '#!/bin/sh\nprintf "Content-Type: application/octet-stream\\r\\n\\r\\n"\nhead -c 67108864 /dev/zero\n' \
+    > "$WORK/www/cgi_splice/large.cgi"
+chmod +x "$WORK/www/cgi_splice/large.cgi"
+cp "$WORK/www/cgi_splice/large.cgi" "$WORK/www/cgi_copy/large.cgi"
+printf 'import sys\nsys.stdout.write("Content-Type: text/plain\\r\\n\\r\\nhello\\n")\n' > "$WORK/www/cgi_py/hello.py"
+cp "$WORK/www/cgi_py/hello.py" "$WORK/www/cgi_pool/hello.py"
+printf '#!/bin/sh\nprintf "Content-Type: application/octet-stream\\r\\n\\r\\n"\nhead -c 1000000 /dev/zero\n' \
+    > "$WORK/www/heap/fill.cgi"
+chmod +x "$WORK/www/heap/fill.cgi"
+{
+    printf -- '--BENCH\r\nContent-Disposition: form-data; name="file"; filename="bench.bin"\r\n'
+    printf 'Content-Type: application/octet-stream\r\n\r\n'
+    head -c 65536 /dev/zero
+    printf -- '\r\n--BENCH--\r\n'
+} > "$WORK/upload.body"
+
+cat > "$WORK/bench.conf" <<CONF
+server {
+    listen $PORT;
+    server_name localhost;
+    log_level warn;
+    location /static/ { methods GET; root www; }
+    location /list/ { methods GET; root www; autoindex on; }
+    location /uploads/ { methods GET POST; root www; }
+    location /cgi/ { methods GET POST; root www; }
+    location /cgi_cached/ { methods GET; root www; cache_valid 60; }
+    location /cgi_splice/ { methods GET; root www; cgi_relay splice; }
+    location /cgi_copy/ { methods GET; root www; cgi_relay copy; }
+    location /cgi_py/ { methods GET; root www; }
+    location /cgi_pool/ { methods GET; root www; cgi_pool 4; }
+    location /heap/ { methods GET; root www; cache_valid 3600; cache_max_size $((HEAP_MB * 1048576)); }
+    location /proxy/ { proxy_pass http://127.0.0.1:$UPSTREAM_PORT; }
+    location /proxy_reconnect/ { proxy_pass http://127.0.0.1:$UPSTREAM_PORT; proxy_keepalive 0; }
+    client_max_body_size 10000000;
+}
+CONF
+
+# Same static tree over TLS
+if [ "$TLS" = 1 ]; then
+    openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -subj /CN=localhost \
+        -days 1 -keyout "$WORK/key.pem" -out "$WORK/cert.pem" > /dev/null 2>&1
+    cat >> "$WORK/bench.conf" <<CONF
+server {
+    listen $TLS_PORT ssl;
+    ssl_certificate cert.pem;
+    ssl_certificate_key key.pem;
+    server_name localhost;
+    log_level warn;
+    location /static/ { methods GET; root www; }
+}
+CONF
+fi
+
+# Starts webserv on config $1 and waits until it serves $2
+start_server() {
+    "$WEBSERV" "$1" > server.log 2>&1 &
+    SERVER_PID=$!
+    i=0
+    until "$LOADGEN" -c 1 -d 0.1 "$2" | grep -q '"200"'; do
+        i=$((i + 1))
+        if [ $i -ge 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+            echo "webserv did not come up:" >&2
+            cat server.log >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+cd "$WORK"
+"$UPSTREAM" -p "$UPSTREAM_PORT" -s 1024 > upstream.log 2>&1 &
+UPSTREAM_PID=$!
+start_server bench.conf "http://localhost:$PORT/static/small.html"
+
+rss() {
+    awk -v key="$1:" '$1 == key { print $2 }' "/proc/$SERVER_PID/status" 2>/dev/null || echo 0
+}
+
+first=1
+scenario() {
+    name=$1
+    shift
+    result=$("$LOADGEN" -n "$name" -d "$DURATION" "$@")
+    [ $first -eq 1 ] || printf ',\n'
+    first=0
+    # With -M, the event loop syscalls the server made per request answered
+    extra=
+    syscalls=$(printf '%s' "$result" | sed -n 's/.*event_loop_syscalls_total{[^}]*}":\([0-9]*\).*/\1/p')
+    requests=$(printf '%s' "$result" | sed -n 's/.*"requests":\([0-9]*\).*/\1/p')
+    if [ -n "$syscalls" ] && [ "${requests:-0}" -gt 0 ]; then
+        extra=$(awk -v s="$syscalls" -v r="$requests" 'BEGIN { printf ",\"syscalls_per_request\":%.2f", s / r }')
+    fi
+    # Append the server's memory use after the run to the generator's object
+    printf '    %s%s,"rss_kb":%s,"peak_rss_kb":%s}' "${result%\}}" "$extra" "$(rss VmRSS)" "$(rss VmHWM)"
+    echo "$name done" >&2
+}
+
+BASE="http://localhost:$PORT"
+{
+    printf '{\n  "commit": "%s",\n  "date": "%s",\n  "duration_s": %s,\n  "note": "%s",\n  "scenarios": [\n' \
+        "$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)" \
+        "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$DURATION" \
+        "webserv closes every HTTP/1.1 connection after its response, so each HTTP/1.1 request pays for a new connection; only the h2 scenarios reuse one"
+    scenario static_small -c "$CONNS" "$BASE/static/small.html"
+    scenario static_small_open -c "$CONNS" -r "$RATE" "$BASE/static/small.html"
+    scenario static_large -c 4 "$BASE/static/large.bin"
+    scenario not_found -c "$CONNS" "$BASE/static/missing.html"
+    scenario listing -c "$CONNS" "$BASE/list/"
+    scenario upload -c 4 -m POST -b "$WORK/upload.body" \
+        -H "Content-Type: multipart/form-data; boundary=BENCH" "$BASE/uploads/"
+    scenario cgi -c 4 "$BASE/cgi/hello.cgi"
+    scenario cgi_cached -c 4 "$BASE/cgi_cached/hello.cgi"
+    scenario cgi_large_splice -c 4 "$BASE/cgi_splice/large.cgi"
+    scenario cgi_large_copy -c 4 "$BASE/cgi_copy/large.cgi"
+    scenario proxy_keepalive -c "$CONNS" "$BASE/proxy/small"
+    scenario proxy_reconnect -c "$CONNS" "$BASE/proxy_reconnect/small"
+    # As many requests in flight as static_small, as streams of one connection
+    scenario h2_static_small -c 1 -2 -s "$CONNS" "$BASE/static/small.html"
+    if [ "$TLS" = 1 ]; then
+        # A handshake per request, full or resumed from a session ticket, then bulk transfer
+        TLS_BASE="https://localhost:$TLS_PORT"
+        scenario tls_handshake_full -c "$CONNS" "$TLS_BASE/static/small.html"
+        scenario tls_handshake_resumed -c "$CONNS" -R "$TLS_BASE/static/small.html"
+        scenario tls_static_large -c 4 "$TLS_BASE/static/large.bin"
+        scenario tls_h2_static_small -c 1 -2 -s "$CONNS" "$TLS_BASE/static/small.html"
+    fi
+    # Spawn latency of a Python script, cold or from cgi_pool, with the server
+    # small and then holding $HEAP_MB MiB of cached responses (fork() copies
+    # page tables in proportion to that, posix_spawn() does not)
+    if [ "$PYTHON" = 1 ]; then
+        scenario cgi_py -c 4 "$BASE/cgi_py/hello.py"
+        scenario cgi_py_pool -c 4 "$BASE/cgi_pool/hello.py"
+        i=0
+        while [ $i -lt "$HEAP_MB" ]; do
+            "$LOADGEN" -c 1 -d 0.01 "$BASE/heap/fill.cgi?$i" > /dev/null
+            i=$((i + 1))
+        done
+        scenario cgi_py_heap -c 4 "$BASE/cgi_py/hello.py"
+        scenario cgi_py_pool_heap -c 4 "$BASE/cgi_pool/hello.py"
+    fi
+    # Small-file load beside $IDLE parked connections, on a server per event
+    # backend; one the kernel lacks falls back (see the metrics' label)
+    kill "$SERVER_PID" && wait "$SERVER_PID" 2>/dev/null || true
+    for backend in poll epoll io_uring; do
+        cat > "event-$backend.conf" <<CONF
+server {
+    listen $EVENT_PORT;
+    server_name localhost;
+    log_level warn;
+    event_backend $backend;
+    location /static/ { methods GET; root www; }
+    location /status { stub_status; }
+}
+CONF
+        start_server "event-$backend.conf" "http://localhost:$EVENT_PORT/static/small.html"
+        scenario "event_${backend}_idle" -c "$CONNS" -i "$IDLE" -M "http://localhost:$EVENT_PORT/status" \
+            "http://localhost:$EVENT_PORT/static/small.html"
+        kill "$SERVER_PID" && wait "$SERVER_PID" 2>/dev/null || true
+    done
+    SERVER_PID=
+    printf '\n  ]\n}\n'
+} > "$OUT"
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Loopback check of fastcgi_pass against tools/fcgi_responder.py: request
+# params and bodies reach the backend, a large answer is relayed without
+# the server holding it, and an answer without a header block gets 502.
+# Prints a line per check and exits non-zero if any fails. Used by
+# `make fcgi-check`; needs python3 and curl.
+#
+# Knobs: CHECK_PORT (default 18180; the responder gets the next port).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WEBSERV="$ROOT/webserv"
+PORT=${CHECK_PORT:-18180}
+FCGI_PORT=$((PORT + 1))
+# Growth of the server's peak RSS a 64 MiB answer may cause, in KiB
+RELAY_MAX_GROWTH_KB=16384
+
+WORK=$(mktemp -d /tmp/webserv-fcgi-check.XXXXXX)
+SERVER_PID=
+FCGI_PID=
+cleanup() {
+    status=$?
+    set +e
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    [ -n "$FCGI_PID" ] && kill "$FCGI_PID" 2>/dev/null && wait "$FCGI_PID" 2>/dev/null
+    rm -rf "$WORK"
+    exit $status
+}
+trap cleanup EXIT INT TERM
+
+cd "$WORK"
+mkdir -p www/fcgi
+cat > check.conf <<CONF
+server {
+    listen $PORT;
+    server_name localhost;
+    log_level warn;
+    location /fcgi/ { methods GET POST; root www; fastcgi_pass 127.0.0.1:$FCGI_PORT; fastcgi_read_timeout 10; }
+    client_max_body_size 10000000;
+}
+CONF
+head -c 3000000 /dev/urandom > body.bin
+BODY_MD5=$(md5sum < body.bin | cut -d' ' -f1)
+
+python3 "$ROOT/tools/fcgi_responder.py" "127.0.0.1:$FCGI_PORT" > fcgi.log 2>&1 &
+FCGI_PID=$!
+"$WEBSERV" check.conf > server.log 2>&1 &
+SERVER_PID=$!
+BASE="http://localhost:$PORT/fcgi"
+i=0
+until [ "$(curl -s -o /dev/null -w "%{http_code}" "$BASE/info")" = 200 ]; do
+    i=$((i + 1))
+    if [ $i -ge 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null || ! kill -0 "$FCGI_PID" 2>/dev/null; then
+        echo "webserv or the responder did not come up:" >&2
+        cat server.log fcgi.log >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+failed=0
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        failed=1
+    fi
+}
+
+rss() {
+    awk -v key="$1:" '$1 == key { print $2 }' "/proc/$SERVER_PID/status" 2>/dev/null || echo 0
+}
+
+check "params" "$(curl -s "$BASE/info?a=1" | grep -c '^QUERY_STRING=a=1$')" 1
+check "body with Content-Length" "$(curl -s --data-binary @body.bin "$BASE/info" | grep '^body')" \
+    "body 3000000 bytes md5 $BODY_MD5"
+check "chunked body" "$(curl -s -H 'Transfer-Encoding: chunked' --data-binary @body.bin "$BASE/info" | grep '^body')" \
+    "body 3000000 bytes md5 $BODY_MD5"
+
+before=$(rss VmHWM)
+size=$(curl -s -o /dev/null -w '%{http_code} %{size_download}' "$BASE/large?size=67108864")
+check "64 MiB answer" "$size" "200 67108864"
+if [ -r "/proc/$SERVER_PID/status" ]; then
+    growth=$(( $(rss VmHWM) - before ))
+    check "64 MiB answer relayed" "$([ $growth -le $RELAY_MAX_GROWTH_KB ] && echo yes || echo "no, +${growth} KiB")" yes
+fi
+
+check "no header block" "$(curl -s -o /dev/null -w '%{http_code}' "$BASE/bad?garbage=200000")" 502
+check "after the failures" "$(curl -s "$BASE/info?b=2" | grep -c '^QUERY_STRING=b=2$')" 1
+
+exit $failed
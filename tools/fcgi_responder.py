@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Minimal FastCGI responder for trying out fastcgi_pass locally.
+
+Usage: tools/fcgi_responder.py unix:/tmp/webserv-fcgi.sock
+       tools/fcgi_responder.py 127.0.0.1:9000
+
+Answers every request with a text/plain summary of its params and body,
+and honours FCGI_KEEP_CONN so pooled connections are reused. A query of
+size=N answers with N bytes instead, and garbage=N with N bytes that never
+end a header block (both used by tools/fcgi_check.sh).
+"""
+import hashlib
+import os
+import socket
+import struct
+import sys
+import threading
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+
+
+def read_exact(conn, n):
+    data = b""
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    header = read_exact(conn, 8)
+    if header is None:
+        return None
+    _, rtype, req_id, length, padding, _ = struct.unpack("!BBHHBB", header)
+    content = read_exact(conn, length + padding)
+    if content is None:
+        return None
+    return rtype, req_id, content[:length]
+
+
+def write_record(conn, rtype, req_id, content):
+    for pos in range(0, max(len(content), 1), 65535):
+        part = content[pos:pos + 65535]
+        padding = (8 - len(part) % 8) % 8
+        conn.sendall(struct.pack("!BBHHBB", 1, rtype, req_id, len(part), padding, 0)
+                     + part + b"\0" * padding)
+
+
+def decode_params(data):
+    params, pos = {}, 0
+    while pos < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[pos] < 128:
+                lengths.append(data[pos])
+                pos += 1
+            else:
+                lengths.append(struct.unpack("!I", data[pos:pos + 4])[0] & 0x7FFFFFFF)
+                pos += 4
+        name = data[pos:pos + lengths[0]].decode("latin-1")
+        pos += lengths[0]
+        params[name] = data[pos:pos + lengths[1]].decode("latin-1")
+        pos += lengths[1]
+    return params
+
+
+def serve(conn):
+    with conn:
+        while True:
+            record = read_record(conn)
+            if record is None or record[0] != BEGIN_REQUEST:
+                return
+            req_id, keep_conn = record[1], record[2][2] & 1
+            params, body = b"", b""
+            while True:
+                record = read_record(conn)
+                if record is None:
+                    return
+                rtype, _, content = record
+                if rtype == PARAMS:
+                    params += content
+                elif rtype == STDIN:
+                    if not content:
+                        break
+                    body += content
+            env = decode_params(params)
+            query = dict(part.split("=", 1) for part in env.get("QUERY_STRING", "").split("&")
+                         if "=" in part)
+            if "size" in query:
+                write_record(conn, STDOUT, req_id, b"Content-Type: application/octet-stream\r\n\r\n")
+                left = int(query["size"])
+                while left > 0:
+                    part = min(left, 65535)
+                    write_record(conn, STDOUT, req_id, b"x" * part)
+                    left -= part
+            elif "garbage" in query:
+                write_record(conn, STDOUT, req_id, b"x" * int(query["garbage"]))
+            else:
+                text = "pid %d\n" % os.getpid()
+                text += "".join("%s=%s\n" % item for item in sorted(env.items()))
+                text += "body %d bytes md5 %s\n" % (len(body), hashlib.md5(body).hexdigest())
+                write_record(conn, STDOUT, req_id,
+                             b"Content-Type: text/plain\r\n\r\n" + text.encode())
+            write_record(conn, STDOUT, req_id, b"")
+            write_record(conn, END_REQUEST, req_id, b"\0" * 8)
+            if not keep_conn:
+                return
+
+
+def main():
+    address = sys.argv[1] if len(sys.argv) > 1 else "unix:/tmp/webserv-fcgi.sock"
+    if address.startswith("unix:"):
+        path = address[5:]
+        if os.path.exists(path):
+            os.unlink(path)
+        server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        server.bind(path)
+    else:
+        host, port = address.rsplit(":", 1)
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind((host, int(port)))
+    server.listen(128)
+    while True:
+        conn, _ = server.accept()
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
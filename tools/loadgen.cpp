@@ -0,0 +1,1127 @@
+// HTTP/1.1 and HTTP/2 load generator for `make bench`.
+//
+// Usage: tools/loadgen [options] http[s]://host:port/path
+//   -c N        connections (default 16)
+//   -d SECONDS  measured duration (default 5)
+//   -r RATE     open loop: send RATE requests/s on a fixed schedule and
+//               measure latency from each request's scheduled time, so a
+//               stalled server is charged for the requests it held up
+//               (coordinated omission). 0 = closed loop (default): every
+//               connection sends its next request as soon as it has an answer.
+//   -k          keep connections open between requests when the server allows it
+//   -m METHOD   request method (default GET)
+//   -b FILE     request body
+//   -H HEADER   extra request header, e.g. -H 'Content-Type: text/plain'
+//   -n NAME     scenario name copied into the output
+//   -R          https: offer the last session ticket on every new connection,
+//               so handshakes are resumed instead of full
+//   -2          HTTP/2, with prior knowledge over http:// and ALPN over
+//               https://; connections stay open and each carries -s streams
+//   -s STREAMS  concurrent streams per HTTP/2 connection (default 1)
+//   -i IDLE     also hold IDLE connections open that never send anything,
+//               as slow or parked clients would
+//   -M URL      scrape this http:// stub_status page before and after the
+//               run and report how much each *_total counter grew
+//
+// Prints one JSON object: request and error counts, status codes, rps and
+// latency percentiles in microseconds, and for https the handshakes done
+// and how many of them were resumed, and the -i and -M results. Linux only (epoll); https needs a
+// build with WEBSERV_TLS (make TLS=1).
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "Http2.hpp"
+#ifdef WEBSERV_TLS
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
+#define READ_CHUNK 65536
+
+enum ConnState { Idle, Connecting, Handshaking, Writing, Reading, Streaming };
+enum BodyMode { BodyLength, BodyChunked, BodyUntilClose };
+enum ChunkState { ChunkSize, ChunkData, ChunkDataEnd, ChunkTrailer };
+
+// One request on an HTTP/2 connection
+struct H2Request {
+    uint64_t intended = 0;
+    int status = 0;
+    size_t body_offset = 0;       // Request body bytes sent
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    size_t unacked = 0;           // DATA bytes not yet given back with WINDOW_UPDATE
+};
+
+struct H2Client {
+    std::string in;               // Bytes read and not yet parsed
+    std::string out;              // Frames not yet written
+    size_t out_offset = 0;
+    uint32_t events = 0;          // What epoll watches for
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    std::map<uint32_t, H2Request> streams;
+    uint32_t next_stream = 1;
+    size_t max_streams = 1;       // -s, or fewer if the server says so
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    uint32_t peer_window = H2_DEFAULT_WINDOW;
+    size_t unacked = 0;
+    uint32_t header_stream = 0;   // Stream of a header block still in CONTINUATIONs
+    bool header_end_stream = false;
+    std::string header_block;
+    bool goaway = false;          // No new streams; closed once the last one is done
+};
+
+struct Conn {
+    int fd = -1;
+    ConnState state = Idle;
+    bool reused = false;          // Request went out on a kept-alive connection
+    size_t out_offset = 0;
+    uint64_t intended = 0;        // When the request was due (open loop) or sent
+    std::string head;             // Response bytes up to the end of the headers
+    bool head_done = false;
+    int status = 0;
+    BodyMode mode = BodyUntilClose;
+    uint64_t remaining = 0;       // BodyLength: bytes still to come
+    ChunkState chunk_state = ChunkSize;
+    std::string chunk_data;       // BodyChunked: undecoded tail
+    bool server_close = false;    // Connection: close, or no keep-alive asked for
+    H2Client h2;                  // -2
+#ifdef WEBSERV_TLS
+    SSL* ssl = NULL;
+#endif
+};
+
+struct Options {
+    size_t connections = 16;
+    double duration = 5;
+    double rate = 0;
+    bool keepalive = false;
+    std::string method = "GET";
+    std::string body;
+    std::vector<std::string> headers;
+    std::string name;
+    std::string host;
+    std::string port = "80";
+    std::string path = "/";
+    bool tls = false;
+    bool resume = false;
+    bool http2 = false;
+    size_t streams = 1;
+    size_t idle = 0;
+    std::string metrics_url;
+};
+
+typedef std::map<std::string, double> Counters;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-c conns] [-d seconds] [-r rate] [-k] [-m method] [-b body_file]"
+                    " [-H header]... [-n name] [-R] [-2 [-s streams]] [-i idle] [-M metrics_url]"
+                    " http[s]://host:port/path\n", argv0);
+    exit(2);
+}
+
+static bool parseUrl(const std::string& url, Options& opts) {
+    std::string rest;
+    if (url.compare(0, 7, "http://") == 0) {
+        rest = url.substr(7);
+    } else if (url.compare(0, 8, "https://") == 0) {
+        rest = url.substr(8);
+        opts.tls = true;
+        opts.port = "443";
+    } else {
+        return false;
+    }
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    opts.path = slash == std::string::npos ? "/" : rest.substr(slash);
+    size_t colon = authority.find(':');
+    opts.host = authority.substr(0, colon);
+    if (colon != std::string::npos)
+        opts.port = authority.substr(colon + 1);
+    return !opts.host.empty();
+}
+
+class LoadGen {
+    public:
+        LoadGen(const Options& opts, const struct sockaddr_storage& addr, socklen_t addr_len);
+        void run();
+        void report(const Counters& metrics) const;
+
+    private:
+        const Options& opts;
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        std::string request;
+        int epfd;
+        std::vector<Conn> conns;
+        std::vector<int> idle;        // -i: connected, never written to
+        size_t idle_closed = 0;       // ...and closed by the server during the run
+        std::vector<uint32_t> latencies;
+        std::map<int, uint64_t> statuses;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        uint64_t started = 0;
+        uint64_t elapsed = 0;
+        uint64_t next_due = 0;        // Open loop: schedule of the next request
+        uint64_t interval = 0;
+        uint64_t backlog = 0;         // Open loop: requests due but never sent
+        uint64_t handshakes = 0;      // https: completed, full or resumed
+        uint64_t resumed = 0;
+#ifdef WEBSERV_TLS
+        SSL_CTX* ctx = NULL;
+        static SSL_SESSION* session;  // Newest ticket the server gave us, for -R
+
+        static int keepSession(SSL* ssl, SSL_SESSION* fresh);
+#endif
+
+        void openIdle();
+        bool openConn(Conn& conn);
+        void closeConn(Conn& conn);
+        void send(Conn& conn, uint64_t intended);
+        void onWritable(Conn& conn);
+        void handshake(Conn& conn);
+        ssize_t write(Conn& conn, const char* data, size_t len);
+        ssize_t read(Conn& conn, char* buf, size_t len);
+        void onReadable(Conn& conn, uint64_t deadline);
+        bool consumeBody(Conn& conn, const char* data, size_t len);
+        void complete(Conn& conn, uint64_t deadline);
+        void fail(Conn& conn);
+        void watch(Conn& conn, uint32_t events, int op);
+        bool fillStreams(Conn& conn, uint64_t now);
+        void startH2(Conn& conn);
+        void sendStream(Conn& conn, uint64_t intended);
+        void pumpBodies(Conn& conn);
+        void flushH2(Conn& conn);
+        void onH2Readable(Conn& conn, uint64_t deadline);
+        bool h2Frame(Conn& conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload,
+                     size_t len, uint64_t deadline);
+        void completeStream(Conn& conn, std::map<uint32_t, H2Request>::iterator it, uint64_t deadline);
+        void failH2(Conn& conn);
+};
+
+LoadGen::LoadGen(const Options& o, const struct sockaddr_storage& a, socklen_t len)
+    : opts(o), addr(a), addr_len(len), conns(o.connections) {
+    std::ostringstream req;
+    req << opts.method << " " << opts.path << " HTTP/1.1\r\n"
+        << "Host: " << opts.host << "\r\n"
+        << "User-Agent: webserv-loadgen\r\n";
+    for (const std::string& header : opts.headers)
+        req << header << "\r\n";
+    if (!opts.body.empty() || opts.method == "POST" || opts.method == "PUT")
+        req << "Content-Length: " << opts.body.size() << "\r\n";
+    if (!opts.keepalive)
+        req << "Connection: close\r\n";
+    req << "\r\n" << opts.body;
+    request = req.str();
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+#ifdef WEBSERV_TLS
+    if (opts.tls) {
+        // Benchmarking only: the server's certificate is not checked
+        ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, keepSession);
+        // The HTTP/2 output buffer grows between retries of a short write
+        SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+        if (opts.http2)
+            SSL_CTX_set_alpn_protos(ctx, (const unsigned char*)"\x02h2", 3);
+    }
+#endif
+}
+
+#ifdef WEBSERV_TLS
+SSL_SESSION* LoadGen::session = NULL;
+
+// TLS 1.3 tickets come after the handshake, while the response is read
+int LoadGen::keepSession(SSL*, SSL_SESSION* fresh) {
+    if (session)
+        SSL_SESSION_free(session);
+    session = fresh;
+    return 1; // Ours now
+}
+#endif
+
+void LoadGen::watch(Conn& conn, uint32_t events, int op) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = &conn - &conns[0];
+    epoll_ctl(epfd, op, conn.fd, &ev);
+}
+
+// Connected before the clock starts and left alone: they cost the server
+// nothing but what its event loop spends on fds that stay quiet
+void LoadGen::openIdle() {
+    for (size_t i = 0; i < opts.idle; i++) {
+        int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, addr_len) < 0) {
+            perror("idle connection");
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        idle.push_back(fd);
+    }
+}
+
+bool LoadGen::openConn(Conn& conn) {
+    conn.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn.fd, (struct sockaddr*)&addr, addr_len) < 0 && errno != EINPROGRESS) {
+        close(conn.fd);
+        conn.fd = -1;
+        return false;
+    }
+    conn.state = Connecting;
+    conn.reused = false;
+    conn.h2 = H2Client();
+    conn.h2.max_streams = opts.streams;
+    watch(conn, EPOLLOUT, EPOLL_CTL_ADD);
+    return true;
+}
+
+void LoadGen::closeConn(Conn& conn) {
+#ifdef WEBSERV_TLS
+    if (conn.ssl) {
+        // Without close_notify OpenSSL would mark the session not resumable
+        SSL_shutdown(conn.ssl);
+        ERR_clear_error();
+        SSL_free(conn.ssl);
+        conn.ssl = NULL;
+    }
+#endif
+    if (conn.fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, NULL);
+        close(conn.fd);
+    }
+    conn.fd = -1;
+    conn.state = Idle;
+}
+
+void LoadGen::send(Conn& conn, uint64_t intended) {
+    conn.intended = intended;
+    conn.out_offset = 0;
+    conn.head.clear();
+    conn.head_done = false;
+    conn.status = 0;
+    conn.chunk_data.clear();
+    if (conn.fd >= 0) {
+        conn.reused = true;
+        conn.state = Writing;
+        watch(conn, EPOLLOUT, EPOLL_CTL_MOD);
+        onWritable(conn);
+    } else if (!openConn(conn)) {
+        errors++;
+    }
+}
+
+void LoadGen::fail(Conn& conn) {
+    errors++;
+    closeConn(conn);
+}
+
+void LoadGen::onWritable(Conn& conn) {
+    if (conn.state == Connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            fail(conn);
+            return;
+        }
+        conn.state = Writing;
+#ifdef WEBSERV_TLS
+        if (opts.tls) {
+            conn.ssl = SSL_new(ctx);
+            SSL_set_fd(conn.ssl, conn.fd);
+            SSL_set_tlsext_host_name(conn.ssl, opts.host.c_str());
+            if (opts.resume && session)
+                SSL_set_session(conn.ssl, session);
+            SSL_set_connect_state(conn.ssl);
+            conn.state = Handshaking;
+            handshake(conn);
+            return;
+        }
+#endif
+        if (opts.http2) {
+            startH2(conn);
+            return;
+        }
+    }
+    while (conn.out_offset < request.size()) {
+        ssize_t n = write(conn, request.data() + conn.out_offset, request.size() - conn.out_offset);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            if (conn.reused) {
+                // The server closed the kept-alive connection first: not an error
+                closeConn(conn);
+                send(conn, conn.intended);
+            } else {
+                fail(conn);
+            }
+            return;
+        }
+        conn.out_offset += n;
+    }
+    conn.state = Reading;
+    watch(conn, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+void LoadGen::handshake(Conn& conn) {
+#ifdef WEBSERV_TLS
+    ERR_clear_error();
+    int rc = SSL_do_handshake(conn.ssl);
+    if (rc == 1) {
+        handshakes++;
+        if (SSL_session_reused(conn.ssl))
+            resumed++;
+        if (opts.http2) {
+            startH2(conn);
+            return;
+        }
+        conn.state = Writing;
+        watch(conn, EPOLLOUT, EPOLL_CTL_MOD);
+        onWritable(conn);
+        return;
+    }
+    int reason = SSL_get_error(conn.ssl, rc);
+    if (reason == SSL_ERROR_WANT_READ)
+        watch(conn, EPOLLIN, EPOLL_CTL_MOD);
+    else if (reason == SSL_ERROR_WANT_WRITE)
+        watch(conn, EPOLLOUT, EPOLL_CTL_MOD);
+    else
+        fail(conn);
+#else
+    fail(conn);
+#endif
+}
+
+#ifdef WEBSERV_TLS
+// What send()/recv() would say for a failed SSL_write()/SSL_read()
+static ssize_t sslResult(SSL* ssl, int rc) {
+    int reason = SSL_get_error(ssl, rc);
+    ERR_clear_error();
+    if (reason == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    errno = reason == SSL_ERROR_WANT_READ || reason == SSL_ERROR_WANT_WRITE ? EAGAIN : ECONNRESET;
+    return -1;
+}
+#endif
+
+ssize_t LoadGen::write(Conn& conn, const char* data, size_t len) {
+#ifdef WEBSERV_TLS
+    if (conn.ssl) {
+        int n = SSL_write(conn.ssl, data, (int)len);
+        return n > 0 ? n : sslResult(conn.ssl, n);
+    }
+#endif
+    return ::send(conn.fd, data, len, MSG_NOSIGNAL);
+}
+
+ssize_t LoadGen::read(Conn& conn, char* buf, size_t len) {
+#ifdef WEBSERV_TLS
+    if (conn.ssl) {
+        int n = SSL_read(conn.ssl, buf, (int)len);
+        return n > 0 ? n : sslResult(conn.ssl, n);
+    }
+#endif
+    return recv(conn.fd, buf, len, 0);
+}
+
+// Feeds body bytes to the framing; returns true once the body is complete
+bool LoadGen::consumeBody(Conn& conn, const char* data, size_t len) {
+    if (conn.mode == BodyUntilClose)
+        return false;
+    if (conn.mode == BodyLength) {
+        conn.remaining -= std::min<uint64_t>(conn.remaining, len);
+        return conn.remaining == 0;
+    }
+    conn.chunk_data.append(data, len);
+    size_t pos = 0;
+    bool done = false;
+    while (!done) {
+        if (conn.chunk_state == ChunkData) {
+            size_t take = std::min<uint64_t>(conn.remaining, conn.chunk_data.size() - pos);
+            pos += take;
+            conn.remaining -= take;
+            if (conn.remaining > 0)
+                break;
+            conn.chunk_state = ChunkDataEnd;
+        }
+        size_t eol = conn.chunk_data.find("\r\n", pos);
+        if (eol == std::string::npos)
+            break;
+        if (conn.chunk_state == ChunkSize) {
+            conn.remaining = strtoull(conn.chunk_data.c_str() + pos, NULL, 16);
+            conn.chunk_state = conn.remaining > 0 ? ChunkData : ChunkTrailer;
+        } else if (conn.chunk_state == ChunkDataEnd) {
+            conn.chunk_state = ChunkSize;
+        } else if (eol == pos) {
+            done = true; // Empty line after the last chunk's trailers
+        }
+        pos = eol + 2;
+    }
+    conn.chunk_data.erase(0, pos);
+    return done;
+}
+
+void LoadGen::onReadable(Conn& conn, uint64_t deadline) {
+    char buf[READ_CHUNK];
+    while (true) {
+        ssize_t n = read(conn, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            if (conn.head_done && conn.mode == BodyUntilClose) {
+                conn.server_close = true;
+                complete(conn, deadline);
+            } else if (conn.reused && conn.head.empty()) {
+                closeConn(conn);
+                send(conn, conn.intended);
+            } else {
+                fail(conn);
+            }
+            return;
+        }
+        bytes += n;
+        const char* body = buf;
+        size_t body_len = n;
+        if (!conn.head_done) {
+            size_t before = conn.head.size();
+            conn.head.append(buf, n);
+            size_t end = conn.head.find("\r\n\r\n");
+            if (end == std::string::npos)
+                continue;
+            conn.head_done = true;
+            conn.head.resize(end + 4);
+            body = buf + (end + 4 - before);
+            body_len = n - (end + 4 - before);
+            conn.status = atoi(conn.head.c_str() + 9);
+
+            std::string lower = conn.head;
+            std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+            size_t cl = lower.find("\r\ncontent-length:");
+            conn.server_close = !opts.keepalive || lower.find("\r\nconnection: close") != std::string::npos;
+            if (lower.find("\r\ntransfer-encoding: chunked") != std::string::npos) {
+                conn.mode = BodyChunked;
+                conn.chunk_state = ChunkSize;
+                conn.remaining = 0;
+            } else if (cl != std::string::npos) {
+                conn.mode = BodyLength;
+                conn.remaining = strtoull(lower.c_str() + cl + 17, NULL, 10);
+            } else {
+                conn.mode = BodyUntilClose;
+            }
+            if (conn.mode == BodyLength && conn.remaining == 0) {
+                complete(conn, deadline);
+                return;
+            }
+        }
+        if (body_len > 0 && consumeBody(conn, body, body_len)) {
+            complete(conn, deadline);
+            return;
+        }
+    }
+}
+
+void LoadGen::complete(Conn& conn, uint64_t deadline) {
+    uint64_t now = now_us();
+    if (now <= deadline) {
+        uint64_t latency = now - conn.intended;
+        latencies.push_back(latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+        statuses[conn.status]++;
+    }
+    if (conn.server_close)
+        closeConn(conn);
+    else
+        conn.state = Idle;
+}
+
+// -2: keeps the connection open with up to max_streams requests on it.
+// False when the open-loop schedule has nothing more due.
+bool LoadGen::fillStreams(Conn& conn, uint64_t now) {
+    if (conn.fd < 0) {
+        if (!openConn(conn))
+            errors++;
+        return true;
+    }
+    H2Client& h2 = conn.h2;
+    if (conn.state != Streaming || h2.goaway)
+        return true;
+    bool due = true;
+    bool queued = false;
+    while (h2.streams.size() < h2.max_streams && h2.next_stream <= H2_MAX_WINDOW) {
+        if (opts.rate > 0) {
+            if (next_due > now) {
+                due = false;
+                break;
+            }
+            sendStream(conn, next_due);
+            next_due += interval;
+        } else {
+            sendStream(conn, now);
+        }
+        queued = true;
+    }
+    if (queued) {
+        pumpBodies(conn);
+        flushH2(conn);
+    }
+    return due;
+}
+
+void LoadGen::startH2(Conn& conn) {
+#ifdef WEBSERV_TLS
+    if (conn.ssl) {
+        const unsigned char* proto = NULL;
+        unsigned int len = 0;
+        SSL_get0_alpn_selected(conn.ssl, &proto, &len);
+        if (len != 2 || memcmp(proto, "h2", 2) != 0) {
+            fail(conn); // The server did not pick h2
+            return;
+        }
+    }
+#endif
+    conn.state = Streaming;
+    conn.h2.out.append(H2_PREFACE, H2_PREFACE_LEN);
+    Http2::settings(conn.h2.out);
+    conn.h2.events = 0;
+    flushH2(conn);
+}
+
+void LoadGen::sendStream(Conn& conn, uint64_t intended) {
+    H2Client& h2 = conn.h2;
+    uint32_t id = h2.next_stream;
+    h2.next_stream += 2;
+    HeaderList fields;
+    fields.push_back(HeaderField(":method", opts.method));
+    fields.push_back(HeaderField(":scheme", opts.tls ? "https" : "http"));
+    fields.push_back(HeaderField(":authority", opts.host));
+    fields.push_back(HeaderField(":path", opts.path));
+    fields.push_back(HeaderField("user-agent", "webserv-loadgen"));
+    for (const std::string& header : opts.headers) {
+        size_t colon = header.find(':');
+        std::string name = header.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (colon == std::string::npos || name == "host" || name == "connection")
+            continue;
+        size_t value = header.find_first_not_of(" \t", colon + 1);
+        fields.push_back(HeaderField(name, value == std::string::npos ? "" : header.substr(value)));
+    }
+    if (!opts.body.empty() || opts.method == "POST" || opts.method == "PUT")
+        fields.push_back(HeaderField("content-length", std::to_string(opts.body.size())));
+    std::string block;
+    h2.encoder.encode(fields, block);
+    Http2::headers(h2.out, id, block, opts.body.empty(), H2_MAX_FRAME);
+
+    H2Request& request = h2.streams[id];
+    request.intended = intended;
+    request.send_window = h2.peer_window;
+}
+
+// Request bodies, as far as the flow-control windows let them go
+void LoadGen::pumpBodies(Conn& conn) {
+    H2Client& h2 = conn.h2;
+    for (auto& entry : h2.streams) {
+        H2Request& request = entry.second;
+        while (request.body_offset < opts.body.size() && h2.send_window > 0 && request.send_window > 0) {
+            size_t len = std::min<int64_t>(std::min(h2.send_window, request.send_window), H2_MAX_FRAME);
+            len = std::min(len, opts.body.size() - request.body_offset);
+            bool last = request.body_offset + len == opts.body.size();
+            Http2::frame(h2.out, H2Data, last ? H2_FLAG_END_STREAM : 0, entry.first,
+                         opts.body.data() + request.body_offset, len);
+            request.body_offset += len;
+            request.send_window -= len;
+            h2.send_window -= len;
+        }
+    }
+}
+
+void LoadGen::flushH2(Conn& conn) {
+    H2Client& h2 = conn.h2;
+    while (h2.out_offset < h2.out.size()) {
+        ssize_t n = write(conn, h2.out.data() + h2.out_offset, h2.out.size() - h2.out_offset);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            failH2(conn);
+            return;
+        }
+        h2.out_offset += n;
+    }
+    if (h2.out_offset == h2.out.size()) {
+        h2.out.clear();
+        h2.out_offset = 0;
+    }
+    uint32_t events = h2.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    if (events != h2.events) {
+        watch(conn, events, EPOLL_CTL_MOD);
+        h2.events = events;
+    }
+}
+
+void LoadGen::onH2Readable(Conn& conn, uint64_t deadline) {
+    H2Client& h2 = conn.h2;
+    char buf[READ_CHUNK];
+    while (true) {
+        ssize_t n = read(conn, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            failH2(conn);
+            return;
+        }
+        bytes += n;
+        h2.in.append(buf, n);
+        size_t pos = 0;
+        while (h2.in.size() - pos >= H2_FRAME_HEADER) {
+            const uint8_t* p = (const uint8_t*)h2.in.data() + pos;
+            size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+            if (h2.in.size() - pos < H2_FRAME_HEADER + len)
+                break;
+            if (!h2Frame(conn, p[3], p[4], Http2::read32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len,
+                         deadline)) {
+                failH2(conn);
+                return;
+            }
+            pos += H2_FRAME_HEADER + len;
+        }
+        h2.in.erase(0, pos);
+    }
+    if (h2.goaway && h2.streams.empty()) {
+        closeConn(conn);
+        return;
+    }
+    pumpBodies(conn);
+    flushH2(conn);
+}
+
+// Handles one frame from the server; false for a protocol error
+bool LoadGen::h2Frame(Conn& conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload,
+                      size_t len, uint64_t deadline) {
+    H2Client& h2 = conn.h2;
+    if (h2.header_stream != 0 && (type != H2Continuation || id != h2.header_stream))
+        return false;
+    auto it = h2.streams.find(id);
+    switch (type) {
+        case H2Data:
+            h2.unacked += len;
+            if (h2.unacked >= H2_WINDOW / 2) {
+                Http2::windowUpdate(h2.out, 0, h2.unacked);
+                h2.unacked = 0;
+            }
+            if (it == h2.streams.end())
+                return true;
+            if (flags & H2_FLAG_END_STREAM) {
+                completeStream(conn, it, deadline);
+            } else if ((it->second.unacked += len) >= H2_WINDOW / 2) {
+                Http2::windowUpdate(h2.out, id, it->second.unacked);
+                it->second.unacked = 0;
+            }
+            return true;
+        case H2Headers:
+        case H2Continuation: {
+            if (type == H2Headers) {
+                size_t skip = 0;
+                size_t pad = 0;
+                if (flags & H2_FLAG_PADDED) {
+                    if (len < 1)
+                        return false;
+                    pad = payload[0];
+                    skip = 1;
+                }
+                if (flags & H2_FLAG_PRIORITY)
+                    skip += 5;
+                if (skip + pad > len)
+                    return false;
+                h2.header_block.assign((const char*)payload + skip, len - skip - pad);
+                h2.header_end_stream = flags & H2_FLAG_END_STREAM;
+            } else if (h2.header_stream == 0) {
+                return false;
+            } else {
+                h2.header_block.append((const char*)payload, len);
+            }
+            if (!(flags & H2_FLAG_END_HEADERS)) {
+                h2.header_stream = id;
+                return true;
+            }
+            h2.header_stream = 0;
+            HeaderList fields;
+            if (!h2.decoder.decode((const uint8_t*)h2.header_block.data(), h2.header_block.size(), fields))
+                return false;
+            if (it == h2.streams.end())
+                return true;
+            for (const HeaderField& field : fields) {
+                if (field.first == ":status" && atoi(field.second.c_str()) >= 200)
+                    it->second.status = atoi(field.second.c_str());
+            }
+            if (h2.header_end_stream)
+                completeStream(conn, it, deadline);
+            return true;
+        }
+        case H2RstStream:
+            if (it != h2.streams.end()) {
+                errors++;
+                h2.streams.erase(it);
+            }
+            return true;
+        case H2Settings:
+            if (flags & H2_FLAG_ACK)
+                return true;
+            for (size_t i = 0; i + 6 <= len; i += 6) {
+                uint16_t setting = (payload[i] << 8) | payload[i + 1];
+                uint32_t value = Http2::read32(payload + i + 2);
+                if (setting == H2HeaderTableSize) {
+                    h2.encoder.setMaxSize(value);
+                } else if (setting == H2MaxConcurrentStreams) {
+                    h2.max_streams = std::min<size_t>(opts.streams, value);
+                } else if (setting == H2InitialWindowSize) {
+                    for (auto& entry : h2.streams)
+                        entry.second.send_window += (int64_t)value - h2.peer_window;
+                    h2.peer_window = value;
+                }
+            }
+            Http2::frame(h2.out, H2Settings, H2_FLAG_ACK, 0, "", 0);
+            return true;
+        case H2Ping:
+            if (!(flags & H2_FLAG_ACK))
+                Http2::frame(h2.out, H2Ping, H2_FLAG_ACK, 0, (const char*)payload, len);
+            return true;
+        case H2Goaway: {
+            if (len < 8)
+                return false;
+            // Streams above the last one the server took were never answered
+            uint32_t last = Http2::read32(payload) & 0x7fffffff;
+            h2.goaway = true;
+            for (auto stream = h2.streams.upper_bound(last); stream != h2.streams.end();) {
+                errors++;
+                stream = h2.streams.erase(stream);
+            }
+            return true;
+        }
+        case H2WindowUpdate:
+            if (len != 4)
+                return false;
+            if (id == 0)
+                h2.send_window += Http2::read32(payload) & 0x7fffffff;
+            else if (it != h2.streams.end())
+                it->second.send_window += Http2::read32(payload) & 0x7fffffff;
+            return true;
+        default:
+            return true; // PRIORITY, PUSH_PROMISE (push is off) and unknown types
+    }
+}
+
+void LoadGen::completeStream(Conn& conn, std::map<uint32_t, H2Request>::iterator it, uint64_t deadline) {
+    uint64_t now = now_us();
+    if (now <= deadline) {
+        uint64_t latency = now - it->second.intended;
+        latencies.push_back(latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+        statuses[it->second.status]++;
+    }
+    conn.h2.streams.erase(it);
+}
+
+// Streams still open when the connection fails count as errors; a
+// connection closed with none open (idle timeout) does not
+void LoadGen::failH2(Conn& conn) {
+    errors += conn.h2.streams.size();
+    conn.h2.streams.clear();
+    closeConn(conn);
+}
+
+void LoadGen::run() {
+    std::vector<struct epoll_event> events(conns.size());
+
+    openIdle();
+    started = now_us();
+    uint64_t deadline = started + (uint64_t)(opts.duration * 1e6);
+    if (opts.rate > 0) {
+        interval = (uint64_t)(1e6 / opts.rate);
+        if (interval == 0)
+            interval = 1;
+        next_due = started;
+    }
+    while (true) {
+        uint64_t now = now_us();
+        if (now >= deadline)
+            break;
+        // Hand out work to idle connections
+        for (Conn& conn : conns) {
+            if (opts.http2) {
+                if (!fillStreams(conn, now))
+                    break;
+                continue;
+            }
+            if (conn.state != Idle)
+                continue;
+            if (opts.rate > 0) {
+                if (next_due > now)
+                    break;
+                send(conn, next_due);
+                next_due += interval;
+            } else {
+                send(conn, now);
+            }
+        }
+        uint64_t wake = deadline;
+        if (opts.rate > 0 && next_due < wake)
+            wake = next_due;
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            Conn& conn = conns[events[i].data.u64];
+            if (conn.fd < 0)
+                continue;
+            if (conn.state == Handshaking)
+                handshake(conn);
+            else if (conn.state == Connecting || conn.state == Writing)
+                onWritable(conn);
+            else if (conn.state == Reading)
+                onReadable(conn, deadline);
+            else if (conn.state == Streaming)
+                onH2Readable(conn, deadline);
+        }
+    }
+    elapsed = now_us() - started;
+    if (opts.rate > 0 && next_due < started + elapsed)
+        backlog = (started + elapsed - next_due) / interval;
+    for (Conn& conn : conns)
+        closeConn(conn);
+    char byte;
+    for (int fd : idle) {
+        ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            idle_closed++;
+        close(fd);
+    }
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Prometheus text from a stub_status page: every *_total sample, by name
+// and labels. False if the page could not be fetched.
+static bool scrape(const Options& url, const struct sockaddr_storage& addr, socklen_t addr_len,
+                   Counters& counters) {
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, addr_len) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    std::string request = "GET " + url.path + " HTTP/1.1\r\nHost: " + url.host + "\r\nConnection: close\r\n\r\n";
+    std::string response;
+    char buf[READ_CHUNK];
+    ssize_t n;
+    if (::write(fd, request.data(), request.size()) == (ssize_t)request.size()) {
+        while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+            response.append(buf, n);
+    }
+    close(fd);
+    size_t body = response.find("\r\n\r\n");
+    if (response.compare(0, 12, "HTTP/1.1 200") != 0 || body == std::string::npos)
+        return false;
+    std::istringstream lines(response.substr(body + 4));
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t space = line.rfind(' ');
+        if (line.empty() || line[0] == '#' || space == std::string::npos)
+            continue;
+        std::string sample = line.substr(0, space);
+        std::string name = sample.substr(0, sample.find('{'));
+        if (name.size() > 6 && name.compare(name.size() - 6, 6, "_total") == 0)
+            counters[sample] = strtod(line.c_str() + space + 1, NULL);
+    }
+    return true;
+}
+
+static std::string jsonEscape(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+void LoadGen::report(const Counters& metrics) const {
+    std::vector<uint32_t> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    double mean = 0;
+    for (uint32_t latency : sorted)
+        mean += latency;
+    if (!sorted.empty())
+        mean /= sorted.size();
+    double seconds = elapsed / 1e6;
+
+    printf("{\"name\":\"%s\",\"url\":\"%s://%s:%s%s\",\"method\":\"%s\",\"protocol\":\"%s\","
+           "\"connections\":%zu,\"keepalive\":%s,\"mode\":\"%s\",\"target_rate\":%.0f,\"duration_s\":%.3f,"
+           "\"requests\":%zu,\"errors\":%llu,\"backlog\":%llu,\"bytes\":%llu,\"rps\":%.1f,",
+           opts.name.c_str(), opts.tls ? "https" : "http", opts.host.c_str(), opts.port.c_str(), opts.path.c_str(),
+           opts.method.c_str(), opts.http2 ? "h2" : "http/1.1", opts.connections,
+           opts.keepalive || opts.http2 ? "true" : "false",
+           opts.rate > 0 ? "open" : "closed", opts.rate, seconds, sorted.size(),
+           (unsigned long long)errors, (unsigned long long)backlog, (unsigned long long)bytes,
+           seconds > 0 ? sorted.size() / seconds : 0.0);
+    printf("\"status\":{");
+    bool first = true;
+    for (const auto& status : statuses) {
+        printf("%s\"%d\":%llu", first ? "" : ",", status.first, (unsigned long long)status.second);
+        first = false;
+    }
+    printf("},");
+    if (opts.http2)
+        printf("\"streams\":%zu,", opts.streams);
+    if (opts.tls)
+        printf("\"handshakes\":%llu,\"resumed\":%llu,", (unsigned long long)handshakes,
+               (unsigned long long)resumed);
+    if (opts.idle)
+        printf("\"idle\":%zu,\"idle_closed\":%zu,", idle.size(), idle_closed);
+    if (!opts.metrics_url.empty()) {
+        // Counters that moved during the run (and the scrapes themselves)
+        printf("\"metrics\":{");
+        first = true;
+        for (const auto& counter : metrics) {
+            printf("%s\"%s\":%.0f", first ? "" : ",", jsonEscape(counter.first).c_str(), counter.second);
+            first = false;
+        }
+        printf("},");
+    }
+    printf("\"latency_us\":{\"mean\":%.0f,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+           mean, percentile(sorted, 0.5), percentile(sorted, 0.9), percentile(sorted, 0.99),
+           percentile(sorted, 0.999), sorted.empty() ? 0 : sorted.back());
+}
+
+static bool resolve(const Options& opts, struct sockaddr_storage& addr, socklen_t& addr_len) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(opts.host.c_str(), opts.port.c_str(), &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", opts.host.c_str(), gai_strerror(err));
+        return false;
+    }
+    // The server listens on IPv4; "localhost" may resolve to ::1 first
+    struct addrinfo* chosen = res;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            chosen = ai;
+            break;
+        }
+    }
+    memcpy(&addr, chosen->ai_addr, chosen->ai_addrlen);
+    addr_len = chosen->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    int c;
+    while ((c = getopt(argc, argv, "c:d:r:km:b:H:n:R2s:i:M:")) != -1) {
+        switch (c) {
+            case 'c': opts.connections = strtoul(optarg, NULL, 10); break;
+            case 'd': opts.duration = atof(optarg); break;
+            case 'r': opts.rate = atof(optarg); break;
+            case 'k': opts.keepalive = true; break;
+            case 'm': opts.method = optarg; break;
+            case 'b': {
+                std::ifstream in(optarg, std::ios::binary);
+                if (!in) {
+                    perror(optarg);
+                    return 1;
+                }
+                std::ostringstream content;
+                content << in.rdbuf();
+                opts.body = content.str();
+                break;
+            }
+            case 'H': opts.headers.push_back(optarg); break;
+            case 'n': opts.name = optarg; break;
+            case 'R': opts.resume = true; break;
+            case '2': opts.http2 = true; break;
+            case 's': opts.streams = strtoul(optarg, NULL, 10); break;
+            case 'i': opts.idle = strtoul(optarg, NULL, 10); break;
+            case 'M': opts.metrics_url = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || !parseUrl(argv[optind], opts) || opts.connections == 0
+        || opts.streams == 0)
+        usage(argv[0]);
+#ifndef WEBSERV_TLS
+    if (opts.tls) {
+        fprintf(stderr, "%s: built without TLS support (make TLS=1)\n", argv[0]);
+        return 1;
+    }
+#endif
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (!resolve(opts, addr, addr_len))
+        return 1;
+
+    // The status page is fetched over plain http, whatever the target is
+    Options metrics;
+    struct sockaddr_storage metrics_addr;
+    socklen_t metrics_len = 0;
+    Counters before, after;
+    if (!opts.metrics_url.empty()) {
+        if (!parseUrl(opts.metrics_url, metrics) || metrics.tls)
+            usage(argv[0]);
+        if (!resolve(metrics, metrics_addr, metrics_len))
+            return 1;
+        if (!scrape(metrics, metrics_addr, metrics_len, before)) {
+            fprintf(stderr, "%s: cannot fetch metrics\n", opts.metrics_url.c_str());
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    LoadGen gen(opts, addr, addr_len);
+    gen.run();
+    Counters growth;
+    if (!opts.metrics_url.empty() && scrape(metrics, metrics_addr, metrics_len, after)) {
+        for (const auto& counter : after) {
+            double delta = counter.second - before[counter.first];
+            if (delta != 0)
+                growth[counter.first] = delta;
+        }
+    }
+    gen.report(growth);
+    return 0;
+}
@@ -0,0 +1,403 @@
+// Microbenchmarks for the request path's hot functions, linked against the
+// server's objects. `make microbench`, or tools/microbench [--json] [filter].
+//
+// For every function and input size it reports ns/op, heap allocations/op
+// (counted by replacing operator new) and user-space instructions/op from
+// perf_event_open when the kernel allows it ("-" otherwise). The objects are
+// built with the server's own CFLAGS, so numbers compare builds, not
+// compilers.
+#include "../includes/Server.hpp"
+#include "../includes/Router.hpp"
+#include "../includes/MimeTypes.hpp"
+#include "../includes/ConfigCache.hpp"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <new>
+#include <functional>
+
+// Minimum measured time per case
+#define MICROBENCH_MIN_NS 200000000ULL
+
+static uint64_t g_allocs = 0;
+
+void* operator new(size_t size) {
+    g_allocs++;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// User-space instruction counter for this thread, -1 if unavailable
+static int openInstructionCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct Result {
+    std::string function;
+    std::string input;
+    double ns;
+    double allocs;
+    double instructions;    // < 0 when not measured
+};
+
+class Bench {
+    public:
+        Bench(const std::string& filter) : filter(filter), perf_fd(openInstructionCounter()) {}
+
+        void run(const std::string& function, const std::string& input, const std::function<void()>& op);
+        void print(bool json) const;
+
+    private:
+        std::string filter;
+        int perf_fd;
+        std::vector<Result> results;
+};
+
+void Bench::run(const std::string& function, const std::string& input, const std::function<void()>& op) {
+    if (!filter.empty() && (function + " " + input).find(filter) == std::string::npos)
+        return;
+    // Warm up and find an iteration count that runs for MICROBENCH_MIN_NS
+    uint64_t iterations = 1;
+    while (true) {
+        uint64_t start = now_ns();
+        for (uint64_t i = 0; i < iterations; i++)
+            op();
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= MICROBENCH_MIN_NS / 10) {
+            iterations = iterations * MICROBENCH_MIN_NS / (elapsed ? elapsed : 1) + 1;
+            break;
+        }
+        iterations *= 2;
+    }
+
+    uint64_t allocs = g_allocs;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++)
+        op();
+    uint64_t elapsed = now_ns() - start;
+    long long instructions = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &instructions, sizeof(instructions)) != sizeof(instructions))
+            instructions = -1;
+    }
+    allocs = g_allocs - allocs;
+
+    Result result = {function, input, (double)elapsed / iterations, (double)allocs / iterations,
+                     instructions < 0 ? -1.0 : (double)instructions / iterations};
+    results.push_back(result);
+    if (isatty(STDERR_FILENO))
+        fprintf(stderr, "%s %s\n", function.c_str(), input.c_str());
+}
+
+void Bench::print(bool json) const {
+    if (json) {
+        printf("[\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            printf("  {\"function\":\"%s\",\"input\":\"%s\",\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+                   "\"instructions_per_op\":", r.function.c_str(), r.input.c_str(), r.ns, r.allocs);
+            if (r.instructions < 0)
+                printf("null");
+            else
+                printf("%.0f", r.instructions);
+            printf("}%s\n", i + 1 < results.size() ? "," : "");
+        }
+        printf("]\n");
+        return;
+    }
+    printf("%-34s %-22s %12s %12s %14s\n", "function", "input", "ns/op", "allocs/op", "instr/op");
+    for (const Result& r : results) {
+        char instructions[32] = "-";
+        if (r.instructions >= 0)
+            snprintf(instructions, sizeof(instructions), "%.0f", r.instructions);
+        printf("%-34s %-22s %12.1f %12.2f %14s\n", r.function.c_str(), r.input.c_str(), r.ns,
+               r.allocs, instructions);
+    }
+}
+
+// ---- Corpus ----
+
+static std::string smallGet() {
+    return "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+}
+
+static std::string browserGet() {
+    return "GET /static/css/site.min.css?v=1729331234 HTTP/1.1\r\n"
+           "Host: localhost:8081\r\n"
+           "Connection: keep-alive\r\n"
+           "sec-ch-ua: \"Chromium\";v=\"129\", \"Not=A?Brand\";v=\"8\"\r\n"
+           "sec-ch-ua-mobile: ?0\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+           "Chrome/129.0.0.0 Safari/537.36\r\n"
+           "sec-ch-ua-platform: \"Linux\"\r\n"
+           "Accept: text/css,*/*;q=0.1\r\n"
+           "Sec-Fetch-Site: same-origin\r\n"
+           "Sec-Fetch-Mode: no-cors\r\n"
+           "Sec-Fetch-Dest: style\r\n"
+           "Referer: http://localhost:8081/\r\n"
+           "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+           "Accept-Language: en-US,en;q=0.9\r\n"
+           "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1\r\n"
+           "If-None-Match: \"1a2b3c-4d5e-6f70\"\r\n"
+           "\r\n";
+}
+
+static std::string formPost(size_t body_size) {
+    std::string body;
+    while (body.size() < body_size)
+        body += "field" + std::to_string(body.size()) + "=value+with%20escapes&";
+    body.resize(body_size);
+    return "POST /submit/ HTTP/1.1\r\nHost: localhost\r\n"
+           "Content-Type: application/x-www-form-urlencoded\r\n"
+           "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static std::string multipartBody(size_t file_size) {
+    return "--BENCHBOUNDARY\r\n"
+           "Content-Disposition: form-data; name=\"file\"; filename=\"bench.bin\"\r\n"
+           "Content-Type: application/octet-stream\r\n\r\n"
+           + std::string(file_size, 'x') + "\r\n--BENCHBOUNDARY--\r\n";
+}
+
+static std::string escapedPath(size_t size) {
+    std::string path = "/";
+    while (path.size() < size)
+        path += "dir%20name%2F";
+    return path;
+}
+
+// `servers` virtual hosts on consecutive ports, each with `locations` prefixes
+static std::vector<ServerConfig> makeConfigs(size_t servers, size_t locations) {
+    std::vector<ServerConfig> configs;
+    for (size_t s = 0; s < servers; s++) {
+        ServerConfig server;
+        server.port = 8000 + s;
+        server.sock_fd = -1;
+        server.server_names.push_back(s == 0 ? "localhost" : "host" + std::to_string(s) + ".example.com");
+        RouteConfigFromConfigFile root;
+        root.path = "/";
+        root.root = "www";
+        root.allowed_methods = {"GET", "POST"};
+        server.routes.push_back(root);
+        for (size_t l = 1; l < locations; l++) {
+            RouteConfigFromConfigFile route;
+            route.path = "/app" + std::to_string(l) + "/";
+            route.root = "www";
+            route.allowed_methods = {"GET", "POST", "DELETE"};
+            route.cgi_handlers[".py"] = "/usr/bin/python3";
+            server.routes.push_back(route);
+        }
+        configs.push_back(server);
+    }
+    return configs;
+}
+
+// Config text with 10 servers sharing `locations` location blocks
+static std::string configText(size_t locations) {
+    std::string text;
+    for (size_t s = 0; s < 10; s++) {
+        text += "server {\n    listen " + std::to_string(9000 + s) + ";\n    server_name host"
+                + std::to_string(s) + ".example.com;\n";
+        for (size_t l = 0; l < locations / 10; l++)
+            text += "    location /app" + std::to_string(l) + "/ { methods GET POST; root www; # generated\n"
+                    "        cgi .py /usr/bin/python3; autoindex on; }\n";
+        text += "}\n";
+    }
+    return text;
+}
+
+static volatile size_t g_sink;
+
+int main(int argc, char** argv) {
+    bool json = false;
+    std::string filter;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--json")
+            json = true;
+        else
+            filter = argv[i];
+    }
+    Log::level = LogError;
+    MimeTable types;
+    MimeTypes::loadDefaults(types);
+    MimeTypes::replace(types);
+    Bench bench(filter);
+
+    // Request parsing
+    const std::pair<std::string, std::string> requests[] = {
+        {"small GET", smallGet()},
+        {"browser GET", browserGet()},
+        {"form POST 4KB", formPost(4096)},
+        {"form POST 64KB", formPost(65536)},
+    };
+    for (const auto& req : requests) {
+        bench.run("Request::parseRequest", req.first, [&]() {
+            Request r;
+            r.parseRequest(req.second);
+            g_sink = r.getRequestLine().url.size();
+        });
+    }
+    for (const auto& req : requests) {
+        bench.run("Request::isMalformedRequest", req.first, [&]() {
+            Request r;
+            std::string raw = req.second;
+            g_sink = r.isMalformedRequest(raw);
+        });
+    }
+
+    // Routing: prefix match deep in the table, and a miss that falls back to "/"
+    for (size_t locations : {5, 50, 500}) {
+        Router router(makeConfigs(1, locations));
+        std::string hit = "/app" + std::to_string(locations - 1) + "/assets/logo.png";
+        bench.run("Router::getRouteConfig", std::to_string(locations) + " loc hit", [&]() {
+            g_sink = router.getRouteConfig(hit).root_dir.size();
+        });
+        bench.run("Router::getRouteConfig", std::to_string(locations) + " loc fallback", [&]() {
+            g_sink = router.getRouteConfig("/nothing/here.html").root_dir.size();
+        });
+    }
+
+    // Virtual host selection: the last server, by name and by port only
+    for (size_t servers : {1, 16, 256}) {
+        std::vector<ServerConfig> configs = makeConfigs(servers, 5);
+        const ServerConfig& last = configs.back();
+        std::string host = last.server_names[0];
+        bench.run("Server::getServerConfigByHost", std::to_string(servers) + " vhosts", [&]() {
+            g_sink = (size_t)Server::getServerConfigByHost(configs, host, last.port);
+        });
+        bench.run("Server::getServerConfigByHost", std::to_string(servers) + " vhosts no host", [&]() {
+            g_sink = (size_t)Server::getServerConfigByHost(configs, "", last.port);
+        });
+    }
+
+    // Response building
+    std::vector<ServerConfig> configs = makeConfigs(1, 5);
+    Response response(configs);
+    for (size_t size : {0, 1024, 65536}) {
+        std::string body(size, 'x');
+        bench.run("Response::buildResponse", std::to_string(size) + "B body", [&]() {
+            g_sink = response.buildResponse(body, 200, "text/html").size();
+        });
+    }
+    const std::pair<std::string, std::string> paths[] = {
+        {"html", "www/static/index.html"},
+        {"double extension", "www/downloads/archive.tar.gz"},
+        {"unknown", "www/files/README"},
+    };
+    for (const auto& path : paths) {
+        bench.run("Response::getMimeType", path.first, [&]() {
+            g_sink = response.getMimeType(path.second).size();
+        });
+    }
+
+    const std::pair<std::string, std::string> encoded[] = {
+        {"plain", "/static/css/site.min.css"},
+        {"escaped", "/files/My%20Documents/report%202024%20%28final%29.pdf?x=%2Fa%26b"},
+        {"1KB escaped", escapedPath(1024)},
+    };
+    for (const auto& url : encoded) {
+        bench.run("Request::urlDecode", url.first, [&]() {
+            g_sink = response.urlDecode(url.second).size();
+        });
+    }
+
+    // Upstream peer choice, paid on every proxied request
+    const std::pair<std::string, UpstreamBalance> balancers[] = {
+        {"round robin", BalanceRoundRobin},
+        {"least_conn", BalanceLeastConn},
+        {"hash", BalanceHash},
+    };
+    for (const auto& balancer : balancers) {
+        UpstreamGroup group("bench");
+        group.balance = balancer.second;
+        for (int peer = 0; peer < 8; peer++)
+            group.addPeer("127.0.0.1:" + std::to_string(9000 + peer), peer % 3 + 1, 1, 10);
+        group.buildRing();
+        std::string key = "/static/css/site.min.css?v=1729331234";
+        bench.run("UpstreamGroup::pick", balancer.first + " 8 peers", [&]() {
+            int peer = group.pick(key, 0, 1000);
+            group.started(peer);
+            group.finished(peer);
+            g_sink = peer;
+        });
+    }
+
+    // Response cache hit: the stored copy plus its Age header
+    for (size_t size : {1024, 65536}) {
+        std::string key = "/cgi/\nGET localhost/cgi/page.py?id=" + std::to_string(size);
+        std::string cached;
+        ResponseCache::lookup("/cgi/", RESPONSE_CACHE_DEFAULT_SIZE, 60, key, cached);
+        ResponseCache::complete(key, response.buildResponse(std::string(size, 'x'), 200, "text/html"));
+        bench.run("ResponseCache::lookup", std::to_string(size) + "B hit", [&]() {
+            std::string out;
+            g_sink = ResponseCache::lookup("/cgi/", RESPONSE_CACHE_DEFAULT_SIZE, 60, key, out);
+        });
+    }
+
+    // Startup: parsing the text, and loading the --compile cache instead
+    char dir_template[] = "/tmp/webserv-microbench.XXXXXX";
+    char* dir = mkdtemp(dir_template);
+    if (dir) {
+        std::string conf = std::string(dir) + "/bench.conf";
+        std::string cache = conf + CONFIG_CACHE_SUFFIX;
+        for (size_t locations : {1000, 10000}) {
+            std::ofstream(conf) << configText(locations);
+            unlink(cache.c_str());
+            std::string input = std::to_string(locations) + " loc";
+            bench.run("ConfigManager::loadFromFile", input + " text", [&]() {
+                ConfigManager manager;
+                g_sink = manager.loadFromFile(conf);
+            });
+            ConfigManager().compileCache(conf);
+            bench.run("ConfigManager::loadFromFile", input + " cached", [&]() {
+                ConfigManager manager;
+                g_sink = manager.loadFromFile(conf);
+            });
+        }
+        unlink(cache.c_str());
+        unlink(conf.c_str());
+    }
+
+    // Uploads go to a scratch directory; the file is rewritten every iteration
+    if (dir) {
+        std::string upload_dir = std::string(dir) + "/";
+        for (size_t size : {1024, 65536}) {
+            std::string body = multipartBody(size);
+            bench.run("Response::handleFileUpload", std::to_string(size / 1024) + "KB file", [&]() {
+                std::string saved;
+                g_sink = response.handleFileUpload(upload_dir, body, "--BENCHBOUNDARY", saved);
+            });
+        }
+        unlink((upload_dir + "bench.bin").c_str());
+        rmdir(dir);
+    }
+
+    bench.print(json);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+# Loopback check of proxy_pass against tools/upstream: upstream connections
+# are reused, request and response bodies survive the trip with either
+# framing, and a non-idempotent request is not sent twice when a pooled
+# connection fails. Prints a line per check and exits non-zero if any fails.
+# Used by `make proxy-check`; needs curl.
+#
+# Knobs: CHECK_PORT (default 18280; the upstreams get the next two ports).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WEBSERV="$ROOT/webserv"
+UPSTREAM="$ROOT/tools/upstream"
+PORT=${CHECK_PORT:-18280}
+LENGTH_PORT=$((PORT + 1))
+CHUNKED_PORT=$((PORT + 2))
+
+WORK=$(mktemp -d /tmp/webserv-proxy-check.XXXXXX)
+SERVER_PID=
+LENGTH_PID=
+CHUNKED_PID=
+cleanup() {
+    status=$?
+    set +e
+    for pid in "$SERVER_PID" "$LENGTH_PID" "$CHUNKED_PID"; do
+        [ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+    done
+    rm -rf "$WORK"
+    exit $status
+}
+trap cleanup EXIT INT TERM
+
+# /len/ answers with Content-Length, /chunked/ with chunks, and /fresh/ opens
+# a new upstream connection for every request
+cd "$WORK"
+cat > check.conf <<CONF
+server {
+    listen $PORT;
+    server_name localhost;
+    log_level warn;
+    location /len/ { proxy_pass http://127.0.0.1:$LENGTH_PORT; }
+    location /chunked/ { proxy_pass http://127.0.0.1:$CHUNKED_PORT; }
+    location /fresh/ { proxy_pass http://127.0.0.1:$LENGTH_PORT; proxy_keepalive 0; }
+    client_max_body_size 10000000;
+}
+CONF
+head -c 3000000 /dev/urandom > body.bin
+BODY_MD5=$(md5sum < body.bin | cut -d' ' -f1)
+
+"$UPSTREAM" -p "$LENGTH_PORT" -l > length.log 2>&1 &
+LENGTH_PID=$!
+"$UPSTREAM" -p "$CHUNKED_PORT" -c -l > chunked.log 2>&1 &
+CHUNKED_PID=$!
+"$WEBSERV" check.conf > server.log 2>&1 &
+SERVER_PID=$!
+BASE="http://localhost:$PORT"
+i=0
+until [ "$(curl -s -o /dev/null -w "%{http_code}" "$BASE/len/up")" = 200 ]; do
+    i=$((i + 1))
+    if [ $i -ge 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        echo "webserv or the upstreams did not come up:" >&2
+        cat server.log length.log chunked.log >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+failed=0
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: expected '$3', got '$2'"
+        failed=1
+    fi
+}
+
+# Position of the request on its upstream connection, 1 for a new one
+connection_request() {
+    curl -s -D - -o /dev/null "$1" | tr -d '\r' | sed -n 's/^X-Connection-Request: //p'
+}
+
+# Upstream log lines for `METHOD target`
+seen() {
+    grep -c "^$2 $3\$" "$1" || true
+}
+
+curl -s -o /dev/null "$BASE/len/warm"
+check "upstream connection reused" "$([ "$(connection_request "$BASE/len/again")" -gt 1 ] && echo yes || echo no)" yes
+check "proxy_keepalive 0 reconnects" "$(connection_request "$BASE/fresh/a")$(connection_request "$BASE/fresh/b")" 11
+
+for location in len chunked; do
+    check "$location: Content-Length request body" \
+        "$(curl -s --data-binary @body.bin "$BASE/$location/echo" | md5sum | cut -d' ' -f1)" "$BODY_MD5"
+    check "$location: chunked request body" \
+        "$(curl -s -H 'Transfer-Encoding: chunked' --data-binary @body.bin "$BASE/$location/echo" | md5sum | cut -d' ' -f1)" \
+        "$BODY_MD5"
+done
+
+# A pooled connection the upstream drops without answering: GET is sent
+# again on a new connection, POST is not
+curl -s -o /dev/null "$BASE/len/warm"
+check "GET on a dropped connection" "$(curl -s -o /dev/null -w '%{http_code}' "$BASE/len/get/drop")" 502
+check "GET retried" "$(seen length.log GET /len/get/drop)" 2
+curl -s -o /dev/null "$BASE/len/warm"
+check "POST on a dropped connection" "$(curl -s -o /dev/null -w '%{http_code}' -d x=1 "$BASE/len/post/drop")" 502
+check "POST not retried" "$(seen length.log POST /len/post/drop)" 1
+
+exit $failed
@@ -0,0 +1,660 @@
+// Replays traffic recorded with `capture_file` against a server.
+//
+//   tools/replay run [-s speed] [-c conns] [-t timeout] [-w sums] [-b baseline]
+//                    capture.wscap http://host:port
+//       -s SPEED     1 = recorded pace (default), N = N times faster,
+//                    0 = as fast as possible
+//       -c CONNS     connections open at once (default 256)
+//       -t SECONDS   give up on a response after this long (default 5)
+//       -w FILE      write "connection status checksum" lines for later runs
+//       -b FILE      compare checksums against such a file
+//
+//   tools/replay import [-p path] [-H host] [-i ms] input.jsonl out.wscap
+//       Turns JSON lines into a capture with one connection per line, -i ms
+//       apart. A line with "raw" is sent verbatim; one with "method",
+//       "path", "host", "content_type" and/or "body" becomes that request.
+//       Any other JSON object (e.g. a requests.jsonl backlog entry) is
+//       POSTed to -p as application/json.
+//
+// The response checksum covers the status code and the body, not the
+// headers, so Date and the like do not count as differences. Prints a JSON
+// summary with latencies (last request byte sent to response complete).
+// Linux only (epoll).
+#include "../includes/Capture.hpp"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#define REPLAY_READ_CHUNK 65536
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct Chunk {
+    uint64_t at;        // Microseconds since capture start
+    std::string data;
+};
+
+struct Recorded {
+    uint32_t id;
+    uint64_t opened;
+    std::vector<Chunk> chunks;
+};
+
+struct Live {
+    size_t conn;            // Index into the recorded connections
+    int fd = -1;
+    uint64_t started = 0;   // When replay opened it
+    size_t next_chunk = 0;
+    size_t chunk_offset = 0;
+    bool connected = false;
+    bool writing_done = false;
+    uint64_t last_sent = 0;
+    std::string head;
+    bool head_done = false;
+    int status = 0;
+    uint64_t checksum = FNV_OFFSET;
+};
+
+struct Outcome {
+    int status = 0;         // 0 = no response
+    uint64_t checksum = 0;
+    bool done = false;
+};
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t decodeLE(const unsigned char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+static void encodeLE(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out += (char)((value >> (8 * i)) & 0xff);
+}
+
+static void fnv(uint64_t& hash, const char* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= FNV_PRIME;
+    }
+}
+
+static bool readCapture(const char* path, std::vector<Recorded>& conns) {
+    std::ifstream in(path, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in && !in.eof())
+        return false;
+    if (content.compare(0, CAPTURE_MAGIC_LEN, CAPTURE_MAGIC) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        return false;
+    }
+    std::map<uint32_t, size_t> index;
+    size_t pos = CAPTURE_MAGIC_LEN;
+    const unsigned char* bytes = (const unsigned char*)content.data();
+    while (pos + CAPTURE_RECORD_HEADER <= content.size()) {
+        int type = bytes[pos];
+        uint32_t id = decodeLE(bytes + pos + 1, 4);
+        uint64_t at = decodeLE(bytes + pos + 5, 8);
+        uint32_t len = decodeLE(bytes + pos + 13, 4);
+        pos += CAPTURE_RECORD_HEADER;
+        if (pos + len > content.size())
+            break; // Cut short while the server was writing it
+        if (type == CaptureOpen) {
+            index[id] = conns.size();
+            conns.push_back({id, at, std::vector<Chunk>()});
+        } else if (type == CaptureData && index.count(id)) {
+            conns[index[id]].chunks.push_back({at, content.substr(pos, len)});
+        }
+        pos += len;
+    }
+    return true;
+}
+
+// ---- import ----
+
+// Flat JSON object reader: string members are returned decoded, anything
+// else (numbers, nested values) is skipped
+static bool parseJsonObject(const std::string& line, std::map<std::string, std::string>& out) {
+    size_t pos = line.find('{');
+    if (pos == std::string::npos)
+        return false;
+    pos++;
+    auto skipSpace = [&]() {
+        while (pos < line.size() && isspace((unsigned char)line[pos]))
+            pos++;
+    };
+    auto readString = [&](std::string& value) -> bool {
+        if (pos >= line.size() || line[pos] != '"')
+            return false;
+        pos++;
+        while (pos < line.size() && line[pos] != '"') {
+            char c = line[pos++];
+            if (c != '\\') {
+                value += c;
+                continue;
+            }
+            if (pos >= line.size())
+                return false;
+            char e = line[pos++];
+            switch (e) {
+                case 'n': value += '\n'; break;
+                case 'r': value += '\r'; break;
+                case 't': value += '\t'; break;
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'u': {
+                    unsigned code = strtoul(line.substr(pos, 4).c_str(), NULL, 16);
+                    pos += 4;
+                    if (code < 0x80) {
+                        value += (char)code;
+                    } else if (code < 0x800) {
+                        value += (char)(0xc0 | (code >> 6));
+                        value += (char)(0x80 | (code & 0x3f));
+                    } else {
+                        value += (char)(0xe0 | (code >> 12));
+                        value += (char)(0x80 | ((code >> 6) & 0x3f));
+                        value += (char)(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default: value += e;
+            }
+        }
+        pos++;
+        return pos <= line.size();
+    };
+    while (true) {
+        skipSpace();
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == '}')
+            return true;
+        std::string key, value;
+        if (!readString(key))
+            return false;
+        skipSpace();
+        if (pos >= line.size() || line[pos++] != ':')
+            return false;
+        skipSpace();
+        if (pos < line.size() && line[pos] == '"') {
+            if (!readString(value))
+                return false;
+            out[key] = value;
+        } else {
+            // Skip a non-string value, minding brackets and strings inside it
+            int depth = 0;
+            while (pos < line.size()) {
+                char c = line[pos];
+                if (c == '"') {
+                    std::string ignored;
+                    readString(ignored);
+                    continue;
+                }
+                if (c == '{' || c == '[')
+                    depth++;
+                else if (c == '}' || c == ']') {
+                    if (depth == 0)
+                        break;
+                    depth--;
+                } else if (c == ',' && depth == 0) {
+                    break;
+                }
+                pos++;
+            }
+        }
+        skipSpace();
+        if (pos < line.size() && line[pos] == ',')
+            pos++;
+    }
+}
+
+static std::string requestFromJson(const std::string& line, const std::map<std::string, std::string>& fields,
+                                   const std::string& default_path, const std::string& default_host) {
+    auto field = [&](const char* name, const std::string& fallback) {
+        auto it = fields.find(name);
+        return it == fields.end() ? fallback : it->second;
+    };
+    if (fields.count("raw"))
+        return fields.at("raw");
+    std::string method, path, content_type, body;
+    if (fields.count("method") || fields.count("path")) {
+        body = field("body", "");
+        method = field("method", body.empty() ? "GET" : "POST");
+        path = field("path", default_path);
+        content_type = field("content_type", body.empty() ? "" : "text/plain");
+    } else {
+        // Not a request description: the document itself is the payload
+        method = "POST";
+        path = default_path;
+        content_type = "application/json";
+        body = line;
+    }
+    std::string request = method + " " + path + " HTTP/1.1\r\nHost: " + field("host", default_host) + "\r\n";
+    if (!content_type.empty())
+        request += "Content-Type: " + content_type + "\r\n";
+    if (!body.empty() || method == "POST")
+        request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    return request + "\r\n" + body;
+}
+
+static void writeRecord(std::string& out, int type, uint32_t id, uint64_t at, const std::string& data) {
+    out += (char)type;
+    encodeLE(out, id, 4);
+    encodeLE(out, at, 8);
+    encodeLE(out, data.size(), 4);
+    out += data;
+}
+
+static int importJsonl(int argc, char** argv) {
+    std::string path = "/", host = "localhost";
+    uint64_t interval_us = 10000;
+    int c;
+    while ((c = getopt(argc, argv, "p:H:i:")) != -1) {
+        switch (c) {
+            case 'p': path = optarg; break;
+            case 'H': host = optarg; break;
+            case 'i': interval_us = strtoull(optarg, NULL, 10) * 1000; break;
+            default: return 2;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "usage: replay import [-p path] [-H host] [-i ms] input.jsonl out.wscap\n");
+        return 2;
+    }
+    std::ifstream in(argv[optind]);
+    if (!in) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::string out(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    std::string line;
+    uint32_t id = 0;
+    size_t skipped = 0;
+    while (std::getline(in, line)) {
+        std::map<std::string, std::string> fields;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        if (!parseJsonObject(line, fields)) {
+            skipped++;
+            continue;
+        }
+        uint64_t at = id * interval_us;
+        writeRecord(out, CaptureOpen, id, at, "");
+        writeRecord(out, CaptureData, id, at, requestFromJson(line, fields, path, host));
+        writeRecord(out, CaptureClose, id, at, "");
+        id++;
+    }
+    std::ofstream file(argv[optind + 1], std::ios::binary | std::ios::trunc);
+    file.write(out.data(), out.size());
+    if (!file) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    fprintf(stderr, "%u connections written, %zu lines skipped\n", id, skipped);
+    return 0;
+}
+
+// ---- run ----
+
+class Replayer {
+    public:
+        Replayer(std::vector<Recorded>& conns, const struct sockaddr_storage& addr, socklen_t addr_len,
+                 double speed, size_t max_live, uint64_t timeout_us);
+        void run();
+        const std::vector<Outcome>& outcomes() const { return results; }
+        void report(const std::map<uint32_t, Outcome>* baseline) const;
+
+    private:
+        std::vector<Recorded>& conns;
+        struct sockaddr_storage addr;
+        socklen_t addr_len;
+        double speed;
+        size_t max_live;
+        uint64_t timeout_us;
+        int epfd;
+        std::map<int, Live> live;       // By socket
+        std::vector<Outcome> results;
+        std::vector<uint32_t> latencies;
+        uint64_t errors = 0;
+        uint64_t timeouts = 0;
+        uint64_t elapsed = 0;
+
+        uint64_t due(const Live& conn, size_t chunk) const;
+        bool start(size_t index, uint64_t now);
+        void pump(Live& conn, uint64_t now);
+        void receive(Live& conn);
+        void finish(Live& conn, bool ok);
+};
+
+Replayer::Replayer(std::vector<Recorded>& c, const struct sockaddr_storage& a, socklen_t len,
+                   double s, size_t m, uint64_t t)
+    : conns(c), addr(a), addr_len(len), speed(s), max_live(m), timeout_us(t), results(c.size()) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+// When chunk `chunk` of a live connection should go out
+uint64_t Replayer::due(const Live& conn, size_t chunk) const {
+    if (speed <= 0)
+        return conn.started;
+    const Recorded& rec = conns[conn.conn];
+    return conn.started + (uint64_t)((rec.chunks[chunk].at - rec.opened) / speed);
+}
+
+bool Replayer::start(size_t index, uint64_t now) {
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    Live conn;
+    conn.conn = index;
+    conn.fd = fd;
+    conn.started = now;
+    conn.last_sent = now;
+    live[fd] = conn;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return true;
+}
+
+// Sends whatever is due; stops writing (but keeps reading) if the server
+// has stopped taking bytes
+void Replayer::pump(Live& conn, uint64_t now) {
+    const Recorded& rec = conns[conn.conn];
+    while (conn.connected && !conn.writing_done && conn.next_chunk < rec.chunks.size()
+           && due(conn, conn.next_chunk) <= now) {
+        const std::string& data = rec.chunks[conn.next_chunk].data;
+        ssize_t n = send(conn.fd, data.data() + conn.chunk_offset, data.size() - conn.chunk_offset,
+                         MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0) {
+            conn.writing_done = true;
+            break;
+        }
+        conn.chunk_offset += n;
+        conn.last_sent = now_us();
+        if (conn.chunk_offset == data.size()) {
+            conn.next_chunk++;
+            conn.chunk_offset = 0;
+        }
+    }
+    if (conn.next_chunk == rec.chunks.size())
+        conn.writing_done = true;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (!conn.connected || (!conn.writing_done && due(conn, conn.next_chunk) <= now))
+        ev.events |= EPOLLOUT;
+    ev.data.fd = conn.fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+void Replayer::receive(Live& conn) {
+    char buf[REPLAY_READ_CHUNK];
+    while (true) {
+        ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            finish(conn, n == 0 && conn.head_done);
+            return;
+        }
+        const char* body = buf;
+        size_t body_len = n;
+        if (!conn.head_done) {
+            size_t before = conn.head.size();
+            conn.head.append(buf, n);
+            size_t end = conn.head.find("\r\n\r\n");
+            if (end == std::string::npos)
+                continue;
+            conn.head_done = true;
+            conn.status = atoi(conn.head.c_str() + 9);
+            body = buf + (end + 4 - before);
+            body_len = n - (end + 4 - before);
+        }
+        fnv(conn.checksum, body, body_len);
+    }
+}
+
+void Replayer::finish(Live& conn, bool ok) {
+    Outcome& outcome = results[conn.conn];
+    outcome.done = true;
+    if (ok) {
+        outcome.status = conn.status;
+        outcome.checksum = conn.checksum;
+        uint64_t latency = now_us() - conn.last_sent;
+        latencies.push_back(latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+    } else {
+        errors++;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, NULL);
+    close(conn.fd);
+    live.erase(conn.fd);
+}
+
+void Replayer::run() {
+    uint64_t begin = now_us();
+    uint64_t first = conns.empty() ? 0 : conns[0].opened;
+    size_t next = 0;
+    std::vector<struct epoll_event> events(256);
+
+    while (next < conns.size() || !live.empty()) {
+        uint64_t now = now_us();
+        // Open connections that are due, within the concurrency limit
+        while (next < conns.size() && live.size() < max_live) {
+            uint64_t at = speed > 0 ? begin + (uint64_t)((conns[next].opened - first) / speed) : now;
+            if (at > now)
+                break;
+            if (!start(next, now)) {
+                results[next].done = true;
+                errors++;
+            }
+            next++;
+        }
+        // Next wakeup: a connection to open, a chunk to send, or a timeout
+        uint64_t wake = now + 100000;
+        if (next < conns.size() && live.size() < max_live && speed > 0)
+            wake = std::min(wake, begin + (uint64_t)((conns[next].opened - first) / speed));
+        std::vector<int> expired;
+        for (auto& entry : live) {
+            Live& conn = entry.second;
+            if (conn.writing_done && now - conn.last_sent > timeout_us)
+                expired.push_back(entry.first);
+            else if (conn.connected && !conn.writing_done)
+                wake = std::min(wake, due(conn, conn.next_chunk));
+            if (conn.writing_done)
+                wake = std::min(wake, conn.last_sent + timeout_us);
+        }
+        for (int fd : expired) {
+            timeouts++;
+            errors--; // finish() counts it as an error as well
+            finish(live[fd], false);
+        }
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+        now = now_us();
+        for (int i = 0; i < n; i++) {
+            auto it = live.find(events[i].data.fd);
+            if (it == live.end())
+                continue;
+            Live& conn = it->second;
+            if (!conn.connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    finish(conn, false);
+                    continue;
+                }
+                conn.connected = true;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receive(conn);
+                if (live.find(events[i].data.fd) == live.end())
+                    continue;
+            }
+            pump(conn, now);
+        }
+        for (auto& entry : live)
+            pump(entry.second, now);
+    }
+    elapsed = now_us() - begin;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+}
+
+void Replayer::report(const std::map<uint32_t, Outcome>* baseline) const {
+    std::vector<uint32_t> sorted(latencies);
+    std::sort(sorted.begin(), sorted.end());
+    std::map<int, uint64_t> statuses;
+    for (const Outcome& outcome : results) {
+        if (outcome.status)
+            statuses[outcome.status]++;
+    }
+    printf("{\"connections\":%zu,\"completed\":%zu,\"errors\":%llu,\"timeouts\":%llu,"
+           "\"duration_s\":%.3f,\"speed\":%g,", conns.size(), sorted.size(),
+           (unsigned long long)errors, (unsigned long long)timeouts, elapsed / 1e6, speed);
+    printf("\"status\":{");
+    bool first = true;
+    for (const auto& status : statuses) {
+        printf("%s\"%d\":%llu", first ? "" : ",", status.first, (unsigned long long)status.second);
+        first = false;
+    }
+    printf("},\"latency_us\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}",
+           percentile(sorted, 0.5), percentile(sorted, 0.9), percentile(sorted, 0.99),
+           percentile(sorted, 0.999), sorted.empty() ? 0 : sorted.back());
+    if (baseline) {
+        size_t compared = 0;
+        std::vector<uint32_t> differ;
+        for (size_t i = 0; i < results.size(); i++) {
+            auto it = baseline->find(conns[i].id);
+            if (it == baseline->end())
+                continue;
+            compared++;
+            if (it->second.status != results[i].status || it->second.checksum != results[i].checksum)
+                differ.push_back(conns[i].id);
+        }
+        printf(",\"compared\":%zu,\"mismatches\":%zu,\"mismatched\":[", compared, differ.size());
+        for (size_t i = 0; i < differ.size() && i < 20; i++)
+            printf("%s%u", i ? "," : "", differ[i]);
+        printf("]");
+    }
+    printf("}\n");
+}
+
+static bool resolve(const std::string& url, struct sockaddr_storage& addr, socklen_t& addr_len) {
+    if (url.compare(0, 7, "http://") != 0)
+        return false;
+    std::string authority = url.substr(7, url.find('/', 7) - 7);
+    size_t colon = authority.find(':');
+    std::string host = authority.substr(0, colon);
+    std::string port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET; // The server listens on IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return false;
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static int runReplay(int argc, char** argv) {
+    double speed = 1;
+    size_t max_live = 256;
+    uint64_t timeout_us = 5000000;
+    const char* sums_out = NULL;
+    const char* baseline_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "s:c:t:w:b:")) != -1) {
+        switch (c) {
+            case 's': speed = atof(optarg); break;
+            case 'c': max_live = strtoul(optarg, NULL, 10); break;
+            case 't': timeout_us = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'w': sums_out = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            default: return 2;
+        }
+    }
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (optind != argc - 2 || max_live == 0 || !resolve(argv[optind + 1], addr, addr_len)) {
+        fprintf(stderr, "usage: replay run [-s speed] [-c conns] [-t seconds] [-w sums] [-b baseline]"
+                        " capture.wscap http://host:port\n");
+        return 2;
+    }
+    std::vector<Recorded> conns;
+    if (!readCapture(argv[optind], conns))
+        return 1;
+
+    std::map<uint32_t, Outcome> baseline;
+    if (baseline_path) {
+        std::ifstream in(baseline_path);
+        if (!in) {
+            perror(baseline_path);
+            return 1;
+        }
+        uint32_t id;
+        Outcome outcome;
+        while (in >> id >> outcome.status >> std::hex >> outcome.checksum >> std::dec)
+            baseline[id] = outcome;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    Replayer replayer(conns, addr, addr_len, speed, max_live, timeout_us);
+    replayer.run();
+    replayer.report(baseline_path ? &baseline : NULL);
+
+    if (sums_out) {
+        std::ofstream out(sums_out, std::ios::trunc);
+        for (size_t i = 0; i < conns.size(); i++) {
+            const Outcome& outcome = replayer.outcomes()[i];
+            out << conns[i].id << " " << outcome.status << " " << std::hex << outcome.checksum
+                << std::dec << "\n";
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]) == "run")
+        return runReplay(argc - 1, argv + 1);
+    if (argc >= 2 && std::string(argv[1]) == "import")
+        return importJsonl(argc - 1, argv + 1);
+    fprintf(stderr, "usage: replay run|import ... (see tools/replay.cpp)\n");
+    return 2;
+}
@@ -0,0 +1,256 @@
+// Stand-in HTTP/1.1 backend for trying proxy_pass and for `make bench`.
+//
+// Usage: tools/upstream [-p port] [-s body_bytes] [-c] [-l]
+//   -p PORT     port to listen on, loopback only (default 18081)
+//   -s BYTES    size of the response body (default 1024)
+//   -c          send the body chunked instead of with Content-Length
+//   -l          print "METHOD target" for every request read
+//
+// Every request is answered with 200 and the same body, on a kept-alive
+// connection unless the request says Connection: close. Request bodies
+// (Content-Length or chunked) are read and their size echoed back in
+// X-Received; the target and some headers are echoed as X-Request-Target,
+// X-Request-Host and X-Request-Forwarded-For, and the port that answered in
+// X-Upstream-Port (to watch upstream balancing), and its position on the
+// connection in X-Connection-Request (1 for a new one). A request for a path
+// ending in /hang is never answered, to try the proxy timeouts; one ending in
+// /drop makes the connection close without an answer; one ending in /echo is
+// answered with its own body. Used by tools/proxy_check.sh. Linux only (epoll).
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <string>
+#include <map>
+
+#define READ_CHUNK 65536
+
+struct Conn {
+    std::string in;
+    std::string out;
+    size_t out_offset = 0;
+    bool close_after = false;
+    bool hung = false;
+    bool dropped = false;
+    size_t requests = 0;
+};
+
+struct Options {
+    int port = 18081;
+    size_t body_size = 1024;
+    bool chunked = false;
+    bool log = false;
+};
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-p port] [-s body_bytes] [-c] [-l]\n", argv0);
+    exit(2);
+}
+
+static std::string header(const std::string& head, const char* name) {
+    size_t pos = head.find("\r\n");
+    while (pos != std::string::npos && pos + 2 < head.size()) {
+        size_t start = pos + 2;
+        size_t end = head.find("\r\n", start);
+        size_t colon = head.find(':', start);
+        if (end == std::string::npos || end == start)
+            break;
+        if (colon < end && colon - start == strlen(name) && strncasecmp(head.c_str() + start, name, colon - start) == 0) {
+            size_t value = head.find_first_not_of(" \t", colon + 1);
+            return value < end ? head.substr(value, end - value) : "";
+        }
+        pos = end;
+    }
+    return "";
+}
+
+// Length of a complete chunked body at the start of `data` and its payload
+// size, or 0 while more is needed (trailers are not supported). The payload
+// itself goes to `decoded`.
+static size_t chunkedEnd(const std::string& data, size_t& payload, std::string& decoded) {
+    size_t pos = 0;
+    payload = 0;
+    decoded.clear();
+    while (true) {
+        size_t line_end = data.find("\r\n", pos);
+        if (line_end == std::string::npos)
+            return 0;
+        size_t size = strtoul(data.c_str() + pos, NULL, 16);
+        pos = line_end + 2;
+        if (size == 0)
+            return data.compare(pos, 2, "\r\n") == 0 ? pos + 2 : 0;
+        if (data.size() < pos + size + 2)
+            return 0;
+        payload += size;
+        decoded.append(data, pos, size);
+        pos += size + 2;
+    }
+}
+
+// Answers every complete request at the front of conn.in
+static void serve(Conn& conn, const Options& opts, const std::string& body) {
+    while (!conn.hung && !conn.close_after && !conn.dropped) {
+        size_t head_end = conn.in.find("\r\n\r\n");
+        if (head_end == std::string::npos)
+            return;
+        std::string head = conn.in.substr(0, head_end + 4);
+        size_t used = head_end + 4, received = 0;
+        std::string length = header(head, "Content-Length");
+        std::string request_body;
+        if (strcasecmp(header(head, "Transfer-Encoding").c_str(), "chunked") == 0) {
+            size_t end = chunkedEnd(conn.in.substr(used), received, request_body);
+            if (end == 0)
+                return;
+            used += end;
+        } else if (!length.empty()) {
+            received = strtoul(length.c_str(), NULL, 10);
+            if (conn.in.size() < used + received)
+                return;
+            request_body = conn.in.substr(used, received);
+            used += received;
+        }
+        conn.in.erase(0, used);
+        conn.requests++;
+        size_t target_start = head.find(' ') + 1;
+        std::string target = head.substr(target_start, head.find(' ', target_start) - target_start);
+        if (opts.log) {
+            printf("%s %s\n", head.substr(0, target_start - 1).c_str(), target.c_str());
+            fflush(stdout);
+        }
+        std::string path = target.substr(0, target.find('?'));
+        if (path.size() >= 5 && path.compare(path.size() - 5, 5, "/hang") == 0) {
+            conn.hung = true;
+            return;
+        }
+        if (path.size() >= 5 && path.compare(path.size() - 5, 5, "/drop") == 0) {
+            conn.dropped = true;
+            return;
+        }
+        const std::string& answer = path.size() >= 5 && path.compare(path.size() - 5, 5, "/echo") == 0
+                                    ? request_body : body;
+        conn.close_after = strcasecmp(header(head, "Connection").c_str(), "close") == 0;
+
+        std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n";
+        response += "X-Received: " + std::to_string(received) + "\r\n";
+        response += "X-Request-Target: " + target + "\r\n";
+        response += "X-Request-Host: " + header(head, "Host") + "\r\n";
+        response += "X-Request-Forwarded-For: " + header(head, "X-Forwarded-For") + "\r\n";
+        response += "X-Upstream-Port: " + std::to_string(opts.port) + "\r\n";
+        response += "X-Connection-Request: " + std::to_string(conn.requests) + "\r\n";
+        if (conn.close_after)
+            response += "Connection: close\r\n";
+        bool head_only = head.compare(0, 5, "HEAD ") == 0;
+        if (opts.chunked) {
+            response += "Transfer-Encoding: chunked\r\n\r\n";
+            if (!head_only) {
+                char size[32];
+                snprintf(size, sizeof(size), "%zx\r\n", answer.size());
+                if (!answer.empty())
+                    response += size + answer + "\r\n";
+                response += "0\r\n\r\n";
+            }
+        } else {
+            response += "Content-Length: " + std::to_string(answer.size()) + "\r\n\r\n";
+            if (!head_only)
+                response += answer;
+        }
+        conn.out += response;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:cl")) != -1) {
+        switch (opt) {
+        case 'p': opts.port = atoi(optarg); break;
+        case 's': opts.body_size = strtoul(optarg, NULL, 10); break;
+        case 'c': opts.chunked = true; break;
+        case 'l': opts.log = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::string body(opts.body_size, 'x');
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(opts.port);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        perror("upstream: listen");
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {EPOLLIN, {.fd = listen_fd}};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    std::map<int, Conn> conns;
+    struct epoll_event events[256];
+    char buf[READ_CHUNK];
+
+    while (true) {
+        int n = epoll_wait(epfd, events, 256, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("upstream: epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                int client;
+                while ((client = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    conns[client] = Conn();
+                    struct epoll_event cev = {EPOLLIN, {.fd = client}};
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, client, &cev);
+                }
+                continue;
+            }
+            Conn& conn = conns[fd];
+            bool closed = false;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t got;
+                while ((got = recv(fd, buf, sizeof(buf), 0)) > 0)
+                    conn.in.append(buf, got);
+                closed = got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+                serve(conn, opts, body);
+                closed = closed || conn.dropped;
+            }
+            while (!closed && conn.out_offset < conn.out.size()) {
+                ssize_t sent = send(fd, conn.out.data() + conn.out_offset, conn.out.size() - conn.out_offset, 0);
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (sent < 0)
+                    closed = true;
+                else
+                    conn.out_offset += sent;
+            }
+            if (!closed && conn.out_offset == conn.out.size()) {
+                conn.out.clear();
+                conn.out_offset = 0;
+                closed = conn.close_after;
+            }
+            if (closed) {
+                close(fd);
+                conns.erase(fd);
+                continue;
+            }
+            struct epoll_event cev = {conn.out.empty() ? (uint32_t)EPOLLIN : (uint32_t)(EPOLLIN | EPOLLOUT), {.fd = fd}};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &cev);
+        }
+    }
+}